@@ -1,4 +1,6 @@
 #include <jni.h>
+#include <memory>
+#include <mutex>
 #include <string>
 #include "include/FileTransferServer.h"
 
@@ -21,11 +23,34 @@ Java_com_example_dexfiletransfer_MainActivity_runDexFileTransferServerJNI(
     return env->NewStringUTF(hello.c_str());
 }
 
+// The service's server runs on its own threads, so starting and stopping it
+// returns immediately instead of blocking a JNI thread.
+static std::mutex serviceServerMutex;
+static std::unique_ptr<Dex::FileTransferServer> serviceServer;
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_example_dexfiletransfer_DexFileTransferService_startDexFileTransferServerJNI(JNIEnv *env,
+                                                                                      jobject thiz) {
+    std::lock_guard<std::mutex> lock(serviceServerMutex);
+    if (serviceServer) {
+        return JNI_TRUE;
+    }
+    std::unique_ptr<Dex::FileTransferServer> server(new Dex::FileTransferServer());
+    if (server->start() != 0) {
+        return JNI_FALSE;
+    }
+    serviceServer = std::move(server);
+    return JNI_TRUE;
+}
+
 extern "C"
 JNIEXPORT void JNICALL
-Java_com_example_dexfiletransfer_DexFileTransferService_runDexFileTransferServerJNI(JNIEnv *env,
-                                                                                    jobject thiz) {
-    // TODO: implement runDexFileTransferServerJNI()
-    Dex::FileTransferServer ftServer;
-    ftServer.runServer();
-}
\ No newline at end of file
+Java_com_example_dexfiletransfer_DexFileTransferService_stopDexFileTransferServerJNI(JNIEnv *env,
+                                                                                     jobject thiz) {
+    std::lock_guard<std::mutex> lock(serviceServerMutex);
+    if (serviceServer) {
+        serviceServer->stop();
+        serviceServer.reset();
+    }
+}
@@ -41,7 +41,9 @@ class DexFileTransferService : Service() {
         Thread {
             // TODO: Improve scan execution
             MainActivity.scanDirectory(this, "/storage/self/primary/DCIM/DexFileTransfer")
-            runDexFileTransferServerJNI()
+            if (!startDexFileTransferServerJNI()) {
+                println("DexLog server failed to start")
+            }
         }.start()
 
         println("DexLog service onCreate end")
@@ -54,6 +56,7 @@ class DexFileTransferService : Service() {
 
     override fun onDestroy() {
         println("DexLog service onDestroy")
+        stopDexFileTransferServerJNI()
         super.onDestroy()
     }
 
@@ -61,5 +64,6 @@ class DexFileTransferService : Service() {
         System.loadLibrary("dexfiletransfer")
     }
 
-    external fun runDexFileTransferServerJNI()
+    external fun startDexFileTransferServerJNI(): Boolean
+    external fun stopDexFileTransferServerJNI()
 }
@@ -0,0 +1,411 @@
+#!/usr/bin/env python3
+"""Loopback end-to-end throughput benchmark for ft.
+
+Starts `ft -s` on a loopback port, runs a fixed matrix of client commands
+against it and records throughput, CPU time and peak RSS for each scenario,
+plus the open and stat calls the server made per file, scraped from its
+metrics endpoint. Results are written as JSON and optionally compared against
+a saved baseline.
+
+Usage:
+    bench/bench.py --ft bin/ft [--out FILE] [--baseline FILE] [--save-baseline]
+"""
+import argparse
+import json
+import os
+import platform
+import random
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+SEED = 9413
+BLOCK = 1024 * 1024
+
+# Scenario matrix: (name, dataset, command)
+SCENARIOS = [
+    ("huge-pull", "huge", "pull"),
+    ("huge-push", "huge", "push"),
+    ("tiny-pull", "tiny", "pull"),
+    ("tiny-push", "tiny", "push"),
+    ("tiny-list", "tiny", "list"),
+    ("mixed-pull", "mixed", "pull"),
+    ("mixed-push", "mixed", "push"),
+    ("mixed-list", "mixed", "list"),
+]
+
+# Metric name -> True if higher is better
+METRICS = {
+    "mb_per_s": True,
+    "files_per_s": True,
+    "client_cpu_s": False,
+    "server_cpu_s": False,
+    "client_peak_rss_kb": False,
+    "server_meta_calls_per_file": False,
+}
+
+
+def log(msg):
+    print("bench: " + msg, flush=True)
+
+
+# ---------------------------------------------------------------------------
+# Datasets
+# ---------------------------------------------------------------------------
+
+def write_pattern_file(path, size, block):
+    """Write `size` bytes derived from a seeded block. Each 1 MiB block gets
+    its index stamped into the first bytes so blocks are not identical."""
+    with open(path, "wb") as f:
+        written = 0
+        index = 0
+        while written < size:
+            n = min(BLOCK, size - written)
+            chunk = index.to_bytes(8, "little") + block[8:n]
+            f.write(chunk[:n])
+            written += n
+            index += 1
+
+
+def make_datasets(root, huge_mb, tiny_count, mixed_count):
+    rng = random.Random(SEED)
+    block = bytes(rng.getrandbits(8) for _ in range(BLOCK))
+    datasets = {}
+
+    d = os.path.join(root, "huge")
+    os.makedirs(d)
+    write_pattern_file(os.path.join(d, "f_huge.bin"), huge_mb * BLOCK, block)
+    datasets["huge"] = d
+
+    # Tiny files are 1 byte .. 4 KiB. Zero-byte files are avoided on purpose:
+    # the benchmark measures throughput, not edge cases.
+    d = os.path.join(root, "tiny")
+    os.makedirs(d)
+    for i in range(tiny_count):
+        size = rng.randint(1, 4096)
+        with open(os.path.join(d, "f%05d.bin" % i), "wb") as f:
+            f.write(block[:size])
+    datasets["tiny"] = d
+
+    # Mixed sizes are log-uniform between 1 KiB and 16 MiB.
+    d = os.path.join(root, "mixed")
+    os.makedirs(d)
+    for i in range(mixed_count):
+        size = int(2 ** rng.uniform(10, 24))
+        write_pattern_file(os.path.join(d, "f%05d.bin" % i), size, block)
+    datasets["mixed"] = d
+
+    return datasets
+
+
+def dataset_stats(path):
+    files = 0
+    total = 0
+    for name in os.listdir(path):
+        if name.startswith("f"):
+            files += 1
+            total += os.path.getsize(os.path.join(path, name))
+    return files, total
+
+
+# ---------------------------------------------------------------------------
+# Process helpers
+# ---------------------------------------------------------------------------
+
+def proc_cpu_s(pid):
+    """User + system CPU seconds of a running process (Linux /proc)."""
+    with open("/proc/%d/stat" % pid) as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    ticks = os.sysconf("SC_CLK_TCK")
+    return (int(fields[11]) + int(fields[12])) / ticks
+
+
+def proc_peak_rss_kb(pid):
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+def wait_for_port(port, timeout=10.0):
+    deadline = time.time() + timeout
+    while True:
+        try:
+            with socket.create_connection(("127.0.0.1", port), timeout=0.5):
+                return True
+        except OSError:
+            if time.time() >= deadline:
+                return False
+            time.sleep(0.05)
+
+
+def run_client(ft, port, cwd, args, deadline):
+    """Run one client to completion and return (cpu_s, peak_rss_kb).
+
+    ru_maxrss of a child also counts the memory of the forked Python parent
+    before exec, so the peak is sampled from VmHWM while the client runs.
+    VmHWM only grows, which makes the last sample a good approximation."""
+    cmd = [ft, "-c", "-i", "127.0.0.1", "-P", str(port)] + args
+    rss = 0
+    with open(os.path.join(cwd, "..", "client.log"), "ab") as out:
+        p = subprocess.Popen(cmd, cwd=cwd, stdout=out, stderr=out)
+        while True:
+            rss = max(rss, proc_peak_rss_kb(p.pid))
+            pid, status, ru = os.wait4(p.pid, os.WNOHANG)
+            if pid:
+                break
+            if time.perf_counter() > deadline:
+                p.kill()
+                os.wait4(p.pid, 0)
+                raise RuntimeError("client timed out: %s" % " ".join(cmd))
+            time.sleep(0.001)
+    if os.waitstatus_to_exitcode(status) != 0:
+        raise RuntimeError("client failed: %s" % " ".join(cmd))
+    return ru.ru_utime + ru.ru_stime, rss
+
+
+def scrape_meta_calls(metrics_port):
+    """Open plus stat calls the server has counted so far, or None if its
+    metrics endpoint cannot be read."""
+    url = "http://127.0.0.1:%d/metrics" % metrics_port
+    try:
+        with urllib.request.urlopen(url, timeout=5) as resp:
+            text = resp.read().decode()
+    except OSError:
+        return None
+    total = 0
+    for line in text.splitlines():
+        if (line.startswith('dexft_syscalls_total{call="open"}') or
+                line.startswith('dexft_syscalls_total{call="stat"}')):
+            total += int(float(line.split()[-1]))
+    return total
+
+
+def wait_for_stats(path, expected, deadline):
+    """The PUSH client exits once its last byte is handed to the kernel, so
+    poll the server side until everything has landed on disk."""
+    while dataset_stats(path) != expected:
+        if time.perf_counter() > deadline:
+            return dataset_stats(path)
+        time.sleep(0.001)
+    return expected
+
+
+# ---------------------------------------------------------------------------
+# Benchmark
+# ---------------------------------------------------------------------------
+
+def reset_dir(path):
+    shutil.rmtree(path, ignore_errors=True)
+    os.makedirs(path)
+
+
+def run_scenario(ft, port, metrics_port, server_pid, work, datasets, name,
+                 dataset, command, timeout):
+    client_dir = os.path.join(work, "client")
+    server_dir = os.path.join(work, "server")
+    reset_dir(client_dir)
+    reset_dir(os.path.join(server_dir, "DexFileTransfer"))
+
+    src = datasets[dataset]
+    pattern = os.path.join(src, "f*")
+    files, total = dataset_stats(src)
+    flag = {"pull": "-p", "push": "-u", "list": "-l"}[command]
+
+    server_cpu_before = proc_cpu_s(server_pid)
+    meta_before = scrape_meta_calls(metrics_port)
+    start = time.perf_counter()
+    deadline = start + timeout
+    cpu, rss = run_client(ft, port, client_dir, [flag, pattern], deadline)
+
+    # Sanity check that the transfer actually moved the data
+    if command == "pull":
+        got_files, got_total = dataset_stats(client_dir)
+    elif command == "push":
+        got_files, got_total = wait_for_stats(
+            os.path.join(server_dir, "DexFileTransfer"), (files, total),
+            deadline)
+    else:
+        got_files, got_total = files, total
+    wall = time.perf_counter() - start
+    server_cpu = proc_cpu_s(server_pid) - server_cpu_before
+    meta_after = scrape_meta_calls(metrics_port)
+    meta = 0.0
+    if meta_before is not None and meta_after is not None:
+        meta = (meta_after - meta_before) / files
+    if (got_files, got_total) != (files, total):
+        raise RuntimeError("%s: expected %d files/%d bytes, got %d/%d" %
+                           (name, files, total, got_files, got_total))
+
+    moved = 0 if command == "list" else total
+    return {
+        "files": files,
+        "bytes": moved,
+        "wall_s": wall,
+        "mb_per_s": moved / BLOCK / wall if moved else 0.0,
+        "files_per_s": files / wall,
+        "client_cpu_s": cpu,
+        "server_cpu_s": server_cpu,
+        "client_peak_rss_kb": rss,
+        "server_peak_rss_kb": proc_peak_rss_kb(server_pid),
+        "server_meta_calls_per_file": meta,
+    }
+
+
+def best_of(runs):
+    """Pick the run with the lowest wall time; throughput benchmarks on a
+    shared machine are dominated by noise in the other direction."""
+    return min(runs, key=lambda r: r["wall_s"])
+
+
+def run_bench(args):
+    ft = os.path.abspath(args.ft)
+    work = tempfile.mkdtemp(prefix="dexft-bench-", dir=args.tmpdir)
+    server = None
+    try:
+        log("generating datasets in %s" % work)
+        datasets = make_datasets(os.path.join(work, "data"), args.huge_mb,
+                                 args.tiny_count, args.mixed_count)
+        server_dir = os.path.join(work, "server")
+        os.makedirs(server_dir)
+        # ft sets SO_REUSEPORT, so a stale server on the same port would
+        # silently take half of the connections.
+        metrics_port = args.port + 1
+        for p in (args.port, metrics_port):
+            if wait_for_port(p, timeout=0):
+                raise RuntimeError("port %d is already in use" % p)
+        server_log = open(os.path.join(work, "server.log"), "wb")
+        server = subprocess.Popen([ft, "-s", "-P", str(args.port),
+                                   "-m", str(metrics_port)],
+                                  cwd=server_dir, stdout=server_log,
+                                  stderr=server_log)
+        if not wait_for_port(args.port):
+            raise RuntimeError("server did not start on port %d" % args.port)
+
+        results = {}
+        for name, dataset, command in SCENARIOS:
+            if args.only and name not in args.only:
+                continue
+            runs = []
+            for _ in range(args.repeat):
+                runs.append(run_scenario(ft, args.port, metrics_port,
+                                         server.pid, work, datasets, name,
+                                         dataset, command, args.timeout))
+            results[name] = best_of(runs)
+            r = results[name]
+            log("%-11s %9.2f MB/s %9.1f files/s  client cpu %.2fs rss %d KiB"
+                "  server cpu %.2fs  open+stat/file %.2f" %
+                (name, r["mb_per_s"], r["files_per_s"], r["client_cpu_s"],
+                 r["client_peak_rss_kb"], r["server_cpu_s"],
+                 r["server_meta_calls_per_file"]))
+        return results
+    finally:
+        if server is not None:
+            server.send_signal(signal.SIGTERM)
+            server.wait()
+        if args.keep:
+            log("kept work directory %s" % work)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+
+def compare(results, baseline, tolerance):
+    """Return a list of regression descriptions."""
+    regressions = []
+    for name, r in results.items():
+        base = baseline.get("scenarios", {}).get(name)
+        if not base:
+            continue
+        for metric, higher_is_better in METRICS.items():
+            old = base.get(metric, 0)
+            new = r.get(metric, 0)
+            if old <= 0:
+                continue
+            change = (new - old) / old
+            worse = -change if higher_is_better else change
+            if worse > tolerance:
+                regressions.append("%s %s: %.3f -> %.3f (%+.1f%%)" %
+                                   (name, metric, old, new, change * 100))
+    return regressions
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--ft", default="bin/ft", help="path to the ft binary")
+    ap.add_argument("--port", type=int, default=19413,
+                    help="server port, the metrics endpoint uses the next one")
+    ap.add_argument("--out", default="bench/results/latest.json")
+    ap.add_argument("--baseline", default="bench/baseline.json")
+    ap.add_argument("--save-baseline", action="store_true",
+                    help="write the results to the baseline file")
+    ap.add_argument("--tolerance", type=float, default=0.15,
+                    help="allowed relative regression per metric")
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--huge-mb", type=int, default=512)
+    ap.add_argument("--tiny-count", type=int, default=10000)
+    ap.add_argument("--mixed-count", type=int, default=200)
+    ap.add_argument("--timeout", type=float, default=600.0,
+                    help="per client run timeout in seconds")
+    ap.add_argument("--tmpdir", default=None)
+    ap.add_argument("--only", nargs="*", help="run only these scenarios")
+    ap.add_argument("--keep", action="store_true",
+                    help="keep the temporary work directory")
+    args = ap.parse_args()
+
+    results = run_bench(args)
+    report = {
+        "host": platform.node(),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "timestamp": int(time.time()),
+        "config": {
+            "huge_mb": args.huge_mb,
+            "tiny_count": args.tiny_count,
+            "mixed_count": args.mixed_count,
+            "repeat": args.repeat,
+        },
+        "scenarios": results,
+    }
+
+    os.makedirs(os.path.dirname(os.path.abspath(args.out)), exist_ok=True)
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+    log("results written to %s" % args.out)
+
+    if args.save_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+        log("baseline saved to %s" % args.baseline)
+        return 0
+
+    if not os.path.exists(args.baseline):
+        log("no baseline at %s, run 'make bench_baseline' to create one" %
+            args.baseline)
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    if baseline.get("config") != report["config"]:
+        log("baseline was recorded with a different config, not comparing")
+        return 0
+    regressions = compare(results, baseline, args.tolerance)
+    if regressions:
+        log("REGRESSIONS (tolerance %.0f%%):" % (args.tolerance * 100))
+        for r in regressions:
+            log("  " + r)
+        return 1
+    log("no regressions against %s" % args.baseline)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
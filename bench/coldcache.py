@@ -0,0 +1,332 @@
+#!/usr/bin/env python3
+"""Cold page cache PULL benchmark for ft --disk-order.
+
+Lays out files so that directory order and disk order disagree: many small
+files written in a shuffled order, and one large file written in shuffled
+pieces so its extents are out of order on the disk. Each PULL starts with
+the files evicted from the page cache, and is run against a server with
+and without --disk-order.
+
+Seeks are reported two ways. The read order is taken from the client's
+trace and replayed against the FIEMAP layout of the files, counting jumps
+between extents and the distance they cover. Where the files are on a
+block device its read requests, merges and busy time are read from
+/sys/dev/block as well; merged requests are reads the kernel found
+adjacent to one another.
+
+Evicting clean pages with posix_fadvise works without root. As root,
+dentries and inodes are dropped too, through /proc/sys/vm/drop_caches.
+
+Usage:
+    bench/coldcache.py --ft bin/ft [--files 2000] [--fragmented-mb 256]
+"""
+import argparse
+import fcntl
+import glob
+import json
+import os
+import random
+import shutil
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+import bench
+
+FS_IOC_FIEMAP = 0xC020660B
+FIEMAP_EXTENT_LAST = 0x1
+FIEMAP_MAX_EXTENTS = 1024
+SMALL_SIZE = 128 * 1024
+PIECE = bench.BLOCK
+
+# (name, pattern relative to the dataset)
+SCENARIOS = [
+    ("scattered-pull", "scattered/f*"),
+    ("fragmented-pull", "fragmented/f_fragmented.bin"),
+]
+MODES = [("dir-order", []), ("disk-order", ["--disk-order"])]
+
+
+def log(msg):
+    print("coldcache: " + msg, flush=True)
+
+
+# ---------------------------------------------------------------------------
+# Layout
+# ---------------------------------------------------------------------------
+
+def fiemap(path):
+    """[(logical, physical, length)] of path in file order, or None where the
+    file system cannot map files."""
+    header = struct.Struct("=QQIIII")  # start, length, flags, mapped, count
+    extent = struct.Struct("=QQQQQIIII")
+    buf = bytearray(header.size + FIEMAP_MAX_EXTENTS * extent.size)
+    header.pack_into(buf, 0, 0, 0xFFFFFFFFFFFFFFFF, 0, 0, FIEMAP_MAX_EXTENTS,
+                     0)
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        fcntl.ioctl(fd, FS_IOC_FIEMAP, buf)
+    except OSError:
+        return None
+    finally:
+        os.close(fd)
+    mapped = header.unpack_from(buf, 0)[3]
+    extents = []
+    for i in range(mapped):
+        fields = extent.unpack_from(buf, header.size + i * extent.size)
+        extents.append((fields[0], fields[1], fields[2]))
+    return extents
+
+
+def make_datasets(root, files, fragmented_mb):
+    """Small files created in a shuffled order, so the directory lists them
+    in an order unrelated to where they are, and a large file whose pieces
+    were written in a shuffled order between the writes of another file."""
+    rng = random.Random(bench.SEED)
+    block = bytes(rng.getrandbits(8) for _ in range(PIECE))
+    scattered = os.path.join(root, "scattered")
+    os.makedirs(scattered)
+    names = ["f%06d.bin" % i for i in range(files)]
+    rng.shuffle(names)
+    for i, name in enumerate(names):
+        with open(os.path.join(scattered, name), "wb") as f:
+            f.write(i.to_bytes(8, "little") + block[8:SMALL_SIZE])
+            os.fsync(f.fileno())
+
+    fragmented = os.path.join(root, "fragmented")
+    os.makedirs(fragmented)
+    big = os.path.join(fragmented, "f_fragmented.bin")
+    filler = os.path.join(fragmented, "filler")
+    pieces = list(range(fragmented_mb * bench.BLOCK // PIECE))
+    rng.shuffle(pieces)
+    fd = os.open(big, os.O_WRONLY | os.O_CREAT, 0o644)
+    fill = os.open(filler, os.O_WRONLY | os.O_CREAT, 0o644)
+    try:
+        for i in pieces:
+            os.pwrite(fd, i.to_bytes(8, "little") + block[8:], i * PIECE)
+            os.fdatasync(fd)
+            os.write(fill, block)
+            os.fdatasync(fill)
+    finally:
+        os.close(fd)
+        os.close(fill)
+    os.unlink(filler)
+    return {"scattered": scattered, "fragmented": fragmented}
+
+
+def evict(paths, drop_caches):
+    os.sync()
+    for path in paths:
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        finally:
+            os.close(fd)
+    if drop_caches:
+        with open("/proc/sys/vm/drop_caches", "w") as f:
+            f.write("3\n")
+
+
+def can_drop_caches():
+    return os.access("/proc/sys/vm/drop_caches", os.W_OK)
+
+
+def disk_stats_path(path):
+    dev = os.stat(path).st_dev
+    stat = "/sys/dev/block/%d:%d/stat" % (os.major(dev), os.minor(dev))
+    return stat if os.path.exists(stat) else None
+
+
+def disk_stats(stat_path):
+    """(read requests, merged reads, sectors read, read ms)"""
+    if not stat_path:
+        return None
+    with open(stat_path) as f:
+        return tuple(int(v) for v in f.read().split()[:4])
+
+
+def read_order(trace_dir):
+    """Names of the files the client received, in order."""
+    spans = []
+    for path in glob.glob(os.path.join(trace_dir, "dexft-*-client.json")):
+        with open(path) as f:
+            events = json.load(f).get("traceEvents", [])
+        spans += [(e["ts"], e["args"]["detail"]) for e in events
+                  if e.get("name") == "file" and e.get("ph") == "X"]
+    return [name for _, name in sorted(spans)]
+
+
+def replay_seeks(directory, names, disk_order):
+    """Jumps between consecutive reads, and the bytes they skip over, if
+    the files are read in this order. With disk_order the pieces of each
+    file are read by physical address, as ft --disk-order does."""
+    seeks = 0
+    travel = 0
+    head = None
+    for name in names:
+        extents = fiemap(os.path.join(directory, name))
+        if extents is None:
+            return None, None
+        if disk_order:
+            extents = sorted(extents, key=lambda e: e[1])
+        for _, physical, length in extents:
+            if head is not None and physical != head:
+                seeks += 1
+                travel += abs(physical - head)
+            head = physical + length
+    return seeks, travel
+
+
+# ---------------------------------------------------------------------------
+# Benchmark
+# ---------------------------------------------------------------------------
+
+def run_scenario(ft, port, work, source, pattern, disk_order, drop_caches,
+                 timeout):
+    client_dir = os.path.join(work, "client")
+    trace_dir = os.path.join(work, "trace")
+    bench.reset_dir(client_dir)
+    bench.reset_dir(trace_dir)
+    paths = glob.glob(os.path.join(source, pattern))
+    directory = os.path.dirname(paths[0])
+    total = sum(os.path.getsize(p) for p in paths)
+    stat_path = disk_stats_path(directory)
+
+    evict(paths, drop_caches)
+    before = disk_stats(stat_path)
+    start = time.perf_counter()
+    bench.run_client(ft, port, client_dir, ["--no-agent", "-t", trace_dir,
+                                            "-p", os.path.join(source,
+                                                               pattern)],
+                     start + timeout)
+    wall = time.perf_counter() - start
+    after = disk_stats(stat_path)
+    got = bench.dataset_stats(client_dir)
+    if got != (len(paths), total):
+        raise RuntimeError("expected %d files/%d bytes, got %d/%d" %
+                           (len(paths), total, got[0], got[1]))
+
+    seeks, travel = replay_seeks(directory, read_order(trace_dir),
+                                 disk_order)
+    result = {
+        "files": len(paths),
+        "bytes": total,
+        "wall_s": wall,
+        "mb_per_s": total / bench.BLOCK / wall,
+        "seeks": seeks,
+        "seek_mb": travel / bench.BLOCK if travel is not None else None,
+    }
+    if before and after:
+        delta = [a - b for a, b in zip(after, before)]
+        result.update(disk_reads=delta[0], disk_merged_reads=delta[1],
+                      disk_read_mb=delta[2] * 512 / bench.BLOCK,
+                      disk_read_ms=delta[3])
+    return result
+
+
+def run_mode(args, ft, work, datasets, mode, flags):
+    server_dir = os.path.join(work, "server")
+    os.makedirs(server_dir, exist_ok=True)
+    cmd = [ft, "-s", "-P", str(args.port), "-L", "error"] + flags
+    with open(os.path.join(work, "server.log"), "ab") as out:
+        server = subprocess.Popen(cmd, cwd=server_dir, stdout=out,
+                                  stderr=out)
+    if not bench.wait_for_port(args.port):
+        server.kill()
+        raise RuntimeError("server did not start on port %d" % args.port)
+    results = {}
+    try:
+        for scenario, pattern in SCENARIOS:
+            if args.only and scenario not in args.only:
+                continue
+            dataset, glob_pattern = pattern.split("/", 1)
+            runs = [run_scenario(ft, args.port, work, datasets[dataset],
+                                 glob_pattern, mode == "disk-order",
+                                 args.drop_caches, args.timeout)
+                    for _ in range(args.repeat)]
+            r = min(runs, key=lambda run: run["wall_s"])
+            results[scenario] = r
+            log("%-10s %-16s %8.2f MB/s  seeks %s (%s MB)%s" %
+                (mode, scenario, r["mb_per_s"], r["seeks"],
+                 "%.0f" % r["seek_mb"] if r["seek_mb"] is not None else "-",
+                 "  disk reads %d merged %d busy %d ms" %
+                 (r["disk_reads"], r["disk_merged_reads"],
+                  r["disk_read_ms"]) if "disk_reads" in r else ""))
+    finally:
+        server.send_signal(signal.SIGTERM)
+        try:
+            server.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            server.kill()
+            server.wait()
+    return results
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--ft", default="bin/ft", help="path to the ft binary")
+    ap.add_argument("--port", type=int, default=19433)
+    ap.add_argument("--out", default="bench/results/coldcache.json")
+    ap.add_argument("--only", nargs="*", help="run only these scenarios")
+    ap.add_argument("--files", type=int, default=2000)
+    ap.add_argument("--fragmented-mb", type=int, default=256)
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--drop-caches", action="store_true",
+                    default=can_drop_caches(),
+                    help="also drop dentries and inodes (default when "
+                    "running as root)")
+    ap.add_argument("--timeout", type=float, default=600.0,
+                    help="per client run timeout in seconds")
+    ap.add_argument("--tmpdir", default=None,
+                    help="where to lay out the files; use a directory on "
+                    "the disk to measure, not tmpfs")
+    ap.add_argument("--keep", action="store_true",
+                    help="keep the temporary work directory")
+    args = ap.parse_args()
+
+    ft = os.path.abspath(args.ft)
+    if bench.wait_for_port(args.port, timeout=0):
+        raise RuntimeError("port %d is already in use" % args.port)
+    work = tempfile.mkdtemp(prefix="dexft-coldcache-", dir=args.tmpdir)
+    try:
+        log("laying out files in %s" % work)
+        datasets = make_datasets(os.path.join(work, "data"), args.files,
+                                 args.fragmented_mb)
+        big = os.path.join(datasets["fragmented"], "f_fragmented.bin")
+        extents = fiemap(big)
+        if extents is None:
+            log("FIEMAP is not supported here, seeks are not modelled")
+        else:
+            log("%s has %d extents, %d out of disk order" %
+                (os.path.basename(big), len(extents),
+                 sum(1 for a, b in zip(extents, extents[1:])
+                     if b[1] < a[1])))
+        results = {mode: run_mode(args, ft, work, datasets, mode, flags)
+                   for mode, flags in MODES}
+    finally:
+        if args.keep:
+            log("kept work directory %s" % work)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+    report = {
+        "timestamp": int(time.time()),
+        "config": {
+            "files": args.files,
+            "fragmented_mb": args.fragmented_mb,
+            "drop_caches": args.drop_caches,
+        },
+        "modes": results,
+    }
+    os.makedirs(os.path.dirname(os.path.abspath(args.out)), exist_ok=True)
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+    log("results written to %s" % args.out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+"""Multipath benchmark for ft --multipath on loopback, without root.
+
+Emulates a host with two network paths to the server, e.g. a wired link and
+Wi-Fi, with one netem proxy per path in front of the same `ft -s`. The
+subflows through a proxy share its rate. The server is started with
+--advertise for each proxy, so subflows reach it through them; the control
+connection goes through the first one. A huge file is PULLed and PUSHed
+over the first path alone and striped over both, and once more striped
+while the second path is cut partway through, which has to reinject its
+unACKed chunks on the first.
+
+Each scenario reports throughput and the bytes each proxy forwarded, and
+the failover one the chunks the server reinjected, from its metrics.
+
+Usage:
+    bench/multipath.py --ft bin/ft [--huge-mb 256] [--paths wired:wifi-good]
+"""
+import argparse
+import json
+import os
+import random
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.request
+
+import bench
+import netem
+
+# (name, command, flags, cut the second path)
+SCENARIOS = [
+    ("single-pull", "pull", [], False),
+    ("multipath-pull", "pull", ["--multipath"], False),
+    ("multipath-push", "push", ["--multipath"], False),
+    ("failover-pull", "pull", ["--multipath"], True),
+]
+
+PATHS = dict(netem.PROFILES)
+PATHS["wired"] = dict(rtt_ms=2, jitter_ms=0, rate_mbit=400, loss=0.0,
+                      reorder=0.0)
+
+
+def log(msg):
+    print("multipath: " + msg, flush=True)
+
+
+def scrape_reinjected(metrics_port):
+    url = "http://127.0.0.1:%d/metrics" % metrics_port
+    try:
+        with urllib.request.urlopen(url, timeout=5) as resp:
+            text = resp.read().decode()
+    except OSError:
+        return None
+    for line in text.splitlines():
+        if line.startswith("dexft_multipath_reinjected_chunks_total"):
+            return int(float(line.split()[-1]))
+    return 0
+
+
+def run_scenario(ft, proxies, metrics_port, work, source, command, flags,
+                 cut_after, timeout):
+    client_dir = os.path.join(work, "client")
+    server_dir = os.path.join(work, "server")
+    for d in (client_dir, os.path.join(server_dir, "DexFileTransfer")):
+        bench.reset_dir(d)
+    files, total = bench.dataset_stats(source)
+    args = ["--no-agent", "--local-socket", "off"] + flags
+    args += ["-u" if command == "push" else "-p", os.path.join(source, "f*")]
+
+    for proxy in proxies:
+        proxy.take_stats()
+    reinjected = scrape_reinjected(metrics_port)
+    cut = None
+    if cut_after is not None:
+        cut = threading.Timer(cut_after, proxies[1].sever)
+        cut.start()
+    start = time.perf_counter()
+    deadline = start + timeout
+    try:
+        bench.run_client(ft, proxies[0].port, client_dir, args, deadline)
+    finally:
+        if cut:
+            cut.cancel()
+    if command == "push":
+        got = bench.wait_for_stats(os.path.join(server_dir, "DexFileTransfer"),
+                                   (files, total), deadline)
+    else:
+        got = bench.dataset_stats(client_dir)
+    wall = time.perf_counter() - start
+    if got != (files, total):
+        raise RuntimeError("expected %d files/%d bytes, got %d/%d" %
+                           (files, total, got[0], got[1]))
+    after = scrape_reinjected(metrics_port)
+    return {
+        "bytes": total,
+        "wall_s": wall,
+        "mb_per_s": total / bench.BLOCK / wall,
+        "path_mb": [p.take_stats()["bytes"] / bench.BLOCK for p in proxies],
+        "reinjected": (after - reinjected
+                       if after is not None and reinjected is not None
+                       else None),
+    }
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--ft", default="bin/ft", help="path to the ft binary")
+    ap.add_argument("--port", type=int, default=19533,
+                    help="server port; the proxies and metrics use the "
+                    "next ones")
+    ap.add_argument("--out", default="bench/results/multipath.json")
+    ap.add_argument("--only", nargs="*", help="run only these scenarios")
+    ap.add_argument("--paths", default="wired:wifi-good",
+                    help="profiles of the two paths, from: %s" %
+                    ", ".join(sorted(PATHS)))
+    ap.add_argument("--huge-mb", type=int, default=256)
+    ap.add_argument("--cut-after", type=float, default=None,
+                    help="seconds into failover-pull to cut the second "
+                    "path (default a third of multipath-pull's time)")
+    ap.add_argument("--timeout", type=float, default=600.0,
+                    help="per client run timeout in seconds")
+    ap.add_argument("--keep", action="store_true",
+                    help="keep the temporary work directory")
+    args = ap.parse_args()
+
+    names = args.paths.split(":")
+    if len(names) != 2 or any(n not in PATHS for n in names):
+        raise SystemExit("--paths takes two of: %s" %
+                         ", ".join(sorted(PATHS)))
+    ft = os.path.abspath(args.ft)
+    ports = [args.port + i for i in range(4)]
+    for port in ports:
+        if bench.wait_for_port(port, timeout=0):
+            raise RuntimeError("port %d is already in use" % port)
+    server_port, metrics_port, proxy_ports = ports[0], ports[1], ports[2:]
+
+    work = tempfile.mkdtemp(prefix="dexft-multipath-")
+    results = {}
+    proxies = []
+    server = None
+    try:
+        source = os.path.join(work, "data")
+        os.makedirs(source)
+        rng = random.Random(bench.SEED)
+        block = bytes(rng.getrandbits(8) for _ in range(bench.BLOCK))
+        bench.write_pattern_file(os.path.join(source, "f_huge.bin"),
+                                 args.huge_mb * bench.BLOCK, block)
+
+        for i, (name, port) in enumerate(zip(names, proxy_ports)):
+            proxy = netem.Proxy(port, server_port, PATHS[name],
+                                bench.SEED + i, shared=True)
+            proxy.port = port
+            proxies.append(proxy)
+        server_dir = os.path.join(work, "server")
+        os.makedirs(server_dir)
+        cmd = [ft, "-s", "-P", str(server_port), "-L", "error",
+               "-m", str(metrics_port), "--local-socket", "off"]
+        for port in proxy_ports:
+            cmd += ["--advertise", "127.0.0.1:%d" % port]
+        with open(os.path.join(work, "server.log"), "ab") as out:
+            server = subprocess.Popen(cmd, cwd=server_dir, stdout=out,
+                                      stderr=out)
+        if not bench.wait_for_port(server_port):
+            raise RuntimeError("server did not start on port %d" %
+                               server_port)
+
+        for scenario, command, flags, cut in SCENARIOS:
+            if args.only and scenario not in args.only:
+                continue
+            cut_after = None
+            if cut:
+                cut_after = args.cut_after
+                if cut_after is None:
+                    striped = results.get("multipath-pull")
+                    cut_after = striped["wall_s"] / 3 if striped else 1.0
+            r = run_scenario(ft, proxies, metrics_port, work, source,
+                             command, flags, cut_after, args.timeout)
+            results[scenario] = r
+            log("%-15s %8.2f MB/s  %s: %.0f MB  %s: %.0f MB%s" %
+                (scenario, r["mb_per_s"], names[0], r["path_mb"][0],
+                 names[1], r["path_mb"][1],
+                 "  reinjected %s chunks" % r["reinjected"] if cut else ""))
+    finally:
+        if server:
+            server.send_signal(signal.SIGTERM)
+            try:
+                server.wait(timeout=10)
+            except subprocess.TimeoutExpired:
+                server.kill()
+                server.wait()
+        for proxy in proxies:
+            proxy.close()
+        if args.keep:
+            log("kept work directory %s" % work)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+    report = {
+        "timestamp": int(time.time()),
+        "config": {
+            "paths": {n: PATHS[n] for n in names},
+            "huge_mb": args.huge_mb,
+        },
+        "scenarios": results,
+    }
+    os.makedirs(os.path.dirname(os.path.abspath(args.out)), exist_ok=True)
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+    log("results written to %s" % args.out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,503 @@
+#!/usr/bin/env python3
+"""Network emulation harness for ft on loopback, without root.
+
+Runs `ft -s` behind a userspace TCP proxy that delays, throttles, drops and
+reorders what it forwards, then runs scripted transfers through the proxy
+and reports throughput and per-file latency for each network profile.
+
+The proxy terminates TCP on both sides, so ft never sees a lost segment
+itself. Instead each forwarded chunk gets the delivery delay a loss causes:
+one extra round trip when more data follows (fast retransmit), a 200 ms
+retransmission timeout when it was the last data in flight. A reordered
+chunk arrives later than the ones after it would have; the stream stays in
+order, so they wait behind it as they would in the receiver's TCP. UDP file
+data does not pass through the proxy, so UDP scenarios pass the profile's
+loss and one-way delay to ft's own --impair instead.
+
+Usage:
+    bench/netem.py --ft bin/ft [--profiles wifi-busy lte] [--scenarios FILE]
+"""
+import argparse
+import collections
+import glob
+import json
+import math
+import os
+import random
+import select
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import bench
+
+MSS = 1448  # Payload of one TCP segment, loss is drawn per segment
+READ_SIZE = 64 * 1024
+MIN_RTO_S = 0.2
+
+# Link profiles. rtt_ms and jitter_ms are round trip, split evenly between
+# the directions; rate_mbit is per direction, 0 for unlimited; loss and
+# reorder are fractions of segments and chunks.
+PROFILES = {
+    "loopback": dict(rtt_ms=0, jitter_ms=0, rate_mbit=0, loss=0.0,
+                     reorder=0.0),
+    "wifi-good": dict(rtt_ms=4, jitter_ms=2, rate_mbit=300, loss=0.0,
+                      reorder=0.0),
+    "wifi-busy": dict(rtt_ms=20, jitter_ms=15, rate_mbit=40, loss=0.002,
+                      reorder=0.01),
+    "wifi-far": dict(rtt_ms=40, jitter_ms=30, rate_mbit=8, loss=0.01,
+                     reorder=0.02),
+    "lte": dict(rtt_ms=60, jitter_ms=10, rate_mbit=30, loss=0.001,
+                reorder=0.0),
+}
+
+# Scenario matrix run under each profile: (name, dataset, command)
+SCENARIOS = [
+    ("huge-pull", "huge", "pull"),
+    ("huge-push", "huge", "push"),
+    ("huge-pull-udp", "huge", "pull-udp"),
+    ("tiny-pull", "tiny", "pull"),
+    ("mixed-pull", "mixed", "pull"),
+]
+
+
+def log(msg):
+    print("netem: " + msg, flush=True)
+
+
+# ---------------------------------------------------------------------------
+# Proxy
+# ---------------------------------------------------------------------------
+
+class Bottleneck:
+    """Serialization of a link, by default one per connection and
+    direction. Connections sharing one also share its rate."""
+
+    def __init__(self):
+        self.free = 0.0  # When the last chunk finishes serializing
+        self.lock = threading.Lock()
+
+
+class Link:
+    """Impairment of one direction of a connection."""
+
+    def __init__(self, profile, rng, bottleneck=None):
+        self.one_way_s = profile["rtt_ms"] / 2000.0
+        self.jitter_s = profile["jitter_ms"] / 2000.0
+        rate = profile["rate_mbit"] * 1e6 / 8
+        self.bytes_per_s = rate or None
+        self.loss = profile["loss"]
+        self.reorder = profile["reorder"]
+        self.rtt_s = profile["rtt_ms"] / 1000.0
+        self.rng = rng
+        self.bottleneck = bottleneck or Bottleneck()
+        self.last_delivery = 0.0
+        # Room for two bandwidth-delay products, or 4 MiB when unlimited
+        if self.bytes_per_s:
+            self.queue_limit = max(256 * 1024,
+                                   int(2 * self.bytes_per_s *
+                                       max(self.rtt_s, 0.01)))
+        else:
+            self.queue_limit = 4 * 1024 * 1024
+
+    def schedule(self, now, size, more_pending, stats):
+        """Return when a chunk of size bytes read at now is delivered."""
+        with self.bottleneck.lock:
+            start = max(self.bottleneck.free, now)
+            self.bottleneck.free = start + (size / self.bytes_per_s
+                                            if self.bytes_per_s else 0.0)
+            free = self.bottleneck.free
+        delay = self.one_way_s + self.rng.uniform(-self.jitter_s,
+                                                  self.jitter_s)
+        at = free + max(delay, 0.0)
+
+        segments = max(1, math.ceil(size / MSS))
+        if self.loss and self.rng.random() < 1 - (1 - self.loss) ** segments:
+            stats["lost"] += 1
+            at += self.rtt_s if more_pending else MIN_RTO_S + self.rtt_s
+        if self.reorder and self.rng.random() < self.reorder:
+            stats["reordered"] += 1
+            at += max(self.one_way_s, self.jitter_s, 0.001)
+
+        at = max(at, self.last_delivery)  # TCP delivers in order
+        self.last_delivery = at
+        return at
+
+
+class Pipe:
+    """Forwards one direction of a connection through a Link."""
+
+    def __init__(self, src, dst, link, stats):
+        self.src = src
+        self.dst = dst
+        self.link = link
+        self.stats = stats
+        self.queue = collections.deque()  # (deliver_at, data or None at EOF)
+        self.queued = 0
+        self.cond = threading.Condition()
+        self.closed = False
+
+    def start(self):
+        threads = [threading.Thread(target=self.read_loop, daemon=True),
+                   threading.Thread(target=self.write_loop, daemon=True)]
+        for t in threads:
+            t.start()
+        return threads
+
+    def read_loop(self):
+        while True:
+            try:
+                data = self.src.recv(READ_SIZE)
+            except OSError:
+                data = b""
+            now = time.monotonic()
+            with self.cond:
+                if not data:
+                    self.queue.append((self.link.last_delivery, None))
+                    self.cond.notify_all()
+                    return
+                more = bool(select.select([self.src], [], [], 0)[0])
+                at = self.link.schedule(now, len(data), more, self.stats)
+                self.stats["bytes"] += len(data)
+                self.queue.append((at, data))
+                self.queued += len(data)
+                self.cond.notify_all()
+                # Backpressure: stop reading while the link is full
+                while self.queued > self.link.queue_limit and not self.closed:
+                    self.cond.wait()
+                if self.closed:
+                    return
+
+    def write_loop(self):
+        while True:
+            with self.cond:
+                while not self.queue:
+                    self.cond.wait()
+                at, data = self.queue[0]
+            wait = at - time.monotonic()
+            if wait > 0:
+                time.sleep(wait)
+            with self.cond:
+                self.queue.popleft()
+                if data:
+                    self.queued -= len(data)
+                self.cond.notify_all()
+            try:
+                if data is None:
+                    self.dst.shutdown(socket.SHUT_WR)
+                    return
+                self.dst.sendall(data)
+            except OSError:
+                with self.cond:
+                    self.closed = True
+                    self.cond.notify_all()
+                return
+
+
+class Proxy:
+    """Accepts on listen_port and forwards each connection to target_port
+    through a pair of impaired links. With shared set the connections
+    share the profile's rate, as connections over one network path do."""
+
+    def __init__(self, listen_port, target_port, profile, seed,
+                 shared=False):
+        self.target_port = target_port
+        self.bottlenecks = ((Bottleneck(), Bottleneck()) if shared
+                            else (None, None))
+        self.profile = profile
+        self.rng = random.Random(seed)
+        self.stats = {"bytes": 0, "lost": 0, "reordered": 0}
+        self.conns = set()  # Sockets of the connections being forwarded
+        self.conns_lock = threading.Lock()
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(("127.0.0.1", listen_port))
+        self.sock.listen(16)
+        self.thread = threading.Thread(target=self.accept_loop, daemon=True)
+        self.thread.start()
+
+    def accept_loop(self):
+        while True:
+            try:
+                client, _ = self.sock.accept()
+            except OSError:
+                return
+            threading.Thread(target=self.serve, args=(client,),
+                             daemon=True).start()
+
+    def serve(self, client):
+        try:
+            server = socket.create_connection(("127.0.0.1", self.target_port))
+        except OSError:
+            client.close()
+            return
+        for s in (client, server):
+            s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        with self.conns_lock:
+            self.conns.update((client, server))
+        threads = []
+        for (src, dst), bottleneck in zip(((client, server),
+                                           (server, client)),
+                                          self.bottlenecks):
+            link = Link(self.profile, random.Random(self.rng.random()),
+                        bottleneck)
+            threads += Pipe(src, dst, link, self.stats).start()
+        for t in threads:
+            t.join()
+        with self.conns_lock:
+            self.conns.difference_update((client, server))
+        client.close()
+        server.close()
+
+    def take_stats(self):
+        stats = dict(self.stats)
+        for key in self.stats:
+            self.stats[key] = 0
+        return stats
+
+    def sever(self):
+        """Resets the connections being forwarded, as a path going down
+        would."""
+        with self.conns_lock:
+            conns = list(self.conns)
+        for s in conns:
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def close(self):
+        # shutdown wakes the thread blocked in accept, close alone does not
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+        self.sock.close()
+        self.thread.join()
+
+
+# ---------------------------------------------------------------------------
+# Scenarios
+# ---------------------------------------------------------------------------
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    k = min(len(values) - 1, max(0, int(math.ceil(p / 100.0 * len(values))) - 1))
+    return values[k]
+
+
+def file_latencies_ms(trace_dir):
+    """Durations of the client's per-file spans in its Chrome traces."""
+    latencies = []
+    for path in glob.glob(os.path.join(trace_dir, "dexft-*-client.json")):
+        with open(path) as f:
+            events = json.load(f).get("traceEvents", [])
+        latencies += [e["dur"] / 1000.0 for e in events
+                      if e.get("name") == "file" and e.get("ph") == "X"]
+    return latencies
+
+
+def impair_arg(profile):
+    return "%g%%,%dms" % (profile["loss"] * 100,
+                          int(round(profile["rtt_ms"] / 2.0)))
+
+
+def run_scenario(ft, proxy, proxy_port, work, datasets, profile, dataset,
+                 command, timeout):
+    client_dir = os.path.join(work, "client")
+    server_dir = os.path.join(work, "server")
+    trace_dir = os.path.join(work, "trace")
+    for d in (client_dir, trace_dir, os.path.join(server_dir,
+                                                  "DexFileTransfer")):
+        bench.reset_dir(d)
+
+    src = datasets[dataset]
+    files, total = bench.dataset_stats(src)
+    args = ["--no-agent", "-t", trace_dir]
+    if command == "pull-udp":
+        args += ["-U", "--impair", impair_arg(profile)]
+    flag = "-u" if command == "push" else "-p"
+    args += [flag, os.path.join(src, "f*")]
+
+    proxy.take_stats()
+    start = time.perf_counter()
+    deadline = start + timeout
+    bench.run_client(ft, proxy_port, client_dir, args, deadline)
+    if command == "push":
+        got = bench.wait_for_stats(os.path.join(server_dir, "DexFileTransfer"),
+                                   (files, total), deadline)
+    else:
+        got = bench.dataset_stats(client_dir)
+    wall = time.perf_counter() - start
+    if got != (files, total):
+        raise RuntimeError("expected %d files/%d bytes, got %d/%d" %
+                           (files, total, got[0], got[1]))
+
+    latencies = file_latencies_ms(trace_dir)
+    stats = proxy.take_stats()
+    return {
+        "files": files,
+        "bytes": total,
+        "wall_s": wall,
+        "mb_per_s": total / bench.BLOCK / wall,
+        "files_per_s": files / wall,
+        "file_ms_p50": percentile(latencies, 50),
+        "file_ms_p90": percentile(latencies, 90),
+        "file_ms_p99": percentile(latencies, 99),
+        "file_ms_max": max(latencies) if latencies else 0.0,
+        "proxy_bytes": stats["bytes"],
+        "proxy_lost": stats["lost"],
+        "proxy_reordered": stats["reordered"],
+    }
+
+
+def start_server(ft, port, server_dir, log_path, profile, udp):
+    cmd = [ft, "-s", "-P", str(port), "-L", "error"]
+    if udp:
+        cmd += ["--impair", impair_arg(profile)]
+    out = open(log_path, "ab")
+    server = subprocess.Popen(cmd, cwd=server_dir, stdout=out, stderr=out)
+    if not bench.wait_for_port(port):
+        server.kill()
+        raise RuntimeError("server did not start on port %d" % port)
+    return server
+
+
+def stop_server(server):
+    server.send_signal(signal.SIGTERM)
+    try:
+        server.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+
+
+def run_profile(args, ft, work, datasets, name, profile):
+    server_port = args.port
+    proxy_port = args.port + 1
+    server_dir = os.path.join(work, "server")
+    os.makedirs(server_dir, exist_ok=True)
+    results = {}
+    proxy = Proxy(proxy_port, server_port, profile, bench.SEED)
+    try:
+        # UDP scenarios need the server started with the profile's --impair
+        for udp in (False, True):
+            scenarios = [s for s in SCENARIOS
+                         if (s[2] == "pull-udp") == udp and
+                         (not args.only or s[0] in args.only)]
+            if not scenarios:
+                continue
+            server = start_server(ft, server_port, server_dir,
+                                  os.path.join(work, "server.log"), profile,
+                                  udp)
+            try:
+                for scenario, dataset, command in scenarios:
+                    r = run_scenario(ft, proxy, proxy_port, work, datasets,
+                                     profile, dataset, command, args.timeout)
+                    results[scenario] = r
+                    log("%-10s %-14s %8.2f MB/s %8.1f files/s  file ms"
+                        " p50 %.1f p99 %.1f max %.1f  lost %d reordered %d" %
+                        (name, scenario, r["mb_per_s"], r["files_per_s"],
+                         r["file_ms_p50"], r["file_ms_p99"],
+                         r["file_ms_max"], r["proxy_lost"],
+                         r["proxy_reordered"]))
+            finally:
+                stop_server(server)
+    finally:
+        proxy.close()
+    return results
+
+
+def load_profiles(args):
+    profiles = dict(PROFILES)
+    if args.scenarios:
+        # {"name": {"rtt_ms": .., "jitter_ms": .., "rate_mbit": ..,
+        #           "loss": .., "reorder": ..}, ...}
+        with open(args.scenarios) as f:
+            for name, custom in json.load(f).items():
+                profile = dict(PROFILES["loopback"])
+                profile.update(custom)
+                profiles[name] = profile
+    names = args.profiles or ([n for n in profiles if n not in PROFILES]
+                              if args.scenarios else list(PROFILES))
+    unknown = [n for n in names if n not in profiles]
+    if unknown:
+        raise SystemExit("unknown profiles: %s" % ", ".join(unknown))
+    return [(n, profiles[n]) for n in names]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--ft", default="bin/ft", help="path to the ft binary")
+    ap.add_argument("--port", type=int, default=19423,
+                    help="server port, the proxy listens on the next one")
+    ap.add_argument("--out", default="bench/results/netem.json")
+    ap.add_argument("--profiles", nargs="*",
+                    help="profiles to run (default all): %s" %
+                    ", ".join(PROFILES))
+    ap.add_argument("--scenarios", help="JSON file of extra profiles; "
+                    "only those run unless --profiles is given")
+    ap.add_argument("--only", nargs="*", help="run only these scenarios")
+    ap.add_argument("--huge-mb", type=int, default=32)
+    ap.add_argument("--tiny-count", type=int, default=200)
+    ap.add_argument("--mixed-count", type=int, default=20)
+    ap.add_argument("--timeout", type=float, default=600.0,
+                    help="per client run timeout in seconds")
+    ap.add_argument("--tmpdir", default=None)
+    ap.add_argument("--keep", action="store_true",
+                    help="keep the temporary work directory")
+    args = ap.parse_args()
+
+    profiles = load_profiles(args)
+    ft = os.path.abspath(args.ft)
+    for p in (args.port, args.port + 1):
+        if bench.wait_for_port(p, timeout=0):
+            raise RuntimeError("port %d is already in use" % p)
+    work = tempfile.mkdtemp(prefix="dexft-netem-", dir=args.tmpdir)
+    try:
+        log("generating datasets in %s" % work)
+        datasets = bench.make_datasets(os.path.join(work, "data"),
+                                       args.huge_mb, args.tiny_count,
+                                       args.mixed_count)
+        results = {}
+        for name, profile in profiles:
+            log("%s: rtt %g ms jitter %g ms rate %s loss %g%% reorder %g%%" %
+                (name, profile["rtt_ms"], profile["jitter_ms"],
+                 "%g Mbit/s" % profile["rate_mbit"] if profile["rate_mbit"]
+                 else "unlimited", profile["loss"] * 100,
+                 profile["reorder"] * 100))
+            results[name] = {"profile": profile,
+                             "scenarios": run_profile(args, ft, work,
+                                                      datasets, name,
+                                                      profile)}
+    finally:
+        if args.keep:
+            log("kept work directory %s" % work)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+    report = {
+        "timestamp": int(time.time()),
+        "config": {
+            "huge_mb": args.huge_mb,
+            "tiny_count": args.tiny_count,
+            "mixed_count": args.mixed_count,
+        },
+        "profiles": results,
+    }
+    os.makedirs(os.path.dirname(os.path.abspath(args.out)), exist_ok=True)
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+    log("results written to %s" % args.out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,52 @@
+#ifndef AGENT_H
+#define AGENT_H
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Dex {
+
+#define AGENT_IDLE_SEC 60 // Idle connections are closed after this
+#define AGENT_MAX_IDLE 4 // Idle connections kept per server
+#define AGENT_CONNECT_MS 2000 // Then the client connects by itself
+
+// The agent is a local process that keeps warm keep-alive connections to
+// recently used servers. A client borrows one over the agent's Unix socket:
+// the agent passes the TCP socket itself (SCM_RIGHTS), the client runs its
+// commands on it and tells the agent whether it can be reused. Files are
+// still read and written by the client process.
+class Agent {
+public:
+	Agent();
+	~Agent();
+	int run(const char* path); // Serves until SIGINT or SIGTERM
+	static std::string defaultSocketPath();
+
+private:
+	struct Connection {
+		int fd;
+		std::string server; // "ip:port"
+		int lender; // Unix socket of the borrowing client, -1 when idle
+		uint64_t idleSince;
+	};
+
+	void lend(int clientFd);
+	void release(int clientFd);
+	void closeConnection(size_t i);
+	void expireIdle();
+
+	int listenSocket;
+	std::string socketPath;
+	std::vector<Connection> connections;
+};
+
+// Borrows a connection to serverIp:port from the agent at path. Returns the
+// TCP socket and stores the agent connection in *agentSocket, or returns -1
+// if no agent is running.
+int agentBorrow(const char* path, const char* serverIp, int port,
+                int* agentSocket);
+// Hands the connection back; reusable means it is idle and in sync.
+void agentRelease(int agentSocket, bool reusable);
+
+} // namespace Dex
+#endif // AGENT_H
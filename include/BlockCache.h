@@ -0,0 +1,101 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+#include "Metrics.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace Dex {
+
+#define BLOCK_CACHE_BLOCK_SIZE (64 * 1024)
+#define BLOCK_CACHE_SHARDS 16 // Independently locked parts of the cache
+#define BLOCK_CACHE_SIZE (64ULL * 1024 * 1024) // Default capacity
+// Lookups this soon after a block was loaded are part of the same read
+#define BLOCK_CACHE_CORRELATED_MS 1000
+
+// Identifies one version of a file. A file that is modified gets a new
+// mtime, and usually a new size, so blocks of its old contents are never
+// returned again and simply age out of the cache.
+struct FileId {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	int64_t mtimeNsec;
+
+	static FileId of(const struct stat& st);
+	bool operator==(const FileId& other) const;
+	bool operator<(const FileId& other) const;
+};
+
+// Server-wide cache of file blocks for files that are sent again and again.
+// Eviction is 2Q: blocks read once enter a small FIFO, and only blocks read
+// again later, while still in it or while their key is remembered after
+// leaving it, move to the main LRU. A large file read once therefore cannot
+// flush the hot blocks.
+// Keys are spread over BLOCK_CACHE_SHARDS shards with a lock each, and
+// blocks are copied out after the lock is released.
+class BlockCache {
+public:
+	explicit BlockCache(Metrics& metrics);
+	// Total bytes of cached blocks, 0 disables the cache. Set it before the
+	// cache is used.
+	void setCapacity(uint64_t bytes);
+	// Copies up to length bytes of the file open on fd at offset. id comes
+	// from the caller's stat of fd. Returns the bytes copied, 0 at the end
+	// of the file or -1 on a read error.
+	ssize_t read(int fd, const FileId& id, uint64_t offset, char* buffer,
+	             size_t length);
+
+private:
+	typedef std::shared_ptr<const std::vector<char>> Block;
+
+	struct Key {
+		FileId file;
+		uint64_t block;
+		bool operator==(const Key& other) const;
+	};
+
+	struct KeyHash {
+		size_t operator()(const Key& key) const;
+	};
+
+	enum class Queue {
+		IN, // Read once, FIFO
+		OUT, // Evicted from IN, only the key is kept
+		MAIN // Read again after leaving IN, LRU
+	};
+
+	struct Entry {
+		Block data;
+		Queue queue;
+		std::list<Key>::iterator position;
+		uint64_t loadedUsec;
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<Key, Entry, KeyHash> entries;
+		std::list<Key> in; // Newest first
+		std::list<Key> out;
+		std::list<Key> main; // Most recently used first
+		uint64_t bytes = 0; // Of IN and MAIN
+		uint64_t inBytes = 0;
+	};
+
+	Block lookup(Shard& shard, const Key& key);
+	void insert(Shard& shard, const Key& key, const Block& data);
+	void evict(Shard& shard);
+	Block load(int fd, const Key& key);
+
+	Metrics& metrics;
+	uint64_t shardCapacity; // Bytes
+	Shard shards[BLOCK_CACHE_SHARDS];
+};
+
+} // namespace Dex
+#endif // BLOCKCACHE_H
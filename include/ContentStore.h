@@ -0,0 +1,75 @@
+#ifndef CONTENTSTORE_H
+#define CONTENTSTORE_H
+#include "Sha256.h"
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <set>
+#include <string>
+
+#define CONTENT_CLAIM_WAIT_MS 30000 // Then the content is received again
+
+namespace Dex {
+
+class ContentStore;
+
+// The right to receive one content into the store, held while it is being
+// received. Other sessions with the same content wait for it to be released,
+// for up to CONTENT_CLAIM_WAIT_MS.
+class ContentClaim {
+public:
+	ContentClaim() = default;
+	~ContentClaim(); // Lets the waiting sessions go on
+	ContentClaim(const ContentClaim&) = delete;
+	ContentClaim& operator=(const ContentClaim&) = delete;
+
+private:
+	friend class ContentStore;
+	ContentStore* store = nullptr;
+	std::string key;
+};
+
+// Keeps one copy of each received content under <path>/objects/, named by
+// its SHA-256. Received files are published under their own names as
+// reflinks of the stored copy where the file system supports them (btrfs,
+// XFS, APFS), and as plain copies elsewhere, so each name is its own file
+// with its own time and mode. Stored copies are read-only. The store has to
+// be on the file system of the received files.
+class ContentStore {
+public:
+	ContentStore() = default;
+	// Creates the store at path if needed. Returns -1 on failure.
+	int open(const std::string& path);
+	bool enabled() const { return !root.empty(); }
+	// Returns true if the store has the content with this hash and size.
+	// Otherwise claims it for the caller, who receives it, after waiting
+	// while another session receives the same content. If that takes longer
+	// than CONTENT_CLAIM_WAIT_MS the caller receives it without a claim.
+	bool claim(const uint8_t hash[SHA256_SIZE], uint64_t size,
+	           ContentClaim& claim);
+	// Publishes the stored content as path with modification time time.
+	// Returns -1 if it is not stored or cannot be linked.
+	int link(const uint8_t hash[SHA256_SIZE], const std::string& path,
+	         time_t time);
+	// Stores the content of the received file published as path. If the
+	// store already has it and reflinks are supported, path is replaced with
+	// a reflink of the stored copy and its own blocks are freed. Returns -1
+	// on failure; path is left as it was.
+	int add(const uint8_t hash[SHA256_SIZE], const std::string& path,
+	        time_t time);
+
+private:
+	friend class ContentClaim;
+	std::string objectPath(const std::string& key) const;
+	bool has(const std::string& key, uint64_t size) const;
+	void release(const std::string& key);
+
+	std::string root;
+	std::mutex mutex; // Guards receiving
+	std::condition_variable released;
+	std::set<std::string> receiving; // Hashes claimed by a session
+};
+
+} // namespace Dex
+#endif // CONTENTSTORE_H
@@ -0,0 +1,51 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace Dex {
+
+#define WRITE_BEHIND_BYTES (8 * 1024 * 1024) // Dirty data allowed per file
+#define SYNC_BATCH_FILES 256 // BATCH syncs after this many files...
+#define SYNC_BATCH_BYTES (1024ULL * 1024 * 1024) // ...or this many bytes
+
+// When received files are made durable:
+//   NONE   leave it to the kernel; a crash may lose completed files
+//   FILE   fsync every file and its directory before reporting it done
+//   BATCH  write behind while receiving and syncfs once per batch of files,
+//          and at the end of each command
+enum class Durability {
+	NONE,
+	FILE,
+	BATCH
+};
+
+// Returns -1 if name is not none, file or batch
+int parseDurability(const char* name, Durability* durability);
+
+// Applies the durability policy to the files of one command. FILE and
+// BATCH also start writeback every WRITE_BEHIND_BYTES and wait for the
+// previous window, which keeps large transfers from piling up dirty pages
+// until the whole system stalls in reclaim.
+class DurabilityTracker {
+public:
+	explicit DurabilityTracker(Durability durability);
+	~DurabilityTracker(); // Runs finish() if it was not called
+	void written(FILE* file, uint64_t bytes); // After each write
+	int fileDone(FILE* file); // Before the file is published
+	int published(const std::string& path, uint64_t size); // After publish
+	int finish(); // End of the command
+
+private:
+	int syncPending();
+
+	Durability durability;
+	uint64_t unflushedBytes = 0; // Of the current file, since writeback
+	unsigned pendingFiles = 0; // Published since the last syncfs
+	uint64_t pendingBytes = 0;
+	std::string pendingDirectory; // Where the pending files were published
+};
+
+} // namespace Dex
+#endif // DURABILITY_H
@@ -0,0 +1,62 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include "BlockCache.h"
+#include "Metrics.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace Dex {
+
+#define FANOUT_CHUNK_SIZE (256 * 1024) // Bytes per disk read
+#define FANOUT_WINDOW_CHUNKS 32 // Chunks kept in memory per shared file
+#define FANOUT_MIN_SIZE (1024 * 1024) // Smaller files are read privately
+
+class SharedRead;
+
+// One session's cursor into a shared read of a file
+class FanOutReader {
+public:
+	FanOutReader() = default;
+	~FanOutReader(); // Leaves the shared read
+	FanOutReader(const FanOutReader&) = delete;
+	FanOutReader& operator=(const FanOutReader&) = delete;
+	bool attached() const { return stream != nullptr; }
+	// Copies up to length bytes at offset, reading them from disk first if
+	// no other session has. Returns the bytes copied, -1 on a read error, or
+	// 0 once the reader has fallen a whole window behind the fastest one;
+	// it is then detached and must read the rest of the file itself.
+	ssize_t read(uint64_t offset, char* buffer, size_t length);
+
+private:
+	friend class FanOut;
+	std::shared_ptr<SharedRead> stream;
+	unsigned member = 0;
+};
+
+// Lets sessions sending the same file at the same time share one stream of
+// disk reads. The first session to need a chunk reads it into a window of
+// FANOUT_WINDOW_CHUNKS; the others copy it from there. The window follows
+// the fastest session, so a slow client never holds the others back: once
+// it falls out of the window it is detached and reads on its own.
+class FanOut {
+public:
+	// Chunks are read through cache
+	FanOut(Metrics& metrics, BlockCache& cache);
+	// Attaches reader to the shared read of the file open on fd with status
+	// st, starting a new one unless a read of the same file is still at its
+	// beginning. Returns -1 if the file cannot be shared.
+	int join(int fd, const struct stat& st, FanOutReader& reader);
+
+private:
+	Metrics& metrics;
+	BlockCache& cache;
+	std::mutex mutex; // Guards streams
+	std::map<FileId, std::weak_ptr<SharedRead>> streams;
+};
+
+} // namespace Dex
+#endif // FANOUT_H
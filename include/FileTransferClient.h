@@ -2,25 +2,150 @@
 #define FILETRANSFERCLIENT_H
 
 #include "packet.h"
+#include "Durability.h"
+#include "Progress.h"
+#include "Filter.h"
+#include "Tuning.h"
+#include "Pipeline.h"
+#include "UdpTransport.h"
+#include "Multipath.h"
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace Dex {
 
+struct ListEntry {
+	const char* name; // Only valid during the callback
+	uint64_t size;
+	int64_t time;
+	FileType type;
+};
+
+typedef void (*ListCallback)(const ListEntry& entry, void* ctx);
+
+// One client object runs one transfer at a time; use several objects to run
+// transfers concurrently. Clients share no state with each other.
 class FileTransferClient {
 public:
 	FileTransferClient();
-	~FileTransferClient();
-	void runClient(const char* serverIp, Command cmd, const char* pattern);
+	~FileTransferClient(); // Cancels and waits for a running transfer
+	TransferResult runClient(const char* serverIp, Command cmd,
+	                         const char* pattern);
+	// Runs the transfer on a background thread. The completion callback, if
+	// any, is called on that thread before the future becomes ready.
+	std::future<TransferResult> start(const char* serverIp, Command cmd,
+	                                  const char* pattern,
+	                                  CompletionCallback callback = nullptr,
+	                                  void* ctx = nullptr);
+	void cancel();
+	bool isRunning() const { return running.load(); }
+	void setPort(int port);
+	void setDirectory(const char* directory); // PULL destination, default "."
+	void setDurability(Durability durability); // Default NONE
+	// Sends PULL and PUSH file data over UDP, optionally with parity
+	// packets; control messages stay on TCP. See UdpTransport.h.
+	void setUdp(bool enable, bool fec = false);
+	// Drops and delays outgoing UDP datagrams, for testing
+	void setUdpImpairment(const UdpImpairment& impairment);
+	// Stripes PULL and PUSH file data over a connection from every local
+	// address to every server address, see Multipath.h
+	void setMultipath(bool enable);
+	void setProgressCallback(ProgressCallback callback, void* ctx,
+	                         unsigned intervalMs = PROGRESS_INTERVAL_MS);
+	// Keeps the connection open after a command so later commands to the
+	// same server reuse it. disconnect() closes it.
+	void setKeepAlive(bool keepAlive);
+	// Borrow connections from the agent listening on path when it runs
+	void setAgentSocket(const char* path);
+	// Connects to servers on a loopback address over their Unix socket, see
+	// LocalTransport.h. Defaults to defaultLocalSocketPath(port), null
+	// always uses TCP.
+	void setLocalSocket(const char* path);
+	void disconnect();
+	// LIST pagination: start at cursor (0 = first page) and return at most
+	// limit entries (0 = all). getListCursor() gives the cursor of the next
+	// page after a LIST, or 0 when the listing is complete.
+	void setListPage(uint64_t cursor, unsigned limit);
+	uint64_t getListCursor() const { return listCursor; }
+	// Narrows the files of later commands, see Filter.h. Returns -1 if the
+	// expression is invalid.
+	int setFilter(const char* expression);
+	// PULL only these byte ranges of each file, see parseRanges() in
+	// utils.h; nullptr clears them. Ranges are written at their offsets
+	// into the local file, which keeps the rest of its contents. Returns -1
+	// if spec is invalid.
+	int setRanges(const char* spec);
+	// PULL writes file contents to stdout, one file after another, instead
+	// of saving them
+	void setStdout(bool enable);
+	// A PULL of one file keeps receiving what is appended to it, across
+	// truncation and rotation, until cancel() or the server stops
+	void setFollow(bool enable);
+	// PUSH sends the SHA-256 of each file before its content, and skips
+	// the content when the server's store already has it
+	void setDedupe(bool enable);
+	// Receives LIST entries instead of logging them
+	void setListCallback(ListCallback callback, void* ctx);
 
 private:
+	TransferResult transfer(const char* serverIp, Command cmd,
+	                        const char* pattern);
 	int connectToServer(const char* serverIp);
-	int handleCommand(Command cmd, const char* pattern);
-	int receiveFile();
-	int sendFile(const char* fileName);
+	int handleCommand(Command cmd, const char* pattern,
+	                  ProgressReporter& progress);
+	int receiveFile(ProgressReporter& progress, DurabilityTracker& tracker);
+	int sendFile(const char* fileName, ProgressReporter& progress);
 	int receiveFileList();
+	void closeSocket(bool reusable = false);
 
 	int serverSocket;
+	int port;
+	std::string directory;
+	Durability durability = Durability::NONE;
+	bool udpEnabled = false;
+	bool udpFec = false;
+	UdpImpairment udpImpairment;
+	std::unique_ptr<UdpChannel> udp; // Of the current command
+	bool multipathEnabled = false;
+	std::unique_ptr<MultipathChannel> multipath; // Of the current command
+	std::unique_ptr<AutoTuner> tuner; // Sizes TCP file data chunks
+	std::unique_ptr<ReceivePipeline> pipeline; // Writes PULLed files
+	PipelineStats receiveStalls = {}; // Of the current PULL
+	std::string agentPath;
+	bool localEnabled = true;
+	std::string localSocketPath; // Empty for the default
+	bool localConnection = false; // The open connection is a Unix socket
+	bool passFiles = false; // Contents of the current command are passed
+	Filter filter;
+	std::string filterStr; // Canonical form sent to the server
+	std::vector<RangePkt> ranges;
+	bool toStdout = false;
+	bool follow = false;
+	bool dedupe = false;
+	bool sendHashes = false; // The server of the current PUSH wants them
+	std::string connectedServer; // "ip:port" of the open connection
+	bool keepAlive = false;
+	int agentSocket = -1; // Set while a borrowed connection is in use
+	ProgressCallback progressCallback = nullptr;
+	void* progressCtx = nullptr;
+	ListCallback listCallback = nullptr;
+	void* listCtx = nullptr;
+	uint64_t listCursor = 0;
+	unsigned listLimit = 0;
+	unsigned progressIntervalMs = PROGRESS_INTERVAL_MS;
+	uint64_t sessionId = 0;
 	unsigned totalFiles = 0;
 	unsigned fileCount = 0;
+	std::atomic<bool> running;
+	std::atomic<bool> cancelled;
+	std::mutex socketMutex; // Lets cancel() shut down the socket safely
+	std::thread worker;
 };
 
 } // namespace Dex
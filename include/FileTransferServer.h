@@ -1,26 +1,115 @@
 #ifndef FILETRANSFERSERVER_H
 #define FILETRANSFERSERVER_H
+#include "BlockCache.h"
+#include "ContentStore.h"
+#include "Durability.h"
+#include "FanOut.h"
+#include "Metrics.h"
+#include "Multipath.h"
+#include "Progress.h"
+#include "UdpTransport.h"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace Dex {
 
+// Each client connection is a session with its own state, so one server can
+// run many transfers at once, and one process can run several servers.
 class FileTransferServer {
 public:
 	FileTransferServer();
-	~FileTransferServer();
-	void runServer();
+	~FileTransferServer(); // Stops the server if it is running
+	void runServer(); // start() and wait()
+	int start(); // Binds and accepts on a background thread, -1 on failure
+	void stop(); // Stops accepting, cancels sessions and waits for them
+	void wait(); // Blocks until the server has stopped
+	void setPort(int port);
+	void setDirectory(const char* directory); // PUSH destination
+	void setDurability(Durability durability); // Default NONE
+	// Memory for blocks of hot files, 0 disables the cache. Set it before
+	// start().
+	void setCacheSize(uint64_t bytes);
+	// Keeps one copy of each content PUSHed, in a store at path on the
+	// file system of the PUSH destination, see ContentStore.h. Returns -1
+	// if the store cannot be created.
+	int setStore(const char* path);
+	// PULL reads matched files, and the pieces of fragmented files, in the
+	// order they are on the disk rather than the directory and file order.
+	// Saves seeks on hard disks and SD cards; off by default.
+	void setDiskOrder(bool enable);
+	// Unix socket for clients on the same host, see LocalTransport.h.
+	// Defaults to defaultLocalSocketPath(port), null disables it.
+	void setLocalSocket(const char* path);
+	// Subflows of multipath clients connect to "ADDR[:PORT]", which can be
+	// repeated, instead of the addresses of this host's interfaces. Returns
+	// -1 if address is invalid.
+	int advertiseAddress(const char* address);
+	// Drops and delays outgoing UDP datagrams, for testing
+	void setUdpImpairment(const UdpImpairment& impairment);
+	void setMetricsAddress(const char* address);
+	void setProgressCallback(ProgressCallback callback, void* ctx,
+	                         unsigned intervalMs = PROGRESS_INTERVAL_MS);
+	void setSessionCallback(CompletionCallback callback, void* ctx);
+	const Metrics& getMetrics() const { return metrics; }
 	std::string getLocalPrivateIP();
 
 private:
-	void handleClient(int clientSocket);
-	int sendFile(int clientSocket, const char* filename);
-	int receiveFile(int clientSocket, const char* directory);
-	int sendFileList(int clientSocket, std::vector<std::string> files);
+	struct Session;
+
+	void acceptClients();
+	// local is set for connections over the Unix socket
+	void handleClient(int clientSocket, bool local);
+	bool serveClient(int clientSocket, bool local);
+	// Hands a subflow connection to the multipath session with token
+	bool joinSession(int clientSocket, uint64_t token);
+	void fillPathAddresses(int clientSocket, InitReplyPkt& reply);
+	// Sends filename, or the file already open on fd whose status is st
+	// if that is not null. Closes fd.
+	int sendFile(Session& session, const char* filename, int fd = -1,
+	             const struct stat* st = nullptr);
+	int followFile(Session& session, const char* filename, int fd,
+	               uint64_t offset);
+	int receiveFile(Session& session, const char* directory);
+	int sendFileList(Session& session, const std::string& pattern,
+	                 uint64_t cursor, unsigned limit);
 
 	int serverSocket;
-	unsigned totalFiles = 0;
-	unsigned fileCount = 0;
+	int localSocket = -1; // Unix socket, -1 when disabled
+	bool localEnabled = true;
+	std::string localSocketPath; // Empty for the default
+	int port;
+	std::string directory;
+	Durability durability = Durability::NONE;
+	UdpImpairment udpImpairment;
+	Metrics metrics;
+	MetricsServer metricsServer;
+	std::string metricsAddress;
+	BlockCache blockCache; // Blocks of files sent again and again
+	FanOut fanOut; // Shares disk reads between sessions pulling one file
+	ContentStore store; // PUSHed contents, when enabled
+	bool diskOrder = false;
+	// Addresses for subflows, empty for those of the interfaces
+	std::vector<std::pair<uint32_t, uint16_t>> advertised;
+	ProgressCallback progressCallback = nullptr;
+	void* progressCtx = nullptr;
+	unsigned progressIntervalMs = PROGRESS_INTERVAL_MS;
+	CompletionCallback sessionCallback = nullptr;
+	void* sessionCtx = nullptr;
+
+	std::atomic<bool> stopping;
+	bool running = false;
+	std::thread acceptThread;
+	// Guards running, sessionSockets and multipathSessions
+	std::mutex sessionMutex;
+	std::condition_variable stateChanged;
+	std::set<int> sessionSockets;
+	std::map<uint64_t, MultipathChannel*> multipathSessions; // By token
 };
 
 } // namespace Dex
@@ -0,0 +1,44 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+namespace Dex {
+
+#define FILTER_SIZE 256 // Including the terminating NUL
+
+// A filter narrows the files matched by a pattern. It is a space separated
+// list of terms, all of which must hold:
+//   +GLOB        name matches at least one of the + globs
+//   -GLOB        name matches none of the - globs
+//   size>=N      also >, <, <= and =; N may end in k, m, g or t (1024 based)
+//   newer:TIME   modified at or after TIME
+//   older:TIME   modified before TIME
+// TIME is a duration ago (30m, 12h, 1d, 2w), a date (2024-12-31, local
+// midnight) or @epoch seconds. Example: "+*.jpg +*.heic -*thumb* newer:1d"
+class Filter {
+public:
+	Filter();
+	// Returns -1 on a syntax error. Relative times are resolved against now.
+	int parse(const char* expression, time_t now);
+	// Canonical form with absolute times, so client and server agree
+	std::string toString() const;
+	bool empty() const;
+	bool needsStat() const; // Has size or time terms
+	bool matchName(const char* name) const;
+	bool matchStat(const struct stat& st) const;
+
+private:
+	std::vector<std::string> includes;
+	std::vector<std::string> excludes;
+	uint64_t minSize;
+	uint64_t maxSize;
+	int64_t newerThan;
+	int64_t olderThan;
+};
+
+} // namespace Dex
+#endif // FILTER_H
@@ -0,0 +1,48 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+#include <cstdint>
+#include <string>
+
+namespace Dex {
+
+#define FOLLOW_POLL_MS 250 // Longest wait without an event
+#define FOLLOW_BATCH_MS 10 // Small appends are collected this long
+#define FOLLOW_BATCH_BYTES (64 * 1024) // Larger appends are sent at once
+
+struct FollowChange {
+	bool restart; // Truncated or replaced, read again from offset 0
+	uint64_t size; // Bytes of the file that can be sent
+	bool socketReady; // The peer sent something or closed the connection
+};
+
+// Watches a file that is being appended to, such as a log, for PULL
+// --follow. Uses inotify on Linux and polls elsewhere. A file that is
+// renamed away (rotated) is read to its end before the follower moves on
+// to the new file at the same path.
+class FileFollower {
+public:
+	explicit FileFollower(const std::string& path);
+	~FileFollower();
+	// Starts watching the file open on fd, which is duplicated. Returns -1
+	// on failure.
+	int start(int fd);
+	// Blocks until the file has bytes past offset or was truncated or
+	// replaced, until socket is readable, or for at most timeoutMs.
+	// Returns -1 on failure.
+	int wait(int socket, uint64_t offset, unsigned timeoutMs,
+	         FollowChange* change);
+	int fd() const { return fileFd; } // The file being followed
+
+private:
+	int check(uint64_t offset, FollowChange* change);
+	int watch();
+	void drainEvents();
+
+	std::string path;
+	int fileFd = -1;
+	int inotifyFd = -1;
+	int fileWatch = -1;
+};
+
+} // namespace Dex
+#endif // FOLLOW_H
@@ -0,0 +1,46 @@
+#ifndef LOCALTRANSPORT_H
+#define LOCALTRANSPORT_H
+#include "Progress.h"
+#include <cstdint>
+#include <string>
+
+namespace Dex {
+
+#define LOCAL_COPY_CHUNK (8 * 1024 * 1024) // Bytes per copy call
+
+// Besides its TCP port, a server listens on a Unix socket, and clients
+// given a loopback address connect there instead, so commands skip the
+// TCP stack. Over that socket file contents are not streamed: the sender
+// passes the open file itself (SCM_RIGHTS) and the receiver copies it with
+// copy_file_range, which shares the blocks where the file system has
+// reflinks and copies inside the kernel elsewhere. Containers sharing the
+// socket's directory work the same way; they need not see the same files.
+// Only the server's user may connect, and clients only pass files to, or
+// accept them from, a server running as themselves.
+
+// $XDG_RUNTIME_DIR/dexft-<port>.sock, or /tmp/dexft-<uid>/<port>.sock.
+// The /tmp directory is made private to this user when create is set.
+// Returns "" when it belongs to another user or others may enter it.
+std::string defaultLocalSocketPath(int port, bool create);
+// True for 127.0.0.0/8, ::1 and localhost
+bool isLoopbackAddress(const char* address);
+// Listens on path, replacing a socket file left behind but not a running
+// server. Returns the socket, or -1.
+int listenLocal(const char* path);
+// Returns -1 also when the server runs as another user
+int connectLocal(const char* path);
+// Sends a LocalFilePkt, with fd attached unless it is -1
+int sendLocalFile(int socket, int fd, bool ok);
+// Receives a LocalFilePkt and stores the attached descriptor, or -1, in
+// *fd. With fd null a descriptor is not expected, and closed if sent.
+// Returns -1 if the connection failed.
+int receiveLocalFile(int socket, bool* ok, int* fd);
+// Copies the first size bytes of the regular file from into to at the same
+// offsets and sets the size of to. Holes of from are left as holes. Falls
+// back to read and write where the kernel cannot copy between the two.
+// Returns -1 on failure, with *copied the bytes copied so far.
+int copyFileData(int from, int to, uint64_t size, ProgressReporter& progress,
+                 uint64_t* copied);
+
+} // namespace Dex
+#endif // LOCALTRANSPORT_H
@@ -1,32 +1,177 @@
 #ifndef LOGGER_H
 #define LOGGER_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// LOGx(fmt, ...) keep their printf style API. Instead of formatting on the
+// calling thread, each call copies the format pointer and its arguments as a
+// binary record into a per-thread ring buffer; a background thread formats
+// and flushes the records in batches. The format must be a string literal.
+
+namespace Dex {
+namespace Log {
+
+enum Level {
+	LEVEL_DEBUG,
+	LEVEL_INFO,
+	LEVEL_ERROR,
+	LEVEL_OFF
+};
+
+#define LOG_RING_SIZE (64 * 1024) // Bytes per thread
+#define LOG_MAX_STRING 1024 // Longer string arguments are truncated
+#define LOG_PROGRESS_INTERVAL_MS 250
+
+void setLevel(Level level);
+Level parseLevel(const char* name); // Returns LEVEL_OFF + 1 if invalid
+void setAsync(bool async); // false formats on the calling thread
+void setProgressInterval(unsigned ms);
+void setStderrOnly(bool only); // For when stdout carries file data
+void flush();
+
+namespace detail {
+
+enum ArgTag : uint8_t {
+	TAG_INT,
+	TAG_UINT,
+	TAG_DOUBLE,
+	TAG_STRING,
+	TAG_POINTER
+};
+
+struct RecordHeader {
+	uint32_t size; // Record size including header, 0 marks a ring wrap
+	uint8_t level;
+	uint8_t argCount;
+	uint16_t reserved;
+	uint64_t timestamp;
+	const char* fmt;
+};
+
+extern std::atomic<int> minLevel;
+
+char* reserve(size_t size);
+void commit(char* record);
+bool progressDue(std::atomic<int64_t>& last);
+
+inline size_t stringSize(const char* s) {
+	size_t len = s ? strnlen(s, LOG_MAX_STRING) : 6; // "(null)"
+	return 1 + sizeof(uint16_t) + len;
+}
+
+inline size_t argSize(const char* s) { return stringSize(s); }
+inline size_t argSize(char* s) { return stringSize(s); }
+template <typename T>
+inline size_t argSize(T) { return 1 + sizeof(uint64_t); }
+
+inline size_t argsSize() { return 0; }
+template <typename T, typename... Rest>
+inline size_t argsSize(T first, Rest... rest) {
+	return argSize(first) + argsSize(rest...);
+}
+
+inline char* putTagged(char* p, ArgTag tag, const void* value) {
+	*p++ = static_cast<char>(tag);
+	memcpy(p, value, sizeof(uint64_t));
+	return p + sizeof(uint64_t);
+}
+
+inline char* putArg(char* p, const char* s) {
+	if (!s) {
+		s = "(null)";
+	}
+	uint16_t len = static_cast<uint16_t>(strnlen(s, LOG_MAX_STRING));
+	*p++ = static_cast<char>(TAG_STRING);
+	memcpy(p, &len, sizeof(len));
+	memcpy(p + sizeof(len), s, len);
+	return p + sizeof(len) + len;
+}
+inline char* putArg(char* p, char* s) {
+	return putArg(p, static_cast<const char*>(s));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value &&
+    std::is_signed<T>::value, char*>::type putArg(char* p, T v) {
+	int64_t value = v;
+	return putTagged(p, TAG_INT, &value);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value &&
+    !std::is_signed<T>::value, char*>::type putArg(char* p, T v) {
+	uint64_t value = v;
+	return putTagged(p, TAG_UINT, &value);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value, char*>::type
+    putArg(char* p, T v) {
+	double value = v;
+	return putTagged(p, TAG_DOUBLE, &value);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_enum<T>::value, char*>::type
+    putArg(char* p, T v) {
+	int64_t value = static_cast<int64_t>(v);
+	return putTagged(p, TAG_INT, &value);
+}
+
+template <typename T>
+inline char* putArg(char* p, const T* v) {
+	uint64_t value = reinterpret_cast<uintptr_t>(v);
+	return putTagged(p, TAG_POINTER, &value);
+}
+
+inline char* putArgs(char* p) { return p; }
+template <typename T, typename... Rest>
+inline char* putArgs(char* p, T first, Rest... rest) {
+	return putArgs(putArg(p, first), rest...);
+}
+
+} // namespace detail
+
+template <typename... Args>
+inline void write(Level level, const char* fmt, Args... args) {
+	if (level < detail::minLevel.load(std::memory_order_relaxed)) {
+		return;
+	}
+	size_t size = sizeof(detail::RecordHeader) + detail::argsSize(args...);
+	char* record = detail::reserve(size);
+	detail::RecordHeader* header =
+		reinterpret_cast<detail::RecordHeader*>(record);
+	header->size = static_cast<uint32_t>(size);
+	header->level = static_cast<uint8_t>(level);
+	header->argCount = static_cast<uint8_t>(sizeof...(args));
+	header->reserved = 0;
+	header->fmt = fmt;
+	detail::putArgs(record + sizeof(detail::RecordHeader), args...);
+	detail::commit(record);
+}
+
+} // namespace Log
+} // namespace Dex
+
+// Progress lines are rate limited per call site to one every
+// LOG_PROGRESS_INTERVAL_MS (see Log::setProgressInterval). LOGP_LAST
+// always writes the line when last is true, e.g. for the last file.
+#define LOGP_LAST(last, ...) do { \
+	static std::atomic<int64_t> logpLast_(0); \
+	if ((last) || Dex::Log::detail::progressDue(logpLast_)) \
+		Dex::Log::write(Dex::Log::LEVEL_INFO, __VA_ARGS__); \
+} while (0)
+#define LOGP(...) LOGP_LAST(false, __VA_ARGS__)
 
 #ifdef DEBUG
-#ifdef __ANDROID__
-#include <android/log.h>
-#define LOG_TAG "DexLog"
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#else
-#include <cstdio>
-#define LOGD(fmt, ...) printf("DEBUG: " fmt "\n", ##__VA_ARGS__)
-#define LOGI(fmt, ...) printf("INFO: " fmt "\n", ##__VA_ARGS__)
-#define LOGE(fmt, ...) fprintf(stderr, "ERROR: " fmt "\n", ##__VA_ARGS__)
-#endif
+#define LOGD(...) Dex::Log::write(Dex::Log::LEVEL_DEBUG, __VA_ARGS__)
 #else // RELEASE
-#ifdef __ANDROID__
-#include <android/log.h>
-#define LOG_TAG "DexLog"
 #define LOGD(...)
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#else
-#include <cstdio>
-#define LOGD(fmt, ...)
-#define LOGI(fmt, ...) printf("INFO: " fmt "\n", ##__VA_ARGS__)
-#define LOGE(fmt, ...) fprintf(stderr, "ERROR: " fmt "\n", ##__VA_ARGS__)
-#endif
 #endif // #ifdef DEBUG
+#define LOGI(...) Dex::Log::write(Dex::Log::LEVEL_INFO, __VA_ARGS__)
+#define LOGE(...) Dex::Log::write(Dex::Log::LEVEL_ERROR, __VA_ARGS__)
 
-#endif // LOGGER_H
\ No newline at end of file
+#endif // LOGGER_H
@@ -0,0 +1,104 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include "packet.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace Dex {
+
+// Upper bounds of the per-file latency buckets in microseconds. The last
+// bucket is +Inf.
+#define METRICS_LATENCY_BUCKETS 16
+
+enum class Syscall {
+	ACCEPT,
+	SEND,
+	RECV,
+	OPEN,
+	STAT,
+	READ,
+	WRITE,
+	COUNT
+};
+
+class LatencyHistogram {
+public:
+	LatencyHistogram();
+	void observe(uint64_t usec);
+	void render(std::string& out, const char* name, const char* labels) const;
+
+private:
+	std::atomic<uint64_t> buckets[METRICS_LATENCY_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sumUsec;
+};
+
+struct CommandMetrics {
+	CommandMetrics();
+	std::atomic<uint64_t> filesCompleted;
+	std::atomic<uint64_t> filesFailed;
+	LatencyHistogram fileLatency;
+};
+
+// Server-wide counters. Every field is a relaxed atomic so transfer threads
+// never take a lock. Hot loops count into locals and publish once per file.
+class Metrics {
+public:
+	Metrics();
+
+	void addSyscalls(Syscall call, uint64_t n) {
+		syscalls[static_cast<int>(call)].fetch_add(n, std::memory_order_relaxed);
+	}
+	void addErrors(Syscall call, uint64_t n) {
+		errors[static_cast<int>(call)].fetch_add(n, std::memory_order_relaxed);
+	}
+	void fileDone(Command cmd, bool ok, uint64_t usec);
+	std::string render() const;
+
+	std::atomic<int64_t> activeSessions;
+	std::atomic<uint64_t> sessionsTotal;
+	std::atomic<uint64_t> bytesIn;
+	std::atomic<uint64_t> bytesOut;
+	std::atomic<uint64_t> fanOutDiskBytes; // Read by shared reads
+	std::atomic<uint64_t> fanOutSharedBytes; // Served without a disk read
+	std::atomic<uint64_t> fanOutDetached; // Sessions left behind
+	std::atomic<uint64_t> cacheHits; // Block cache lookups
+	std::atomic<uint64_t> cacheMisses;
+	std::atomic<int64_t> cacheBytes; // Memory held by cached blocks
+	std::atomic<uint64_t> receiveSocketStallUsec; // PUSH recv waited for disk
+	std::atomic<uint64_t> receiveDiskStallUsec; // PUSH write waited for recv
+	std::atomic<uint64_t> storeAdded; // Contents added to the store
+	std::atomic<uint64_t> storeLinked; // Files linked instead of received
+	std::atomic<uint64_t> storeSavedBytes; // Their size
+	std::atomic<uint64_t> localCopyBytes; // Copied from passed files
+	std::atomic<uint64_t> multipathSubflows; // Joined to sessions
+	std::atomic<uint64_t> multipathReinjected; // Chunks of failed subflows
+
+private:
+	std::atomic<uint64_t> syscalls[static_cast<int>(Syscall::COUNT)];
+	std::atomic<uint64_t> errors[static_cast<int>(Syscall::COUNT)];
+	CommandMetrics commands[static_cast<int>(Command::INVALID)];
+};
+
+// Serves Metrics::render() as Prometheus text over HTTP on a loopback TCP
+// port ("9414") or a Unix socket ("unix:/path/to/sock").
+class MetricsServer {
+public:
+	MetricsServer();
+	~MetricsServer();
+	int start(const Metrics* metrics, const std::string& address);
+	void stop();
+
+private:
+	void serve();
+
+	const Metrics* metrics;
+	int listenSocket;
+	std::string unixPath;
+	std::thread thread;
+};
+
+} // namespace Dex
+#endif // METRICS_H
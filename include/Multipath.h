@@ -0,0 +1,107 @@
+#ifndef MULTIPATH_H
+#define MULTIPATH_H
+#include "packet.h"
+#include "Progress.h"
+#include "Durability.h"
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Dex {
+
+#define MULTIPATH_CHUNK_SIZE (256 * 1024) // File bytes per chunk
+#define MULTIPATH_MAX_PATHS 8 // Subflows per session
+#define MULTIPATH_MIN_WINDOW 4 // Chunks in flight per subflow at least...
+#define MULTIPATH_WINDOW_MS 250 // ...or this long at its measured rate
+#define MULTIPATH_PATH_TIMEOUT_MS 5000 // A busy subflow without ACKs failed
+#define MULTIPATH_TIMEOUT_MS 10000 // Give up when the peer is silent this long
+#define MULTIPATH_CONNECT_MS 2000 // Per subflow
+
+struct MultipathStats {
+	uint64_t chunks; // Sent or received, without duplicates
+	uint64_t reinjected; // Resent on another path after theirs failed
+	uint64_t wireBytes; // Chunks and their headers
+};
+
+struct PathStats {
+	std::string name; // "local -> remote"
+	uint64_t bytes; // ACKed or received
+	double rate; // Measured throughput in bytes per second (sender)
+	bool failed;
+};
+
+// IPv4 addresses, in network byte order, of the interfaces that are up:
+// the loopback ones, or all others
+std::vector<uint32_t> getInterfaceAddresses(bool loopback);
+uint64_t newMultipathToken();
+
+// Stripes file data over extra TCP connections (subflows) between other
+// pairs of local and server addresses, e.g. Ethernet and Wi-Fi. The
+// control connection keeps all other messages and the receiver's
+// end-of-file confirmation. Chunks name their file offset, so they may
+// arrive on any subflow in any order. Each subflow has a window of chunks
+// in flight sized to its throughput measured from the receiver's ACKs, so
+// faster paths carry proportionally more. When a subflow fails, its
+// unACKed chunks are reinjected on the others, or on the control
+// connection when none is left.
+class MultipathChannel {
+public:
+	explicit MultipathChannel(int controlSocket);
+	~MultipathChannel(); // Closes the subflows
+	// Client: connects a subflow from every local address to every server
+	// address in reply, up to MULTIPATH_MAX_PATHS, and joins them to the
+	// session. Returns the number of subflows.
+	int join(const InitPkt& initPkt, const InitReplyPkt& reply, int port);
+	// Server: adds a subflow that joined the session, and owns socket.
+	// Returns false, leaving socket to the caller, when the session already
+	// has MULTIPATH_MAX_PATHS subflows.
+	bool addPath(int socket);
+	size_t pathCount();
+	int sendFile(int fd, const std::vector<ExtentPkt>& extents,
+	             ProgressReporter& progress);
+	// A chunk for bytes past size fails the path it came on
+	int receiveFile(FILE* file, uint64_t size, uint64_t chunks,
+	                ProgressReporter& progress, DurabilityTracker& durability);
+	const MultipathStats& getStats() const { return stats; }
+	std::vector<PathStats> getPathStats();
+	static uint64_t chunkCount(const std::vector<ExtentPkt>& extents);
+
+private:
+	struct Path {
+		int socket;
+		std::string name;
+		bool failed = false;
+		uint64_t bytes = 0;
+		// Packet and payload being written (sender) or read (receiver)
+		std::vector<char> buffer;
+		size_t done = 0;
+		size_t total = 0;
+		// Sender
+		std::deque<uint64_t> inflight; // Chunks written or being written
+		uint64_t inflightBytes = 0;
+		std::vector<char> ack; // Being read
+		size_t ackDone = 0;
+		uint64_t lastProgressUsec = 0; // Last write or ACK
+		double rate = 0; // Bytes per second, 0 until measured
+		uint64_t sampleStartUsec = 0;
+		uint64_t sampleBytes = 0;
+	};
+
+	void adopt();
+	void failPath(Path& path, std::deque<uint64_t>* queue);
+	int sendDone(bool ok);
+	int receiveDone(bool* ok);
+
+	int controlSocket;
+	uint32_t fileId; // Same sequence on both ends, one per file
+	std::vector<Path> paths;
+	std::mutex joiningMutex; // Guards joining
+	std::vector<int> joining; // Subflows added while a file is transferred
+	MultipathStats stats;
+};
+
+} // namespace Dex
+#endif // MULTIPATH_H
@@ -0,0 +1,88 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include "Durability.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace Dex {
+
+#define PIPELINE_SLOTS 16 // Buffers between the socket and the disk...
+#define PIPELINE_SLOT_BYTES (256 * 1024) // ...of this size, 4 MiB in all
+
+// Time one file spent waiting on either side of a ReceivePipeline
+struct PipelineStats {
+	uint64_t socketStallUsec; // Socket reader waited for the disk
+	uint64_t diskStallUsec; // Disk writer waited for the network
+	uint64_t writeUsec; // Spent writing
+	uint64_t writes;
+};
+
+// Receives file data on the calling thread while a writer thread writes it
+// to disk, so a flash stall does not stop the socket from being drained
+// and the sender from sending. The two threads share a ring of
+// PIPELINE_SLOTS buffers through atomic indices and only sleep when the
+// ring is full or empty. The writer thread is started on first use and
+// serves one file after another.
+class ReceivePipeline {
+public:
+	ReceivePipeline();
+	~ReceivePipeline();
+	// Starts a file. file and tracker belong to the writer until finish().
+	void begin(FILE* file, DurabilityTracker* tracker);
+	// Following data is written at offset
+	void seek(uint64_t offset);
+	// Returns where to receive the next bytes and sets *room to how many
+	// fit, waiting while the ring is full. Returns nullptr if a write
+	// failed.
+	char* reserve(size_t* room);
+	void commit(size_t bytes); // Received into what reserve() returned
+	// Waits until the file is written and fills stats. Returns -1 with
+	// errno set if a write failed.
+	int finish(PipelineStats* stats);
+
+private:
+	struct Slot {
+		char* data;
+		size_t length;
+		bool seek; // Move to offset before writing
+		uint64_t offset;
+	};
+
+	void publish();
+	void run();
+
+	std::unique_ptr<char[]> memory;
+	Slot slots[PIPELINE_SLOTS];
+	std::atomic<size_t> produced; // Slots handed to the writer
+	std::atomic<size_t> consumed; // Slots written
+	std::atomic<bool> socketWaiting; // The reader sleeps, the ring is full
+	std::atomic<bool> diskWaiting; // The writer sleeps, the ring is empty
+	std::atomic<bool> failed;
+	std::atomic<int> error; // errno of the failed write
+	std::atomic<uint64_t> diskStallUsec;
+	std::atomic<uint64_t> writeUsec;
+	std::atomic<uint64_t> writes;
+	std::mutex mutex; // Only taken to sleep and wake
+	std::condition_variable changed;
+	bool stopping = false;
+	std::thread thread;
+
+	// Reader side
+	Slot* current = nullptr; // Being filled, not yet published
+	bool seekPending = false;
+	uint64_t seekOffset = 0;
+	uint64_t socketStallUsec = 0;
+
+	// Set by begin() while the writer is idle
+	FILE* file = nullptr;
+	DurabilityTracker* tracker = nullptr;
+	uint64_t fileStartUsec = 0; // The writer waits for this file from here
+};
+
+} // namespace Dex
+#endif // PIPELINE_H
@@ -0,0 +1,56 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+#include "Metrics.h"
+#include "utils.h"
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+namespace Dex {
+
+#define PREFETCH_FILES 4 // Files kept open ahead of the one being sent
+#define PREFETCH_BYTES (4 * 1024 * 1024) // Read ahead of each of them
+
+// Opens the next files of a multi-file PULL on a background thread while
+// the current one is being sent, and asks the kernel to start reading
+// them, so slow storage seeks to file N+1 while file N is on the wire.
+// At most PREFETCH_FILES descriptors are open at a time. Files are opened
+// relative to their directory and stat'ed only if the scan did not.
+class Prefetcher {
+public:
+	Prefetcher(int dirFd, const std::vector<FileEntry>& files,
+	           Metrics& metrics);
+	~Prefetcher(); // Stops the thread and closes what was not taken
+	// Returns the descriptor of files[index] and fills st with its status,
+	// opening it now if it was not prefetched. Returns -1 if it cannot be
+	// opened or is not a regular file. Files before index are given up.
+	int take(size_t index, struct stat* st);
+
+private:
+	struct Opened {
+		int fd;
+		struct stat st;
+	};
+
+	void run();
+	int open(size_t index, struct stat* st);
+
+	int dirFd;
+	const std::vector<FileEntry>& files;
+	Metrics& metrics;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::map<size_t, Opened> ready; // Index to open file
+	size_t next = 0; // Next file to open
+	size_t taken = 0; // Files before this one were handed out or skipped
+	bool opening = false; // files[next] is being opened
+	bool stopping = false;
+	std::thread thread;
+};
+
+} // namespace Dex
+#endif // PREFETCH_H
@@ -0,0 +1,76 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+#include "packet.h"
+#include <cstdint>
+
+namespace Dex {
+
+#define PROGRESS_INTERVAL_MS 250
+
+enum class TransferStatus {
+	OK,
+	FAILED,
+	CANCELLED
+};
+
+struct TransferResult {
+	TransferStatus status;
+	unsigned files; // Files transferred successfully
+	unsigned failedFiles;
+	uint64_t bytes;
+	uint64_t elapsedUsec;
+};
+
+struct Progress {
+	uint64_t sessionId;
+	Command command;
+	const char* currentFile; // Only valid during the callback
+	uint64_t bytes;
+	unsigned files;
+	unsigned failedFiles;
+	unsigned totalFiles;
+	double bytesPerSec; // Since the previous report, overall when done
+	uint64_t elapsedUsec;
+	bool done; // Final report of the transfer
+};
+
+// Callbacks run on the transfer thread, so they must be quick. A server
+// invokes them from every session thread concurrently.
+typedef void (*ProgressCallback)(const Progress& progress, void* ctx);
+typedef void (*CompletionCallback)(uint64_t sessionId,
+                                   const TransferResult& result, void* ctx);
+
+// Tracks the counters of one transfer and calls the progress callback at
+// most once per interval. Updating it does not allocate, and costs only an
+// add when no callback is set.
+class ProgressReporter {
+public:
+	ProgressReporter(ProgressCallback callback, void* ctx, unsigned intervalMs,
+	                 uint64_t sessionId, Command cmd);
+	void setTotalFiles(unsigned totalFiles) { progress.totalFiles = totalFiles; }
+	void beginFile(const char* name) { progress.currentFile = name; }
+	void addBytes(uint64_t bytes) {
+		progress.bytes += bytes;
+		if (callback) {
+			report(false);
+		}
+	}
+	void fileDone(bool ok);
+	void finish(); // Always reports, with done set
+	TransferResult result(TransferStatus status) const;
+	const Progress& get() const { return progress; }
+
+private:
+	void report(bool force);
+
+	ProgressCallback callback;
+	void* ctx;
+	uint64_t intervalUsec;
+	uint64_t startUsec;
+	uint64_t lastUsec;
+	uint64_t lastBytes;
+	Progress progress;
+};
+
+} // namespace Dex
+#endif // PROGRESS_H
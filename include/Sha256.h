@@ -0,0 +1,36 @@
+#ifndef SHA256_H
+#define SHA256_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Dex {
+
+#define SHA256_SIZE 32 // Bytes of a digest
+
+// Incremental SHA-256 (FIPS 180-4). Uses the SHA extensions of x86 CPUs
+// that have them.
+class Sha256 {
+public:
+	Sha256();
+	void update(const void* data, size_t length);
+	void updateZeros(uint64_t length); // The holes of a sparse file
+	void final(uint8_t digest[SHA256_SIZE]);
+
+private:
+	void compress(const uint8_t* block, size_t blocks);
+
+	uint32_t state[8];
+	uint64_t total = 0; // Bytes hashed
+	uint8_t buffer[64];
+	size_t used = 0; // Bytes of buffer waiting for a full block
+};
+
+// Hashes the contents of the file open on fd, holes read as zeros.
+// Returns -1 on a read error.
+int hashFile(int fd, uint8_t digest[SHA256_SIZE]);
+
+std::string hexDigest(const uint8_t digest[SHA256_SIZE]);
+
+} // namespace Dex
+#endif // SHA256_H
@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <cstdint>
+
+namespace Dex {
+namespace Trace {
+
+// Number of spans kept per thread. When a session records more than this
+// the oldest spans are overwritten and counted as dropped.
+#define TRACE_RING_SIZE 16384
+// Chunk level read/write/send/recv calls only get their own span when they
+// take at least this long; faster ones are summed into the file span.
+#define TRACE_SLOW_USEC 1000
+#define TRACE_MAX_ARGS 5
+#define TRACE_DETAIL_SIZE 64 // Longer details are cut
+
+// Opt-in per-phase tracing. Each thread records spans into its own ring
+// buffer while a session is active on it; endSession() writes the spans as
+// Chrome trace-event JSON (loadable in chrome://tracing and Perfetto) to
+// <directory>/dexft-<sessionId>-<role>.json. Timestamps are wall clock
+// microseconds so client and server traces of one session line up.
+
+void enable(const char* directory);
+bool enabled();
+bool active(); // A session is being traced on this thread
+uint64_t newSessionId();
+uint64_t nowUsec();
+
+void beginSession(uint64_t sessionId, const char* role);
+void endSession();
+
+// name and argName must be string literals; detail is copied.
+void record(const char* name, uint64_t startUsec, uint64_t durUsec,
+            const char* detail = nullptr, const char* argName = nullptr,
+            uint64_t arg = 0);
+
+// Times one chunk operation that started at startUsec: adds its duration to
+// *totalUsec, records a span if it was slow and returns the current time so
+// calls can be chained through a loop.
+uint64_t lap(const char* name, uint64_t startUsec, uint64_t* totalUsec,
+             const char* detail, uint64_t bytes);
+
+// Traces a session for the enclosing scope and records a span covering it.
+class Session {
+public:
+	Session(uint64_t sessionId, const char* role);
+	~Session();
+
+private:
+	uint64_t startUsec;
+};
+
+// Records a span for the enclosing scope. Costs one thread-local check when
+// tracing is off. detail is copied, so it may go out of scope first.
+class Span {
+public:
+	explicit Span(const char* name, const char* detail = nullptr);
+	~Span();
+	void setArg(int i, const char* argName, uint64_t value);
+	void setDetail(const char* detail);
+	void end(); // Record now instead of at the end of the scope
+
+private:
+	const char* name;
+	char detail[TRACE_DETAIL_SIZE];
+	uint64_t startUsec;
+	const char* argNames[TRACE_MAX_ARGS];
+	uint64_t args[TRACE_MAX_ARGS];
+};
+
+} // namespace Trace
+} // namespace Dex
+#endif // TRACE_H
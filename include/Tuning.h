@@ -0,0 +1,55 @@
+#ifndef TUNING_H
+#define TUNING_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Dex {
+
+#define TUNE_MIN_CHUNK (16 * 1024) // Until the connection has been measured
+#define TUNE_MAX_CHUNK (1024 * 1024)
+#define TUNE_CHUNK_USEC 1000 // A chunk carries about this much transfer time
+#define TUNE_PROBE_BYTES (2 * 1024 * 1024) // Moved before the first decision
+#define TUNE_PROBE_MS 50
+#define TUNE_INTERVAL_MS 1000 // Between later decisions
+#define TUNE_MAX_SOCKET_BUFFER (16 * 1024 * 1024)
+
+// Sends small control packets at once instead of holding them back until
+// the previous segment is acknowledged
+void setNoDelay(int socket);
+
+// Sizes the file data chunks and the socket buffer of one side of a TCP
+// connection to its measured speed. Chunks start at TUNE_MIN_CHUNK. Once
+// TUNE_PROBE_BYTES of a file have moved in at least TUNE_PROBE_MS, and then
+// every TUNE_INTERVAL_MS, the throughput and round-trip time are sampled:
+// a chunk becomes about TUNE_CHUNK_USEC of data, so fast links need fewer
+// syscalls and slow ones keep small buffers, and the send or receive buffer
+// is raised to twice the bandwidth-delay product. Buffers only grow, so a
+// link limited by its buffer measures a larger product next time. Chosen
+// values are logged when they change.
+class AutoTuner {
+public:
+	// sending selects the socket buffer that is tuned
+	AutoTuner(int socket, bool sending);
+	size_t chunkSize() const { return chunk; }
+	char* buffer() { return data.data(); } // Holds chunkSize() bytes
+	// A file starts; the time before it is not measured
+	void begin();
+	// Called after each chunk with the bytes it moved
+	void moved(size_t bytes);
+
+private:
+	void adjust(uint64_t elapsedUsec);
+
+	int socket;
+	bool sending;
+	size_t chunk = TUNE_MIN_CHUNK;
+	std::vector<char> data;
+	int socketBuffer = 0; // As reported by the kernel
+	bool probed = false;
+	uint64_t windowStartUsec = 0;
+	uint64_t windowBytes = 0;
+};
+
+} // namespace Dex
+#endif // TUNING_H
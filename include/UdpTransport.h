@@ -0,0 +1,102 @@
+#ifndef UDPTRANSPORT_H
+#define UDPTRANSPORT_H
+#include "packet.h"
+#include "Progress.h"
+#include "Durability.h"
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <vector>
+
+namespace Dex {
+
+#define UDP_PAYLOAD_SIZE 1400 // File bytes per datagram, fits a 1500 MTU
+#define UDP_WINDOW 8192 // Packets beyond the cumulative ACK, power of two
+#define UDP_FEC_GROUP 16 // Data packets per XOR parity packet
+#define UDP_ACK_PACKETS 16 // Receivers ACK after this many packets...
+#define UDP_ACK_INTERVAL_US 2000 // ...or this long after the first unACKed
+#define UDP_TIMEOUT_MS 10000 // Give up when the peer is silent this long
+#define UDP_BW_SAMPLES 10 // Delivery rate samples in the max filter
+
+// Applied to outgoing datagrams, to test over loopback
+struct UdpImpairment {
+	double loss = 0; // Probability of dropping a datagram
+	unsigned delayMs = 0; // One way delay added to every datagram
+};
+
+// Parses "LOSS%[,DELAYms]", e.g. "1%,20ms". Returns -1 on a syntax error.
+int parseImpairment(const char* str, UdpImpairment* impairment);
+
+struct UdpStats {
+	uint64_t packets; // Data packets sent or received, without duplicates
+	uint64_t retransmits;
+	uint64_t parity; // FEC packets sent or received
+	uint64_t recovered; // Data packets rebuilt from parity
+	uint64_t wireBytes; // All datagrams, including headers and ACKs
+	double rate; // Final pacing rate in bytes per second (sender)
+};
+
+// Carries file data over UDP next to a TCP connection, which keeps all
+// control messages and the receiver's end-of-file confirmation. Datagrams
+// name their file offset, so receivers write them where they belong and
+// sparse files need no extra framing. Senders pace packets at the measured
+// delivery rate instead of halving on loss, resend what selective ACKs show
+// missing, and optionally add one XOR parity packet per UDP_FEC_GROUP data
+// packets so single losses are repaired without a round trip.
+class UdpChannel {
+public:
+	UdpChannel(bool fec, const UdpImpairment& impairment);
+	~UdpChannel();
+	// Binds next to the TCP connection's local address. Returns the UDP
+	// port, or -1.
+	int open(int controlSocket);
+	// Sends to this port on the TCP connection's peer
+	int connect(int port);
+	int sendFile(int fd, const std::vector<ExtentPkt>& extents,
+	             ProgressReporter& progress);
+	// Datagrams for bytes past size are dropped
+	int receiveFile(FILE* file, uint64_t size, uint64_t packets,
+	                ProgressReporter& progress, DurabilityTracker& durability);
+	const UdpStats& getStats() const { return stats; }
+	static uint64_t packetCount(const std::vector<ExtentPkt>& extents);
+
+private:
+	// Sender rate control state, kept from file to file
+	struct Pacing {
+		double rate; // Bytes per second
+		double bwSamples[UDP_BW_SAMPLES] = {};
+		double maxBw = 0;
+		unsigned bwIndex = 0;
+		unsigned cycle = 0;
+		bool probed = false; // Startup has found the bandwidth
+		uint64_t minRtt = UINT64_MAX;
+		uint64_t srtt = 0;
+		uint64_t rttVar = 0;
+	};
+
+	struct Delayed {
+		uint64_t dueUsec;
+		std::vector<char> data;
+	};
+
+	void transmit(const void* data, size_t length);
+	void flushDelayed(uint64_t now);
+	uint64_t nextDelayedUsec() const;
+	int wait(uint64_t untilUsec, bool* controlReady);
+	int sendDone(bool ok);
+	int receiveDone(bool* ok);
+
+	int udpSocket;
+	int controlSocket;
+	bool fec;
+	UdpImpairment impairment;
+	std::mt19937 random;
+	std::deque<Delayed> delayed;
+	uint32_t fileId; // Same sequence on both ends, one per file
+	Pacing pacing;
+	UdpStats stats;
+};
+
+} // namespace Dex
+#endif // UDPTRANSPORT_H
@@ -1,6 +1,7 @@
 #ifndef PACKET_H
 #define PACKET_H
 #include <ctime>
+#include <cstdint>
 
 enum class Command {
 	PULL,
@@ -9,15 +10,48 @@ enum class Command {
 	INVALID
 };
 
+#define MAX_RANGES 8
+#define MAX_PATH_ADDRESSES 8
+
+// A byte range of a PULL. A negative offset counts from the end of the
+// file, and length 0 runs to the end.
+typedef struct RangePkt {
+	int64_t offset;
+	uint64_t length;
+} rangePkt;
+
 typedef struct InitPkt {
 	Command command = Command::INVALID;
 	char pattern[512]; // file pattern
 	unsigned totalFiles; // Number of local files found used for PUSH command.
+	uint64_t totalBytes; // PUSH: disk space the files need on the server
+	uint64_t sessionId; // Client generated, ties client and server traces
+	bool keepAlive; // Server waits for another InitPkt after this command
+	uint64_t cursor; // LIST: resume position from a previous page, 0 = start
+	unsigned limit; // LIST: maximum number of entries, 0 = all
+	char filter[256]; // Filter expression in canonical form, see Filter.h
+	uint16_t udpPort; // PULL/PUSH: client's UDP port for file data, 0 = TCP
+	bool udpFec; // Add parity packets to UDP file data
+	uint8_t rangeCount; // PULL: send only these ranges of each file
+	RangePkt ranges[MAX_RANGES];
+	bool follow; // PULL of one file: keep sending what is appended to it
+	bool dedupe; // PUSH: FileInfoPkt carries the SHA-256 of each file
+	bool fileOrder; // PULL: extents have to come in file order (stdout)
+	bool localFiles; // Unix socket: contents may be passed as open files
+	bool multipath; // PULL/PUSH: file data may be striped over subflows
+	uint64_t joinToken; // This connection is a subflow of that session
 } InitPacket ;
 
 typedef struct InitReplyPkt {
 	bool proceed;
 	unsigned totalFiles;
+	uint16_t udpPort; // Server's UDP port, 0 = file data stays on TCP
+	bool dedupe; // PUSH: hashes are answered with a ContentReplyPkt
+	bool localFiles; // Agrees to InitPkt.localFiles
+	uint64_t multipathToken; // Subflows join with it, 0 = no multipath
+	uint8_t pathCount; // Server addresses subflows may connect to
+	uint32_t pathAddresses[MAX_PATH_ADDRESSES]; // IPv4, network byte order
+	uint16_t pathPorts[MAX_PATH_ADDRESSES];
 } initReplyPkt;
 
 typedef struct StartSignalPkt {
@@ -28,6 +62,65 @@ typedef struct FileInfoPkt {
 	char name[128];
 	size_t size;
 	time_t time;
+	bool sparse; // Content is sent as ExtentPkt records, see below
+	uint64_t udpPackets; // Content is sent as this many UDP datagrams instead
+	bool partial; // Only the requested ranges are sent, as extents
+	bool follow; // Appended data follows as extents until the end extent
+	bool diskOrder; // Extents of a dense file, in the order they are on disk
+	bool local; // Content follows as a LocalFilePkt, see below
+	uint64_t multipathChunks; // Content is striped as this many chunks over
+	                          // the subflows instead, see Multipath.h
+	bool hashed; // PUSH with dedupe: hash is set
+	uint8_t hash[32]; // SHA-256 of the content, holes read as zeros
 } fileInfoPkt;
 
+// With dedupe, the server answers a hashed FileInfoPkt before the content
+// is sent. Content the server already has is not sent.
+typedef struct ContentReplyPkt {
+	bool have;
+} contentReplyPkt;
+
+// A local file's content is not sent: the sender passes the open file
+// (SCM_RIGHTS) with a LocalFilePkt, and the receiver copies it and answers
+// with one telling whether it did.
+typedef struct LocalFilePkt {
+	bool ok;
+} localFilePkt;
+
+// The content of a sparse file is a sequence of data extents, each an
+// ExtentPkt followed by length bytes. An extent with length 0 ends the file;
+// everything not covered by an extent is a hole. While following a file,
+// an extent at EXTENT_RESTART with length 0 means it was truncated or
+// replaced, and the extents after it describe the new contents.
+#define EXTENT_RESTART UINT64_MAX
+typedef struct ExtentPkt {
+	uint64_t offset;
+	uint64_t length;
+} extentPkt;
+
+// LIST replies are streamed as batches of at most LIST_BATCH_SIZE bytes of
+// ListEntryPkt records, each followed by its name (not NUL terminated). A
+// batch with count 0 ends the list.
+#define LIST_BATCH_SIZE (16 * 1024)
+
+enum class FileType : uint8_t {
+	REGULAR,
+	DIRECTORY,
+	SYMLINK,
+	OTHER
+};
+
+typedef struct ListBatchPkt {
+	uint32_t count; // Entries in this batch
+	uint32_t length; // Bytes of entries following this header
+	uint64_t cursor; // Last batch only: next page cursor, 0 when complete
+} listBatchPkt;
+
+typedef struct ListEntryPkt {
+	uint64_t size;
+	int64_t time;
+	uint16_t nameLength;
+	FileType type;
+} listEntryPkt;
+
 #endif // PACKET_H
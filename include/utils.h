@@ -1,13 +1,91 @@
 #ifndef UTILS_H
 #define UTILS_H
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
 #include <string>
 #include <vector>
+#include <sys/socket.h>
+#include "Filter.h"
+#include "packet.h"
+#include <sys/stat.h>
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // Apple platforms use SO_NOSIGPIPE instead
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+// Parses a byte count that may end in k, m, g or t (1024 based). Returns -1
+// on a syntax error.
+int parseSize(const char* str, uint64_t* size);
+// Parses comma separated byte ranges OFFSET[:LENGTH] with size suffixes,
+// e.g. "0:64k,-10m". A negative offset counts from the end of the file and
+// a missing length runs to the end. Returns -1 on a syntax error or more
+// than MAX_RANGES ranges.
+int parseRanges(const char* spec, std::vector<RangePkt>& ranges);
+// Clamps the ranges to a file of size bytes and returns them as sorted,
+// merged extents
+void resolveRanges(const RangePkt* ranges, unsigned count, uint64_t size,
+                   std::vector<ExtentPkt>& extents);
 bool isFilePattern(const char* filename);
 std::string getBaseName(const std::string& path);
 void splitPathAndPattern(const std::string& filestr, std::string& directory,
                          std::string& pattern);
-std::vector<std::string> getMatchingFiles(const std::string& filestr);
-bool fileExists(const char *path);
+// Regular files in the pattern's directory whose names match its glob and
+// that pass the filter, if any. Entries are stat'ed at most once, and only
+// when the filter needs it.
+std::vector<std::string> getMatchingFiles(const std::string& filestr,
+                                          const Dex::Filter* filter = nullptr);
+// A file found by scanMatchingFiles. st is only valid if hasStat is set,
+// which happens when the filter needed it or the entry had no type.
+struct FileEntry {
+	std::string name; // Relative to the scanned directory
+	ino_t ino; // From the directory entry
+	bool hasStat;
+	struct stat st;
+};
+// Like getMatchingFiles, but keeps the directory open so the files can be
+// opened with openat instead of resolving their full paths again. Returns
+// the directory descriptor, which the caller closes, or -1 on failure.
+int scanMatchingFiles(const std::string& filestr, const Dex::Filter* filter,
+                      std::vector<FileEntry>& entries);
+// Fills extents with the data extents of fd if the file has holes. Returns
+// -1 for dense files and where holes cannot be detected.
+int getSparseExtents(int fd, const struct stat& st,
+                     std::vector<ExtentPkt>& extents);
+// Where a piece of a file is stored on its device
+struct DiskExtent {
+	uint64_t logical; // Offset in the file
+	uint64_t physical; // Offset on the device, 0 if not allocated yet
+	uint64_t length;
+};
+// Fills extents with the first maxExtents extents of fd, in file order,
+// using FIEMAP. Returns 1 if the file has more, and -1 where the file
+// system cannot map files.
+int getDiskExtents(int fd, size_t maxExtents, std::vector<DiskExtent>& extents);
+// Orders the files found by scanMatchingFiles by where their data starts
+// on the disk, so reading them in turn sweeps the disk once instead of
+// seeking back and forth. Files with nothing on the disk yet come first.
+// Where files cannot be mapped they are ordered by inode number, which
+// file systems tend to allocate close to the data.
+void sortByDiskLocation(int dirFd, std::vector<FileEntry>& entries);
 int createDirectory(const char *dir);
+// Returns -1 if the file system holding dir has less than bytes available
+int checkFreeSpace(const char* dir, uint64_t bytes);
+// Received files are written to a hidden temporary file next to path and
+// renamed into place when complete, so readers never see partial files.
+// Dense files get their full size preallocated, beyond the end of the file,
+// to avoid fragmentation.
+FILE* createPartialFile(const std::string& path, uint64_t size, bool sparse,
+                        std::string& tempPath);
+// Checks for write errors and the size, applies the modification time and
+// renames the file to path. Closes file, and removes it on failure.
+int publishPartialFile(FILE* file, const std::string& tempPath,
+                       const std::string& path, uint64_t size, time_t time);
+void discardPartialFile(FILE* file, const std::string& tempPath);
+// Opens path for writing byte ranges in place, creating it if needed and
+// keeping the rest of its contents
+FILE* openRangeFile(const std::string& path);
 #endif // UTILS_H
\ No newline at end of file
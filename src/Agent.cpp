@@ -0,0 +1,380 @@
+#include "Agent.h"
+#include "Logger.h"
+#include "Tuning.h"
+#include "utils.h"
+#include <chrono>
+#include <csignal>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+namespace Dex {
+
+typedef struct AgentRequestPkt {
+	char serverIp[64];
+	int port;
+} agentRequestPkt;
+
+typedef struct AgentReplyPkt {
+	bool ok;
+	bool reused; // A warm connection, otherwise newly connected
+} agentReplyPkt;
+
+typedef struct AgentReleasePkt {
+	bool reusable;
+} agentReleasePkt;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onStopSignal(int) {
+	stopRequested = 1;
+}
+
+static uint64_t nowSec() {
+	return std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int connectUnix(const char* path) {
+	struct sockaddr_un addr{};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOGE("Agent socket path too long: %s", path);
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, strlen(path));
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int connectToServer(const char* serverIp, int port) {
+	struct sockaddr_in serverAddr{};
+	serverAddr.sin_family = AF_INET;
+	serverAddr.sin_port = htons(port);
+	if (inet_pton(AF_INET, serverIp, &serverAddr.sin_addr) <= 0) {
+		LOGE("Invalid address / Address not supported: %s", serverIp);
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		LOGE("Socket creation failed: %s", strerror(errno));
+		return -1;
+	}
+	// Every client waits on the agent's loop, so an unreachable server is
+	// given up on quickly
+	int flags = fcntl(fd, F_GETFL);
+	int error = 0;
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		error = errno;
+	} else if (connect(fd, (struct sockaddr*)&serverAddr,
+	                   sizeof(serverAddr)) != 0) {
+		struct pollfd pfd = {fd, POLLOUT, 0};
+		socklen_t errorLen = sizeof(error);
+		if (errno != EINPROGRESS) {
+			error = errno;
+		} else if (poll(&pfd, 1, AGENT_CONNECT_MS) != 1) {
+			error = ETIMEDOUT;
+		} else {
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+		}
+	}
+	if (error || fcntl(fd, F_SETFL, flags) != 0) {
+		LOGE("Connection to server %s:%d failed: %s", serverIp, port,
+		     strerror(error ? error : errno));
+		close(fd);
+		return -1;
+	}
+	setNoDelay(fd);
+	return fd;
+}
+
+// An idle keep-alive connection must not have anything to read: data or EOF
+// means the server closed it or the stream is out of sync.
+static bool isIdleConnectionUsable(int fd) {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	return poll(&pfd, 1, 0) == 0;
+}
+
+Agent::Agent() : listenSocket(-1) {
+}
+
+Agent::~Agent() {
+	while (!connections.empty()) {
+		closeConnection(connections.size() - 1);
+	}
+	if (listenSocket != -1) {
+		close(listenSocket);
+		unlink(socketPath.c_str());
+	}
+}
+
+std::string Agent::defaultSocketPath() {
+	const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+	if (runtimeDir && *runtimeDir) {
+		return std::string(runtimeDir) + "/dexft-agent.sock";
+	}
+	return "/tmp/dexft-agent-" + std::to_string(getuid()) + ".sock";
+}
+
+int Agent::run(const char* path) {
+	struct sockaddr_un addr{};
+
+	if (strlen(path) == 0 || strlen(path) >= sizeof(addr.sun_path)) {
+		LOGE("Invalid agent socket path: %s", path);
+		return -1;
+	}
+	// Only replace the socket file if no agent is serving it
+	int existing = connectUnix(path);
+	if (existing >= 0) {
+		close(existing);
+		LOGE("Agent already running on %s", path);
+		return -1;
+	}
+
+	if ((listenSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		LOGE("Agent socket creation failed: %s", strerror(errno));
+		return -1;
+	}
+	socketPath = path;
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, strlen(path));
+	unlink(path);
+	if (bind(listenSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		LOGE("Agent bind failed: %s", strerror(errno));
+		close(listenSocket);
+		listenSocket = -1;
+		return -1;
+	}
+	chmod(path, S_IRUSR | S_IWUSR); // Lend connections to this user only
+	if (listen(listenSocket, 16) < 0) {
+		LOGE("Agent listen failed: %s", strerror(errno));
+		return -1;
+	}
+
+	struct sigaction sa{};
+	sa.sa_handler = onStopSignal; // No SA_RESTART so poll() returns
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	LOGI("Agent listening on %s", path);
+
+	std::vector<struct pollfd> fds;
+	while (!stopRequested) {
+		// Borrowed connections are watched through the client's Unix socket,
+		// idle ones directly so servers closing them are noticed
+		fds.clear();
+		fds.push_back({listenSocket, POLLIN, 0});
+		for (const auto& c : connections) {
+			fds.push_back({c.lender != -1 ? c.lender : c.fd, POLLIN, 0});
+		}
+
+		if (poll(fds.data(), fds.size(), 1000) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOGE("Agent poll failed: %s", strerror(errno));
+			break;
+		}
+
+		for (size_t i = fds.size() - 1; i > 0; i--) {
+			if (!fds[i].revents) {
+				continue;
+			}
+			const Connection& c = connections[i - 1];
+			if (c.lender != -1) {
+				release(c.lender);
+			} else {
+				LOGD("Idle connection to %s closed", c.server.c_str());
+				closeConnection(i - 1);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int clientFd = accept(listenSocket, nullptr, nullptr);
+			if (clientFd >= 0) {
+				lend(clientFd);
+			}
+		}
+		expireIdle();
+	}
+
+	LOGI("Agent stopped");
+	return 0;
+}
+
+void Agent::lend(int clientFd) {
+	AgentRequestPkt request{};
+	AgentReplyPkt reply{};
+	struct timeval tv = {1, 0};
+	setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (recv(clientFd, &request, sizeof(request), MSG_WAITALL) !=
+	    sizeof(request)) {
+		close(clientFd);
+		return;
+	}
+	request.serverIp[sizeof(request.serverIp) - 1] = '\0';
+	std::string server = std::string(request.serverIp) + ":" +
+	                     std::to_string(request.port);
+
+	// Prefer the most recently used idle connection
+	size_t index = connections.size();
+	for (size_t i = connections.size(); i-- > 0;) {
+		if (connections[i].lender != -1 || connections[i].server != server) {
+			continue;
+		}
+		if (isIdleConnectionUsable(connections[i].fd)) {
+			index = i;
+			reply.reused = true;
+			break;
+		}
+		closeConnection(i);
+	}
+	if (index == connections.size()) {
+		int fd = connectToServer(request.serverIp, request.port);
+		if (fd >= 0) {
+			connections.push_back({fd, server, -1, nowSec()});
+		}
+	}
+	reply.ok = index < connections.size();
+
+	// The TCP socket travels as ancillary data with the reply
+	struct iovec iov = {&reply, sizeof(reply)};
+	struct msghdr msg{};
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (reply.ok) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &connections[index].fd, sizeof(int));
+	}
+	if (sendmsg(clientFd, &msg, MSG_NOSIGNAL) != sizeof(reply) || !reply.ok) {
+		close(clientFd);
+		return;
+	}
+	connections[index].lender = clientFd;
+	LOGI("Lent %s connection to %s", reply.reused ? "warm" : "new",
+	     server.c_str());
+}
+
+void Agent::release(int clientFd) {
+	size_t i = 0;
+	while (i < connections.size() && connections[i].lender != clientFd) {
+		i++;
+	}
+	if (i == connections.size()) {
+		close(clientFd);
+		return;
+	}
+
+	// A client that exits without releasing may have left the stream in an
+	// unknown state, so only an explicit release keeps the connection
+	AgentReleasePkt releasePkt{};
+	bool reusable = recv(clientFd, &releasePkt, sizeof(releasePkt),
+	                     MSG_DONTWAIT) == sizeof(releasePkt) &&
+	                releasePkt.reusable;
+	close(clientFd);
+
+	unsigned idle = 0;
+	for (const auto& c : connections) {
+		if (c.lender == -1 && c.server == connections[i].server) {
+			idle++;
+		}
+	}
+	if (!reusable || idle >= AGENT_MAX_IDLE) {
+		closeConnection(i);
+		return;
+	}
+	connections[i].lender = -1;
+	connections[i].idleSince = nowSec();
+}
+
+void Agent::closeConnection(size_t i) {
+	if (connections[i].lender != -1) {
+		close(connections[i].lender);
+	}
+	close(connections[i].fd);
+	connections.erase(connections.begin() + i);
+}
+
+void Agent::expireIdle() {
+	uint64_t now = nowSec();
+	for (size_t i = connections.size(); i-- > 0;) {
+		if (connections[i].lender == -1 &&
+		    now - connections[i].idleSince > AGENT_IDLE_SEC) {
+			LOGD("Closing idle connection to %s",
+			     connections[i].server.c_str());
+			closeConnection(i);
+		}
+	}
+}
+
+int agentBorrow(const char* path, const char* serverIp, int port,
+    int* agentSocket) {
+	int fd = connectUnix(path);
+	if (fd < 0) {
+		LOGD("No agent on %s", path);
+		return -1;
+	}
+
+	AgentRequestPkt request{};
+	strncpy(request.serverIp, serverIp, sizeof(request.serverIp) - 1);
+	request.port = port;
+	if (send(fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+		close(fd);
+		return -1;
+	}
+
+	AgentReplyPkt reply{};
+	struct iovec iov = {&reply, sizeof(reply)};
+	struct msghdr msg{};
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(reply) || !reply.ok) {
+		LOGD("Agent could not provide a connection");
+		close(fd);
+		return -1;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS) {
+		close(fd);
+		return -1;
+	}
+	int serverSocket;
+	memcpy(&serverSocket, CMSG_DATA(cmsg), sizeof(int));
+	LOGD("Borrowed %s connection from agent", reply.reused ? "warm" : "new");
+	*agentSocket = fd;
+	return serverSocket;
+}
+
+void agentRelease(int agentSocket, bool reusable) {
+	AgentReleasePkt releasePkt{};
+	releasePkt.reusable = reusable;
+	send(agentSocket, &releasePkt, sizeof(releasePkt), MSG_NOSIGNAL);
+	close(agentSocket);
+}
+
+} // namespace Dex
@@ -0,0 +1,198 @@
+#include "BlockCache.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <tuple>
+#include <unistd.h>
+
+namespace Dex {
+
+static uint64_t nowUsec() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+FileId FileId::of(const struct stat& st) {
+#ifdef __APPLE__
+	const struct timespec& mtime = st.st_mtimespec;
+#else
+	const struct timespec& mtime = st.st_mtim;
+#endif
+	return FileId{st.st_dev, st.st_ino, st.st_size,
+	              static_cast<int64_t>(mtime.tv_sec) * 1000000000 +
+	              mtime.tv_nsec};
+}
+
+bool FileId::operator==(const FileId& other) const {
+	return dev == other.dev && ino == other.ino && size == other.size &&
+	       mtimeNsec == other.mtimeNsec;
+}
+
+bool FileId::operator<(const FileId& other) const {
+	return std::tie(dev, ino, size, mtimeNsec) <
+	       std::tie(other.dev, other.ino, other.size, other.mtimeNsec);
+}
+
+bool BlockCache::Key::operator==(const Key& other) const {
+	return block == other.block && file == other.file;
+}
+
+size_t BlockCache::KeyHash::operator()(const Key& key) const {
+	uint64_t h = std::hash<uint64_t>()(key.file.ino);
+	h = h * 31 + std::hash<uint64_t>()(key.file.dev);
+	h = h * 31 + std::hash<int64_t>()(key.file.mtimeNsec);
+	h = h * 31 + std::hash<uint64_t>()(key.block);
+	return h ^ (h >> 29);
+}
+
+BlockCache::BlockCache(Metrics& metrics) : metrics(metrics),
+    shardCapacity(BLOCK_CACHE_SIZE / BLOCK_CACHE_SHARDS) {
+}
+
+void BlockCache::setCapacity(uint64_t bytes) {
+	shardCapacity = bytes / BLOCK_CACHE_SHARDS;
+}
+
+// Returns the block if it is cached, updating its queue position
+BlockCache::Block BlockCache::lookup(Shard& shard, const Key& key) {
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find(key);
+	if (it == shard.entries.end() || it->second.queue == Queue::OUT) {
+		return nullptr;
+	}
+	Entry& entry = it->second;
+	if (entry.queue == Queue::MAIN) {
+		shard.main.splice(shard.main.begin(), shard.main, entry.position);
+	} else if (nowUsec() - entry.loadedUsec >=
+	           BLOCK_CACHE_CORRELATED_MS * 1000ULL) {
+		// Read again by a later transfer
+		shard.inBytes -= entry.data->size();
+		shard.main.splice(shard.main.begin(), shard.in, entry.position);
+		entry.queue = Queue::MAIN;
+	}
+	return entry.data;
+}
+
+void BlockCache::insert(Shard& shard, const Key& key, const Block& data) {
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find(key);
+	if (it != shard.entries.end()) {
+		if (it->second.queue != Queue::OUT) {
+			return; // Another session loaded it meanwhile
+		}
+		// Read again soon after it left IN: it is hot
+		shard.out.erase(it->second.position);
+		shard.main.push_front(key);
+		it->second = Entry{data, Queue::MAIN, shard.main.begin(), nowUsec()};
+	} else {
+		shard.in.push_front(key);
+		shard.entries[key] = Entry{data, Queue::IN, shard.in.begin(),
+		                           nowUsec()};
+		shard.inBytes += data->size();
+	}
+	shard.bytes += data->size();
+	metrics.cacheBytes.fetch_add(data->size(), std::memory_order_relaxed);
+	evict(shard);
+}
+
+// Frees blocks until the shard fits. IN is held to a quarter of the shard,
+// and the keys it drops are remembered for as many blocks as half a shard.
+void BlockCache::evict(Shard& shard) {
+	uint64_t outLimit = shardCapacity / BLOCK_CACHE_BLOCK_SIZE / 2;
+	while (shard.bytes > shardCapacity) {
+		bool fromIn = !shard.in.empty() &&
+			(shard.inBytes > shardCapacity / 4 || shard.main.empty());
+		std::list<Key>& queue = fromIn ? shard.in : shard.main;
+		auto it = shard.entries.find(queue.back());
+		size_t size = it->second.data->size();
+		shard.bytes -= size;
+		metrics.cacheBytes.fetch_sub(size, std::memory_order_relaxed);
+		if (fromIn) {
+			shard.inBytes -= size;
+			shard.out.splice(shard.out.begin(), shard.in,
+			                 it->second.position);
+			it->second.data.reset();
+			it->second.queue = Queue::OUT;
+		} else {
+			shard.main.pop_back();
+			shard.entries.erase(it);
+		}
+	}
+	while (shard.out.size() > outLimit) {
+		shard.entries.erase(shard.out.back());
+		shard.out.pop_back();
+	}
+}
+
+BlockCache::Block BlockCache::load(int fd, const Key& key) {
+	uint64_t offset = key.block * BLOCK_CACHE_BLOCK_SIZE;
+	size_t want = std::min<uint64_t>(BLOCK_CACHE_BLOCK_SIZE,
+	                                 key.file.size - offset);
+	std::shared_ptr<std::vector<char>> data =
+		std::make_shared<std::vector<char>>(want);
+	size_t got = 0;
+	while (got < want) {
+		ssize_t n = pread(fd, data->data() + got, want - got, offset + got);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			LOGE("Error reading file: %s", strerror(errno));
+			return nullptr;
+		}
+		if (n == 0) {
+			break;
+		}
+		got += n;
+	}
+	data->resize(got);
+	return data;
+}
+
+ssize_t BlockCache::read(int fd, const FileId& id, uint64_t offset,
+	char* buffer, size_t length) {
+	if (shardCapacity < BLOCK_CACHE_BLOCK_SIZE) {
+		ssize_t n;
+		while ((n = pread(fd, buffer, length, offset)) < 0 && errno == EINTR) {
+		}
+		return n;
+	}
+
+	size_t copied = 0;
+	uint64_t size = id.size;
+	while (copied < length && offset + copied < size) {
+		Key key{id, (offset + copied) / BLOCK_CACHE_BLOCK_SIZE};
+		Shard& shard = shards[KeyHash()(key) % BLOCK_CACHE_SHARDS];
+		Block data = lookup(shard, key);
+		if (data) {
+			metrics.cacheHits.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			metrics.cacheMisses.fetch_add(1, std::memory_order_relaxed);
+			data = load(fd, key);
+			if (!data) {
+				return copied ? static_cast<ssize_t>(copied) : -1;
+			}
+			// Short blocks mean the file changed since it was stat'ed. A
+			// rewrite that keeps the size still moves the mtime, so a block
+			// read meanwhile is keyed by a version no later stat returns.
+			if (data->size() == std::min<uint64_t>(BLOCK_CACHE_BLOCK_SIZE,
+				id.size - key.block * BLOCK_CACHE_BLOCK_SIZE)) {
+				insert(shard, key, data);
+			}
+		}
+
+		size_t skip = offset + copied - key.block * BLOCK_CACHE_BLOCK_SIZE;
+		if (skip >= data->size()) {
+			break; // The file shrank
+		}
+		size_t n = std::min(length - copied, data->size() - skip);
+		memcpy(buffer + copied, data->data() + skip, n);
+		copied += n;
+	}
+	return copied;
+}
+
+} // namespace Dex
@@ -0,0 +1,241 @@
+#include "ContentStore.h"
+#include "Logger.h"
+#include "utils.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
+
+namespace Dex {
+
+ContentClaim::~ContentClaim() {
+	if (store) {
+		store->release(key);
+	}
+}
+
+// ".name.pid.n.link" next to path, unique among concurrent sessions
+static std::string tempName(const std::string& path) {
+	static std::atomic<unsigned> counter(0);
+	size_t slash = path.find_last_of('/');
+	size_t nameStart = slash == std::string::npos ? 0 : slash + 1;
+	return path.substr(0, nameStart) + "." + path.substr(nameStart) + "." +
+	       std::to_string(getpid()) + "." + std::to_string(counter++) +
+	       ".link";
+}
+
+// Creates to as a copy of from that shares its blocks. Fails with
+// EOPNOTSUPP, EXDEV or EINVAL where the file system cannot.
+static int cloneFile(const std::string& from, const std::string& to) {
+#if defined(__linux__) && defined(FICLONE)
+	int source = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source < 0) {
+		return -1;
+	}
+	int target = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+	                    0666);
+	if (target < 0) {
+		close(source);
+		return -1;
+	}
+	int result = ioctl(target, FICLONE, source);
+	int error = errno;
+	close(source);
+	close(target);
+	if (result != 0) {
+		unlink(to.c_str());
+		errno = error;
+		return -1;
+	}
+	return 0;
+#elif defined(__APPLE__)
+	return clonefile(from.c_str(), to.c_str(), 0);
+#else
+	(void)from;
+	(void)to;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+// Creates to as a copy of from with blocks of its own
+static int copyFile(const std::string& from, const std::string& to) {
+	int source = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source < 0) {
+		LOGE("Error opening %s: %s", from.c_str(), strerror(errno));
+		return -1;
+	}
+	int target = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+	                    0666);
+	if (target < 0) {
+		LOGE("Error creating %s: %s", to.c_str(), strerror(errno));
+		close(source);
+		return -1;
+	}
+	char buffer[65536];
+	ssize_t n;
+	while ((n = read(source, buffer, sizeof(buffer))) > 0) {
+		for (ssize_t done = 0; done < n; ) {
+			ssize_t written = write(target, buffer + done, n - done);
+			if (written < 0) {
+				n = -1;
+				break;
+			}
+			done += written;
+		}
+		if (n < 0) {
+			break;
+		}
+	}
+	int error = errno;
+	close(source);
+	if (close(target) != 0 && n == 0) {
+		n = -1;
+		error = errno;
+	}
+	if (n != 0) {
+		LOGE("Error copying %s to %s: %s", from.c_str(), to.c_str(),
+		     strerror(error));
+		unlink(to.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+// Makes to a reflink of from, or a copy if that is not possible. A hard
+// link would share the mode and time of the stored copy with the user's
+// file.
+static int cloneOrCopy(const std::string& from, const std::string& to) {
+	if (cloneFile(from, to) == 0) {
+		return 0;
+	}
+	return copyFile(from, to);
+}
+
+// Renames temp over path
+static int replace(const std::string& temp, const std::string& path) {
+	if (rename(temp.c_str(), path.c_str()) != 0) {
+		LOGE("Error renaming %s to %s: %s", temp.c_str(), path.c_str(),
+		     strerror(errno));
+		unlink(temp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+int ContentStore::open(const std::string& path) {
+	if (createDirectory(path.c_str()) != 0 ||
+	    createDirectory((path + "/objects").c_str()) != 0) {
+		return -1;
+	}
+	root = path;
+	return 0;
+}
+
+std::string ContentStore::objectPath(const std::string& key) const {
+	return root + "/objects/" + key.substr(0, 2) + "/" + key.substr(2);
+}
+
+bool ContentStore::has(const std::string& key, uint64_t size) const {
+	struct stat st;
+	return stat(objectPath(key).c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+	       static_cast<uint64_t>(st.st_size) == size;
+}
+
+bool ContentStore::claim(const uint8_t hash[SHA256_SIZE], uint64_t size,
+    ContentClaim& claim) {
+	std::string key = hexDigest(hash);
+	std::unique_lock<std::mutex> lock(mutex);
+	bool waited = released.wait_for(lock,
+	    std::chrono::milliseconds(CONTENT_CLAIM_WAIT_MS),
+	    [&] { return !receiving.count(key); });
+	if (has(key, size)) {
+		return true;
+	}
+	if (!waited) {
+		LOGI("Gave up waiting for another upload of %s", key.c_str());
+		return false;
+	}
+	receiving.insert(key);
+	claim.store = this;
+	claim.key = key;
+	return false;
+}
+
+void ContentStore::release(const std::string& key) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		receiving.erase(key);
+	}
+	released.notify_all();
+}
+
+int ContentStore::link(const uint8_t hash[SHA256_SIZE],
+    const std::string& path, time_t time) {
+	std::string temp = tempName(path);
+	if (cloneOrCopy(objectPath(hexDigest(hash)), temp) != 0) {
+		return -1;
+	}
+	struct timespec times[2];
+	times[0].tv_sec = time;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
+	if (utimensat(AT_FDCWD, temp.c_str(), times, 0) != 0) {
+		LOGE("Error copying file timestamp: %s", strerror(errno));
+		unlink(temp.c_str());
+		return -1;
+	}
+	return replace(temp, path);
+}
+
+int ContentStore::add(const uint8_t hash[SHA256_SIZE],
+    const std::string& path, time_t time) {
+	std::string key = hexDigest(hash);
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		LOGE("Error getting status of %s: %s", path.c_str(), strerror(errno));
+		return -1;
+	}
+	if (has(key, st.st_size)) {
+		// Without reflinks a copy would free nothing, path is kept as it is
+		std::string temp = tempName(path);
+		if (cloneFile(objectPath(key), temp) != 0) {
+			return 0;
+		}
+		struct timespec times[2];
+		times[0].tv_sec = time;
+		times[0].tv_nsec = 0;
+		times[1] = times[0];
+		if (utimensat(AT_FDCWD, temp.c_str(), times, 0) != 0 ||
+		    chmod(temp.c_str(), st.st_mode & 07777) != 0) {
+			LOGE("Error copying file status: %s", strerror(errno));
+			unlink(temp.c_str());
+			return -1;
+		}
+		return replace(temp, path);
+	}
+
+	std::string object = objectPath(key);
+	std::string temp = tempName(object);
+	if (createDirectory(object.substr(0, object.find_last_of('/')).c_str())
+	    != 0 || cloneOrCopy(path, temp) != 0) {
+		return -1;
+	}
+	if (chmod(temp.c_str(), 0444) != 0) {
+		LOGE("Error protecting %s: %s", temp.c_str(), strerror(errno));
+		unlink(temp.c_str());
+		return -1;
+	}
+	return replace(temp, object);
+}
+
+} // namespace Dex
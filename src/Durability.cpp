@@ -0,0 +1,151 @@
+#include "Durability.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace Dex {
+
+// Starts writeback of the file's dirty pages after waiting for the
+// writeback started by the previous call
+static void writeBehind(int fd) {
+#if defined(__linux__) && (!defined(__ANDROID__) || __ANDROID_API__ >= 26)
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+	                SYNC_FILE_RANGE_WRITE);
+#else
+	(void)fd;
+#endif
+}
+
+static int syncFileSystem(const std::string& directory) {
+#ifdef __linux__
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGE("Error opening %s: %s", directory.c_str(), strerror(errno));
+		return -1;
+	}
+#if defined(__ANDROID__) && __ANDROID_API__ < 28
+	int ret = syscall(__NR_syncfs, fd);
+#else
+	int ret = syncfs(fd);
+#endif
+	if (ret != 0) {
+		LOGE("Error syncing %s: %s", directory.c_str(), strerror(errno));
+	}
+	close(fd);
+	return ret;
+#else
+	(void)directory;
+	sync();
+	return 0;
+#endif
+}
+
+static int syncDirectory(const std::string& directory) {
+	int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGE("Error opening %s: %s", directory.c_str(), strerror(errno));
+		return -1;
+	}
+	int ret = fsync(fd);
+	if (ret != 0) {
+		LOGE("Error syncing %s: %s", directory.c_str(), strerror(errno));
+	}
+	close(fd);
+	return ret;
+}
+
+static std::string parentDirectory(const std::string& path) {
+	size_t slash = path.find_last_of('/');
+	if (slash == std::string::npos) {
+		return ".";
+	}
+	return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+int parseDurability(const char* name, Durability* durability) {
+	if (strcmp(name, "none") == 0) {
+		*durability = Durability::NONE;
+	} else if (strcmp(name, "file") == 0) {
+		*durability = Durability::FILE;
+	} else if (strcmp(name, "batch") == 0) {
+		*durability = Durability::BATCH;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+DurabilityTracker::DurabilityTracker(Durability durability)
+    : durability(durability) {
+}
+
+DurabilityTracker::~DurabilityTracker() {
+	finish();
+}
+
+void DurabilityTracker::written(FILE* file, uint64_t bytes) {
+	if (durability == Durability::NONE) {
+		return;
+	}
+	unflushedBytes += bytes;
+	if (unflushedBytes >= WRITE_BEHIND_BYTES) {
+		fflush(file);
+		writeBehind(fileno(file));
+		unflushedBytes = 0;
+	}
+}
+
+int DurabilityTracker::fileDone(FILE* file) {
+	unflushedBytes = 0;
+	if (durability != Durability::FILE) {
+		return 0;
+	}
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+		LOGE("Error syncing file: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int DurabilityTracker::published(const std::string& path, uint64_t size) {
+	std::string directory = parentDirectory(path);
+	switch (durability) {
+	case Durability::FILE:
+		// Makes the rename itself durable
+		return syncDirectory(directory);
+	case Durability::BATCH:
+		if (pendingFiles && directory != pendingDirectory &&
+			syncPending() != 0) {
+			return -1;
+		}
+		pendingDirectory = directory;
+		pendingFiles++;
+		pendingBytes += size;
+		if (pendingFiles >= SYNC_BATCH_FILES ||
+			pendingBytes >= SYNC_BATCH_BYTES) {
+			return syncPending();
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+int DurabilityTracker::finish() {
+	return pendingFiles ? syncPending() : 0;
+}
+
+int DurabilityTracker::syncPending() {
+	LOGD("Syncing %u files, %llu bytes", pendingFiles,
+	     static_cast<unsigned long long>(pendingBytes));
+	pendingFiles = 0;
+	pendingBytes = 0;
+	return syncFileSystem(pendingDirectory);
+}
+
+} // namespace Dex
@@ -0,0 +1,232 @@
+#include "FanOut.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Dex {
+
+#define NO_CHUNK UINT64_MAX
+
+class SharedRead {
+public:
+	SharedRead(int fd, const FileId& id, Metrics& metrics, BlockCache& cache);
+	~SharedRead();
+	unsigned join();
+	void leave(unsigned member);
+	ssize_t read(unsigned member, uint64_t offset, char* buffer,
+	             size_t length);
+	bool atStart();
+
+private:
+	struct Slot {
+		uint64_t chunk = NO_CHUNK;
+		bool loading = false;
+		std::unique_ptr<char[]> data;
+	};
+
+	struct Member {
+		uint64_t cursor = 0;
+		bool active = true;
+		bool detached = false;
+	};
+
+	void slide(uint64_t newBase);
+	size_t chunkLength(uint64_t chunk) const;
+
+	int fd;
+	FileId id;
+	uint64_t size;
+	Metrics& metrics;
+	BlockCache& cache;
+	std::mutex mutex;
+	std::condition_variable loaded;
+	std::vector<Slot> slots; // Chunk c lives in slot c % slots.size()
+	std::vector<Member> members;
+	uint64_t base = 0; // Oldest chunk still in the window
+	uint64_t diskBytes = 0;
+	uint64_t sharedBytes = 0; // Copied to a session that did not read it
+	unsigned detached = 0;
+};
+
+SharedRead::SharedRead(int fd, const FileId& id, Metrics& metrics,
+    BlockCache& cache) : fd(fd), id(id), size(id.size), metrics(metrics),
+    cache(cache) {
+	uint64_t chunks = (size + FANOUT_CHUNK_SIZE - 1) / FANOUT_CHUNK_SIZE;
+	slots.resize(std::min<uint64_t>(FANOUT_WINDOW_CHUNKS, chunks));
+}
+
+SharedRead::~SharedRead() {
+	LOGD("Shared read done: sessions=%zu disk=%llu shared=%llu detached=%u",
+	     members.size(), static_cast<unsigned long long>(diskBytes),
+	     static_cast<unsigned long long>(sharedBytes), detached);
+	metrics.fanOutDiskBytes.fetch_add(diskBytes, std::memory_order_relaxed);
+	metrics.fanOutSharedBytes.fetch_add(sharedBytes, std::memory_order_relaxed);
+	metrics.fanOutDetached.fetch_add(detached, std::memory_order_relaxed);
+	close(fd);
+}
+
+unsigned SharedRead::join() {
+	std::lock_guard<std::mutex> lock(mutex);
+	members.emplace_back();
+	return members.size() - 1;
+}
+
+void SharedRead::leave(unsigned member) {
+	std::lock_guard<std::mutex> lock(mutex);
+	members[member].active = false;
+}
+
+bool SharedRead::atStart() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return base == 0;
+}
+
+size_t SharedRead::chunkLength(uint64_t chunk) const {
+	uint64_t offset = chunk * FANOUT_CHUNK_SIZE;
+	return offset >= size ? 0 :
+	       std::min<uint64_t>(FANOUT_CHUNK_SIZE, size - offset);
+}
+
+// Moves the window forward, detaching the sessions left behind it
+void SharedRead::slide(uint64_t newBase) {
+	base = newBase;
+	for (Member& m : members) {
+		if (m.active && !m.detached && m.cursor / FANOUT_CHUNK_SIZE < base) {
+			m.detached = true;
+			detached++;
+		}
+	}
+}
+
+ssize_t SharedRead::read(unsigned member, uint64_t offset, char* buffer,
+	size_t length) {
+	std::unique_lock<std::mutex> lock(mutex);
+	uint64_t chunk = offset / FANOUT_CHUNK_SIZE;
+	bool loadedHere = false;
+
+	// Members may grow while the lock is released, so they are indexed anew
+	members[member].cursor = offset;
+	while (true) {
+		if (!members[member].detached && chunk < base) {
+			members[member].detached = true;
+			detached++;
+		}
+		if (members[member].detached || offset >= size) {
+			return 0;
+		}
+		if (chunk >= base + slots.size()) {
+			slide(chunk - slots.size() + 1);
+			continue;
+		}
+
+		Slot& slot = slots[chunk % slots.size()];
+		if (slot.chunk == chunk) {
+			size_t skip = offset - chunk * FANOUT_CHUNK_SIZE;
+			size_t n = std::min(length, chunkLength(chunk) - skip);
+			memcpy(buffer, slot.data.get() + skip, n);
+			if (!loadedHere) {
+				sharedBytes += n;
+			}
+			return n;
+		}
+		if (slot.loading) {
+			loaded.wait(lock);
+			continue;
+		}
+
+		// Read the chunk without holding the lock, so other sessions keep
+		// copying from the rest of the window meanwhile
+		slot.loading = true;
+		slot.chunk = NO_CHUNK;
+		if (!slot.data) {
+			slot.data.reset(new char[FANOUT_CHUNK_SIZE]);
+		}
+		char* data = slot.data.get();
+		size_t want = chunkLength(chunk);
+		lock.unlock();
+		size_t got = 0;
+		while (got < want) {
+			ssize_t n = cache.read(fd, id, chunk * FANOUT_CHUNK_SIZE + got,
+			                       data + got, want - got);
+			if (n <= 0) {
+				break;
+			}
+			got += n;
+		}
+		lock.lock();
+		slot.loading = false;
+		loaded.notify_all();
+		if (got != want) {
+			// Read error, or the file shrank since it was opened
+			LOGE("Error reading shared file");
+			return -1;
+		}
+		slot.chunk = chunk;
+		diskBytes += want;
+		loadedHere = true;
+	}
+}
+
+FanOutReader::~FanOutReader() {
+	if (stream) {
+		stream->leave(member);
+	}
+}
+
+ssize_t FanOutReader::read(uint64_t offset, char* buffer, size_t length) {
+	ssize_t n = stream->read(member, offset, buffer, length);
+	if (n == 0) {
+		LOGI("Client fell behind the shared read at %llu, reading alone",
+		     static_cast<unsigned long long>(offset));
+		stream->leave(member);
+		stream.reset();
+	}
+	return n;
+}
+
+FanOut::FanOut(Metrics& metrics, BlockCache& cache) : metrics(metrics),
+    cache(cache) {
+}
+
+int FanOut::join(int fd, const struct stat& st, FanOutReader& reader) {
+	if (!S_ISREG(st.st_mode) || st.st_size <= 0) {
+		return -1;
+	}
+	FileId key = FileId::of(st);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto it = streams.begin(); it != streams.end();) {
+		it = it->second.expired() ? streams.erase(it) : std::next(it);
+	}
+
+	std::shared_ptr<SharedRead> stream;
+	auto it = streams.find(key);
+	if (it != streams.end()) {
+		stream = it->second.lock();
+	}
+	// Sessions can only join while the first chunk is in the window; later
+	// ones start a new shared read that the next arrivals join instead
+	if (!stream || !stream->atStart()) {
+		int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (own < 0) {
+			LOGE("Error duplicating file descriptor: %s", strerror(errno));
+			return -1;
+		}
+		stream = std::make_shared<SharedRead>(own, key, metrics, cache);
+		streams[key] = stream;
+	} else {
+		LOGD("Joining shared read of inode %llu",
+		     static_cast<unsigned long long>(st.st_ino));
+	}
+	reader.member = stream->join();
+	reader.stream = stream;
+	return 0;
+}
+
+} // namespace Dex
@@ -1,6 +1,12 @@
 #include "FileTransferClient.h"
 #include "utils.h"
 #include "Logger.h"
+#include "Trace.h"
+#include "Agent.h"
+#include "LocalTransport.h"
+#include "Pipeline.h"
+#include "Sha256.h"
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sys/socket.h>
@@ -11,7 +17,6 @@
 #include <cerrno>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <utime.h>
 // Time
 #include <chrono>
 
@@ -19,43 +24,267 @@ namespace Dex {
 
 #define DEFAULT_PORT 9413
 #define FILENAME_SIZE 1024
-#define CHUNK_SIZE 1024*16
 
-FileTransferClient::FileTransferClient(): serverSocket(-1), totalFiles(0),
-    fileCount(0) {
+FileTransferClient::FileTransferClient(): serverSocket(-1), port(DEFAULT_PORT),
+    totalFiles(0), fileCount(0), running(false), cancelled(false) {
 }
 
 FileTransferClient::~FileTransferClient() {
+	cancel();
+	if (worker.joinable()) {
+		worker.join();
+	}
+	closeSocket(true);
+}
+
+TransferResult FileTransferClient::runClient(const char* serverIp, Command cmd,
+    const char* pattern) {
+	if (running.exchange(true)) {
+		LOGE("A transfer is already running");
+		return TransferResult{TransferStatus::FAILED, 0, 0, 0, 0};
+	}
+	cancelled = false;
+	TransferResult result = transfer(serverIp, cmd, pattern);
+	running = false;
+	return result;
+}
+
+std::future<TransferResult> FileTransferClient::start(const char* serverIp,
+    Command cmd, const char* pattern, CompletionCallback callback, void* ctx) {
+	std::promise<TransferResult> promise;
+	std::future<TransferResult> future = promise.get_future();
+
+	if (running.exchange(true)) {
+		LOGE("A transfer is already running");
+		promise.set_value(TransferResult{TransferStatus::FAILED, 0, 0, 0, 0});
+		return future;
+	}
+	if (worker.joinable()) {
+		worker.join(); // Previous transfer has finished
+	}
+	cancelled = false;
+
+	std::string ip(serverIp);
+	std::string pat(pattern);
+	worker = std::thread([this, ip, cmd, pat, callback, ctx,
+	                      promise = std::move(promise)]() mutable {
+		TransferResult result = transfer(ip.c_str(), cmd, pat.c_str());
+		if (callback) {
+			callback(sessionId, result, ctx);
+		}
+		running = false;
+		promise.set_value(result);
+	});
+	return future;
+}
+
+void FileTransferClient::cancel() {
+	cancelled = true;
+	// Wakes up any send/recv blocked on the connection
+	std::lock_guard<std::mutex> lock(socketMutex);
 	if (serverSocket != -1) {
-		close(serverSocket);
+		shutdown(serverSocket, SHUT_RDWR);
+	}
+}
+
+void FileTransferClient::setPort(int port) {
+	this->port = port;
+}
+
+void FileTransferClient::setKeepAlive(bool keepAlive) {
+	this->keepAlive = keepAlive;
+}
+
+void FileTransferClient::setAgentSocket(const char* path) {
+	agentPath = path;
+}
+
+void FileTransferClient::setMultipath(bool enable) {
+	multipathEnabled = enable;
+}
+
+void FileTransferClient::setLocalSocket(const char* path) {
+	localEnabled = path != nullptr;
+	localSocketPath = path ? path : "";
+}
+
+void FileTransferClient::disconnect() {
+	closeSocket(true);
+}
+
+void FileTransferClient::setListPage(uint64_t cursor, unsigned limit) {
+	listCursor = cursor;
+	listLimit = limit;
+}
+
+int FileTransferClient::setRanges(const char* spec) {
+	if (!spec) {
+		ranges.clear();
+		return 0;
 	}
+	return parseRanges(spec, ranges);
+}
+
+void FileTransferClient::setStdout(bool enable) {
+	toStdout = enable;
+}
+
+void FileTransferClient::setFollow(bool enable) {
+	follow = enable;
+}
+
+void FileTransferClient::setDedupe(bool enable) {
+	dedupe = enable;
+}
+
+int FileTransferClient::setFilter(const char* expression) {
+	Filter parsed;
+	if (parsed.parse(expression, time(nullptr)) != 0) {
+		return -1;
+	}
+	std::string str = parsed.toString();
+	if (str.length() >= FILTER_SIZE) {
+		LOGE("Filter expression too long: %s", str.c_str());
+		return -1;
+	}
+	filter = parsed;
+	filterStr = str;
+	return 0;
+}
+
+void FileTransferClient::setListCallback(ListCallback callback, void* ctx) {
+	listCallback = callback;
+	listCtx = ctx;
+}
+
+void FileTransferClient::setDirectory(const char* directory) {
+	this->directory = directory;
+}
+
+void FileTransferClient::setDurability(Durability durability) {
+	this->durability = durability;
+}
+
+void FileTransferClient::setUdp(bool enable, bool fec) {
+	udpEnabled = enable;
+	udpFec = fec;
+}
+
+void FileTransferClient::setUdpImpairment(const UdpImpairment& impairment) {
+	udpImpairment = impairment;
+}
+
+void FileTransferClient::setProgressCallback(ProgressCallback callback,
+    void* ctx, unsigned intervalMs) {
+	progressCallback = callback;
+	progressCtx = ctx;
+	progressIntervalMs = intervalMs;
 }
 
-void FileTransferClient::runClient(const char* serverIp, Command cmd,
+TransferResult FileTransferClient::transfer(const char* serverIp, Command cmd,
     const char* pattern) {
-	// Connect to server
-	serverSocket = connectToServer(serverIp);
+	fileCount = 0;
+	sessionId = Trace::newSessionId();
+	Trace::Session traceSession(sessionId, "client");
+	ProgressReporter progress(progressCallback, progressCtx, progressIntervalMs,
+	                          sessionId, cmd);
+
+	// Connect to server unless the kept alive connection can be reused
+	int ret = 0;
+	if (serverSocket == -1 ||
+	    connectedServer != std::string(serverIp) + ":" + std::to_string(port)) {
+		closeSocket(true);
+		Trace::Span connectSpan("connect", serverIp);
+		ret = connectToServer(serverIp);
+	}
 
 	// Handle command
-	handleCommand(cmd, pattern);
+	if (ret == 0 && !cancelled) {
+		ret = handleCommand(cmd, pattern, progress);
+	}
+
+	TransferResult result = progress.result(TransferStatus::OK);
+	if (ret != 0 || result.failedFiles || cancelled ||
+	    (!keepAlive && agentSocket == -1)) {
+		// Also drops connections left out of sync by a failed command
+		LOGD("Closing connection");
+		closeSocket();
+	} else if (!keepAlive) {
+		closeSocket(true); // Hand the borrowed connection back to the agent
+	}
+	progress.finish();
 
-	LOGD("Closing connection");
-	close(serverSocket);
-	LOGI("Complete");
+	if (cancelled) {
+		result.status = TransferStatus::CANCELLED;
+		LOGI("Cancelled");
+	} else if (ret != 0 || result.failedFiles) {
+		result.status = TransferStatus::FAILED;
+		LOGI("Failed");
+	} else {
+		LOGI("Complete");
+	}
+	return result;
+}
+
+void FileTransferClient::closeSocket(bool reusable) {
+	std::lock_guard<std::mutex> lock(socketMutex);
+	if (agentSocket != -1) {
+		agentRelease(agentSocket, reusable && serverSocket != -1);
+		agentSocket = -1;
+	}
+	if (serverSocket != -1) {
+		close(serverSocket);
+		serverSocket = -1;
+	}
+	connectedServer.clear();
+	localConnection = false;
 }
 
 int FileTransferClient::connectToServer(const char* serverIp) {
 	int fd;
 	struct sockaddr_in serverAddr;
+	std::string server = std::string(serverIp) + ":" + std::to_string(port);
+
+	// A server on this host is reached over its Unix socket, which does not
+	// need the agent to be fast
+	if (localEnabled && isLoopbackAddress(serverIp)) {
+		std::string path = localSocketPath.empty() ?
+			defaultLocalSocketPath(port, false) : localSocketPath;
+		if (!path.empty() && (fd = connectLocal(path.c_str())) >= 0) {
+			std::lock_guard<std::mutex> lock(socketMutex);
+			serverSocket = fd;
+			connectedServer = server;
+			localConnection = true;
+			LOGI("Connected to server over %s", path.c_str());
+			return 0;
+		}
+		LOGD("No server on %s, using TCP", path.c_str());
+	}
+
+	// Use a warm connection from the agent if one is running
+	if (!agentPath.empty()) {
+		int agentFd;
+		if ((fd = agentBorrow(agentPath.c_str(), serverIp, port, &agentFd)) >= 0) {
+			std::lock_guard<std::mutex> lock(socketMutex);
+			serverSocket = fd;
+			agentSocket = agentFd;
+			connectedServer = server;
+			return 0;
+		}
+	}
 
 	// Create socket
 	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 		LOGE("Socket creation failed: %s", strerror(errno));
 		return -1;
 	}
+	{
+		std::lock_guard<std::mutex> lock(socketMutex);
+		serverSocket = fd;
+	}
 
 	serverAddr.sin_family = AF_INET;
-	serverAddr.sin_port = htons(DEFAULT_PORT);
+	serverAddr.sin_port = htons(port);
 
 	if (inet_pton(AF_INET, serverIp, &serverAddr.sin_addr) <= 0) {
 		LOGE("Invalid address / Address not supported");
@@ -68,11 +297,14 @@ int FileTransferClient::connectToServer(const char* serverIp) {
 		LOGE("Connection to server failed: %s", strerror(errno));
 		return -1;
 	}
+	setNoDelay(fd);
 	LOGD("Connected to server");
-	return fd;
+	connectedServer = server;
+	return 0;
 }
 
-int FileTransferClient::handleCommand(Command cmd, const char *pattern) {
+int FileTransferClient::handleCommand(Command cmd, const char *pattern,
+    ProgressReporter& progress) {
 	LOGD("Handle command=%d pattern=%s ", static_cast<int>(cmd), pattern);
 	InitPacket initPkt{};
 	std::vector<std::string> files;
@@ -80,7 +312,8 @@ int FileTransferClient::handleCommand(Command cmd, const char *pattern) {
 
 	// Check if local file(s) exist for PUSH command
 	if (cmd == Command::PUSH) {
-		files = getMatchingFiles(pattern);
+		Trace::Span scanSpan("scan", pattern);
+		files = getMatchingFiles(pattern, &filter);
 		if (files.empty()) {
 			LOGI("No files found with pattern=[%s]", pattern);
 			return -1;
@@ -88,36 +321,80 @@ int FileTransferClient::handleCommand(Command cmd, const char *pattern) {
 		totalFiles = files.size();
 		initPkt.totalFiles = totalFiles;
 		LOGD("totalFiles=[%d]", totalFiles);
+
+		// Lets the server refuse a batch that does not fit. Sparse files
+		// only need their allocated blocks.
+		struct stat st;
+		for (const auto& file : files) {
+			if (stat(file.c_str(), &st) == 0) {
+				initPkt.totalBytes += std::min<uint64_t>(st.st_size,
+					static_cast<uint64_t>(st.st_blocks) * 512);
+			}
+		}
 	}
 
 	// Send command to server
 	LOGI("Sending command=%d pattern=%s totalFiles=%d", static_cast<int>(cmd),
 	      pattern, totalFiles);
 	initPkt.command = cmd;
+	initPkt.sessionId = sessionId;
+	initPkt.keepAlive = keepAlive || agentSocket != -1;
+	memcpy(initPkt.filter, filterStr.c_str(), filterStr.length());
+	if (cmd == Command::LIST) {
+		initPkt.cursor = listCursor;
+		initPkt.limit = listLimit;
+	}
+	if (cmd == Command::PULL) {
+		initPkt.rangeCount = static_cast<uint8_t>(ranges.size());
+		std::copy(ranges.begin(), ranges.end(), initPkt.ranges);
+		initPkt.follow = follow;
+		initPkt.fileOrder = toStdout;
+	}
+	initPkt.dedupe = dedupe && cmd == Command::PUSH;
+	// Whole files only, and not into stdout
+	initPkt.localFiles = localConnection && cmd != Command::LIST &&
+		!(cmd == Command::PULL && (toStdout || follow));
+	initPkt.multipath = multipathEnabled && !localConnection &&
+		cmd != Command::LIST && !(cmd == Command::PULL && (toStdout || follow));
 	memcpy(initPkt.pattern, pattern, strlen(pattern));
+	tuner.reset(new AutoTuner(serverSocket, cmd == Command::PUSH));
+	udp.reset();
+	multipath.reset();
+	// stdout may be a pipe, which UDP data cannot be written into by offset
+	if (udpEnabled && !localConnection && !initPkt.multipath &&
+	    cmd != Command::LIST &&
+	    !(cmd == Command::PULL && toStdout)) {
+		udp.reset(new UdpChannel(udpFec, udpImpairment));
+		int udpPort = udp->open(serverSocket);
+		if (udpPort < 0) {
+			udp.reset();
+		} else {
+			initPkt.udpPort = static_cast<uint16_t>(udpPort);
+			initPkt.udpFec = udpFec;
+		}
+	}
+	Trace::Span initSpan("init");
 
-	if (send(serverSocket, &initPkt, sizeof(initPkt), 0) < 0) {
+	if (send(serverSocket, &initPkt, sizeof(initPkt), MSG_NOSIGNAL) < 0) {
 		LOGE("Send command failed: %s", strerror(errno));
-		close(serverSocket);
 		return -1;
 	}
 
 	// Receive init reply
 	InitReplyPkt initReplyPkt{};
 	LOGI("Waiting server response");
-	if (recv(serverSocket, &initReplyPkt, sizeof(initReplyPkt), 0) < 0) {
+	if (recv(serverSocket, &initReplyPkt, sizeof(initReplyPkt), 0) <= 0) {
 		LOGE("Receive init reply failed: %s", strerror(errno));
-		close(serverSocket);
 		return -1;
 	}
 
 	if (cmd == Command::PULL || cmd == Command::LIST) {
-		// If no files are found then close
+		// If no files are found then close. LIST does not know the number
+		// of files in advance.
 		totalFiles = initReplyPkt.totalFiles;
 		LOGD("totalFiles: %d", totalFiles);
-		if (totalFiles == 0) {
+		if (!initReplyPkt.proceed) {
 			LOGE("No files found in server with pattern=%s", pattern);
-			close(serverSocket);
 			return -1;
 		}
 	} else if (cmd == Command::PUSH) {
@@ -127,6 +404,29 @@ int FileTransferClient::handleCommand(Command cmd, const char *pattern) {
 		}
 	}
 
+	initSpan.end();
+	progress.setTotalFiles(totalFiles);
+	sendHashes = initPkt.dedupe && initReplyPkt.dedupe;
+	passFiles = initPkt.localFiles && initReplyPkt.localFiles;
+	if (initPkt.dedupe && !sendHashes) {
+		LOGI("Server has no content store, sending every file");
+	}
+	if (udp && (!initReplyPkt.udpPort ||
+	    udp->connect(initReplyPkt.udpPort) != 0)) {
+		LOGI("Server does not support UDP, using TCP");
+		udp.reset();
+	}
+	if (initPkt.multipath && !initReplyPkt.multipathToken) {
+		LOGI("Server does not support multipath, using TCP");
+	} else if (initPkt.multipath) {
+		// Kept without subflows, the server may still send over this one
+		Trace::Span joinSpan("join");
+		multipath.reset(new MultipathChannel(serverSocket));
+		if (multipath->join(initPkt, initReplyPkt, port) == 0) {
+			LOGI("No subflow could be connected, using TCP");
+		}
+	}
+
 	// Start time
 	auto startTime = std::chrono::high_resolution_clock::now();
 
@@ -135,18 +435,34 @@ int FileTransferClient::handleCommand(Command cmd, const char *pattern) {
 	{
 		LOGI("Start receiving files");
 		// Receive file(s) and save to local
-		for (size_t i = 0; i < totalFiles; i++) {
-			receiveFile();
+		DurabilityTracker tracker(durability);
+		receiveStalls = PipelineStats{};
+		for (size_t i = 0; i < totalFiles && !cancelled; i++) {
+			progress.fileDone(receiveFile(progress, tracker) == 0);
+		}
+		if (tracker.finish() != 0) {
+			return -1;
 		}
 		LOGI("Total files received: %d ", fileCount);
+		if (receiveStalls.socketStallUsec || receiveStalls.diskStallUsec) {
+			LOGI("Receiving waited %llu ms for the disk, writing waited "
+			     "%llu ms for the network",
+			     static_cast<unsigned long long>(
+			         receiveStalls.socketStallUsec / 1000),
+			     static_cast<unsigned long long>(
+			         receiveStalls.diskStallUsec / 1000));
+		}
 		break;
 	}
 	case Command::PUSH:
 	{
 		LOGI("Start sending files");
 		for (const auto& file: files) {
+			if (cancelled) {
+				break;
+			}
 			LOGD("file: %s", file.c_str());
-			sendFile(file.c_str());
+			progress.fileDone(sendFile(file.c_str(), progress) == 0);
 		}
 		LOGI("Total files sent: %d ", fileCount);
 		break;
@@ -154,7 +470,9 @@ int FileTransferClient::handleCommand(Command cmd, const char *pattern) {
 	case Command::LIST:
 	{
 		LOGI("Start receiving file list");
-		receiveFileList();
+		if (receiveFileList() != 0) {
+			return -1;
+		}
 		LOGI("Total files found: %d ", totalFiles);
 		break;
 	}
@@ -172,11 +490,34 @@ int FileTransferClient::handleCommand(Command cmd, const char *pattern) {
 	LOGI("Elapsed time: %lld milliseconds %.2f seconds",
 	     static_cast<long long int>(elapsed.count()),
 	     static_cast<double>(elapsed.count()/1000));
+	if (multipath) {
+		for (const auto& path : multipath->getPathStats()) {
+			LOGI("Subflow %s: %.1f MB, %.1f MB/s%s", path.name.c_str(),
+			     path.bytes / 1e6, path.bytes / 1e3 /
+			     std::max(elapsed.count(), 1.0),
+			     path.failed ? ", failed" : "");
+		}
+	}
 
 	return 0;
 }
 
-int FileTransferClient::receiveFile() {
+static int writeZeros(FILE* file, uint64_t length) {
+	static const char zeros[TUNE_MIN_CHUNK] = {0};
+	while (length > 0) {
+		size_t n = std::min<uint64_t>(sizeof(zeros), length);
+		if (fwrite(zeros, 1, n, file) != n) {
+			return -1;
+		}
+		length -= n;
+	}
+	return 0;
+}
+
+int FileTransferClient::receiveFile(ProgressReporter& progress,
+    DurabilityTracker& tracker) {
+	Trace::Span fileSpan("file");
+
 	// Send start signal to server
 	LOGD("Sending start signal");
 	StartSignalPkt startSignalPkt{};
@@ -184,7 +525,7 @@ int FileTransferClient::receiveFile() {
 	ssize_t bytesSent = 0;
 	
 	if ((bytesSent = send(serverSocket, &startSignalPkt,
-	    sizeof(startSignalPkt), 0)) != sizeof(startSignalPkt)) {
+	    sizeof(startSignalPkt), MSG_NOSIGNAL)) != sizeof(startSignalPkt)) {
 		if (bytesSent < 0)
 			LOGE("Send start signal failed: %s", strerror(errno));
 		else
@@ -196,6 +537,7 @@ int FileTransferClient::receiveFile() {
 	ssize_t bytesRecv = 0;
 	FileInfoPkt fileInfoPkt{};
 	LOGD("Receiving file info");
+	Trace::Span waitSpan("wait_info");
 	if ((bytesRecv = recv(serverSocket, &fileInfoPkt, sizeof(fileInfoPkt), 0))
 	        != sizeof(fileInfoPkt)) {
 		if (bytesRecv < 0)
@@ -204,69 +546,307 @@ int FileTransferClient::receiveFile() {
 			LOGE("Receive file info failed bytesRecv=%zu", bytesRecv);
 		return -1;
 	}
+	waitSpan.end();
+	fileSpan.setDetail(fileInfoPkt.name);
+	progress.beginFile(fileInfoPkt.name);
 	LOGD("File name=%s size=%ld time=%ld", fileInfoPkt.name, fileInfoPkt.size,
 	      fileInfoPkt.time);
 
-	// Open file for writing
-	FILE *file = fopen(fileInfoPkt.name, "wb");
+	// Prepend directory if present
+	std::string fileNameStr = fileInfoPkt.name;
+	if (!directory.empty()) {
+		fileNameStr = directory + "/" + fileInfoPkt.name;
+	}
+
+	// Write to stdout, into the file itself for ranges, or to a temporary
+	// file that replaces it when complete
+	Trace::Span openSpan("open");
+	std::string tempNameStr;
+	FILE *file;
+	if (toStdout) {
+		file = stdout;
+	} else if (fileInfoPkt.partial || fileInfoPkt.follow) {
+		file = openRangeFile(fileNameStr);
+		// A followed file is rewritten from the start
+		if (file && !fileInfoPkt.partial &&
+		    ftruncate(fileno(file), 0) != 0) {
+			LOGE("Error truncating %s: %s", fileNameStr.c_str(),
+			     strerror(errno));
+			fclose(file);
+			return -1;
+		}
+	} else {
+		// Files sent in disk order have no holes to leave unallocated
+		file = createPartialFile(fileNameStr, fileInfoPkt.size,
+		                         fileInfoPkt.sparse && !fileInfoPkt.diskOrder,
+		                         tempNameStr);
+	}
 	if (!file) {
-		LOGE("Error opening file");
 		return -1;
 	}
+	openSpan.end();
 
 	fileCount += 1;
-	LOGI("Receiving %d/%d name=%s size=%zu...", fileCount, totalFiles,
+	LOGD("Receiving %d/%d name=%s size=%zu...", fileCount, totalFiles,
 	     fileInfoPkt.name, fileInfoPkt.size);
 
 	// Receive the content of the file
 	LOGD("Receiving file content");
-	char buffer[CHUNK_SIZE] = {0};
 	bytesRecv = 0;
 	size_t totalBytesRecv = 0;
-	while (true) {
-		if ((bytesRecv = recv(serverSocket, buffer, CHUNK_SIZE, 0)) < 0) {
-			LOGE("Receive file chunk failed: %s", strerror(errno));
-			fileCount -= 1;
-			break;
+	bool failed = false;
+	bool tracing = Trace::active();
+	uint64_t recvUsec = 0;
+	uint64_t writeUsec = 0;
+	PipelineStats stats{};
+	uint64_t lapUsec = tracing ? Trace::nowUsec() : 0;
+	if (fileInfoPkt.local) {
+		// Copies the file the server passed and tells it when done
+		bool ok = false;
+		int fd = -1;
+		if (!passFiles || receiveLocalFile(serverSocket, &ok, &fd) != 0) {
+			LOGE("Unexpected local file");
+			failed = true;
+		} else {
+			uint64_t copied = 0;
+			Trace::Span copySpan("copy", fileInfoPkt.name);
+			if (!ok || fd < 0 || fflush(file) != 0 || copyFileData(fd,
+			    fileno(file), fileInfoPkt.size, progress, &copied) != 0) {
+				failed = true;
+			}
+			copySpan.end();
+			if (fd >= 0) {
+				close(fd);
+			}
+			tracker.written(file, copied);
+			totalBytesRecv = copied;
+			if (sendLocalFile(serverSocket, -1, !failed) != 0) {
+				failed = true;
+			}
+		}
+	} else if (fileInfoPkt.udpPackets) {
+		if (!udp) {
+			LOGE("UDP file data without a UDP transport");
+			failed = true;
+		} else {
+			failed = udp->receiveFile(file, fileInfoPkt.size,
+			                          fileInfoPkt.udpPackets, progress,
+			                          tracker) != 0;
+			totalBytesRecv = udp->getStats().packets * UDP_PAYLOAD_SIZE;
 		}
+	} else if (fileInfoPkt.multipathChunks) {
+		if (!multipath) {
+			LOGE("Multipath file data without subflows");
+			failed = true;
+		} else {
+			failed = multipath->receiveFile(file, fileInfoPkt.size,
+			                                fileInfoPkt.multipathChunks,
+			                                progress, tracker) != 0;
+			totalBytesRecv = multipath->getStats().wireBytes;
+		}
+	} else {
+		ExtentPkt extent = {0, fileInfoPkt.size};
+		uint64_t position = 0; // Of stdout within the file
+		// Written behind the socket unless it fits one slot or is written
+		// piece by piece as it arrives
+		ReceivePipeline* writer = nullptr;
+		if (!toStdout && !fileInfoPkt.follow &&
+		    fileInfoPkt.size > PIPELINE_SLOT_BYTES) {
+			if (!pipeline) {
+				pipeline.reset(new ReceivePipeline());
+			}
+			writer = pipeline.get();
+			writer->begin(file, &tracker);
+		}
+		tuner->begin();
+		while (!failed) {
+			if (fileInfoPkt.sparse) {
+				if (recv(serverSocket, &extent, sizeof(extent), MSG_WAITALL) !=
+				    sizeof(extent)) {
+					LOGE("Receive extent failed: %s", strerror(errno));
+					failed = true;
+					break;
+				}
+				if (extent.offset == EXTENT_RESTART && extent.length == 0 &&
+				    fileInfoPkt.follow) {
+					LOGI("%s was truncated or replaced", fileInfoPkt.name);
+					if (!toStdout && (fflush(file) != 0 ||
+					    ftruncate(fileno(file), 0) != 0)) {
+						LOGE("Error truncating file: %s", strerror(errno));
+						failed = true;
+						break;
+					}
+					position = 0;
+					continue;
+				}
+				if (extent.length == 0) {
+					break;
+				}
+				// Followed files grow past their size
+				if (!fileInfoPkt.follow &&
+				    (extent.offset > fileInfoPkt.size ||
+				    extent.length > fileInfoPkt.size - extent.offset)) {
+					LOGE("Invalid extent offset=%llu length=%llu",
+					     static_cast<unsigned long long>(extent.offset),
+					     static_cast<unsigned long long>(extent.length));
+					failed = true;
+					break;
+				}
+				if (toStdout) {
+					// Holes of whole files are written out as zeros
+					if (extent.offset < position || (!fileInfoPkt.partial &&
+					    writeZeros(file, extent.offset - position) != 0)) {
+						LOGE("Error writing to stdout");
+						failed = true;
+						break;
+					}
+				} else if (writer) {
+					writer->seek(extent.offset);
+				} else if (fseeko(file, extent.offset, SEEK_SET) != 0) {
+					// Seeking past the end leaves a hole
+					LOGE("Error seeking file: %s", strerror(errno));
+					failed = true;
+					break;
+				}
+				position = extent.offset + extent.length;
+			}
 
-		fwrite(buffer, 1, bytesRecv, file);
-		totalBytesRecv += bytesRecv;
+			uint64_t remaining = extent.length;
+			while (remaining > 0) {
+				char* buffer = tuner->buffer();
+				size_t room = tuner->chunkSize();
+				if (writer && !(buffer = writer->reserve(&room))) {
+					failed = true; // finish() reports the write error
+					break;
+				}
+				if ((bytesRecv = recv(serverSocket, buffer,
+				    std::min<uint64_t>(room, remaining), 0)) <= 0) {
+					if (bytesRecv < 0)
+						LOGE("Receive file chunk failed: %s", strerror(errno));
+					else
+						LOGE("Receive file chunk failed: connection closed");
+					failed = true;
+					break;
+				}
+				if (tracing) {
+					lapUsec = Trace::lap("recv", lapUsec, &recvUsec,
+					                     fileInfoPkt.name, bytesRecv);
+				}
 
-		if (totalBytesRecv >= fileInfoPkt.size) {
-			break;
+				if (writer) {
+					writer->commit(bytesRecv);
+				} else if (fwrite(buffer, 1, bytesRecv, file) !=
+				           static_cast<size_t>(bytesRecv)) {
+					LOGE("Error writing file: %s", strerror(errno));
+					failed = true;
+					break;
+				} else if (!toStdout) {
+					tracker.written(file, bytesRecv);
+				}
+				totalBytesRecv += bytesRecv;
+				remaining -= bytesRecv;
+				progress.addBytes(bytesRecv);
+				tuner->moved(bytesRecv);
+				if (tracing && !writer) {
+					lapUsec = Trace::lap("write", lapUsec, &writeUsec,
+					                     fileInfoPkt.name, bytesRecv);
+				}
+			}
+			// Followed data is visible as soon as it arrives
+			if (!failed && fileInfoPkt.follow && fflush(file) != 0) {
+				LOGE("Error writing file: %s", strerror(errno));
+				failed = true;
+			}
+			if (!fileInfoPkt.sparse) {
+				break;
+			}
+		}
+		if (writer) {
+			if (writer->finish(&stats) != 0) {
+				LOGE("Error writing file: %s", strerror(errno));
+				failed = true;
+			}
+			writeUsec = stats.writeUsec;
+			receiveStalls.socketStallUsec += stats.socketStallUsec;
+			receiveStalls.diskStallUsec += stats.diskStallUsec;
+		}
+		// Holes after the last extent
+		if (!failed && toStdout && fileInfoPkt.sparse &&
+		    !fileInfoPkt.partial && !fileInfoPkt.follow &&
+		    writeZeros(file, fileInfoPkt.size - position) != 0) {
+			LOGE("Error writing to stdout");
+			failed = true;
 		}
-		memset(buffer, 0, CHUNK_SIZE);
 	}
 
-	// Close the file
-	LOGD("Closing file");
-	fclose(file);
+	if (toStdout) {
+		if (fflush(file) != 0) {
+			LOGE("Error writing to stdout: %s", strerror(errno));
+			failed = true;
+		}
+	} else if (fileInfoPkt.partial || fileInfoPkt.follow) {
+		// Written in place, the file keeps its size and time
+		if (!failed && tracker.fileDone(file) != 0) {
+			failed = true;
+		}
+		if (fclose(file) != 0) {
+			LOGE("Error writing file: %s", strerror(errno));
+			failed = true;
+		}
+		if (!failed && tracker.published(fileNameStr, totalBytesRecv) != 0) {
+			failed = true;
+		}
+	} else {
+		// Holes after the last extent
+		if (!failed && fileInfoPkt.sparse && (fflush(file) != 0 ||
+		    ftruncate(fileno(file), static_cast<off_t>(fileInfoPkt.size)) !=
+		    0)) {
+			LOGE("Error setting file size: %s", strerror(errno));
+			failed = true;
+		}
 
-	// Copy original file timestamp
-	LOGD("Copying original time stamp");
-	struct utimbuf new_times;
-	new_times.actime = fileInfoPkt.time; // Use the current access time
-	new_times.modtime = fileInfoPkt.time; // Set the modification time
-	if (utime(fileInfoPkt.name, &new_times) == -1) {
-		LOGE("Error copying file timestamp: %s", strerror(errno));
+		// Publish the file under its final name only when it is complete
+		LOGD("Publishing file");
+		if (!failed && tracker.fileDone(file) != 0) {
+			failed = true;
+		}
+		if (failed) {
+			discardPartialFile(file, tempNameStr);
+		} else if (publishPartialFile(file, tempNameStr, fileNameStr,
+		           fileInfoPkt.size, fileInfoPkt.time) != 0 ||
+		           tracker.published(fileNameStr, fileInfoPkt.size) != 0) {
+			failed = true;
+		}
+	}
+	if (failed) {
 		fileCount -= 1;
 		return -1;
 	}
 
-	LOGI("Receive file completed %d/%d %s", fileCount, totalFiles,
-	     fileInfoPkt.name);
+	LOGP_LAST(fileCount == totalFiles, "Receive file completed %d/%d %s",
+	          fileCount, totalFiles, fileInfoPkt.name);
 
-	return 0;
+	fileSpan.setArg(0, "bytes", totalBytesRecv);
+	fileSpan.setArg(1, "recv_us", recvUsec);
+	fileSpan.setArg(2, "write_us", writeUsec);
+	fileSpan.setArg(3, "socket_stall_us", stats.socketStallUsec);
+	fileSpan.setArg(4, "disk_stall_us", stats.diskStallUsec);
+	return failed ? -1 : 0;
 }
 
-int FileTransferClient::sendFile(const char* fileName) {
+int FileTransferClient::sendFile(const char* fileName,
+    ProgressReporter& progress) {
+	std::string fileBaseName = getBaseName(fileName);
+	Trace::Span fileSpan("file", fileBaseName.c_str());
+	progress.beginFile(fileBaseName.c_str());
+
 	// Wait start signal from server
 	LOGD("Waiting for start signal");
 	StartSignalPkt startSignalPkt{};
 	ssize_t bytesRecv = 0;
 	ssize_t bytesSent = 0;
 
+	Trace::Span waitSpan("wait_start");
 	if ((bytesRecv = recv(serverSocket, &startSignalPkt,
 	    sizeof(startSignalPkt), 0)) != sizeof(startSignalPkt)) {
 		if (bytesRecv < 0)
@@ -275,6 +855,7 @@ int FileTransferClient::sendFile(const char* fileName) {
 			LOGE("Receive start signal failed bytesRecv=%zu", bytesRecv);
 		return -1;
 	}
+	waitSpan.end();
 
 	if (!startSignalPkt.start) {
 		LOGE("Error server did not proceed: signal=%d", startSignalPkt.start);
@@ -283,80 +864,202 @@ int FileTransferClient::sendFile(const char* fileName) {
 
 	// Retrieve file status
 	struct stat file_stat;
+	Trace::Span statSpan("stat");
 	if (stat(fileName, &file_stat) != 0) {
 		LOGE("Error getting file status");
 		return -1;
 	}
+	statSpan.end();
 
 	// Construct file info packet
 	FileInfoPkt fileInfoPkt{};
-	std::string fileBaseName = getBaseName(fileName);
 	memcpy(fileInfoPkt.name, fileBaseName.c_str(), fileBaseName.length());
 	fileInfoPkt.size = file_stat.st_size;
 	fileInfoPkt.time = file_stat.st_mtime;
 
+	// Open file for reading
+	Trace::Span openSpan("open");
+	FILE *file = fopen(fileName, "rb");
+	if (!file) {
+		LOGE("Error opening file");
+		return -1;
+	}
+	openSpan.end();
+
+	// Only the data extents of a sparse file are sent
+	std::vector<ExtentPkt> extents;
+	fileInfoPkt.sparse = getSparseExtents(fileno(file), file_stat,
+	                                      extents) == 0;
+	if (!fileInfoPkt.sparse) {
+		extents.assign(1, {0, fileInfoPkt.size});
+	}
+	if (udp) {
+		fileInfoPkt.udpPackets = UdpChannel::packetCount(extents);
+	}
+	if (multipath && multipath->pathCount() > 0) {
+		fileInfoPkt.multipathChunks = MultipathChannel::chunkCount(extents);
+	}
+	fileInfoPkt.local = passFiles;
+	if (sendHashes) {
+		Trace::Span hashSpan("hash");
+		if (hashFile(fileno(file), fileInfoPkt.hash) != 0) {
+			LOGE("Error reading file: %s", strerror(errno));
+			fclose(file);
+			return -1;
+		}
+		fileInfoPkt.hashed = true;
+	}
+
 	// Send file info packet to server
-	LOGD("Sending file name=%s size=%ld time=%ld...", fileInfoPkt.name,
-	     fileInfoPkt.size, fileInfoPkt.time);
-	if ((bytesSent = send(serverSocket, &fileInfoPkt, sizeof(fileInfoPkt), 0)) 
-	    != sizeof(fileInfoPkt)) {
+	LOGD("Sending file name=%s size=%ld time=%ld sparse=%d extents=%zu...",
+	     fileInfoPkt.name, fileInfoPkt.size, fileInfoPkt.time,
+	     fileInfoPkt.sparse, extents.size());
+	if ((bytesSent = send(serverSocket, &fileInfoPkt, sizeof(fileInfoPkt),
+	    MSG_NOSIGNAL)) != sizeof(fileInfoPkt)) {
 		if (bytesSent < 0)
 			LOGE("Send file info failed: %s", strerror(errno));
 		else
 			LOGE("Send file info failed bytesSent=%zu", bytesSent);
+		fclose(file);
 		return -1;
 	}
 
-	// Open file for reading
-	FILE *file = fopen(fileName, "rb");
-	if (!file) {
-		LOGE("Error opening file");
-		return -1;
+	// The content is not sent if the server has it
+	if (fileInfoPkt.hashed) {
+		ContentReplyPkt contentReplyPkt{};
+		if (recv(serverSocket, &contentReplyPkt, sizeof(contentReplyPkt),
+		    MSG_WAITALL) != sizeof(contentReplyPkt)) {
+			LOGE("Receive content reply failed: %s", strerror(errno));
+			fclose(file);
+			return -1;
+		}
+		if (contentReplyPkt.have) {
+			fileCount += 1;
+			fclose(file);
+			LOGP_LAST(fileCount == totalFiles, "Server already has %d/%d %s",
+			          fileCount, totalFiles, fileName);
+			fileSpan.setArg(0, "bytes", 0);
+			return 0;
+		}
 	}
 
 	// Send file content
 	fileCount += 1;
-	LOGI("Sending file %d/%d %s...", fileCount, totalFiles, fileName);
-	char buffer[CHUNK_SIZE] = {0};
+	LOGD("Sending file %d/%d %s...", fileCount, totalFiles, fileName);
 	size_t bytesRead = 0;
+	size_t fileBytesSent = 0;
+	bool failed = false;
 	bytesSent = 0;
-	while ((bytesRead = fread(buffer, 1, CHUNK_SIZE, file)) > 0) {
-		if (bytesRead < CHUNK_SIZE) {
-			if (feof(file)) {
-				LOGD("End of file reached.");
-			} else if (ferror(file)) {
-				LOGE("Error reading file");
-				fileCount -= 1;
-			}
+	bool tracing = Trace::active();
+	uint64_t readUsec = 0;
+	uint64_t sendUsec = 0;
+	uint64_t lapUsec = tracing ? Trace::nowUsec() : 0;
+	if (fileInfoPkt.local) {
+		// Passes the open file and waits for the server to copy it
+		bool copied = false;
+		if (sendLocalFile(serverSocket, fileno(file), true) != 0 ||
+		    receiveLocalFile(serverSocket, &copied, nullptr) != 0) {
+			failed = true;
+		} else if (!copied) {
+			LOGE("Server could not copy %s", fileName);
+			failed = true;
+		} else {
+			fileBytesSent = fileInfoPkt.size;
+			progress.addBytes(fileInfoPkt.size);
 		}
+	} else if (fileInfoPkt.udpPackets) {
+		failed = udp->sendFile(fileno(file), extents, progress) != 0;
+		fileBytesSent = udp->getStats().wireBytes;
+	} else if (fileInfoPkt.multipathChunks) {
+		failed = multipath->sendFile(fileno(file), extents, progress) != 0;
+		fileBytesSent = multipath->getStats().wireBytes;
+	} else {
+		tuner->begin();
+		for (size_t i = 0; i < extents.size() && !failed; i++) {
+			const ExtentPkt& extent = extents[i];
+			if (fileInfoPkt.sparse) {
+				if (send(serverSocket, &extent, sizeof(extent),
+				    MSG_NOSIGNAL | MSG_MORE) != sizeof(extent)) {
+					LOGE("Send extent failed: %s", strerror(errno));
+					failed = true;
+					break;
+				}
+				if (fseeko(file, extent.offset, SEEK_SET) != 0) {
+					LOGE("Error seeking file: %s", strerror(errno));
+					failed = true;
+					break;
+				}
+			}
 
-		size_t totalBytesSent = 0;
-		while (totalBytesSent < bytesRead) {
-			if ((bytesSent = send(serverSocket, buffer + totalBytesSent,
-			    bytesRead - totalBytesSent, 0)) < 0) {
-				LOGE("Send data failed: %s", strerror(errno));
-				break;
+			uint64_t remaining = extent.length;
+			while (remaining > 0) {
+				char* buffer = tuner->buffer();
+				bytesRead = fread(buffer, 1, std::min<uint64_t>(
+				                  tuner->chunkSize(), remaining), file);
+				if (bytesRead == 0) {
+					// Read error, or the file shrank since stat
+					LOGE("Error reading file");
+					failed = true;
+					break;
+				}
+				if (tracing) {
+					lapUsec = Trace::lap("read", lapUsec, &readUsec,
+					                     fileBaseName.c_str(), bytesRead);
+				}
+
+				size_t totalBytesSent = 0;
+				while (totalBytesSent < bytesRead) {
+					if ((bytesSent = send(serverSocket, buffer + totalBytesSent,
+					    bytesRead - totalBytesSent, MSG_NOSIGNAL)) < 0) {
+						LOGE("Send data failed: %s", strerror(errno));
+						break;
+					}
+					totalBytesSent += bytesSent;
+				}
+				fileBytesSent += totalBytesSent;
+				progress.addBytes(totalBytesSent);
+				tuner->moved(totalBytesSent);
+				if (tracing) {
+					lapUsec = Trace::lap("send", lapUsec, &sendUsec,
+					                     fileBaseName.c_str(), totalBytesSent);
+				}
+
+				if (totalBytesSent != bytesRead) {
+					LOGE("Error bytes sent not equal to bytes read!");
+					failed = true;
+					break;
+				}
+				remaining -= bytesRead;
 			}
-			totalBytesSent += bytesSent;
 		}
 
-		if (totalBytesSent != bytesRead) {
-			LOGE("Error bytes sent not equal to bytes read!");
-			fileCount -= 1;
-			break;
+		// An empty extent ends a sparse file
+		if (!failed && fileInfoPkt.sparse) {
+			ExtentPkt endPkt{};
+			if (send(serverSocket, &endPkt, sizeof(endPkt), MSG_NOSIGNAL) !=
+			    sizeof(endPkt)) {
+				LOGE("Send extent failed: %s", strerror(errno));
+				failed = true;
+			}
 		}
-		memset(buffer, 0, sizeof(buffer));
+	}
+	if (failed) {
+		fileCount -= 1;
 	}
 
 	// Close the file
 	fclose(file);
 
-	LOGI("Send file complete %d/%d %s", fileCount, totalFiles, fileName);
-	return 0;
+	LOGP_LAST(fileCount == totalFiles, "Send file complete %d/%d %s",
+	          fileCount, totalFiles, fileName);
+	fileSpan.setArg(0, "bytes", fileBytesSent);
+	fileSpan.setArg(1, "read_us", readUsec);
+	fileSpan.setArg(2, "send_us", sendUsec);
+	return failed ? -1 : 0;
 }
 
 int FileTransferClient::receiveFileList() {
-	char buffer[CHUNK_SIZE] = {0};
+	char buffer[LIST_BATCH_SIZE];
 
 	// Send start signal to server
 	LOGD("Sending start signal");
@@ -364,7 +1067,7 @@ int FileTransferClient::receiveFileList() {
 	startSignalPkt.start = true;
 	ssize_t bytesSent = 0;
 	if ((bytesSent = send(serverSocket, &startSignalPkt,
-	    sizeof(startSignalPkt), 0)) != sizeof(startSignalPkt)) {
+	    sizeof(startSignalPkt), MSG_NOSIGNAL)) != sizeof(startSignalPkt)) {
 		if (bytesSent < 0)
 			LOGE("Send start signal failed: %s", strerror(errno));
 		else
@@ -372,21 +1075,71 @@ int FileTransferClient::receiveFileList() {
 		return -1;
 	}
 
-	// Receive file list
+	// Receive file list batches until the empty one that ends the list
 	LOGD("Receiving file list");
-	ssize_t bytesRecv;
+	Trace::Span listSpan("list");
+	ListBatchPkt batchPkt{};
+	totalFiles = 0;
 	while (true) {
-		memset(buffer, 0, sizeof(buffer));
-		if ((bytesRecv = recv(serverSocket, buffer, CHUNK_SIZE, 0)) < 0) {
-			break;
+		if (recv(serverSocket, &batchPkt, sizeof(batchPkt), MSG_WAITALL) !=
+		    sizeof(batchPkt)) {
+			LOGE("Receive file list failed: %s", strerror(errno));
+			return -1;
 		}
-		if (bytesRecv) {
-			LOGI("Receive: %s", buffer);
-		} else {
+		if (batchPkt.count == 0) {
+			listCursor = batchPkt.cursor;
 			break;
 		}
+		if (batchPkt.length > sizeof(buffer) ||
+		    recv(serverSocket, buffer, batchPkt.length, MSG_WAITALL) !=
+		    static_cast<ssize_t>(batchPkt.length)) {
+			LOGE("Receive file list failed length=%u", batchPkt.length);
+			return -1;
+		}
+
+		size_t offset = 0;
+		for (uint32_t i = 0; i < batchPkt.count; i++) {
+			ListEntryPkt entryPkt;
+			if (offset + sizeof(entryPkt) > batchPkt.length) {
+				LOGE("Invalid file list entry");
+				return -1;
+			}
+			memcpy(&entryPkt, buffer + offset, sizeof(entryPkt));
+			offset += sizeof(entryPkt);
+			if (offset + entryPkt.nameLength > batchPkt.length) {
+				LOGE("Invalid file list entry");
+				return -1;
+			}
+			char name[LIST_BATCH_SIZE + 1];
+			memcpy(name, buffer + offset, entryPkt.nameLength);
+			name[entryPkt.nameLength] = '\0';
+			offset += entryPkt.nameLength;
+			totalFiles++;
+
+			if (listCallback) {
+				ListEntry entry = {name, entryPkt.size, entryPkt.time,
+				                   entryPkt.type};
+				listCallback(entry, listCtx);
+				continue;
+			}
+			static const char typeChars[] = "fdlo";
+			char timeStr[32] = "";
+			time_t time = static_cast<time_t>(entryPkt.time);
+			struct tm tm;
+			if (localtime_r(&time, &tm)) {
+				strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M", &tm);
+			}
+			LOGI("%c %12llu %s %s",
+			     typeChars[static_cast<int>(entryPkt.type) & 3],
+			     static_cast<unsigned long long>(entryPkt.size), timeStr, name);
+		}
 	}
+	listSpan.setArg(0, "files", totalFiles);
 
+	if (listCursor) {
+		LOGI("More entries follow, continue with --cursor %llu",
+		     static_cast<unsigned long long>(listCursor));
+	}
 	return 0;
 }
 
@@ -2,17 +2,24 @@
 #include "utils.h"
 #include "packet.h"
 #include "Logger.h"
+#include "Trace.h"
+#include "Prefetch.h"
+#include "Follow.h"
+#include "Tuning.h"
+#include "Pipeline.h"
+#include "Sha256.h"
+#include "LocalTransport.h"
 #include <iostream>
 #include <fstream>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstring>
 #include <cerrno>
 // Libraries for getting file data
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <utime.h>
 // Multiple connections
 #include <thread>
 #include <vector>
@@ -20,37 +27,247 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <fnmatch.h>
+#include <memory>
 
 #include <string>
 #include <ifaddrs.h>
 #include <netinet/in.h>
+#include <poll.h>
+// Metrics
+#include <chrono>
 
 namespace Dex {
 
 #define DEFAULT_PORT 9413
 #define MAX_CLIENTS 1
 #define FILENAME_SIZE 1024
-#define CHUNK_SIZE 1024*16
+#define DISK_ORDER_MAX_EXTENTS 1024 // More fragmented files are read in order
 
-FileTransferServer::FileTransferServer() : serverSocket(-1), totalFiles(0) {
+FileTransferServer::FileTransferServer() : serverSocket(-1), port(DEFAULT_PORT),
+    blockCache(metrics), fanOut(metrics, blockCache), stopping(false) {
 	LOGD("Starting server...");
+	// Default directory for saving the files to receive
+#ifdef __ANDROID__
+	directory = "/storage/self/primary/DCIM/DexFileTransfer";
+#else
+	directory = "DexFileTransfer";
+#endif
 }
 
 FileTransferServer::~FileTransferServer() {
+	stop();
 	LOGD("Destroying socket...");
 	if (serverSocket != -1) {
 		close(serverSocket);
 	}
 }
 
+void FileTransferServer::setPort(int port) {
+	this->port = port;
+}
+
+void FileTransferServer::setDirectory(const char* directory) {
+	this->directory = directory;
+}
+
+void FileTransferServer::setDurability(Durability durability) {
+	this->durability = durability;
+}
+
+void FileTransferServer::setCacheSize(uint64_t bytes) {
+	blockCache.setCapacity(bytes);
+}
+
+int FileTransferServer::setStore(const char* path) {
+	return store.open(path);
+}
+
+void FileTransferServer::setDiskOrder(bool enable) {
+	diskOrder = enable;
+}
+
+void FileTransferServer::setLocalSocket(const char* path) {
+	localEnabled = path != nullptr;
+	localSocketPath = path ? path : "";
+}
+
+int FileTransferServer::advertiseAddress(const char* address) {
+	std::string host = address;
+	unsigned long subflowPort = 0; // The port the server listens on
+	size_t colon = host.find(':');
+	if (colon != std::string::npos) {
+		char* end;
+		subflowPort = strtoul(host.c_str() + colon + 1, &end, 10);
+		if (*end != '\0' || subflowPort == 0 || subflowPort > 65535) {
+			return -1;
+		}
+		host.resize(colon);
+	}
+	struct in_addr addr;
+	if (inet_pton(AF_INET, host.c_str(), &addr) != 1 ||
+		advertised.size() >= MAX_PATH_ADDRESSES) {
+		return -1;
+	}
+	advertised.push_back({addr.s_addr, static_cast<uint16_t>(subflowPort)});
+	return 0;
+}
+
+void FileTransferServer::setUdpImpairment(const UdpImpairment& impairment) {
+	udpImpairment = impairment;
+}
+
+void FileTransferServer::setMetricsAddress(const char* address) {
+	metricsAddress = address;
+}
+
+void FileTransferServer::setProgressCallback(ProgressCallback callback,
+	void* ctx, unsigned intervalMs) {
+	progressCallback = callback;
+	progressCtx = ctx;
+	progressIntervalMs = intervalMs;
+}
+
+void FileTransferServer::setSessionCallback(CompletionCallback callback,
+	void* ctx) {
+	sessionCallback = callback;
+	sessionCtx = ctx;
+}
+
+static uint64_t nowUsec() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Keeps the active session gauge correct on every return path of
+// handleClient.
+struct SessionGauge {
+	explicit SessionGauge(Metrics& metrics) : metrics(metrics) {
+		metrics.activeSessions.fetch_add(1, std::memory_order_relaxed);
+		metrics.sessionsTotal.fetch_add(1, std::memory_order_relaxed);
+	}
+	~SessionGauge() {
+		metrics.activeSessions.fetch_sub(1, std::memory_order_relaxed);
+	}
+	Metrics& metrics;
+};
+
+// Tallies the syscalls of one file transfer in locals and publishes them,
+// together with the file latency, when it goes out of scope. A file counts
+// as failed unless ok is set before returning.
+struct FileMetrics {
+	FileMetrics(Metrics& metrics, Command cmd) : metrics(metrics), cmd(cmd),
+		startUsec(nowUsec()) {
+	}
+	~FileMetrics() {
+		for (int i = 0; i < static_cast<int>(Syscall::COUNT); i++) {
+			if (calls[i]) {
+				metrics.addSyscalls(static_cast<Syscall>(i), calls[i]);
+			}
+			if (errors[i]) {
+				metrics.addErrors(static_cast<Syscall>(i), errors[i]);
+			}
+		}
+		if (bytesIn) {
+			metrics.bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+		}
+		if (bytesOut) {
+			metrics.bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+		}
+		metrics.fileDone(cmd, ok, nowUsec() - startUsec);
+	}
+	void call(Syscall c) { calls[static_cast<int>(c)]++; }
+	void error(Syscall c) { errors[static_cast<int>(c)]++; }
+
+	Metrics& metrics;
+	Command cmd;
+	uint64_t startUsec;
+	uint64_t calls[static_cast<int>(Syscall::COUNT)] = {};
+	uint64_t errors[static_cast<int>(Syscall::COUNT)] = {};
+	uint64_t bytesIn = 0;
+	uint64_t bytesOut = 0;
+	bool ok = false;
+};
+
+// State of one client connection. Reports the session result to the
+// completion callback when it goes out of scope; the result counts as
+// failed unless status is set before returning.
+struct FileTransferServer::Session {
+	Session(FileTransferServer& server, int socket, uint64_t id, Command cmd) :
+		server(server), socket(socket), id(id), cmd(cmd),
+		durability(server.durability),
+		progress(server.progressCallback, server.progressCtx,
+		         server.progressIntervalMs, id, cmd),
+		tuner(socket, cmd != Command::PUSH) {
+	}
+	~Session() {
+		if (multipathToken) {
+			std::lock_guard<std::mutex> lock(server.sessionMutex);
+			server.multipathSessions.erase(multipathToken);
+		}
+		if (dirFd >= 0) {
+			close(dirFd);
+		}
+		if (fileFd >= 0) {
+			close(fileFd);
+		}
+		progress.finish();
+		if (server.sessionCallback) {
+			TransferResult result = progress.result(status);
+			if (server.stopping) {
+				result.status = TransferStatus::CANCELLED;
+			} else if (result.failedFiles) {
+				result.status = TransferStatus::FAILED;
+			}
+			server.sessionCallback(id, result, server.sessionCtx);
+		}
+	}
+
+	FileTransferServer& server;
+	int socket;
+	uint64_t id;
+	Command cmd;
+	unsigned totalFiles = 0;
+	unsigned fileCount = 0;
+	bool keepAlive = false;
+	Filter filter;
+	std::vector<RangePkt> ranges; // PULL: only these bytes of each file
+	bool follow = false; // PULL: keep streaming appends to the file
+	bool fileOrder = false; // PULL: the client needs extents in file order
+	bool localFiles = false; // Contents are passed as open files
+	bool dedupe = false; // PUSH: files come with their hash
+	std::vector<FileEntry> entries; // PULL: files matched by a pattern
+	int dirFd = -1; // PULL: their directory, files are opened relative to it
+	int fileFd = -1; // PULL: the file named without a pattern, until sent
+	struct stat fileStat; // PULL: its status
+	DurabilityTracker durability;
+	std::unique_ptr<UdpChannel> udp; // File data over UDP when requested
+	std::unique_ptr<MultipathChannel> multipath; // Or striped over subflows
+	uint64_t multipathToken = 0; // Registered in multipathSessions
+	ProgressReporter progress;
+	AutoTuner tuner; // Sizes TCP file data chunks
+	std::unique_ptr<ReceivePipeline> pipeline; // PUSH: writes behind recv
+	TransferStatus status = TransferStatus::FAILED;
+};
+
 void FileTransferServer::runServer() {
-	struct sockaddr_in serverAddr, clientAddr;
-	socklen_t addrLen = sizeof(clientAddr);
+	if (start() != 0) {
+		return;
+	}
+	wait();
+}
+
+int FileTransferServer::start() {
+	struct sockaddr_in serverAddr;
+
+	if (acceptThread.joinable()) {
+		LOGE("Server is already running");
+		return -1;
+	}
 
 	// Create socket
 	if ((serverSocket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 		LOGE("Socket creation failed: %s", strerror(errno));
-		return;
+		return -1;
 	}
 
 	// Attach socket to the port
@@ -59,82 +276,235 @@ void FileTransferServer::runServer() {
 	if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
 		LOGE("Set socket options failed: %s", strerror(errno));
 		close(serverSocket);
-		return;
+		serverSocket = -1;
+		return -1;
 	}
 #else
 	if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
 		sizeof(opt))) {
 		LOGE("Set socket options failed: %s", strerror(errno));
 		close(serverSocket);
-		return;
+		serverSocket = -1;
+		return -1;
 	}
 #endif
 
 	serverAddr.sin_family = AF_INET;
 	serverAddr.sin_addr.s_addr = INADDR_ANY; // Use INADDR_ANY to bind to all interfaces
-	serverAddr.sin_port = htons(DEFAULT_PORT);
+	serverAddr.sin_port = htons(port);
 
 	// Bind the socket to the network address and port
 	if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr))
 		< 0) {
 		LOGE("Bind failed: %s", strerror(errno));
 		close(serverSocket);
-		return;
+		serverSocket = -1;
+		return -1;
 	}
 
 	// Start listening for connections
 	if (listen(serverSocket, MAX_CLIENTS) < 0) {
 		LOGE("Listen failed: %s", strerror(errno));
 		close(serverSocket);
+		serverSocket = -1;
+		return -1;
+	}
+	LOGD("Server is listening on port %d", port);
+
+	// Clients on this host skip TCP. Without the socket they still connect
+	// over TCP, so failing to create it is not fatal.
+	if (localEnabled) {
+		if (localSocketPath.empty()) {
+			localSocketPath = defaultLocalSocketPath(port, true);
+		}
+		localSocket = localSocketPath.empty() ? -1 :
+			listenLocal(localSocketPath.c_str());
+		if (localSocket < 0) {
+			LOGE("Local clients will use TCP");
+		} else {
+			LOGD("Server is listening on %s", localSocketPath.c_str());
+		}
+	}
+
+	if (!metricsAddress.empty() &&
+		metricsServer.start(&metrics, metricsAddress) != 0) {
+		LOGE("Metrics endpoint disabled");
+	}
+
+	stopping = false;
+	{
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		running = true;
+	}
+	acceptThread = std::thread(&FileTransferServer::acceptClients, this);
+	return 0;
+}
+
+void FileTransferServer::wait() {
+	std::unique_lock<std::mutex> lock(sessionMutex);
+	stateChanged.wait(lock, [this] { return !running; });
+}
+
+void FileTransferServer::stop() {
+	if (!acceptThread.joinable()) {
 		return;
 	}
-	LOGD("Server is listening on port %d", DEFAULT_PORT);
+	LOGI("Stopping server");
+	stopping = true;
+	// shutdown() wakes up the thread blocked in poll()
+	shutdown(serverSocket, SHUT_RDWR);
+	if (localSocket >= 0) {
+		shutdown(localSocket, SHUT_RDWR);
+	}
+	acceptThread.join();
+	metricsServer.stop();
+
+	// Cancel active sessions and wait for their threads to finish
+	std::unique_lock<std::mutex> lock(sessionMutex);
+	for (int fd : sessionSockets) {
+		shutdown(fd, SHUT_RDWR);
+	}
+	stateChanged.wait(lock, [this] { return sessionSockets.empty(); });
+	running = false;
+	stateChanged.notify_all();
+}
+
+void FileTransferServer::acceptClients() {
+	struct pollfd fds[2] = {{serverSocket, POLLIN, 0}, {localSocket, POLLIN, 0}};
+	nfds_t count = localSocket >= 0 ? 2 : 1;
 
 	while (true) {
-		// Accept a new connection
-		int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr,
-						   &addrLen);
+		// Accept a new connection on either socket
+		if (poll(fds, count, -1) < 0 && errno == EINTR) {
+			continue;
+		}
+		bool local = count > 1 && fds[0].revents == 0;
+		int clientSocket = accept(local ? localSocket : serverSocket, nullptr,
+			nullptr);
+		if (stopping) {
+			if (clientSocket >= 0) {
+				close(clientSocket);
+			}
+			break;
+		}
+		metrics.addSyscalls(Syscall::ACCEPT, 1);
 		if (clientSocket < 0) {
+			metrics.addErrors(Syscall::ACCEPT, 1);
 			LOGE("Server accept failed: %s", strerror(errno));
-			close(serverSocket);
-			return;
+			break;
+		}
+		if (local) {
+			LOGI("New local client connection");
+		} else {
+			LOGI("New client connection");
+			setNoDelay(clientSocket);
 		}
-		LOGI("New client connection");
 
 		// Handle connection in a separate thread
+		{
+			std::lock_guard<std::mutex> lock(sessionMutex);
+			sessionSockets.insert(clientSocket);
+		}
 		std::thread clientThread(&FileTransferServer::handleClient, this,
-			clientSocket);
+			clientSocket, local);
 		clientThread.detach();
 	}
 
 	LOGI("Closing server socket");
 	close(serverSocket);
+	serverSocket = -1;
+	if (localSocket >= 0) {
+		close(localSocket);
+		unlink(localSocketPath.c_str());
+		localSocket = -1;
+	}
+	if (!stopping) {
+		// Accept failed, sessions keep running until stop()
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		running = false;
+		stateChanged.notify_all();
+	}
 }
 
-void FileTransferServer::handleClient(int clientSocket) {
-	std::vector<std::string> files;
-	totalFiles = 0;
-	fileCount = 0;
+void FileTransferServer::handleClient(int clientSocket, bool local) {
+	// Keep-alive clients send further commands over the same connection
+	while (serveClient(clientSocket, local) && !stopping) {
+	}
+
+	// Close under the lock so stop() never shuts down a reused descriptor
+	std::lock_guard<std::mutex> lock(sessionMutex);
+	sessionSockets.erase(clientSocket);
+	close(clientSocket);
+	stateChanged.notify_all();
+}
+
+// Returns true if the connection stays open for another command.
+bool FileTransferServer::serveClient(int clientSocket, bool local) {
 	Command cmd;
 	ssize_t bytesRecv = 0;
 	ssize_t bytesSent = 0;
+	SessionGauge sessionGauge(metrics);
 
 	// Receive command and pattern
 	InitPkt initPkt{};
+	metrics.addSyscalls(Syscall::RECV, 1);
 	if ((bytesRecv= recv(clientSocket, &initPkt, sizeof(initPkt), 0)) !=
 		sizeof(initPkt)) {
+		if (bytesRecv == 0) {
+			LOGD("Client closed connection");
+			return false;
+		}
+		metrics.addErrors(Syscall::RECV, 1);
 		if (bytesRecv < 0)
 			LOGE("Receive command and pattern failed: %s", strerror(errno));
 		else
 			LOGE("Receive command and pattern failed bytesRecv=%zu", bytesRecv);
-		close(clientSocket);
-		return;
+		return false;
+	}
+	if (initPkt.joinToken) {
+		return joinSession(clientSocket, initPkt.joinToken);
 	}
 	cmd = initPkt.command;
-	totalFiles = initPkt.totalFiles;
 	std::string patternStr(initPkt.pattern);
 	LOGI("Received command=%d pattern=[%s] totalFiles=%d", static_cast<int>(cmd),
-		  patternStr.c_str(), totalFiles);
+		  patternStr.c_str(), initPkt.totalFiles);
+
+	// Use the client's session ID so both sides can be correlated
+	uint64_t sessionId = initPkt.sessionId ? initPkt.sessionId :
+		Trace::newSessionId();
+	Trace::Session traceSession(sessionId, "server");
+	Session session(*this, clientSocket, sessionId, cmd);
+	session.keepAlive = initPkt.keepAlive;
+	uint16_t udpPort = 0;
+	if (initPkt.udpPort && cmd != Command::LIST) {
+		session.udp.reset(new UdpChannel(initPkt.udpFec, udpImpairment));
+		int port = session.udp->open(clientSocket);
+		if (port < 0 || session.udp->connect(initPkt.udpPort) != 0) {
+			LOGE("UDP transport unavailable, using TCP");
+			session.udp.reset();
+		} else {
+			udpPort = static_cast<uint16_t>(port);
+		}
+	}
+	if (initPkt.multipath && !session.udp && !local && cmd != Command::LIST) {
+		session.multipath.reset(new MultipathChannel(clientSocket));
+		session.multipathToken = newMultipathToken();
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		multipathSessions[session.multipathToken] = session.multipath.get();
+	}
+	initPkt.filter[sizeof(initPkt.filter) - 1] = '\0';
+	bool filterValid = session.filter.parse(initPkt.filter, time(nullptr)) == 0;
+	if (initPkt.filter[0]) {
+		LOGI("Filter: %s", initPkt.filter);
+	}
+	if (cmd == Command::PULL) {
+		session.ranges.assign(initPkt.ranges, initPkt.ranges +
+			std::min<unsigned>(initPkt.rangeCount, MAX_RANGES));
+		session.fileOrder = initPkt.fileOrder;
+	}
+	session.localFiles = local && initPkt.localFiles && !session.udp;
+	session.totalFiles = initPkt.totalFiles;
+	session.progress.setTotalFiles(session.totalFiles);
 
 	// If no path '/' symbol in pattern then set default path for android
 #ifdef __ANDROID__
@@ -147,137 +517,276 @@ void FileTransferServer::handleClient(int clientSocket) {
 #endif
 
 	if (cmd == Command::PULL || cmd == Command::LIST) {
-		if (isFilePattern(patternStr.c_str())) {
+		Trace::Span scanSpan("scan", patternStr.c_str());
+		bool found = false;
+		if (!filterValid) {
+			// Reply that nothing was found
+		} else if (cmd == Command::LIST) {
+			// Entries are streamed by sendFileList, only check that the
+			// directory or file exists
+			std::string dirStr, filePattern;
+			struct stat st;
+			if (isFilePattern(patternStr.c_str())) {
+				splitPathAndPattern(patternStr, dirStr, filePattern);
+				found = stat(dirStr.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+			} else {
+				found = lstat(patternStr.c_str(), &st) == 0;
+			}
+		} else if (isFilePattern(patternStr.c_str())) {
 			// Find matching pattern
 			LOGI("Finding matching files: %s...", patternStr.c_str());
-			files = getMatchingFiles(patternStr);
-			totalFiles = files.size();
+			session.dirFd = scanMatchingFiles(patternStr, &session.filter,
+				session.entries);
+			for (const auto& entry : session.entries) {
+				if (entry.hasStat) {
+					metrics.addSyscalls(Syscall::STAT, 1);
+				}
+			}
+			if (diskOrder && session.dirFd >= 0) {
+				metrics.addSyscalls(Syscall::OPEN, session.entries.size());
+				sortByDiskLocation(session.dirFd, session.entries);
+			}
+			session.totalFiles = session.entries.size();
 		} else {
-			// Find matching file
+			// Find matching file, kept open so it is only looked up once
 			LOGI("Finding file: %s", patternStr.c_str());
-			if (fileExists(patternStr.c_str())) {
-				totalFiles = 1;
+			if (session.filter.matchName(getBaseName(patternStr).c_str())) {
+				metrics.addSyscalls(Syscall::OPEN, 1);
+				session.fileFd = open(patternStr.c_str(), O_RDONLY | O_CLOEXEC);
+			}
+			if (session.fileFd >= 0) {
+				metrics.addSyscalls(Syscall::STAT, 1);
+				if (fstat(session.fileFd, &session.fileStat) == 0 &&
+					!S_ISDIR(session.fileStat.st_mode) &&
+					session.filter.matchStat(session.fileStat)) {
+					session.totalFiles = 1;
+				}
 			}
 		}
+		found = found || session.totalFiles > 0;
+		scanSpan.setArg(0, "files", session.totalFiles);
+		scanSpan.end();
+		session.progress.setTotalFiles(session.totalFiles);
 
 		// Send number of found files to client
 		InitReplyPkt initReplyPkt{};
-		initReplyPkt.proceed = totalFiles > 0 ? true : false;
-		initReplyPkt.totalFiles = totalFiles;
-		LOGD("Sending number of file(s): %d", totalFiles);
+		initReplyPkt.proceed = found;
+		initReplyPkt.udpPort = udpPort;
+		initReplyPkt.totalFiles = session.totalFiles;
+		initReplyPkt.localFiles = session.localFiles;
+		if (session.multipath) {
+			initReplyPkt.multipathToken = session.multipathToken;
+			fillPathAddresses(clientSocket, initReplyPkt);
+		}
+		LOGD("Sending number of file(s): %d", session.totalFiles);
+		metrics.addSyscalls(Syscall::SEND, 1);
 		if ((bytesSent = send(clientSocket, &initReplyPkt,
-			sizeof(initReplyPkt), 0)) != sizeof(initReplyPkt)) {
+			sizeof(initReplyPkt), MSG_NOSIGNAL)) != sizeof(initReplyPkt)) {
+			metrics.addErrors(Syscall::SEND, 1);
 			if (bytesSent < 0)
 				LOGE("Sending number of files failed: %s", strerror(errno));
 			else
 				LOGE("Sending number of files failed bytesSent=%zu", bytesSent);
-			close(clientSocket);
-			return;
+			return false;
 		}
 
 		// Close and return if no files are found
-		if (totalFiles == 0) {
+		if (!found) {
 			LOGE("No file(s) found: %s", patternStr.c_str());
-			close(clientSocket);
-			return;
+			return session.keepAlive;
 		}
 	} else if (cmd == Command::PUSH) {
-		// Send init reply to client
+		// Refuse a batch that cannot fit before any data is sent
 		InitReplyPkt initReplyPkt{};
-		initReplyPkt.proceed = true;
+		initReplyPkt.proceed = createDirectory(directory.c_str()) == 0 &&
+			checkFreeSpace(directory.c_str(), initPkt.totalBytes) == 0;
+		initReplyPkt.udpPort = udpPort;
+		session.dedupe = initPkt.dedupe && store.enabled();
+		initReplyPkt.dedupe = session.dedupe;
+		initReplyPkt.localFiles = session.localFiles;
+		if (session.multipath) {
+			initReplyPkt.multipathToken = session.multipathToken;
+			fillPathAddresses(clientSocket, initReplyPkt);
+		}
 		LOGD("Sending init reply...");
+		metrics.addSyscalls(Syscall::SEND, 1);
 		if ((bytesSent = send(clientSocket, &initReplyPkt,
-			sizeof(initReplyPkt), 0)) != sizeof(initReplyPkt)) {
+			sizeof(initReplyPkt), MSG_NOSIGNAL)) != sizeof(initReplyPkt)) {
+			metrics.addErrors(Syscall::SEND, 1);
 			if (bytesSent < 0)
 				LOGE("Sending init reply failed: %s", strerror(errno));
 			else
 				LOGE("Sending init reply failed bytesSent=%zu", bytesSent);
-			close(clientSocket);
-			return;
+			return false;
+		}
+		if (!initReplyPkt.proceed) {
+			return session.keepAlive;
 		}
 	}
 
 	switch (cmd) {
 	case Command::PULL: // Client will receive file from server
 	{
-		if (totalFiles == 1 && !isFilePattern(patternStr.c_str())) {
+		if (session.totalFiles == 1 && !isFilePattern(patternStr.c_str())) {
 			// Send a single file to client
 			LOGD("Sending file: %s", patternStr.c_str());
-			sendFile(clientSocket, patternStr.c_str());
+			session.follow = initPkt.follow;
+			int fd = session.fileFd;
+			session.fileFd = -1; // Closed by sendFile
+			session.progress.fileDone(sendFile(session, patternStr.c_str(),
+				fd, &session.fileStat) == 0);
 		} else {
-			// Send multiple files to client
-			for (const auto& file : files) {
-				LOGD("Sending file=%s", file.c_str());
-				sendFile(clientSocket, file.c_str());
+			// Send multiple files to client, opening the next ones early
+			if (initPkt.follow) {
+				LOGI("Follow needs a single file, sending the matches once");
+			}
+			std::string dirStr, filePattern;
+			splitPathAndPattern(patternStr, dirStr, filePattern);
+			Prefetcher prefetcher(session.dirFd, session.entries, metrics);
+			for (size_t i = 0; i < session.entries.size(); i++) {
+				if (stopping) {
+					break;
+				}
+				std::string path = dirStr + "/" + session.entries[i].name;
+				LOGD("Sending file=%s", path.c_str());
+				struct stat st;
+				int fd = prefetcher.take(i, &st);
+				session.progress.fileDone(sendFile(session, path.c_str(), fd,
+					fd >= 0 ? &st : nullptr) == 0);
 			}
 		}
-		LOGI("Total files sent: %d", fileCount);
+		LOGI("Total files sent: %d", session.fileCount);
 		break;
 	}
 	case Command::PUSH: // Client will send file(s) to server
 	{
-		// Upload
-		std::string dirStr;
-		// Create default directory for saving the file to receive
-#ifdef __ANDROID__
-		dirStr = "/storage/self/primary/DCIM/DexFileTransfer";
-#else
-		dirStr = "DexFileTransfer";
-#endif
-		if (createDirectory(dirStr.c_str()) != 0) {
-			break;
-		}
-
 		// Receive file(s)
-		for (size_t i = 0; i < totalFiles; i++) {
-			receiveFile(clientSocket, dirStr.c_str());
+		for (size_t i = 0; i < session.totalFiles && !stopping; i++) {
+			session.progress.fileDone(
+				receiveFile(session, directory.c_str()) == 0);
+		}
+		if (session.durability.finish() != 0) {
+			return false;
 		}
-		LOGI("Total files received: %d", fileCount);
+		LOGI("Total files received: %d", session.fileCount);
 		break;
 	}
 	case Command::LIST: // Client will receive file list from server
 	{
 		// Send file list to client
-		sendFileList(clientSocket, files);
-		LOGI("Total files sent: %d", fileCount);
+		if (sendFileList(session, patternStr, initPkt.cursor,
+			initPkt.limit) != 0) {
+			return false;
+		}
+		LOGI("Total files sent: %d", session.fileCount);
 		break;
 	}
 	default:
 		LOGE("Invalid command=%d", static_cast<int>(cmd));
-		return;
+		return false;
 		break;
 	}
 
+	session.status = TransferStatus::OK;
+	// A failed file may leave unread data behind, so only reuse clean ones
+	if (session.keepAlive && !stopping && !session.progress.get().failedFiles) {
+		LOGD("Waiting for next command");
+		return true;
+	}
 	LOGI("Closing client connection");
-	close(clientSocket);
+	return false;
 }
 
-int FileTransferServer::sendFile(int clientSocket, const char *filename) {
+static bool diskBefore(const DiskExtent& a, const DiskExtent& b) {
+	return a.physical < b.physical;
+}
+
+// Replaces the extents of a dense file with its pieces in the order they
+// are on the disk. Returns -1 if that is the file order anyway.
+static int getDiskOrderExtents(int fd, uint64_t size,
+	std::vector<ExtentPkt>& extents) {
+	std::vector<DiskExtent> disk;
+	if (getDiskExtents(fd, DISK_ORDER_MAX_EXTENTS, disk) != 0 ||
+		std::is_sorted(disk.begin(), disk.end(), diskBefore)) {
+		return -1;
+	}
+	std::stable_sort(disk.begin(), disk.end(), diskBefore);
+	extents.clear();
+	for (const auto& piece : disk) {
+		if (piece.logical < size) {
+			extents.push_back({piece.logical,
+				std::min(piece.length, size - piece.logical)});
+		}
+	}
+	return 0;
+}
+
+int FileTransferServer::sendFile(Session& session, const char *filename,
+	int fd, const struct stat* st) {
 	// Wait for client start signal
 	LOGD("Waiting for start signal");
 	StartSignalPkt startSignalPkt{};
 	ssize_t bytesRecv = 0;
 	ssize_t bytesSent = 0;
+	FileMetrics fm(metrics, Command::PULL);
+	std::string baseName = getBaseName(filename);
+	Trace::Span fileSpan("file", baseName.c_str());
+	session.progress.beginFile(baseName.c_str());
 
-	if ((bytesRecv = recv(clientSocket, &startSignalPkt,
+	Trace::Span waitSpan("wait_start");
+	fm.call(Syscall::RECV);
+	if ((bytesRecv = recv(session.socket, &startSignalPkt,
 		sizeof(startSignalPkt), 0)) != sizeof(startSignalPkt)) {
+		fm.error(Syscall::RECV);
 		if (bytesRecv < 0)
 			LOGE("Receive start signal failed: %s", strerror(errno));
 		else
 			LOGE("Receive start signal failed bytesRecv=%zu", bytesRecv);
+		if (fd >= 0) {
+			close(fd);
+		}
 		return -1;
 	}
+	waitSpan.end();
 
-	// Retrieve file status
-	struct stat file_stat;
-	if (stat(filename, &file_stat) != 0) {
-		LOGE("Error getting file status");
+	// Open the file unless it was opened when it was found
+	Trace::Span openSpan("open");
+	if (fd < 0) {
+		fm.call(Syscall::OPEN);
+		if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+			fm.error(Syscall::OPEN);
+			LOGE("Error opening file: %s", strerror(errno));
+			return -1;
+		}
+		st = nullptr; // Describes a file that could not be opened
+	}
+	FILE *file = fdopen(fd, "rb");
+	if (!file) {
+		fm.error(Syscall::OPEN);
+		LOGE("Error opening file");
+		close(fd);
 		return -1;
 	}
+	openSpan.end();
+
+	// Retrieve file status, unless it was captured along with the file
+	struct stat file_stat;
+	Trace::Span statSpan("stat");
+	if (st) {
+		file_stat = *st;
+	} else {
+		fm.call(Syscall::STAT);
+		if (fstat(fd, &file_stat) != 0) {
+			fm.error(Syscall::STAT);
+			LOGE("Error getting file status");
+			fclose(file);
+			return -1;
+		}
+	}
+	statSpan.end();
 
 	// Construct file info packet
 	FileInfoPkt fileInfoPkt{};
-	std::string baseName = getBaseName(filename);
 	memset(fileInfoPkt.name, 0, sizeof(fileInfoPkt.name));
 	memcpy(fileInfoPkt.name, baseName.c_str(), baseName.length());
 	fileInfoPkt.size = file_stat.st_size;
@@ -285,77 +794,330 @@ int FileTransferServer::sendFile(int clientSocket, const char *filename) {
 	LOGD("xxxxxx file_stat.st_size=%lld", file_stat.st_size);
 	LOGD("xxxxxx file_stat.st_mtime=%ld", file_stat.st_mtime);
 
+	// Only the data extents of a sparse file are sent
+	std::vector<ExtentPkt> extents;
+	fileInfoPkt.sparse = getSparseExtents(fileno(file), file_stat,
+		extents) == 0;
+	if (!fileInfoPkt.sparse) {
+		extents.assign(1, {0, fileInfoPkt.size});
+	}
+	// Requested ranges replace the data extents, holes in them read as zeros
+	if (!session.ranges.empty()) {
+		resolveRanges(session.ranges.data(), session.ranges.size(),
+			fileInfoPkt.size, extents);
+		fileInfoPkt.sparse = true;
+		fileInfoPkt.partial = true;
+	}
+	// Appends are sent as extents after the current contents
+	if (session.follow) {
+		fileInfoPkt.sparse = true;
+		fileInfoPkt.follow = true;
+	}
+	// A local client copies the whole file itself
+	fileInfoPkt.local = session.localFiles && !fileInfoPkt.partial &&
+		!fileInfoPkt.follow;
+	// Pieces of a fragmented file are read in disk order and put back in
+	// place by the client
+	if (diskOrder && !fileInfoPkt.local && !fileInfoPkt.sparse &&
+		!session.fileOrder &&
+		!session.udp && !session.multipath &&
+		getDiskOrderExtents(fileno(file), fileInfoPkt.size,
+		extents) == 0) {
+		fileInfoPkt.sparse = true;
+		fileInfoPkt.diskOrder = true;
+	}
+	if (session.udp && !session.follow) {
+		fileInfoPkt.udpPackets = UdpChannel::packetCount(extents);
+	}
+	if (session.multipath && !session.follow &&
+		session.multipath->pathCount() > 0) {
+		fileInfoPkt.multipathChunks = MultipathChannel::chunkCount(extents);
+	}
+
 	// Send file info packet to client
-	LOGD("Sending file name=%s size=%ld time=%ld", fileInfoPkt.name,
-		 fileInfoPkt.size, fileInfoPkt.time);
-	if ((bytesSent = send(clientSocket, &fileInfoPkt, sizeof(fileInfoPkt), 0))
-		!= sizeof(fileInfoPkt)) {
+	LOGD("Sending file name=%s size=%ld time=%ld sparse=%d extents=%zu",
+		 fileInfoPkt.name, fileInfoPkt.size, fileInfoPkt.time,
+		 fileInfoPkt.sparse, extents.size());
+	fm.call(Syscall::SEND);
+	if ((bytesSent = send(session.socket, &fileInfoPkt, sizeof(fileInfoPkt),
+		MSG_NOSIGNAL)) != sizeof(fileInfoPkt)) {
+		fm.error(Syscall::SEND);
 		if (bytesSent < 0)
 			LOGE("Send file info failed: %s", strerror(errno));
 		else
 			LOGE("Send file info failed bytesSent=%zu", bytesSent);
-		return -1;
-	}
-
-	// Open file for reading
-	FILE *file = fopen(filename, "rb");
-	if (!file) {
-		LOGE("Error opening file");
+		fclose(file);
 		return -1;
 	}
 
 	// Send file content
-	fileCount += 1;
-	LOGI("Sending %d/%d %s...", fileCount, totalFiles, filename);
-	char buffer[CHUNK_SIZE] = {0};
+	session.fileCount += 1;
+	LOGD("Sending %d/%d %s...", session.fileCount, session.totalFiles,
+		 filename);
 	size_t bytesRead = 0;
 	size_t totalBytesSent = 0;
-	while ((bytesRead = fread(buffer, 1, CHUNK_SIZE, file)) > 0) {
-		if (bytesRead < CHUNK_SIZE) {
-			if (feof(file)) {
-				LOGD("End of file reached.");
-			} else if (ferror(file)) {
-				LOGE("Error reading file");
-				fileCount -= 1;
+	bool failed = false;
+	bool tracing = Trace::active();
+	uint64_t readUsec = 0;
+	uint64_t sendUsec = 0;
+	uint64_t lapUsec = tracing ? Trace::nowUsec() : 0;
+	// Sessions pulling the same large file at once share its disk reads
+	FanOutReader shared;
+	FileId fileId = FileId::of(file_stat);
+	if (!fileInfoPkt.udpPackets && !fileInfoPkt.partial &&
+		!fileInfoPkt.follow && !fileInfoPkt.diskOrder && !fileInfoPkt.local &&
+		!fileInfoPkt.multipathChunks && fileInfoPkt.size >= FANOUT_MIN_SIZE) {
+		fanOut.join(fileno(file), file_stat, shared);
+	}
+	if (fileInfoPkt.local) {
+		// Passes the open file and waits for the client to copy it
+		bool copied = false;
+		fm.call(Syscall::SEND);
+		if (sendLocalFile(session.socket, fileno(file), true) != 0) {
+			fm.error(Syscall::SEND);
+			failed = true;
+		} else {
+			fm.call(Syscall::RECV);
+			if (receiveLocalFile(session.socket, &copied, nullptr) != 0) {
+				fm.error(Syscall::RECV);
+				failed = true;
 			}
 		}
+		if (!failed && !copied) {
+			LOGE("Client could not copy %s", filename);
+			failed = true;
+		}
+		if (!failed) {
+			session.progress.addBytes(fileInfoPkt.size);
+			metrics.localCopyBytes.fetch_add(fileInfoPkt.size,
+				std::memory_order_relaxed);
+		}
+	} else if (fileInfoPkt.udpPackets) {
+		failed = session.udp->sendFile(fileno(file), extents,
+			session.progress) != 0;
+		fm.bytesOut += session.udp->getStats().wireBytes;
+	} else if (fileInfoPkt.multipathChunks) {
+		failed = session.multipath->sendFile(fileno(file), extents,
+			session.progress) != 0;
+		fm.bytesOut += session.multipath->getStats().wireBytes;
+		metrics.multipathReinjected.fetch_add(
+			session.multipath->getStats().reinjected, std::memory_order_relaxed);
+	} else {
+		session.tuner.begin();
+		for (size_t i = 0; i < extents.size() && !failed; i++) {
+			const ExtentPkt& extent = extents[i];
+			if (fileInfoPkt.sparse) {
+				fm.call(Syscall::SEND);
+				if (send(session.socket, &extent, sizeof(extent),
+					MSG_NOSIGNAL | MSG_MORE) != sizeof(extent)) {
+					fm.error(Syscall::SEND);
+					LOGE("Send extent failed: %s", strerror(errno));
+					failed = true;
+					break;
+				}
+				fm.bytesOut += sizeof(extent);
+			}
 
-		totalBytesSent = 0;
-		while (totalBytesSent < bytesRead) {
-			if ((bytesSent = send(clientSocket, buffer + totalBytesSent,
-				bytesRead - totalBytesSent, 0)) < 0) {
-				LOGE("Send data failed: %s", strerror(errno));
-				break;
+			uint64_t remaining = extent.length;
+			while (remaining > 0) {
+				uint64_t offset = extent.offset + extent.length - remaining;
+				char* buffer = session.tuner.buffer();
+				size_t length = std::min<uint64_t>(session.tuner.chunkSize(),
+					remaining);
+				bytesRead = 0;
+				if (shared.attached()) {
+					ssize_t n = shared.read(offset, buffer, length);
+					if (n < 0) {
+						fm.error(Syscall::READ);
+						failed = true;
+						break;
+					}
+					bytesRead = n;
+				}
+				if (!bytesRead) {
+					// Hot files are served from the block cache
+					fm.call(Syscall::READ);
+					ssize_t n = blockCache.read(fileno(file), fileId, offset,
+						buffer, length);
+					bytesRead = n > 0 ? n : 0;
+				}
+				if (bytesRead == 0) {
+					// Read error, or the file shrank since stat
+					fm.error(Syscall::READ);
+					LOGE("Error reading file");
+					failed = true;
+					break;
+				}
+				if (tracing) {
+					lapUsec = Trace::lap("read", lapUsec, &readUsec,
+					                     baseName.c_str(), bytesRead);
+				}
+
+				totalBytesSent = 0;
+				while (totalBytesSent < bytesRead) {
+					fm.call(Syscall::SEND);
+					if ((bytesSent = send(session.socket, buffer + totalBytesSent,
+						bytesRead - totalBytesSent, MSG_NOSIGNAL)) < 0) {
+						fm.error(Syscall::SEND);
+						LOGE("Send data failed: %s", strerror(errno));
+						break;
+					}
+					totalBytesSent += bytesSent;
+				}
+				fm.bytesOut += totalBytesSent;
+				session.progress.addBytes(totalBytesSent);
+				session.tuner.moved(totalBytesSent);
+				if (tracing) {
+					lapUsec = Trace::lap("send", lapUsec, &sendUsec,
+					                     baseName.c_str(), totalBytesSent);
+				}
+
+				if (totalBytesSent != bytesRead) {
+					LOGE("Error bytes sent not equal to bytes read!");
+					failed = true;
+					break;
+				}
+				remaining -= bytesRead;
 			}
-			totalBytesSent += bytesSent;
 		}
 
-		if (totalBytesSent != bytesRead) {
-			LOGE("Error bytes sent not equal to bytes read!");
-			fileCount -= 1;
-			break;
+		// Follows the file until the client leaves or the server stops
+		bool clientLeft = false;
+		if (!failed && fileInfoPkt.follow) {
+			int ret = followFile(session, filename, fileno(file),
+				fileInfoPkt.size);
+			failed = ret < 0;
+			clientLeft = ret > 0;
+		}
+
+		// An empty extent ends a sparse file
+		if (!failed && !clientLeft && fileInfoPkt.sparse) {
+			ExtentPkt endPkt{};
+			fm.call(Syscall::SEND);
+			if (send(session.socket, &endPkt, sizeof(endPkt), MSG_NOSIGNAL) !=
+				sizeof(endPkt)) {
+				fm.error(Syscall::SEND);
+				LOGE("Send extent failed: %s", strerror(errno));
+				failed = true;
+			}
+			fm.bytesOut += sizeof(endPkt);
 		}
-		memset(buffer, 0, sizeof(buffer));
+	}
+	if (failed) {
+		session.fileCount -= 1;
 	}
 
 	// Close the file
 	fclose(file);
 
-	LOGI("Send file complete %d/%d %s", fileCount, totalFiles, filename);
+	LOGP_LAST(session.fileCount == session.totalFiles,
+		"Send file complete %d/%d %s", session.fileCount, session.totalFiles,
+		filename);
+	fm.ok = !failed;
+	fileSpan.setArg(0, "bytes", fm.bytesOut);
+	fileSpan.setArg(1, "read_us", readUsec);
+	fileSpan.setArg(2, "send_us", sendUsec);
+	return failed ? -1 : 0;
+}
+
+// Sends one extent of fd, returns -1 on failure
+static int sendExtent(int socket, int fd, const ExtentPkt& extent,
+	Metrics& metrics, ProgressReporter& progress) {
+	char buffer[TUNE_MIN_CHUNK];
+	metrics.addSyscalls(Syscall::SEND, 1);
+	if (send(socket, &extent, sizeof(extent), MSG_NOSIGNAL | MSG_MORE) !=
+		sizeof(extent)) {
+		metrics.addErrors(Syscall::SEND, 1);
+		LOGE("Send extent failed: %s", strerror(errno));
+		return -1;
+	}
+	uint64_t offset = extent.offset;
+	uint64_t end = extent.offset + extent.length;
+	while (offset < end) {
+		metrics.addSyscalls(Syscall::READ, 1);
+		ssize_t n = pread(fd, buffer, std::min<uint64_t>(sizeof(buffer),
+			end - offset), offset);
+		if (n <= 0) {
+			// The extent was checked against the size just before
+			metrics.addErrors(Syscall::READ, 1);
+			LOGE("Error reading file: %s", n < 0 ? strerror(errno) :
+			     "file shrank");
+			return -1;
+		}
+		metrics.addSyscalls(Syscall::SEND, 1);
+		if (send(socket, buffer, n, MSG_NOSIGNAL) != n) {
+			metrics.addErrors(Syscall::SEND, 1);
+			LOGE("Send data failed: %s", strerror(errno));
+			return -1;
+		}
+		offset += n;
+		progress.addBytes(n);
+	}
+	metrics.bytesOut.fetch_add(sizeof(extent) + extent.length,
+	                           std::memory_order_relaxed);
+	return 0;
+}
+
+// Streams what is appended to the file from offset on. Counts into the
+// server metrics directly, as a follow can last for hours. Returns 0 when
+// the server stops, 1 when the client closed the connection and -1 on
+// failure.
+int FileTransferServer::followFile(Session& session, const char* filename,
+	int fd, uint64_t offset) {
+	FileFollower follower(filename);
+	if (follower.start(fd) != 0) {
+		return -1;
+	}
+	LOGI("Following %s", filename);
+	while (!stopping) {
+		FollowChange change;
+		if (follower.wait(session.socket, offset, FOLLOW_POLL_MS,
+			&change) != 0) {
+			return -1;
+		}
+		if (change.socketReady) {
+			LOGI("Client stopped following %s", filename);
+			return 1;
+		}
+		if (change.restart) {
+			LOGI("%s was truncated or replaced", filename);
+			ExtentPkt restartPkt{EXTENT_RESTART, 0};
+			metrics.addSyscalls(Syscall::SEND, 1);
+			if (send(session.socket, &restartPkt, sizeof(restartPkt),
+				MSG_NOSIGNAL) != sizeof(restartPkt)) {
+				metrics.addErrors(Syscall::SEND, 1);
+				LOGE("Send extent failed: %s", strerror(errno));
+				return -1;
+			}
+			offset = 0;
+		}
+		if (change.size > offset) {
+			ExtentPkt extent{offset, change.size - offset};
+			if (sendExtent(session.socket, follower.fd(), extent, metrics,
+				session.progress) != 0) {
+				return -1;
+			}
+			offset = change.size;
+		}
+	}
 	return 0;
 }
 
-int FileTransferServer::receiveFile(int clientSocket, const char *directory) {
+int FileTransferServer::receiveFile(Session& session, const char *directory) {
 	std::string fileNameStr;
 	ssize_t bytesSent = 0;
 	ssize_t bytesRecv = 0;
+	FileMetrics fm(metrics, Command::PUSH);
+	Trace::Span fileSpan("file");
 
 	// Send start signal to client
 	LOGD("Sending start signal");
 	StartSignalPkt startSignalPkt{};
 	startSignalPkt.start = true;
-	if ((bytesSent = send(clientSocket, &startSignalPkt,
-		sizeof(startSignalPkt), 0)) != sizeof(startSignalPkt)) {
+	fm.call(Syscall::SEND);
+	if ((bytesSent = send(session.socket, &startSignalPkt,
+		sizeof(startSignalPkt), MSG_NOSIGNAL)) != sizeof(startSignalPkt)) {
+		fm.error(Syscall::SEND);
 		if (bytesSent < 0)
 			LOGE("Send start signal failed: %s", strerror(errno));
 		else
@@ -366,15 +1128,21 @@ int FileTransferServer::receiveFile(int clientSocket, const char *directory) {
 	// Receive file info packet from client
 	FileInfoPkt fileInfoPkt{};
 	LOGD("Receiving file info");
-	if ((bytesRecv = recv(clientSocket, &fileInfoPkt, sizeof(fileInfoPkt), 0))
+	Trace::Span waitSpan("wait_info");
+	fm.call(Syscall::RECV);
+	if ((bytesRecv = recv(session.socket, &fileInfoPkt, sizeof(fileInfoPkt), 0))
 		!= sizeof(fileInfoPkt)) {
+		fm.error(Syscall::RECV);
 		if (bytesRecv)
 			LOGE("Receive file info failed: %s", strerror(errno));
 		else
 			LOGE("Receive file info failed bytesRecv=%zu", bytesRecv);
 		return -1;
 	}
+	waitSpan.end();
 	fileNameStr = fileInfoPkt.name;
+	fileSpan.setDetail(fileInfoPkt.name);
+	session.progress.beginFile(fileInfoPkt.name);
 
 	// Prepend directory if present
 	if (strlen(directory)) {
@@ -387,67 +1155,381 @@ int FileTransferServer::receiveFile(int clientSocket, const char *directory) {
 	LOGD("File name=%s size=%ld time=%ld", fileNameStr.c_str(),
 		fileInfoPkt.size, fileInfoPkt.time);
 
-	// Open file for writing
-	FILE *file = fopen(fileNameStr.c_str(), "wb");
+	// Content the store already has is linked instead of received. A
+	// session receiving the same content is waited for.
+	ContentClaim claim;
+	if (session.dedupe && fileInfoPkt.hashed) {
+		ContentReplyPkt contentReplyPkt{};
+		contentReplyPkt.have = store.claim(fileInfoPkt.hash, fileInfoPkt.size,
+			claim);
+		fm.call(Syscall::SEND);
+		if ((bytesSent = send(session.socket, &contentReplyPkt,
+			sizeof(contentReplyPkt), MSG_NOSIGNAL)) != sizeof(contentReplyPkt)) {
+			fm.error(Syscall::SEND);
+			LOGE("Send content reply failed: %s", strerror(errno));
+			return -1;
+		}
+		if (contentReplyPkt.have) {
+			fm.call(Syscall::WRITE);
+			if (store.link(fileInfoPkt.hash, fileNameStr, fileInfoPkt.time) != 0 ||
+				session.durability.published(fileNameStr, fileInfoPkt.size) != 0) {
+				fm.error(Syscall::WRITE);
+				return -1;
+			}
+			session.fileCount += 1;
+			metrics.storeLinked.fetch_add(1, std::memory_order_relaxed);
+			metrics.storeSavedBytes.fetch_add(fileInfoPkt.size,
+				std::memory_order_relaxed);
+			LOGP_LAST(session.fileCount == session.totalFiles,
+				"Linked stored content %d/%d %s", session.fileCount,
+				session.totalFiles, fileNameStr.c_str());
+			fm.ok = true;
+			return 0;
+		}
+	}
+
+	// Open a temporary file for writing
+	Trace::Span openSpan("open");
+	std::string tempNameStr;
+	fm.call(Syscall::OPEN);
+	FILE *file = createPartialFile(fileNameStr, fileInfoPkt.size,
+		fileInfoPkt.sparse, tempNameStr);
 	if (!file) {
-		LOGE("Error opening file");
+		fm.error(Syscall::OPEN);
 		return -1;
 	}
+	openSpan.end();
 
-	fileCount += 1;
-	LOGI("Receiving file %d/%d name=%s size=%zu...", fileCount,
-		totalFiles, fileNameStr.c_str(), fileInfoPkt.size);
+	session.fileCount += 1;
+	LOGD("Receiving file %d/%d name=%s size=%zu...", session.fileCount,
+		session.totalFiles, fileNameStr.c_str(), fileInfoPkt.size);
 
 	// Receive the content of the file
 	LOGD("Receiving file content");
-	char buffer[CHUNK_SIZE] = {0};
 	bytesRecv = 0;
-	size_t totalBytesRecv = 0;
-	while (true) {
-		if ((bytesRecv = recv(clientSocket, buffer, CHUNK_SIZE, 0)) < 0) {
-			LOGE("Receive file chunk failed: %s", strerror(errno));
-			fileCount -= 1;
-			break;
+	bool failed = false;
+	bool tracing = Trace::active();
+	uint64_t recvUsec = 0;
+	uint64_t writeUsec = 0;
+	uint64_t socketStallUsec = 0; // recv waited for the disk
+	uint64_t diskStallUsec = 0; // Writing waited for the network
+	uint64_t lapUsec = tracing ? Trace::nowUsec() : 0;
+	// Content for the store is hashed as it arrives, holes as zeros
+	bool hashing = store.enabled() && !fileInfoPkt.udpPackets &&
+		!fileInfoPkt.local && !fileInfoPkt.multipathChunks;
+	Sha256 hasher;
+	uint64_t hashedBytes = 0;
+	if (fileInfoPkt.local) {
+		// Copies the file the client passed and tells it when done
+		bool ok = false;
+		int fd = -1;
+		fm.call(Syscall::RECV);
+		if (!session.localFiles ||
+			receiveLocalFile(session.socket, &ok, &fd) != 0) {
+			fm.error(Syscall::RECV);
+			LOGE("Unexpected local file");
+			failed = true;
+		} else {
+			uint64_t copied = 0;
+			uint64_t startUsec = nowUsec();
+			fm.call(Syscall::WRITE);
+			if (!ok || fd < 0 || fflush(file) != 0 || copyFileData(fd,
+				fileno(file), fileInfoPkt.size, session.progress, &copied) != 0) {
+				fm.error(Syscall::WRITE);
+				failed = true;
+			}
+			writeUsec = nowUsec() - startUsec;
+			if (fd >= 0) {
+				close(fd);
+			}
+			session.durability.written(file, copied);
+			metrics.localCopyBytes.fetch_add(copied, std::memory_order_relaxed);
+			fm.call(Syscall::SEND);
+			if (sendLocalFile(session.socket, -1, !failed) != 0) {
+				fm.error(Syscall::SEND);
+				failed = true;
+			}
+		}
+	} else if (fileInfoPkt.udpPackets) {
+		if (!session.udp) {
+			LOGE("UDP file data without a UDP transport");
+			failed = true;
+		} else {
+			failed = session.udp->receiveFile(file, fileInfoPkt.size,
+				fileInfoPkt.udpPackets, session.progress,
+				session.durability) != 0;
+			fm.bytesIn += session.udp->getStats().packets * UDP_PAYLOAD_SIZE;
 		}
+	} else if (fileInfoPkt.multipathChunks) {
+		if (!session.multipath) {
+			LOGE("Multipath file data without subflows");
+			failed = true;
+		} else {
+			failed = session.multipath->receiveFile(file, fileInfoPkt.size,
+				fileInfoPkt.multipathChunks, session.progress,
+				session.durability) != 0;
+			fm.bytesIn += session.multipath->getStats().wireBytes;
+		}
+	} else {
+		ExtentPkt extent = {0, fileInfoPkt.size};
+		// A file that fits one pipeline slot has nothing to overlap
+		ReceivePipeline* pipeline = nullptr;
+		if (fileInfoPkt.size > PIPELINE_SLOT_BYTES) {
+			if (!session.pipeline) {
+				session.pipeline.reset(new ReceivePipeline());
+			}
+			pipeline = session.pipeline.get();
+			pipeline->begin(file, &session.durability);
+		}
+		session.tuner.begin();
+		while (!failed) {
+			if (fileInfoPkt.sparse) {
+				fm.call(Syscall::RECV);
+				if (recv(session.socket, &extent, sizeof(extent), MSG_WAITALL) !=
+					sizeof(extent)) {
+					fm.error(Syscall::RECV);
+					LOGE("Receive extent failed: %s", strerror(errno));
+					failed = true;
+					break;
+				}
+				fm.bytesIn += sizeof(extent);
+				if (extent.length == 0) {
+					break;
+				}
+				if (extent.offset > fileInfoPkt.size ||
+					extent.length > fileInfoPkt.size - extent.offset) {
+					LOGE("Invalid extent offset=%llu length=%llu",
+						 static_cast<unsigned long long>(extent.offset),
+						 static_cast<unsigned long long>(extent.length));
+					failed = true;
+					break;
+				}
+				if (extent.offset < hashedBytes) {
+					hashing = false; // Out of order, read back below
+				} else if (hashing) {
+					hasher.updateZeros(extent.offset - hashedBytes);
+					hashedBytes = extent.offset;
+				}
+				// Seeking past the end leaves a hole
+				if (pipeline) {
+					pipeline->seek(extent.offset);
+				} else {
+					fm.call(Syscall::WRITE);
+					if (fseeko(file, extent.offset, SEEK_SET) != 0) {
+						fm.error(Syscall::WRITE);
+						LOGE("Error seeking file: %s", strerror(errno));
+						failed = true;
+						break;
+					}
+				}
+			}
 
-		fwrite(buffer, 1, bytesRecv, file);
-		totalBytesRecv += bytesRecv;
+			uint64_t remaining = extent.length;
+			while (remaining > 0) {
+				char* buffer = session.tuner.buffer();
+				size_t room = session.tuner.chunkSize();
+				if (pipeline && !(buffer = pipeline->reserve(&room))) {
+					failed = true; // finish() reports the write error
+					break;
+				}
+				fm.call(Syscall::RECV);
+				if ((bytesRecv = recv(session.socket, buffer,
+					std::min<uint64_t>(room, remaining), 0)) <= 0) {
+					fm.error(Syscall::RECV);
+					if (bytesRecv < 0)
+						LOGE("Receive file chunk failed: %s", strerror(errno));
+					else
+						LOGE("Receive file chunk failed: connection closed");
+					failed = true;
+					break;
+				}
+				if (tracing) {
+					lapUsec = Trace::lap("recv", lapUsec, &recvUsec,
+					                     fileInfoPkt.name, bytesRecv);
+				}
+				if (hashing) {
+					hasher.update(buffer, bytesRecv);
+					hashedBytes += bytesRecv;
+				}
 
-		if (totalBytesRecv >= fileInfoPkt.size) {
-			break;
+				if (pipeline) {
+					pipeline->commit(bytesRecv);
+				} else {
+					fm.call(Syscall::WRITE);
+					if (fwrite(buffer, 1, bytesRecv, file) !=
+						static_cast<size_t>(bytesRecv)) {
+						fm.error(Syscall::WRITE);
+						LOGE("Error writing file: %s", strerror(errno));
+						failed = true;
+						break;
+					}
+					session.durability.written(file, bytesRecv);
+				}
+				if (tracing && !pipeline) {
+					lapUsec = Trace::lap("write", lapUsec, &writeUsec,
+					                     fileInfoPkt.name, bytesRecv);
+				}
+				remaining -= bytesRecv;
+				fm.bytesIn += bytesRecv;
+				session.progress.addBytes(bytesRecv);
+				session.tuner.moved(bytesRecv);
+			}
+			if (!fileInfoPkt.sparse) {
+				break;
+			}
+		}
+		if (pipeline) {
+			PipelineStats stats;
+			if (pipeline->finish(&stats) != 0) {
+				fm.error(Syscall::WRITE);
+				LOGE("Error writing file: %s", strerror(errno));
+				failed = true;
+			}
+			fm.calls[static_cast<int>(Syscall::WRITE)] += stats.writes;
+			writeUsec = stats.writeUsec;
+			socketStallUsec = stats.socketStallUsec;
+			diskStallUsec = stats.diskStallUsec;
+			metrics.receiveSocketStallUsec.fetch_add(socketStallUsec,
+				std::memory_order_relaxed);
+			metrics.receiveDiskStallUsec.fetch_add(diskStallUsec,
+				std::memory_order_relaxed);
 		}
-		memset(buffer, 0, CHUNK_SIZE);
 	}
-	
-	// Close the file
-	LOGD("Closing file");
-	fclose(file);
 
-	// Copy original file timestamp
-	LOGD("Copying original time stamp");
-	struct utimbuf new_times;
-	new_times.actime = fileInfoPkt.time; // Use the current access time
-	new_times.modtime = fileInfoPkt.time; // Set the modification time
-	if (utime(fileNameStr.c_str(), &new_times) == -1) {
-		LOGE("Error copying file timestamp: %s", strerror(errno));
-		fileCount -= 1;
+	// Holes after the last extent
+	if (!failed && fileInfoPkt.sparse) {
+		fm.call(Syscall::WRITE);
+		if (fflush(file) != 0 || ftruncate(fileno(file),
+			static_cast<off_t>(fileInfoPkt.size)) != 0) {
+			fm.error(Syscall::WRITE);
+			LOGE("Error setting file size: %s", strerror(errno));
+			failed = true;
+		}
+	}
+
+	// UDP datagrams and unordered extents are hashed from the file
+	uint8_t digest[SHA256_SIZE];
+	bool storing = !failed && store.enabled();
+	if (storing && hashing) {
+		hasher.updateZeros(fileInfoPkt.size - hashedBytes);
+		hasher.final(digest);
+	} else if (storing) {
+		int fd = -1;
+		if (fflush(file) != 0 ||
+			(fd = open(tempNameStr.c_str(), O_RDONLY | O_CLOEXEC)) < 0 ||
+			hashFile(fd, digest) != 0) {
+			LOGE("Error hashing %s: %s", tempNameStr.c_str(), strerror(errno));
+			storing = false;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	if (storing && fileInfoPkt.hashed &&
+		memcmp(digest, fileInfoPkt.hash, SHA256_SIZE) != 0) {
+		LOGE("%s does not match the hash it was sent with, not storing it",
+			fileNameStr.c_str());
+		storing = false;
+	}
+
+	// Publish the file under its final name only when it is complete
+	LOGD("Publishing file");
+	if (!failed && session.durability.fileDone(file) != 0) {
+		fm.error(Syscall::WRITE);
+		failed = true;
+	}
+	if (failed) {
+		discardPartialFile(file, tempNameStr);
+	} else if (publishPartialFile(file, tempNameStr, fileNameStr,
+		fileInfoPkt.size, fileInfoPkt.time) != 0 ||
+		session.durability.published(fileNameStr, fileInfoPkt.size) != 0) {
+		fm.error(Syscall::WRITE);
+		failed = true;
+	}
+	if (failed) {
+		session.fileCount -= 1;
+		fm.ok = false;
 		return -1;
 	}
 
-	LOGI("Receive file completed %d/%d %s", fileCount, totalFiles,
-		  fileNameStr.c_str());
+	LOGP_LAST(session.fileCount == session.totalFiles,
+		"Receive file completed %d/%d %s", session.fileCount,
+		session.totalFiles, fileNameStr.c_str());
+	if (storing && store.add(digest, fileNameStr, fileInfoPkt.time) == 0) {
+		metrics.storeAdded.fetch_add(1, std::memory_order_relaxed);
+	}
 
-	return 0;
+	fm.ok = !failed;
+	fileSpan.setArg(0, "bytes", fm.bytesIn);
+	fileSpan.setArg(1, "recv_us", recvUsec);
+	fileSpan.setArg(2, "write_us", writeUsec);
+	fileSpan.setArg(3, "socket_stall_us", socketStallUsec);
+	fileSpan.setArg(4, "disk_stall_us", diskStallUsec);
+	return failed ? -1 : 0;
 }
 
-int FileTransferServer::sendFileList(int clientSocket, std::vector<std::string>
-	files) {
+// Collects LIST entries into a batch of at most LIST_BATCH_SIZE bytes and
+// sends it when full, so memory use does not grow with the directory size.
+struct ListBatch {
+	ListBatch(int socket, FileMetrics& fm) : socket(socket), fm(fm) {
+	}
+
+	int add(const char* name, const struct stat& st) {
+		ListEntryPkt entry{};
+		size_t nameLength = strnlen(name, UINT16_MAX);
+		if (length + sizeof(entry) + nameLength > LIST_BATCH_SIZE &&
+			flush(0) != 0) {
+			return -1;
+		}
+		entry.size = st.st_size;
+		entry.time = st.st_mtime;
+		entry.nameLength = static_cast<uint16_t>(nameLength);
+		entry.type = S_ISREG(st.st_mode) ? FileType::REGULAR :
+		             S_ISDIR(st.st_mode) ? FileType::DIRECTORY :
+		             S_ISLNK(st.st_mode) ? FileType::SYMLINK : FileType::OTHER;
+		memcpy(buffer + length, &entry, sizeof(entry));
+		memcpy(buffer + length + sizeof(entry), name, nameLength);
+		length += sizeof(entry) + nameLength;
+		count++;
+		return 0;
+	}
+
+	// Sends the pending entries; an empty batch ends the list
+	int flush(uint64_t cursor) {
+		ListBatchPkt batchPkt{};
+		batchPkt.count = count;
+		batchPkt.length = length;
+		batchPkt.cursor = cursor;
+		fm.call(Syscall::SEND);
+		if (send(socket, &batchPkt, sizeof(batchPkt), MSG_NOSIGNAL |
+			(count ? MSG_MORE : 0)) != sizeof(batchPkt) || (length &&
+			send(socket, buffer, length, MSG_NOSIGNAL) !=
+			static_cast<ssize_t>(length))) {
+			fm.error(Syscall::SEND);
+			LOGE("Send file list failed: %s", strerror(errno));
+			return -1;
+		}
+		fm.bytesOut += sizeof(batchPkt) + length;
+		count = 0;
+		length = 0;
+		return 0;
+	}
+
+	int socket;
+	FileMetrics& fm;
+	uint32_t count = 0;
+	size_t length = 0;
+	char buffer[LIST_BATCH_SIZE];
+};
+
+int FileTransferServer::sendFileList(Session& session,
+	const std::string& pattern, uint64_t cursor, unsigned limit) {
 	ssize_t bytesRecv = 0;
 
 	// Wait for client start signal
 	LOGD("Waiting for start signal");
 	StartSignalPkt startSignalPkt{};
-	if ((bytesRecv = recv(clientSocket, &startSignalPkt,
+	if ((bytesRecv = recv(session.socket, &startSignalPkt,
 		sizeof(startSignalPkt), 0)) != sizeof(startSignalPkt)) {
 		if (bytesRecv < 0)
 			LOGE("Receive start signal failed: %s", strerror(errno));
@@ -456,22 +1538,145 @@ int FileTransferServer::sendFileList(int clientSocket, std::vector<std::string>
 		return -1;
 	}
 
-	// Iterate files
-	for (const auto& file : files) {
-		// Send file list to client
-		std::string fileStr = file + "\n";
-		if (send(clientSocket, fileStr.c_str(), fileStr.length(), 0) < 0) {
-			LOGE("Send file list failed: %s", strerror(errno));
+	FileMetrics fm(metrics, Command::LIST);
+	Trace::Span listSpan("list", pattern.c_str());
+	std::unique_ptr<ListBatch> batch(new ListBatch(session.socket, fm));
+	struct stat st;
+
+	if (!isFilePattern(pattern.c_str())) {
+		// Single file
+		if (lstat(pattern.c_str(), &st) == 0 &&
+			session.filter.matchName(getBaseName(pattern).c_str()) &&
+			session.filter.matchStat(st)) {
+			if (batch->add(getBaseName(pattern).c_str(), st) != 0) {
+				return -1;
+			}
+			session.fileCount = 1;
+		}
+		if ((batch->count && batch->flush(0) != 0) || batch->flush(0) != 0) {
 			return -1;
 		}
-		LOGD("Sent: %s", fileStr.c_str());
-		fileCount += 1;
+		fm.ok = true;
+		return 0;
+	}
+
+	std::string directory, filePattern;
+	splitPathAndPattern(pattern, directory, filePattern);
+	DIR* dir = opendir(directory.c_str());
+	if (!dir) {
+		LOGE("Could not open directory %s: %s", directory.c_str(),
+			strerror(errno));
+		return batch->flush(0);
 	}
 
+	// The cursor is a telldir() position plus one, so 0 can mean done.
+	// Directory positions stay valid across opendir() calls on Linux file
+	// systems, which lets a later connection resume the listing.
+	if (cursor) {
+		seekdir(dir, static_cast<long>(cursor - 1));
+	}
+	uint64_t nextCursor = 0;
+	unsigned listed = 0;
+	int ret = 0;
+	while (true) {
+		long position = telldir(dir);
+		struct dirent* ent = readdir(dir);
+		if (!ent) {
+			break;
+		}
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+			fnmatch(filePattern.c_str(), ent->d_name, 0) != 0 ||
+			!session.filter.matchName(ent->d_name)) {
+			continue;
+		}
+		if (limit && listed == limit) {
+			nextCursor = static_cast<uint64_t>(position) + 1;
+			break;
+		}
+		fm.call(Syscall::STAT);
+		if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			fm.error(Syscall::STAT);
+			continue; // Removed while listing
+		}
+		if (!session.filter.matchStat(st)) {
+			continue;
+		}
+		if ((ret = batch->add(ent->d_name, st)) != 0) {
+			break;
+		}
+		listed++;
+	}
+	closedir(dir);
+
+	if (ret != 0 || (batch->count && batch->flush(0) != 0) ||
+		batch->flush(nextCursor) != 0) {
+		return -1;
+	}
+	session.fileCount = listed;
+	listSpan.setArg(0, "files", listed);
 	LOGI("File list sent completed");
+	fm.ok = true;
 	return 0;
 }
 
+bool FileTransferServer::joinSession(int clientSocket, uint64_t token) {
+	// The session owns a duplicate, handleClient closes this descriptor
+	InitReplyPkt initReplyPkt{};
+	bool known = false;
+	{
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		auto it = multipathSessions.find(token);
+		known = it != multipathSessions.end();
+		int fd = known ? dup(clientSocket) : -1;
+		if (fd >= 0) {
+			initReplyPkt.proceed = it->second->addPath(fd);
+			if (!initReplyPkt.proceed) {
+				close(fd);
+			}
+		}
+	}
+	if (initReplyPkt.proceed) {
+		LOGI("Subflow joined a multipath session");
+		metrics.multipathSubflows.fetch_add(1, std::memory_order_relaxed);
+	} else if (known) {
+		LOGE("Subflow rejected, the session has %d already",
+			MULTIPATH_MAX_PATHS);
+	} else {
+		LOGE("Subflow for an unknown session");
+	}
+	metrics.addSyscalls(Syscall::SEND, 1);
+	if (send(clientSocket, &initReplyPkt, sizeof(initReplyPkt), MSG_NOSIGNAL)
+		!= sizeof(initReplyPkt)) {
+		metrics.addErrors(Syscall::SEND, 1);
+	}
+	return false;
+}
+
+// The advertised addresses, or those of the interfaces of the kind the
+// client reached, loopback or not
+void FileTransferServer::fillPathAddresses(int clientSocket,
+	InitReplyPkt& reply) {
+	std::vector<std::pair<uint32_t, uint16_t>> addresses = advertised;
+	if (addresses.empty()) {
+		struct sockaddr_in addr{};
+		socklen_t addrLen = sizeof(addr);
+		bool loopback = getsockname(clientSocket, (struct sockaddr*)&addr,
+			&addrLen) == 0 && (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+		for (uint32_t address : getInterfaceAddresses(loopback)) {
+			addresses.push_back({address, 0});
+		}
+	}
+	for (const auto& address : addresses) {
+		if (reply.pathCount >= MAX_PATH_ADDRESSES) {
+			break;
+		}
+		reply.pathAddresses[reply.pathCount] = address.first;
+		reply.pathPorts[reply.pathCount] = address.second ? address.second :
+			static_cast<uint16_t>(port);
+		reply.pathCount++;
+	}
+}
+
 std::string FileTransferServer::getLocalPrivateIP() {
 	struct ifaddrs* ifaddr;
 	struct ifaddrs* ifa;
@@ -0,0 +1,178 @@
+#include "Filter.h"
+#include "Logger.h"
+#include "utils.h"
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fnmatch.h>
+#include <sstream>
+
+namespace Dex {
+
+static int parseTime(const char* str, time_t now, int64_t* time) {
+	char* end;
+	if (*str == '@') {
+		*time = strtoll(str + 1, &end, 10);
+		return end != str + 1 && *end == '\0' ? 0 : -1;
+	}
+
+	struct tm tm{};
+	int consumed = 0;
+	if (sscanf(str, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	           &consumed) == 3 && str[consumed] == '\0') {
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_isdst = -1;
+		*time = mktime(&tm);
+		return 0;
+	}
+
+	if (*str < '0' || *str > '9') {
+		return -1;
+	}
+	long long value = strtoll(str, &end, 10);
+	long long unit;
+	switch (*end) {
+	case 's': unit = 1; break;
+	case 'm': unit = 60; break;
+	case 'h': unit = 3600; break;
+	case 'd': unit = 86400; break;
+	case 'w': unit = 7 * 86400; break;
+	default: return -1;
+	}
+	if (end[1] != '\0' || value > LLONG_MAX / unit) {
+		return -1;
+	}
+	*time = static_cast<int64_t>(now) - value * unit;
+	return 0;
+}
+
+Filter::Filter() : minSize(0), maxSize(UINT64_MAX), newerThan(INT64_MIN),
+    olderThan(INT64_MAX) {
+}
+
+int Filter::parse(const char* expression, time_t now) {
+	*this = Filter();
+	std::istringstream terms(expression);
+	std::string term;
+
+	while (terms >> term) {
+		const char* t = term.c_str();
+		if (t[0] == '+' || t[0] == '-') {
+			if (t[1] == '\0') {
+				LOGE("Empty glob in filter term '%s'", t);
+				return -1;
+			}
+			(t[0] == '+' ? includes : excludes).push_back(t + 1);
+		} else if (strncmp(t, "size", 4) == 0) {
+			const char* op = t + 4;
+			size_t opLength = (op[0] && op[1] == '=') ? 2 : 1;
+			uint64_t size;
+			if (parseSize(op + opLength, &size) != 0) {
+				LOGE("Invalid size in filter term '%s'", t);
+				return -1;
+			}
+			if (strncmp(op, ">=", 2) == 0) {
+				minSize = std::max(minSize, size);
+			} else if (strncmp(op, "<=", 2) == 0) {
+				maxSize = std::min(maxSize, size);
+			} else if (op[0] == '>' && size < UINT64_MAX) {
+				minSize = std::max(minSize, size + 1);
+			} else if (op[0] == '<' && size > 0) {
+				maxSize = std::min(maxSize, size - 1);
+			} else if (op[0] == '=') {
+				minSize = std::max(minSize, size);
+				maxSize = std::min(maxSize, size);
+			} else {
+				LOGE("Invalid size comparison in filter term '%s'", t);
+				return -1;
+			}
+		} else if (strncmp(t, "newer:", 6) == 0 ||
+		           strncmp(t, "older:", 6) == 0) {
+			int64_t time;
+			if (parseTime(t + 6, now, &time) != 0) {
+				LOGE("Invalid time in filter term '%s'", t);
+				return -1;
+			}
+			if (t[0] == 'n') {
+				newerThan = std::max(newerThan, time);
+			} else {
+				olderThan = std::min(olderThan, time);
+			}
+		} else {
+			LOGE("Unknown filter term '%s'", t);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+std::string Filter::toString() const {
+	std::string out;
+	char term[64];
+
+	for (const auto& glob : includes) {
+		out += " +" + glob;
+	}
+	for (const auto& glob : excludes) {
+		out += " -" + glob;
+	}
+	if (minSize > 0) {
+		snprintf(term, sizeof(term), " size>=%llu",
+		         static_cast<unsigned long long>(minSize));
+		out += term;
+	}
+	if (maxSize < UINT64_MAX) {
+		snprintf(term, sizeof(term), " size<=%llu",
+		         static_cast<unsigned long long>(maxSize));
+		out += term;
+	}
+	if (newerThan > INT64_MIN) {
+		snprintf(term, sizeof(term), " newer:@%lld",
+		         static_cast<long long>(newerThan));
+		out += term;
+	}
+	if (olderThan < INT64_MAX) {
+		snprintf(term, sizeof(term), " older:@%lld",
+		         static_cast<long long>(olderThan));
+		out += term;
+	}
+	return out.empty() ? out : out.substr(1);
+}
+
+bool Filter::empty() const {
+	return includes.empty() && excludes.empty() && !needsStat();
+}
+
+bool Filter::needsStat() const {
+	return minSize > 0 || maxSize < UINT64_MAX || newerThan > INT64_MIN ||
+	       olderThan < INT64_MAX;
+}
+
+bool Filter::matchName(const char* name) const {
+	for (const auto& glob : excludes) {
+		if (fnmatch(glob.c_str(), name, 0) == 0) {
+			return false;
+		}
+	}
+	if (includes.empty()) {
+		return true;
+	}
+	for (const auto& glob : includes) {
+		if (fnmatch(glob.c_str(), name, 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Filter::matchStat(const struct stat& st) const {
+	uint64_t size = static_cast<uint64_t>(st.st_size);
+	int64_t mtime = static_cast<int64_t>(st.st_mtime);
+	return size >= minSize && size <= maxSize && mtime >= newerThan &&
+	       mtime < olderThan;
+}
+
+} // namespace Dex
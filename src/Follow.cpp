@@ -0,0 +1,163 @@
+#include "Follow.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace Dex {
+
+static uint64_t nowMs() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+FileFollower::FileFollower(const std::string& path) : path(path) {
+}
+
+FileFollower::~FileFollower() {
+	if (fileFd >= 0) {
+		close(fileFd);
+	}
+	if (inotifyFd >= 0) {
+		close(inotifyFd);
+	}
+}
+
+int FileFollower::start(int fd) {
+	fileFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (fileFd < 0) {
+		LOGE("Error duplicating file descriptor: %s", strerror(errno));
+		return -1;
+	}
+#ifdef __linux__
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0) {
+		LOGE("inotify unavailable, polling %s: %s", path.c_str(),
+		     strerror(errno));
+		return 0;
+	}
+	// The directory reports the new file that replaces a rotated one
+	size_t slash = path.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." :
+	                        slash == 0 ? "/" : path.substr(0, slash);
+	if (inotify_add_watch(inotifyFd, directory.c_str(),
+		IN_CREATE | IN_MOVED_TO) < 0 || watch() != 0) {
+		LOGE("Error watching %s: %s", path.c_str(), strerror(errno));
+		close(inotifyFd);
+		inotifyFd = -1;
+	}
+#endif
+	return 0;
+}
+
+int FileFollower::watch() {
+#ifdef __linux__
+	if (fileWatch >= 0) {
+		inotify_rm_watch(inotifyFd, fileWatch);
+	}
+	fileWatch = inotify_add_watch(inotifyFd, path.c_str(), IN_MODIFY |
+		IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	return fileWatch < 0 ? -1 : 0;
+#else
+	return 0;
+#endif
+}
+
+void FileFollower::drainEvents() {
+#ifdef __linux__
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (read(inotifyFd, events, sizeof(events)) > 0) {
+	}
+#endif
+}
+
+int FileFollower::check(uint64_t offset, FollowChange* change) {
+	struct stat st;
+	if (fstat(fileFd, &st) != 0) {
+		LOGE("Error getting file status: %s", strerror(errno));
+		return -1;
+	}
+	change->size = st.st_size;
+	change->restart = change->size < offset; // Truncated
+	if (change->size != offset) {
+		return 0;
+	}
+
+	// Everything was read; has a new file taken the path?
+	struct stat pathSt;
+	if (stat(path.c_str(), &pathSt) != 0 || (pathSt.st_ino == st.st_ino &&
+		pathSt.st_dev == st.st_dev)) {
+		return 0;
+	}
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0; // Looked again at the next event
+	}
+	LOGI("%s was replaced, following the new file", path.c_str());
+	close(fileFd);
+	fileFd = fd;
+	if (inotifyFd >= 0 && watch() != 0) {
+		LOGE("Error watching %s: %s", path.c_str(), strerror(errno));
+	}
+	change->restart = true;
+	change->size = st.st_size;
+	return 0;
+}
+
+int FileFollower::wait(int socket, uint64_t offset, unsigned timeoutMs,
+	FollowChange* change) {
+	uint64_t deadline = nowMs() + timeoutMs;
+	bool batched = false;
+	*change = FollowChange{};
+
+	while (true) {
+		if (inotifyFd >= 0) {
+			drainEvents();
+		}
+		if (check(offset, change) != 0) {
+			return -1;
+		}
+		bool changed = change->restart || change->size > offset;
+		if (changed && (batched || change->restart ||
+			change->size - offset >= FOLLOW_BATCH_BYTES)) {
+			return 0;
+		}
+
+		// A small append waits FOLLOW_BATCH_MS for the writes after it
+		int waitMs;
+		uint64_t now = nowMs();
+		if (changed) {
+			batched = true;
+			waitMs = FOLLOW_BATCH_MS;
+		} else if (now >= deadline) {
+			return 0;
+		} else {
+			waitMs = static_cast<int>(std::min<uint64_t>(deadline - now,
+			                                             FOLLOW_POLL_MS));
+		}
+		struct pollfd fds[2] = {{socket, POLLIN, 0}, {inotifyFd, POLLIN, 0}};
+		nfds_t count = inotifyFd >= 0 && !changed ? 2 : 1;
+		int n = poll(fds, count, waitMs);
+		if (n < 0 && errno != EINTR) {
+			LOGE("poll failed: %s", strerror(errno));
+			return -1;
+		}
+		if (n > 0 && fds[0].revents) {
+			change->socketReady = true;
+			return 0;
+		}
+	}
+}
+
+} // namespace Dex
@@ -0,0 +1,267 @@
+#include "LocalTransport.h"
+#include "Logger.h"
+#include "packet.h"
+#include "utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Dex {
+
+#define LOCAL_LISTEN_BACKLOG 16
+
+std::string defaultLocalSocketPath(int port, bool create) {
+	const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+	if (runtimeDir && *runtimeDir) {
+		return std::string(runtimeDir) + "/dexft-" + std::to_string(port) +
+		       ".sock";
+	}
+	// Anyone may create names in /tmp, so the directory is only used when
+	// nobody else could have put a socket in it
+	std::string dir = "/tmp/dexft-" + std::to_string(geteuid());
+	if (create && mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+		LOGE("Error creating %s: %s", dir.c_str(), strerror(errno));
+		return "";
+	}
+	struct stat st;
+	if (lstat(dir.c_str(), &st) != 0) {
+		return "";
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IRWXG | S_IRWXO))) {
+		LOGE("%s is not a private directory of this user", dir.c_str());
+		return "";
+	}
+	return dir + "/" + std::to_string(port) + ".sock";
+}
+
+bool isLoopbackAddress(const char* address) {
+	return strncmp(address, "127.", 4) == 0 || strcmp(address, "::1") == 0 ||
+	       strcmp(address, "localhost") == 0;
+}
+
+static int fillAddress(const char* path, struct sockaddr_un* addr) {
+	if (strlen(path) == 0 || strlen(path) >= sizeof(addr->sun_path)) {
+		LOGE("Invalid local socket path: %s", path);
+		return -1;
+	}
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, strlen(path));
+	return 0;
+}
+
+static int connectUnix(const char* path) {
+	struct sockaddr_un addr{};
+	if (fillAddress(path, &addr) != 0) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int connectLocal(const char* path) {
+	int fd = connectUnix(path);
+	if (fd < 0) {
+		return -1;
+	}
+	// Files are passed to and taken from this server as they are
+	uid_t uid = static_cast<uid_t>(-1);
+#ifdef __linux__
+	struct ucred cred{};
+	socklen_t credLen = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0) {
+		uid = cred.uid;
+	}
+#else
+	gid_t gid;
+	getpeereid(fd, &uid, &gid);
+#endif
+	if (uid != geteuid()) {
+		LOGE("Server on %s runs as another user, not using it", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int listenLocal(const char* path) {
+	struct sockaddr_un addr{};
+	if (fillAddress(path, &addr) != 0) {
+		return -1;
+	}
+	int existing = connectUnix(path);
+	if (existing >= 0) {
+		close(existing);
+		LOGE("Another server is listening on %s", path);
+		return -1;
+	}
+	unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		LOGE("Local socket creation failed: %s", strerror(errno));
+		return -1;
+	}
+	// Clients of other users connect over TCP
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, S_IRUSR | S_IWUSR) != 0 ||
+	    listen(fd, LOCAL_LISTEN_BACKLOG) < 0) {
+		LOGE("Listening on %s failed: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int sendLocalFile(int socket, int fd, bool ok) {
+	LocalFilePkt localFilePkt{};
+	localFilePkt.ok = ok;
+	struct iovec iov = {&localFilePkt, sizeof(localFilePkt)};
+	struct msghdr msg{};
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	if (sendmsg(socket, &msg, MSG_NOSIGNAL) != sizeof(localFilePkt)) {
+		LOGE("Send local file failed: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int receiveLocalFile(int socket, bool* ok, int* fd) {
+	LocalFilePkt localFilePkt{};
+	struct iovec iov = {&localFilePkt, sizeof(localFilePkt)};
+	struct msghdr msg{};
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (fd) {
+		*fd = -1;
+	}
+	if (recvmsg(socket, &msg, MSG_WAITALL) !=
+	    sizeof(localFilePkt)) {
+		LOGE("Receive local file failed: %s", strerror(errno));
+		return -1;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS) {
+		int received;
+		memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+		if (fd) {
+			*fd = received;
+		} else {
+			close(received);
+		}
+	}
+	*ok = localFilePkt.ok;
+	return 0;
+}
+
+// Copies length bytes at offset with read and write
+static ssize_t copyByReading(int from, int to, off_t offset, size_t length,
+    std::unique_ptr<char[]>& buffer) {
+	if (!buffer) {
+		buffer.reset(new char[LOCAL_COPY_CHUNK]);
+	}
+	ssize_t n = pread(from, buffer.get(), length, offset);
+	for (ssize_t written = 0; n > 0 && written < n;) {
+		ssize_t w = pwrite(to, buffer.get() + written, n - written,
+		                   offset + written);
+		if (w < 0) {
+			return -1;
+		}
+		written += w;
+	}
+	return n;
+}
+
+int copyFileData(int from, int to, uint64_t size, ProgressReporter& progress,
+    uint64_t* copied) {
+	*copied = 0;
+	struct stat st;
+	if (fstat(from, &st) != 0 || !S_ISREG(st.st_mode)) {
+		LOGE("Local file is not a regular file");
+		return -1;
+	}
+	std::vector<ExtentPkt> extents;
+	if (getSparseExtents(from, st, extents) != 0) {
+		extents.assign(1, {0, size});
+	}
+
+	bool kernelCopy = true;
+	std::unique_ptr<char[]> buffer;
+	for (const auto& extent : extents) {
+		off_t offset = static_cast<off_t>(extent.offset);
+		uint64_t remaining = extent.offset < size ?
+			std::min(extent.length, size - extent.offset) : 0;
+		while (remaining > 0) {
+			size_t length = std::min<uint64_t>(remaining, LOCAL_COPY_CHUNK);
+			ssize_t n = -1;
+#ifdef __linux__
+			if (kernelCopy) {
+				loff_t in = offset;
+				loff_t out = offset;
+				n = copy_file_range(from, &in, to, &out, length, 0);
+				// Across file systems on older kernels, and where the file
+				// systems do not support it
+				if (n < 0 && (errno == EXDEV || errno == EINVAL ||
+				    errno == ENOSYS || errno == EOPNOTSUPP)) {
+					LOGD("copy_file_range failed: %s", strerror(errno));
+					kernelCopy = false;
+				}
+			}
+#else
+			kernelCopy = false;
+#endif
+			if (!kernelCopy) {
+				n = copyByReading(from, to, offset, length, buffer);
+			}
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				// Nothing copied means the file shrank
+				LOGE("Error copying local file: %s",
+				     n < 0 ? strerror(errno) : "file is shorter");
+				return -1;
+			}
+			offset += n;
+			remaining -= n;
+			*copied += n;
+			progress.addBytes(n);
+		}
+	}
+	if (ftruncate(to, static_cast<off_t>(size)) != 0) {
+		LOGE("Error setting file size: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+} // namespace Dex
@@ -0,0 +1,456 @@
+#include "Logger.h"
+#include <algorithm>
+#include <cstdarg>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __ANDROID__
+#include <android/log.h>
+#define LOG_TAG "DexLog"
+#endif
+
+namespace Dex {
+namespace Log {
+namespace detail {
+
+#define LOG_ALIGN(n) (((n) + 7) & ~static_cast<size_t>(7))
+#define LOG_FLUSH_INTERVAL_MS 10
+#define LOG_MAX_RECORD (LOG_RING_SIZE / 4)
+
+#ifdef DEBUG
+std::atomic<int> minLevel(LEVEL_DEBUG);
+#else
+std::atomic<int> minLevel(LEVEL_INFO);
+#endif
+
+static std::atomic<bool> asyncEnabled(true);
+// Set once the flush thread is gone at exit; later records are written
+// synchronously instead of touching the destroyed backend.
+static std::atomic<bool> backendStopped(false);
+static std::atomic<int64_t> progressIntervalMs(LOG_PROGRESS_INTERVAL_MS);
+static std::atomic<bool> stderrOnly(false);
+
+// Single producer (the owning thread), single consumer (the flush thread).
+// head and tail count bytes ever written/consumed.
+struct Ring {
+	std::atomic<uint64_t> head{0};
+	std::atomic<uint64_t> tail{0};
+	std::atomic<bool> closed{false};
+	alignas(8) char data[LOG_RING_SIZE];
+};
+
+struct Line {
+	uint64_t timestamp;
+	int level;
+	std::string text;
+};
+
+static uint64_t nowNsec() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void appendFormatted(std::string& out, const char* spec, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void appendFormatted(std::string& out, const char* spec, ...) {
+	char buf[512];
+	va_list ap;
+	va_start(ap, spec);
+	int n = vsnprintf(buf, sizeof(buf), spec, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if (static_cast<size_t>(n) < sizeof(buf)) {
+		out.append(buf, n);
+		return;
+	}
+	std::string big(n + 1, '\0');
+	va_start(ap, spec);
+	vsnprintf(&big[0], big.size(), spec, ap);
+	va_end(ap);
+	out.append(big.c_str(), n);
+}
+
+// Walks the format string and formats each conversion with the argument
+// taken from the record. Length modifiers are normalised to the width of
+// the stored value, so "%d" with a size_t or "%ld" with a long long are
+// both printed correctly.
+static void formatRecord(const RecordHeader* header, std::string& out) {
+	const char* p = reinterpret_cast<const char*>(header) +
+	                sizeof(RecordHeader);
+	int argsLeft = header->argCount;
+	const char* f = header->fmt;
+
+	while (*f) {
+		if (*f != '%') {
+			const char* next = strchr(f, '%');
+			size_t len = next ? static_cast<size_t>(next - f) : strlen(f);
+			out.append(f, len);
+			f += len;
+			continue;
+		}
+		if (f[1] == '%') {
+			out.push_back('%');
+			f += 2;
+			continue;
+		}
+
+		// Copy flags, width and precision; drop length modifiers
+		char spec[32];
+		size_t n = 0;
+		spec[n++] = *f++;
+		while (*f && strchr("-+ #0123456789.*", *f) && n < sizeof(spec) - 4) {
+			if (*f == '*') {
+				// Width/precision from an argument is not supported; skip
+				// the argument so the rest stays aligned.
+				if (argsLeft > 0) {
+					p += 1 + sizeof(uint64_t);
+					argsLeft--;
+				}
+				f++;
+				continue;
+			}
+			spec[n++] = *f++;
+		}
+		while (*f && strchr("hlLqjzt", *f)) {
+			f++;
+		}
+		char conv = *f ? *f++ : 's';
+
+		if (argsLeft <= 0) {
+			out.append("<?>");
+			continue;
+		}
+		argsLeft--;
+
+		ArgTag tag = static_cast<ArgTag>(*p++);
+		if (tag == TAG_STRING) {
+			uint16_t len;
+			memcpy(&len, p, sizeof(len));
+			std::string str(p + sizeof(len), len);
+			p += sizeof(len) + len;
+			spec[n++] = 's';
+			spec[n] = '\0';
+			appendFormatted(out, spec, str.c_str());
+			continue;
+		}
+
+		uint64_t raw;
+		memcpy(&raw, p, sizeof(raw));
+		p += sizeof(raw);
+		if (conv == 's') {
+			conv = tag == TAG_DOUBLE ? 'g' : (tag == TAG_UINT ? 'u' : 'd');
+		}
+
+		switch (conv) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+		case 'c':
+		{
+			long long value;
+			if (tag == TAG_DOUBLE) {
+				double d;
+				memcpy(&d, &raw, sizeof(d));
+				value = static_cast<long long>(d);
+			} else {
+				value = static_cast<long long>(raw);
+			}
+			if (conv == 'c') {
+				spec[n++] = 'c';
+				spec[n] = '\0';
+				appendFormatted(out, spec, static_cast<int>(value));
+			} else {
+				spec[n++] = 'l';
+				spec[n++] = 'l';
+				spec[n++] = conv;
+				spec[n] = '\0';
+				if (conv == 'd' || conv == 'i') {
+					appendFormatted(out, spec, value);
+				} else {
+					appendFormatted(out, spec,
+					                static_cast<unsigned long long>(value));
+				}
+			}
+			break;
+		}
+		case 'p':
+			spec[n++] = 'p';
+			spec[n] = '\0';
+			appendFormatted(out, spec, reinterpret_cast<void*>(
+			                static_cast<uintptr_t>(raw)));
+			break;
+		default: // Floating point conversions
+		{
+			double d;
+			if (tag == TAG_DOUBLE) {
+				memcpy(&d, &raw, sizeof(d));
+			} else if (tag == TAG_INT) {
+				d = static_cast<double>(static_cast<int64_t>(raw));
+			} else {
+				d = static_cast<double>(raw);
+			}
+			spec[n++] = strchr("eEfFgGaA", conv) ? conv : 'g';
+			spec[n] = '\0';
+			appendFormatted(out, spec, d);
+			break;
+		}
+		}
+	}
+}
+
+static void emit(int level, const std::string& text) {
+#ifdef __ANDROID__
+	static const int priorities[] = {
+		ANDROID_LOG_DEBUG, ANDROID_LOG_INFO, ANDROID_LOG_ERROR
+	};
+	__android_log_print(priorities[level], LOG_TAG, "%s", text.c_str());
+#else
+	static const char* prefixes[] = {"DEBUG: ", "INFO: ", "ERROR: "};
+	FILE* stream = level == LEVEL_ERROR ||
+		stderrOnly.load(std::memory_order_relaxed) ? stderr : stdout;
+	fputs(prefixes[level], stream);
+	fwrite(text.data(), 1, text.size(), stream);
+	fputc('\n', stream);
+#endif
+}
+
+class Backend {
+public:
+	Backend() : running(true), thread(&Backend::run, this) {
+	}
+
+	~Backend() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		wake.notify_one();
+		thread.join();
+		drain();
+		backendStopped.store(true, std::memory_order_release);
+	}
+
+	void add(Ring* ring) {
+		std::lock_guard<std::mutex> lock(mutex);
+		rings.push_back(ring);
+	}
+
+	void notify() {
+		wake.notify_one();
+	}
+
+	void flush() {
+		std::lock_guard<std::mutex> lock(mutex);
+		drainLocked();
+	}
+
+private:
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running) {
+			wake.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+			drainLocked();
+		}
+	}
+
+	void drain() {
+		std::lock_guard<std::mutex> lock(mutex);
+		drainLocked();
+	}
+
+	// Formats everything queued in all rings, orders it by time and writes
+	// it out in one batch. Closed rings are freed once empty.
+	void drainLocked() {
+		lines.clear();
+		for (auto it = rings.begin(); it != rings.end();) {
+			Ring* ring = *it;
+			bool closed = ring->closed.load(std::memory_order_acquire);
+			uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			uint64_t head = ring->head.load(std::memory_order_acquire);
+			while (tail < head) {
+				size_t pos = tail % LOG_RING_SIZE;
+				const RecordHeader* header =
+					reinterpret_cast<const RecordHeader*>(ring->data + pos);
+				if (header->size == 0) {
+					tail += LOG_RING_SIZE - pos;
+					continue;
+				}
+				lines.push_back(Line{header->timestamp, header->level,
+				                     std::string()});
+				formatRecord(header, lines.back().text);
+				tail += LOG_ALIGN(header->size);
+			}
+			ring->tail.store(tail, std::memory_order_release);
+			if (closed && tail == ring->head.load(std::memory_order_acquire)) {
+				delete ring;
+				it = rings.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (lines.empty()) {
+			return;
+		}
+		std::stable_sort(lines.begin(), lines.end(),
+			[](const Line& a, const Line& b) {
+				return a.timestamp < b.timestamp;
+			});
+		for (const auto& line : lines) {
+			emit(line.level, line.text);
+		}
+		fflush(stdout);
+		fflush(stderr);
+	}
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<Ring*> rings;
+	std::vector<Line> lines;
+	std::atomic<bool> running;
+	std::thread thread;
+};
+
+static Backend& backend() {
+	static Backend instance;
+	return instance;
+}
+
+// Hands the ring to the flush thread when the owning thread exits.
+struct RingOwner {
+	Ring* ring = nullptr;
+	~RingOwner() {
+		if (ring) {
+			ring->closed.store(true, std::memory_order_release);
+		}
+	}
+};
+
+static thread_local RingOwner ringOwner;
+static thread_local bool inSyncRecord = false;
+alignas(8) static thread_local char syncRecord[LOG_MAX_RECORD];
+
+char* reserve(size_t size) {
+	size = LOG_ALIGN(size);
+	if (size > LOG_MAX_RECORD || !asyncEnabled.load(std::memory_order_relaxed)
+		|| backendStopped.load(std::memory_order_acquire) || inSyncRecord) {
+		inSyncRecord = true;
+		return size > LOG_MAX_RECORD ? new char[size] : syncRecord;
+	}
+
+	Ring* ring = ringOwner.ring;
+	if (!ring) {
+		ring = new Ring();
+		ringOwner.ring = ring;
+		backend().add(ring);
+	}
+
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	size_t pos = head % LOG_RING_SIZE;
+	size_t contiguous = LOG_RING_SIZE - pos;
+	size_t need = size;
+	if (contiguous < size) {
+		need += contiguous; // The tail end is skipped with a wrap marker
+	}
+
+	// Lossless: wait for the flush thread if the ring is full
+	while (LOG_RING_SIZE - (head - ring->tail.load(std::memory_order_acquire))
+		< need) {
+		backend().notify();
+		std::this_thread::yield();
+	}
+
+	if (contiguous < size) {
+		reinterpret_cast<RecordHeader*>(ring->data + pos)->size = 0;
+		head += contiguous;
+		ring->head.store(head, std::memory_order_release);
+		pos = 0;
+	}
+	return ring->data + pos;
+}
+
+void commit(char* record) {
+	RecordHeader* header = reinterpret_cast<RecordHeader*>(record);
+	header->timestamp = nowNsec();
+
+	if (inSyncRecord) {
+		std::string text;
+		formatRecord(header, text);
+		emit(header->level, text);
+		if (header->level == LEVEL_ERROR) {
+			fflush(stderr);
+		}
+		if (record != syncRecord) {
+			delete[] record;
+		}
+		inSyncRecord = false;
+		return;
+	}
+
+	Ring* ring = ringOwner.ring;
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	head += LOG_ALIGN(header->size);
+	ring->head.store(head, std::memory_order_release);
+	// Nudge the flush thread once the ring is half full
+	if (head - ring->tail.load(std::memory_order_relaxed) > LOG_RING_SIZE / 2) {
+		backend().notify();
+	}
+}
+
+bool progressDue(std::atomic<int64_t>& last) {
+	int64_t now = static_cast<int64_t>(nowNsec() / 1000000);
+	int64_t prev = last.load(std::memory_order_relaxed);
+	if (prev && now - prev < progressIntervalMs.load(std::memory_order_relaxed)) {
+		return false;
+	}
+	return last.compare_exchange_strong(prev, now, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+void setLevel(Level level) {
+	detail::minLevel.store(level, std::memory_order_relaxed);
+}
+
+Level parseLevel(const char* name) {
+	static const char* names[] = {"debug", "info", "error", "off"};
+	for (int i = LEVEL_DEBUG; i <= LEVEL_OFF; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return static_cast<Level>(i);
+		}
+	}
+	return static_cast<Level>(LEVEL_OFF + 1);
+}
+
+void setAsync(bool async) {
+	if (!async) {
+		flush();
+	}
+	detail::asyncEnabled.store(async, std::memory_order_relaxed);
+}
+
+void setProgressInterval(unsigned ms) {
+	detail::progressIntervalMs.store(ms, std::memory_order_relaxed);
+}
+
+void setStderrOnly(bool only) {
+	detail::stderrOnly.store(only, std::memory_order_relaxed);
+}
+
+void flush() {
+	if (!detail::backendStopped.load(std::memory_order_acquire)) {
+		detail::backend().flush();
+	}
+}
+
+} // namespace Log
+} // namespace Dex
@@ -0,0 +1,324 @@
+#include "Metrics.h"
+#include "Logger.h"
+#include "utils.h"
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+namespace Dex {
+
+static const uint64_t latencyBoundsUsec[METRICS_LATENCY_BUCKETS - 1] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+static const char* syscallNames[static_cast<int>(Syscall::COUNT)] = {
+	"accept", "send", "recv", "open", "stat", "read", "write"
+};
+
+static const char* commandNames[static_cast<int>(Command::INVALID)] = {
+	"pull", "push", "list"
+};
+
+static void appendMetric(std::string& out, const char* name,
+    const char* labels, double value) {
+	char number[32];
+	snprintf(number, sizeof(number), " %.15g\n", value);
+	out.append(name);
+	out.append(labels);
+	out.append(number);
+}
+
+LatencyHistogram::LatencyHistogram() : count(0), sumUsec(0) {
+	for (auto& b : buckets) {
+		b.store(0, std::memory_order_relaxed);
+	}
+}
+
+void LatencyHistogram::observe(uint64_t usec) {
+	int i = 0;
+	while (i < METRICS_LATENCY_BUCKETS - 1 && usec > latencyBoundsUsec[i]) {
+		i++;
+	}
+	buckets[i].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sumUsec.fetch_add(usec, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::render(std::string& out, const char* name,
+    const char* labels) const {
+	char key[128];
+	char lbl[128];
+	uint64_t cumulative = 0;
+
+	snprintf(key, sizeof(key), "%s_bucket", name);
+	for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+		cumulative += buckets[i].load(std::memory_order_relaxed);
+		if (i < METRICS_LATENCY_BUCKETS - 1) {
+			snprintf(lbl, sizeof(lbl), "{%s,le=\"%g\"}", labels,
+			         latencyBoundsUsec[i] / 1e6);
+		} else {
+			snprintf(lbl, sizeof(lbl), "{%s,le=\"+Inf\"}", labels);
+		}
+		appendMetric(out, key, lbl, cumulative);
+	}
+	snprintf(lbl, sizeof(lbl), "{%s}", labels);
+	snprintf(key, sizeof(key), "%s_sum", name);
+	appendMetric(out, key, lbl, sumUsec.load(std::memory_order_relaxed) / 1e6);
+	snprintf(key, sizeof(key), "%s_count", name);
+	appendMetric(out, key, lbl, count.load(std::memory_order_relaxed));
+}
+
+CommandMetrics::CommandMetrics() : filesCompleted(0), filesFailed(0) {
+}
+
+Metrics::Metrics() : activeSessions(0), sessionsTotal(0), bytesIn(0),
+    bytesOut(0), fanOutDiskBytes(0), fanOutSharedBytes(0), fanOutDetached(0),
+    cacheHits(0), cacheMisses(0), cacheBytes(0), receiveSocketStallUsec(0),
+    receiveDiskStallUsec(0), storeAdded(0), storeLinked(0),
+    storeSavedBytes(0), localCopyBytes(0), multipathSubflows(0),
+    multipathReinjected(0) {
+	for (int i = 0; i < static_cast<int>(Syscall::COUNT); i++) {
+		syscalls[i].store(0, std::memory_order_relaxed);
+		errors[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void Metrics::fileDone(Command cmd, bool ok, uint64_t usec) {
+	if (cmd >= Command::INVALID) {
+		return;
+	}
+	CommandMetrics& m = commands[static_cast<int>(cmd)];
+	if (ok) {
+		m.filesCompleted.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		m.filesFailed.fetch_add(1, std::memory_order_relaxed);
+	}
+	m.fileLatency.observe(usec);
+}
+
+std::string Metrics::render() const {
+	std::string out;
+	char lbl[64];
+
+	out.append("# TYPE dexft_active_sessions gauge\n");
+	appendMetric(out, "dexft_active_sessions", "",
+	             activeSessions.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_sessions_total counter\n");
+	appendMetric(out, "dexft_sessions_total", "",
+	             sessionsTotal.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_bytes_total counter\n");
+	appendMetric(out, "dexft_bytes_total", "{direction=\"in\"}",
+	             bytesIn.load(std::memory_order_relaxed));
+	appendMetric(out, "dexft_bytes_total", "{direction=\"out\"}",
+	             bytesOut.load(std::memory_order_relaxed));
+
+	out.append("# TYPE dexft_fanout_bytes_total counter\n");
+	appendMetric(out, "dexft_fanout_bytes_total", "{source=\"disk\"}",
+	             fanOutDiskBytes.load(std::memory_order_relaxed));
+	appendMetric(out, "dexft_fanout_bytes_total", "{source=\"shared\"}",
+	             fanOutSharedBytes.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_fanout_detached_total counter\n");
+	appendMetric(out, "dexft_fanout_detached_total", "",
+	             fanOutDetached.load(std::memory_order_relaxed));
+
+	out.append("# TYPE dexft_cache_lookups_total counter\n");
+	appendMetric(out, "dexft_cache_lookups_total", "{result=\"hit\"}",
+	             cacheHits.load(std::memory_order_relaxed));
+	appendMetric(out, "dexft_cache_lookups_total", "{result=\"miss\"}",
+	             cacheMisses.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_cache_bytes gauge\n");
+	appendMetric(out, "dexft_cache_bytes", "",
+	             cacheBytes.load(std::memory_order_relaxed));
+
+	// side="socket" is recv waiting for the disk writer to free a buffer,
+	// side="disk" the writer waiting for data while a file is received
+	out.append("# TYPE dexft_receive_stall_seconds_total counter\n");
+	appendMetric(out, "dexft_receive_stall_seconds_total", "{side=\"socket\"}",
+	             receiveSocketStallUsec.load(std::memory_order_relaxed) / 1e6);
+	appendMetric(out, "dexft_receive_stall_seconds_total", "{side=\"disk\"}",
+	             receiveDiskStallUsec.load(std::memory_order_relaxed) / 1e6);
+
+	out.append("# TYPE dexft_store_files_total counter\n");
+	appendMetric(out, "dexft_store_files_total", "{result=\"added\"}",
+	             storeAdded.load(std::memory_order_relaxed));
+	appendMetric(out, "dexft_store_files_total", "{result=\"linked\"}",
+	             storeLinked.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_store_saved_bytes_total counter\n");
+	appendMetric(out, "dexft_store_saved_bytes_total", "",
+	             storeSavedBytes.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_local_copy_bytes_total counter\n");
+	appendMetric(out, "dexft_local_copy_bytes_total", "",
+	             localCopyBytes.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_multipath_subflows_total counter\n");
+	appendMetric(out, "dexft_multipath_subflows_total", "",
+	             multipathSubflows.load(std::memory_order_relaxed));
+	out.append("# TYPE dexft_multipath_reinjected_chunks_total counter\n");
+	appendMetric(out, "dexft_multipath_reinjected_chunks_total", "",
+	             multipathReinjected.load(std::memory_order_relaxed));
+
+	out.append("# TYPE dexft_files_total counter\n");
+	for (int i = 0; i < static_cast<int>(Command::INVALID); i++) {
+		snprintf(lbl, sizeof(lbl), "{command=\"%s\",result=\"ok\"}",
+		         commandNames[i]);
+		appendMetric(out, "dexft_files_total", lbl,
+		             commands[i].filesCompleted.load(std::memory_order_relaxed));
+		snprintf(lbl, sizeof(lbl), "{command=\"%s\",result=\"failed\"}",
+		         commandNames[i]);
+		appendMetric(out, "dexft_files_total", lbl,
+		             commands[i].filesFailed.load(std::memory_order_relaxed));
+	}
+
+	out.append("# TYPE dexft_file_latency_seconds histogram\n");
+	for (int i = 0; i < static_cast<int>(Command::INVALID); i++) {
+		snprintf(lbl, sizeof(lbl), "command=\"%s\"", commandNames[i]);
+		commands[i].fileLatency.render(out, "dexft_file_latency_seconds", lbl);
+	}
+
+	out.append("# TYPE dexft_syscalls_total counter\n");
+	for (int i = 0; i < static_cast<int>(Syscall::COUNT); i++) {
+		snprintf(lbl, sizeof(lbl), "{call=\"%s\"}", syscallNames[i]);
+		appendMetric(out, "dexft_syscalls_total", lbl,
+		             syscalls[i].load(std::memory_order_relaxed));
+	}
+	out.append("# TYPE dexft_errors_total counter\n");
+	for (int i = 0; i < static_cast<int>(Syscall::COUNT); i++) {
+		snprintf(lbl, sizeof(lbl), "{call=\"%s\"}", syscallNames[i]);
+		appendMetric(out, "dexft_errors_total", lbl,
+		             errors[i].load(std::memory_order_relaxed));
+	}
+
+	return out;
+}
+
+MetricsServer::MetricsServer() : metrics(nullptr), listenSocket(-1) {
+}
+
+MetricsServer::~MetricsServer() {
+	stop();
+}
+
+int MetricsServer::start(const Metrics* metrics, const std::string& address) {
+	this->metrics = metrics;
+
+	if (address.compare(0, 5, "unix:") == 0) {
+		struct sockaddr_un addr{};
+		unixPath = address.substr(5);
+		if (unixPath.empty() || unixPath.length() >= sizeof(addr.sun_path)) {
+			LOGE("Invalid metrics socket path: %s", unixPath.c_str());
+			return -1;
+		}
+		if ((listenSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			LOGE("Metrics socket creation failed: %s", strerror(errno));
+			return -1;
+		}
+		addr.sun_family = AF_UNIX;
+		memcpy(addr.sun_path, unixPath.c_str(), unixPath.length());
+		unlink(unixPath.c_str());
+		if (bind(listenSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			LOGE("Metrics bind failed: %s", strerror(errno));
+			close(listenSocket);
+			listenSocket = -1;
+			return -1;
+		}
+	} else {
+		struct sockaddr_in addr{};
+		int port = atoi(address.c_str());
+		if (port <= 0 || port > 65535) {
+			LOGE("Invalid metrics port: %s", address.c_str());
+			return -1;
+		}
+		if ((listenSocket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			LOGE("Metrics socket creation failed: %s", strerror(errno));
+			return -1;
+		}
+		int opt = 1;
+		setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local scrapes only
+		addr.sin_port = htons(port);
+		if (bind(listenSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			LOGE("Metrics bind failed: %s", strerror(errno));
+			close(listenSocket);
+			listenSocket = -1;
+			return -1;
+		}
+	}
+
+	if (listen(listenSocket, 4) < 0) {
+		LOGE("Metrics listen failed: %s", strerror(errno));
+		close(listenSocket);
+		listenSocket = -1;
+		return -1;
+	}
+
+	LOGI("Serving metrics on %s", address.c_str());
+	thread = std::thread(&MetricsServer::serve, this);
+	return 0;
+}
+
+void MetricsServer::stop() {
+	if (listenSocket != -1) {
+		// shutdown() wakes up the thread blocked in accept()
+		shutdown(listenSocket, SHUT_RDWR);
+		if (thread.joinable()) {
+			thread.join();
+		}
+		close(listenSocket);
+		listenSocket = -1;
+		if (!unixPath.empty()) {
+			unlink(unixPath.c_str());
+		}
+	}
+}
+
+void MetricsServer::serve() {
+	char request[1024];
+
+	while (true) {
+		int fd = accept(listenSocket, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOGD("Metrics server stopped: %s", strerror(errno));
+			return;
+		}
+
+		// Any request gets the metrics page; the request itself is ignored
+		// apart from draining its first read.
+		struct timeval tv = {1, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (recv(fd, request, sizeof(request), 0) < 0) {
+			close(fd);
+			continue;
+		}
+
+		std::string body = metrics->render();
+		char header[160];
+		int len = snprintf(header, sizeof(header),
+		                   "HTTP/1.0 200 OK\r\n"
+		                   "Content-Type: text/plain; version=0.0.4\r\n"
+		                   "Content-Length: %zu\r\n\r\n", body.length());
+		std::string reply(header, len);
+		reply.append(body);
+
+		size_t sent = 0;
+		while (sent < reply.length()) {
+			ssize_t n = send(fd, reply.c_str() + sent, reply.length() - sent,
+			                 MSG_NOSIGNAL);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+		close(fd);
+	}
+}
+
+} // namespace Dex
@@ -0,0 +1,770 @@
+#include "Multipath.h"
+#include "Logger.h"
+#include "Trace.h"
+#include "Tuning.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace Dex {
+
+#define MULTIPATH_INITIAL_RATE (1024.0 * 1024) // Bytes per second until measured
+#define MULTIPATH_RATE_INTERVAL_US 100000 // Throughput sample length
+#define MULTIPATH_POLL_MS 100
+
+enum class MultipathType : uint8_t {
+	DATA,
+	ACK,
+	DONE
+};
+
+// DATA is followed by length bytes of the file at offset, and answered with
+// an ACK of its seq on the subflow it came on. DATA also goes over the
+// control connection, unACKed, when no subflow is left. DONE, on the control
+// connection, is sent by the receiver when every chunk is written, or by
+// either side to abort the file.
+typedef struct MultipathPkt {
+	MultipathType type;
+	bool ok; // DONE
+	uint32_t fileId;
+	uint32_t length;
+	uint64_t seq; // Chunk number
+	uint64_t offset;
+} multipathPkt;
+
+static bool isLoopback(uint32_t address) {
+	return (ntohl(address) >> 24) == 127;
+}
+
+static std::string addressName(uint32_t address) {
+	char name[INET_ADDRSTRLEN] = "?";
+	struct in_addr addr;
+	addr.s_addr = address;
+	inet_ntop(AF_INET, &addr, name, sizeof(name));
+	return name;
+}
+
+// "local -> remote:port" of a connected socket
+static std::string pathName(int socket) {
+	struct sockaddr_in local{};
+	struct sockaddr_in remote{};
+	socklen_t localLen = sizeof(local);
+	socklen_t remoteLen = sizeof(remote);
+	if (getsockname(socket, (struct sockaddr*)&local, &localLen) != 0 ||
+	    getpeername(socket, (struct sockaddr*)&remote, &remoteLen) != 0) {
+		return "?";
+	}
+	return addressName(local.sin_addr.s_addr) + " -> " +
+	       addressName(remote.sin_addr.s_addr) + ":" +
+	       std::to_string(ntohs(remote.sin_port));
+}
+
+std::vector<uint32_t> getInterfaceAddresses(bool loopback) {
+	std::vector<uint32_t> addresses;
+	struct ifaddrs* ifaddr;
+	if (getifaddrs(&ifaddr) != 0) {
+		LOGE("Interface lookup failed: %s", strerror(errno));
+		return addresses;
+	}
+	for (struct ifaddrs* ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET ||
+		    (ifa->ifa_flags & (IFF_UP | IFF_RUNNING)) !=
+		    (IFF_UP | IFF_RUNNING) ||
+		    ((ifa->ifa_flags & IFF_LOOPBACK) != 0) != loopback) {
+			continue;
+		}
+		uint32_t address = reinterpret_cast<struct sockaddr_in*>(
+			ifa->ifa_addr)->sin_addr.s_addr;
+		if (std::find(addresses.begin(), addresses.end(), address) ==
+		    addresses.end()) {
+			addresses.push_back(address);
+		}
+	}
+	freeifaddrs(ifaddr);
+	return addresses;
+}
+
+uint64_t newMultipathToken() {
+	std::random_device rd;
+	uint64_t token = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+	return token ? token : 1;
+}
+
+// Connects from local to remote:port within MULTIPATH_CONNECT_MS
+static int connectPath(uint32_t local, uint32_t remote, uint16_t port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct sockaddr_in localAddr{};
+	localAddr.sin_family = AF_INET;
+	localAddr.sin_addr.s_addr = local;
+	struct sockaddr_in remoteAddr{};
+	remoteAddr.sin_family = AF_INET;
+	remoteAddr.sin_addr.s_addr = remote;
+	remoteAddr.sin_port = htons(port);
+	int flags = fcntl(fd, F_GETFL);
+	if (bind(fd, (struct sockaddr*)&localAddr, sizeof(localAddr)) != 0 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		close(fd);
+		return -1;
+	}
+	int error = 0;
+	if (connect(fd, (struct sockaddr*)&remoteAddr, sizeof(remoteAddr)) != 0) {
+		struct pollfd pfd = {fd, POLLOUT, 0};
+		socklen_t errorLen = sizeof(error);
+		if (errno != EINPROGRESS) {
+			error = errno;
+		} else if (poll(&pfd, 1, MULTIPATH_CONNECT_MS) != 1) {
+			error = ETIMEDOUT;
+		} else {
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+		}
+	}
+	if (error || fcntl(fd, F_SETFL, flags) != 0) {
+		LOGD("Subflow %s -> %s failed: %s", addressName(local).c_str(),
+		     addressName(remote).c_str(), strerror(error));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Reads length bytes at offset
+static int readChunk(int fd, char* buffer, size_t length, uint64_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t n = pread(fd, buffer + done, length - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			LOGE("Error reading file: %s",
+			     n < 0 ? strerror(errno) : "file is shorter");
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int sendAll(int socket, const void* data, size_t length) {
+	const char* bytes = static_cast<const char*>(data);
+	while (length > 0) {
+		ssize_t n = send(socket, bytes, length, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		bytes += n;
+		length -= n;
+	}
+	return 0;
+}
+
+MultipathChannel::MultipathChannel(int controlSocket) :
+    controlSocket(controlSocket), fileId(0), stats{} {
+}
+
+MultipathChannel::~MultipathChannel() {
+	for (auto& path : paths) {
+		if (path.socket != -1) {
+			close(path.socket);
+		}
+	}
+	for (int socket : joining) {
+		close(socket);
+	}
+}
+
+uint64_t MultipathChannel::chunkCount(const std::vector<ExtentPkt>& extents) {
+	uint64_t chunks = 0;
+	for (const auto& extent : extents) {
+		chunks += (extent.length + MULTIPATH_CHUNK_SIZE - 1) /
+		          MULTIPATH_CHUNK_SIZE;
+	}
+	return chunks;
+}
+
+int MultipathChannel::join(const InitPkt& initPkt, const InitReplyPkt& reply,
+    int port) {
+	InitPkt joinPkt{};
+	joinPkt.command = initPkt.command;
+	joinPkt.sessionId = initPkt.sessionId;
+	joinPkt.joinToken = reply.multipathToken;
+	unsigned count = std::min<unsigned>(reply.pathCount, MAX_PATH_ADDRESSES);
+	for (unsigned r = 0; r < count; r++) {
+		uint32_t remote = reply.pathAddresses[r];
+		uint16_t remotePort = reply.pathPorts[r] ? reply.pathPorts[r] : port;
+		for (uint32_t local : getInterfaceAddresses(isLoopback(remote))) {
+			if (paths.size() >= MULTIPATH_MAX_PATHS) {
+				return paths.size();
+			}
+			int fd = connectPath(local, remote, remotePort);
+			if (fd < 0) {
+				continue;
+			}
+			// A server that does not answer is not waited for
+			struct timeval timeout = {MULTIPATH_CONNECT_MS / 1000,
+			                          (MULTIPATH_CONNECT_MS % 1000) * 1000};
+			struct timeval none = {0, 0};
+			InitReplyPkt joinReply{};
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			if (sendAll(fd, &joinPkt, sizeof(joinPkt)) != 0 ||
+			    recv(fd, &joinReply, sizeof(joinReply), MSG_WAITALL) !=
+			    sizeof(joinReply) || !joinReply.proceed) {
+				LOGD("Subflow %s was not joined", pathName(fd).c_str());
+				close(fd);
+				continue;
+			}
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+			setNoDelay(fd);
+			Path path;
+			path.socket = fd;
+			path.name = pathName(fd);
+			LOGI("Subflow %s joined", path.name.c_str());
+			paths.push_back(std::move(path));
+		}
+	}
+	return paths.size();
+}
+
+bool MultipathChannel::addPath(int socket) {
+	std::lock_guard<std::mutex> lock(joiningMutex);
+	size_t count = joining.size();
+	for (const auto& path : paths) {
+		count += !path.failed;
+	}
+	if (count >= MULTIPATH_MAX_PATHS) {
+		return false;
+	}
+	setNoDelay(socket);
+	joining.push_back(socket);
+	return true;
+}
+
+// Takes the subflows that joined since the last file
+void MultipathChannel::adopt() {
+	std::lock_guard<std::mutex> lock(joiningMutex);
+	for (int socket : joining) {
+		Path path;
+		path.socket = socket;
+		path.name = pathName(socket);
+		LOGD("Subflow %s joined", path.name.c_str());
+		paths.push_back(std::move(path));
+	}
+	joining.clear();
+}
+
+size_t MultipathChannel::pathCount() {
+	std::lock_guard<std::mutex> lock(joiningMutex);
+	size_t count = joining.size();
+	for (const auto& path : paths) {
+		count += !path.failed;
+	}
+	return count;
+}
+
+std::vector<PathStats> MultipathChannel::getPathStats() {
+	std::vector<PathStats> result;
+	for (const auto& path : paths) {
+		result.push_back({path.name, path.bytes, path.rate, path.failed});
+	}
+	return result;
+}
+
+// Closes the subflow. Its unACKed chunks go to the front of queue, unless
+// queue is null.
+void MultipathChannel::failPath(Path& path, std::deque<uint64_t>* queue) {
+	if (queue && !path.inflight.empty()) {
+		LOGE("Subflow %s failed, reinjecting %zu chunks", path.name.c_str(),
+		     path.inflight.size());
+		queue->insert(queue->begin(), path.inflight.begin(),
+		              path.inflight.end());
+		stats.reinjected += path.inflight.size();
+	} else if (queue) {
+		LOGE("Subflow %s failed", path.name.c_str());
+	}
+	shutdown(path.socket, SHUT_RDWR);
+	close(path.socket);
+	path.socket = -1;
+	path.failed = true;
+	path.inflight.clear();
+	path.inflightBytes = 0;
+	path.done = 0;
+	path.total = 0;
+}
+
+int MultipathChannel::sendDone(bool ok) {
+	MultipathPkt donePkt{};
+	donePkt.type = MultipathType::DONE;
+	donePkt.fileId = fileId;
+	donePkt.ok = ok;
+	if (sendAll(controlSocket, &donePkt, sizeof(donePkt)) != 0) {
+		LOGE("Send multipath done failed: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int MultipathChannel::receiveDone(bool* ok) {
+	MultipathPkt donePkt{};
+	if (recv(controlSocket, &donePkt, sizeof(donePkt), MSG_WAITALL) !=
+	    sizeof(donePkt)) {
+		LOGE("Connection lost during multipath transfer");
+		return -1;
+	}
+	if (donePkt.type != MultipathType::DONE || donePkt.fileId != fileId) {
+		LOGE("Unexpected multipath packet for file %u, expected done of %u",
+		     donePkt.fileId, fileId);
+		return -1;
+	}
+	*ok = donePkt.ok;
+	return 0;
+}
+
+int MultipathChannel::sendFile(int fd, const std::vector<ExtentPkt>& extents,
+    ProgressReporter& progress) {
+	adopt();
+	fileId++;
+	stats = MultipathStats{};
+
+	std::vector<ExtentPkt> chunks;
+	uint64_t totalBytes = 0;
+	for (const auto& extent : extents) {
+		for (uint64_t done = 0; done < extent.length;
+		     done += MULTIPATH_CHUNK_SIZE) {
+			chunks.push_back({extent.offset + done, std::min<uint64_t>(
+				MULTIPATH_CHUNK_SIZE, extent.length - done)});
+		}
+		totalBytes += extent.length;
+	}
+	std::deque<uint64_t> queue; // Chunks not on any subflow
+	for (uint64_t seq = 0; seq < chunks.size(); seq++) {
+		queue.push_back(seq);
+	}
+	uint64_t ackedBytes = 0;
+	uint64_t now = Trace::nowUsec();
+
+	// Puts a chunk behind its header in the subflow's buffer
+	auto start = [&](Path& path, uint64_t seq) -> int {
+		const ExtentPkt& chunk = chunks[seq];
+		MultipathPkt dataPkt{};
+		dataPkt.type = MultipathType::DATA;
+		dataPkt.fileId = fileId;
+		dataPkt.length = static_cast<uint32_t>(chunk.length);
+		dataPkt.seq = seq;
+		dataPkt.offset = chunk.offset;
+		path.buffer.resize(sizeof(dataPkt) + MULTIPATH_CHUNK_SIZE);
+		memcpy(path.buffer.data(), &dataPkt, sizeof(dataPkt));
+		if (readChunk(fd, path.buffer.data() + sizeof(dataPkt), chunk.length,
+		              chunk.offset) != 0) {
+			return -1;
+		}
+		if (path.inflight.empty()) {
+			path.lastProgressUsec = now;
+			path.sampleStartUsec = now;
+			path.sampleBytes = 0;
+		}
+		path.inflight.push_back(seq);
+		path.inflightBytes += chunk.length;
+		path.done = 0;
+		path.total = sizeof(dataPkt) + chunk.length;
+		return 0;
+	};
+
+	// Writes as much of the buffered chunk as the subflow takes
+	auto write = [&](Path& path) -> int {
+		while (path.done < path.total) {
+			ssize_t n = send(path.socket, path.buffer.data() + path.done,
+			                 path.total - path.done, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			if (n <= 0) {
+				return -1;
+			}
+			path.done += n;
+			path.lastProgressUsec = now;
+			stats.wireBytes += n;
+		}
+		path.done = 0;
+		path.total = 0;
+		return 0;
+	};
+
+	// Takes ACKed chunks off the subflow and samples its throughput
+	auto readAcks = [&](Path& path) -> int {
+		MultipathPkt ackPkt;
+		path.ack.resize(sizeof(ackPkt));
+		while (true) {
+			ssize_t n = recv(path.socket, path.ack.data() + path.ackDone,
+			                 sizeof(ackPkt) - path.ackDone, MSG_DONTWAIT);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			if (n <= 0) {
+				return -1;
+			}
+			path.ackDone += n;
+			if (path.ackDone < sizeof(ackPkt)) {
+				continue;
+			}
+			path.ackDone = 0;
+			memcpy(&ackPkt, path.ack.data(), sizeof(ackPkt));
+			if (ackPkt.type != MultipathType::ACK || ackPkt.fileId != fileId) {
+				continue; // Late ACKs of a previous file
+			}
+			auto it = std::find(path.inflight.begin(), path.inflight.end(),
+			                    ackPkt.seq);
+			if (it == path.inflight.end()) {
+				continue;
+			}
+			uint64_t length = chunks[ackPkt.seq].length;
+			path.inflight.erase(it);
+			path.inflightBytes -= length;
+			path.bytes += length;
+			path.lastProgressUsec = now;
+			ackedBytes += length;
+			stats.chunks++;
+			progress.addBytes(length);
+
+			path.sampleBytes += length;
+			uint64_t elapsed = now - path.sampleStartUsec;
+			if (elapsed >= MULTIPATH_RATE_INTERVAL_US) {
+				double sample = path.sampleBytes * 1e6 / elapsed;
+				path.rate = path.rate > 0 ? 0.75 * path.rate + 0.25 * sample :
+				            sample;
+				path.sampleStartUsec = now;
+				path.sampleBytes = 0;
+			}
+		}
+	};
+
+	bool failed = false;
+	bool lost = false; // The control connection
+	bool finished = false;
+	bool ok = false;
+	std::vector<char> controlBuffer;
+	std::vector<struct pollfd> fds;
+	std::vector<Path*> polled;
+	while (!finished && !failed) {
+		now = Trace::nowUsec();
+
+		// Each chunk goes to the subflow that would deliver it soonest at
+		// its measured rate, behind what it has in flight. When that one
+		// has no room in its window the chunk waits for it rather than go
+		// to a slower subflow, which would hold up the end of the file.
+		while (!queue.empty()) {
+			uint64_t length = chunks[queue.front()].length;
+			Path* best = nullptr;
+			double bestTime = 0;
+			bool bestFull = false;
+			for (auto& path : paths) {
+				if (path.failed) {
+					continue;
+				}
+				double rate = path.rate > 0 ? path.rate : MULTIPATH_INITIAL_RATE;
+				uint64_t window = std::max<uint64_t>(
+					MULTIPATH_MIN_WINDOW * MULTIPATH_CHUNK_SIZE,
+					static_cast<uint64_t>(rate * MULTIPATH_WINDOW_MS / 1000));
+				bool full = path.total ||
+					path.inflightBytes + length > window;
+				double time = (path.inflightBytes + length) / rate;
+				if (!best || time < bestTime ||
+				    (time == bestTime && bestFull && !full)) {
+					best = &path;
+					bestTime = time;
+					bestFull = full;
+				}
+			}
+			if (!best || bestFull) {
+				break;
+			}
+			if (start(*best, queue.front()) != 0) {
+				failed = true;
+				break;
+			}
+			queue.pop_front();
+			if (write(*best) != 0) {
+				failPath(*best, &queue);
+			}
+		}
+		if (failed) {
+			break;
+		}
+
+		// Without subflows the rest goes over the control connection
+		bool alive = std::any_of(paths.begin(), paths.end(),
+		                         [](const Path& path) { return !path.failed; });
+		if (!alive && !queue.empty()) {
+			LOGI("No subflows left, sending over the control connection");
+			controlBuffer.resize(MULTIPATH_CHUNK_SIZE);
+			for (; !queue.empty() && !failed; queue.pop_front()) {
+				const ExtentPkt& chunk = chunks[queue.front()];
+				MultipathPkt dataPkt{};
+				dataPkt.type = MultipathType::DATA;
+				dataPkt.fileId = fileId;
+				dataPkt.length = static_cast<uint32_t>(chunk.length);
+				dataPkt.seq = queue.front();
+				dataPkt.offset = chunk.offset;
+				if (readChunk(fd, controlBuffer.data(), chunk.length,
+				              chunk.offset) != 0) {
+					failed = true;
+				} else if (sendAll(controlSocket, &dataPkt, sizeof(dataPkt))
+				           != 0 || sendAll(controlSocket, controlBuffer.data(),
+				           chunk.length) != 0) {
+					LOGE("Send data failed: %s", strerror(errno));
+					failed = true;
+					lost = true;
+				} else {
+					ackedBytes += chunk.length;
+					stats.chunks++;
+					stats.wireBytes += sizeof(dataPkt) + chunk.length;
+					progress.addBytes(chunk.length);
+				}
+			}
+			continue;
+		}
+
+		fds.assign(1, {controlSocket, POLLIN, 0});
+		polled.clear();
+		for (auto& path : paths) {
+			if (!path.failed) {
+				short events = POLLIN | (path.total ? POLLOUT : 0);
+				fds.push_back({path.socket, events, 0});
+				polled.push_back(&path);
+			}
+		}
+		int ret = poll(fds.data(), fds.size(), MULTIPATH_POLL_MS);
+		if (ret < 0 && errno != EINTR) {
+			LOGE("Multipath poll failed: %s", strerror(errno));
+			failed = true;
+			break;
+		}
+		now = Trace::nowUsec();
+		if (ret > 0 && fds[0].revents) {
+			// The receiver has every chunk, or gave up
+			if (receiveDone(&ok) != 0) {
+				failed = true;
+				lost = true;
+			}
+			finished = true;
+			break;
+		}
+		for (size_t i = 0; i < polled.size(); i++) {
+			Path& path = *polled[i];
+			short revents = ret > 0 ? fds[i + 1].revents : 0;
+			if ((revents & (POLLIN | POLLHUP | POLLERR)) &&
+			    readAcks(path) != 0) {
+				failPath(path, &queue);
+			} else if ((revents & POLLOUT) && write(path) != 0) {
+				failPath(path, &queue);
+			} else if ((path.total || !path.inflight.empty()) &&
+			           now - path.lastProgressUsec >
+			           MULTIPATH_PATH_TIMEOUT_MS * 1000ULL) {
+				LOGE("Subflow %s stalled", path.name.c_str());
+				failPath(path, &queue);
+			}
+		}
+	}
+
+	// A chunk left half written would put its subflow out of step with the
+	// receiver
+	for (auto& path : paths) {
+		if (!path.failed && path.total) {
+			LOGD("Closing subflow %s with a chunk half written",
+			     path.name.c_str());
+			failPath(path, nullptr);
+		}
+		path.inflight.clear();
+		path.inflightBytes = 0;
+	}
+	if (failed && !lost) {
+		sendDone(false);
+	}
+	if (finished && ok) {
+		// ACKs still on their way
+		progress.addBytes(totalBytes - ackedBytes);
+		stats.chunks = chunks.size();
+	}
+	LOGD("Multipath sent %llu chunks, %llu reinjected",
+	     static_cast<unsigned long long>(stats.chunks),
+	     static_cast<unsigned long long>(stats.reinjected));
+	return finished && ok && !failed ? 0 : -1;
+}
+
+int MultipathChannel::receiveFile(FILE* file, uint64_t size, uint64_t chunks,
+    ProgressReporter& progress, DurabilityTracker& durability) {
+	adopt();
+	fileId++;
+	stats = MultipathStats{};
+	int fd = fileno(file);
+	if (fflush(file) != 0) {
+		LOGE("Error writing file: %s", strerror(errno));
+		sendDone(false);
+		return -1;
+	}
+	std::vector<bool> received(chunks, false);
+	uint64_t count = 0;
+	bool failed = false;
+	uint64_t now = Trace::nowUsec();
+	uint64_t lastDataUsec = now;
+
+	auto valid = [&](const MultipathPkt& dataPkt) {
+		return dataPkt.type == MultipathType::DATA &&
+		       dataPkt.length <= MULTIPATH_CHUNK_SIZE && dataPkt.offset <= size &&
+		       dataPkt.length <= size - dataPkt.offset;
+	};
+
+	// Writes a chunk where it belongs, once
+	auto accept = [&](const MultipathPkt& dataPkt, const char* payload) -> int {
+		lastDataUsec = now;
+		if (dataPkt.seq >= chunks || received[dataPkt.seq]) {
+			return 0;
+		}
+		if (pwrite(fd, payload, dataPkt.length, dataPkt.offset) !=
+		    static_cast<ssize_t>(dataPkt.length)) {
+			LOGE("Error writing file: %s", strerror(errno));
+			return -1;
+		}
+		received[dataPkt.seq] = true;
+		count++;
+		stats.chunks++;
+		progress.addBytes(dataPkt.length);
+		durability.written(file, dataPkt.length);
+		return 0;
+	};
+
+	// Reads the chunks waiting on a subflow and ACKs them
+	auto readPath = [&](Path& path) -> int {
+		MultipathPkt dataPkt;
+		path.buffer.resize(sizeof(dataPkt) + MULTIPATH_CHUNK_SIZE);
+		while (count < chunks && !failed) {
+			size_t want = sizeof(dataPkt);
+			if (path.done >= sizeof(dataPkt)) {
+				memcpy(&dataPkt, path.buffer.data(), sizeof(dataPkt));
+				if (!valid(dataPkt)) {
+					LOGE("Invalid multipath packet on %s", path.name.c_str());
+					return -1;
+				}
+				want += dataPkt.length;
+			}
+			if (path.done < want) {
+				ssize_t n = recv(path.socket, path.buffer.data() + path.done,
+				                 want - path.done, MSG_DONTWAIT);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					return 0;
+				}
+				if (n <= 0) {
+					return -1;
+				}
+				path.done += n;
+				stats.wireBytes += n;
+				lastDataUsec = now;
+				continue;
+			}
+			path.done = 0;
+			if (dataPkt.fileId != fileId) {
+				continue; // A chunk of a previous file
+			}
+			if (accept(dataPkt, path.buffer.data() + sizeof(dataPkt)) != 0) {
+				failed = true;
+				return 0;
+			}
+			path.bytes += dataPkt.length;
+			MultipathPkt ackPkt{};
+			ackPkt.type = MultipathType::ACK;
+			ackPkt.fileId = fileId;
+			ackPkt.length = dataPkt.length;
+			ackPkt.seq = dataPkt.seq;
+			if (sendAll(path.socket, &ackPkt, sizeof(ackPkt)) != 0) {
+				return -1;
+			}
+		}
+		return 0;
+	};
+
+	std::vector<char> controlBuffer;
+	std::vector<struct pollfd> fds;
+	std::vector<Path*> polled;
+	while (count < chunks && !failed) {
+		fds.assign(1, {controlSocket, POLLIN, 0});
+		polled.clear();
+		for (auto& path : paths) {
+			if (!path.failed) {
+				fds.push_back({path.socket, POLLIN, 0});
+				polled.push_back(&path);
+			}
+		}
+		int ret = poll(fds.data(), fds.size(), MULTIPATH_POLL_MS);
+		if (ret < 0 && errno != EINTR) {
+			LOGE("Multipath poll failed: %s", strerror(errno));
+			failed = true;
+			break;
+		}
+		now = Trace::nowUsec();
+		if (ret > 0 && fds[0].revents) {
+			// Chunks no subflow could carry, or the sender gave up
+			MultipathPkt dataPkt;
+			if (recv(controlSocket, &dataPkt, sizeof(dataPkt), MSG_WAITALL) !=
+			    sizeof(dataPkt)) {
+				LOGE("Connection lost during multipath transfer");
+				return -1;
+			}
+			if (dataPkt.type == MultipathType::DONE) {
+				LOGE("Multipath sender aborted the file");
+				return -1;
+			}
+			controlBuffer.resize(MULTIPATH_CHUNK_SIZE);
+			if (!valid(dataPkt) || dataPkt.fileId != fileId ||
+			    recv(controlSocket, controlBuffer.data(), dataPkt.length,
+			         MSG_WAITALL) != static_cast<ssize_t>(dataPkt.length)) {
+				LOGE("Connection lost during multipath transfer");
+				return -1;
+			}
+			stats.wireBytes += sizeof(dataPkt) + dataPkt.length;
+			failed = accept(dataPkt, controlBuffer.data()) != 0;
+		}
+		for (size_t i = 0; i < polled.size() && ret > 0; i++) {
+			if (fds[i + 1].revents && readPath(*polled[i]) != 0) {
+				LOGE("Subflow %s failed", polled[i]->name.c_str());
+				failPath(*polled[i], nullptr);
+			}
+		}
+		if (now - lastDataUsec > MULTIPATH_TIMEOUT_MS * 1000ULL) {
+			LOGE("Multipath sender not responding");
+			failed = true;
+		}
+	}
+
+	LOGD("Multipath received %llu chunks",
+	     static_cast<unsigned long long>(stats.chunks));
+	if (sendDone(!failed) != 0) {
+		return -1;
+	}
+	return failed ? -1 : 0;
+}
+
+} // namespace Dex
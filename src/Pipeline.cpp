@@ -0,0 +1,180 @@
+#include "Pipeline.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+
+namespace Dex {
+
+static uint64_t nowUsec() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sleeps until ready() holds. The flag and the indices are sequentially
+// consistent, so the other side either sees waiting set after it moved its
+// index, or this side sees the index moved before going to sleep.
+template <typename Ready>
+static void sleepUntil(std::mutex& mutex, std::condition_variable& changed,
+    std::atomic<bool>& waiting, Ready ready) {
+	std::unique_lock<std::mutex> lock(mutex);
+	waiting.store(true);
+	while (!ready()) {
+		changed.wait(lock);
+	}
+	waiting.store(false);
+}
+
+static void wake(std::mutex& mutex, std::condition_variable& changed,
+    const std::atomic<bool>& waiting) {
+	if (waiting.load()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		changed.notify_all();
+	}
+}
+
+ReceivePipeline::ReceivePipeline() :
+    memory(new char[PIPELINE_SLOTS * PIPELINE_SLOT_BYTES]), produced(0),
+    consumed(0), socketWaiting(false), diskWaiting(false), failed(false),
+    error(0), diskStallUsec(0), writeUsec(0), writes(0) {
+	for (size_t i = 0; i < PIPELINE_SLOTS; i++) {
+		slots[i] = Slot{memory.get() + i * PIPELINE_SLOT_BYTES, 0, false, 0};
+	}
+}
+
+ReceivePipeline::~ReceivePipeline() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+void ReceivePipeline::begin(FILE* file, DurabilityTracker* tracker) {
+	// The writer is idle: finish() saw every slot written
+	this->file = file;
+	this->tracker = tracker;
+	fileStartUsec = nowUsec();
+	failed.store(false, std::memory_order_relaxed);
+	current = nullptr;
+	seekPending = false;
+	socketStallUsec = 0;
+	if (!thread.joinable()) {
+		thread = std::thread(&ReceivePipeline::run, this);
+	}
+}
+
+void ReceivePipeline::seek(uint64_t offset) {
+	if (current && current->length) {
+		publish();
+	}
+	if (current) {
+		current->seek = true;
+		current->offset = offset;
+	} else {
+		seekPending = true;
+		seekOffset = offset;
+	}
+}
+
+char* ReceivePipeline::reserve(size_t* room) {
+	if (failed.load(std::memory_order_relaxed)) {
+		return nullptr;
+	}
+	if (!current) {
+		size_t index = produced.load(std::memory_order_relaxed);
+		if (index - consumed.load() == PIPELINE_SLOTS) {
+			uint64_t start = nowUsec();
+			sleepUntil(mutex, changed, socketWaiting, [this, index] {
+				return index - consumed.load() < PIPELINE_SLOTS;
+			});
+			socketStallUsec += nowUsec() - start;
+		}
+		current = &slots[index % PIPELINE_SLOTS];
+		current->length = 0;
+		current->seek = seekPending;
+		current->offset = seekOffset;
+		seekPending = false;
+	}
+	*room = PIPELINE_SLOT_BYTES - current->length;
+	return current->data + current->length;
+}
+
+void ReceivePipeline::commit(size_t bytes) {
+	current->length += bytes;
+	if (current->length == PIPELINE_SLOT_BYTES) {
+		publish();
+	}
+}
+
+void ReceivePipeline::publish() {
+	current = nullptr;
+	produced.fetch_add(1);
+	wake(mutex, changed, diskWaiting);
+}
+
+int ReceivePipeline::finish(PipelineStats* stats) {
+	if (current && (current->length || current->seek)) {
+		publish();
+	}
+	current = nullptr;
+	size_t index = produced.load(std::memory_order_relaxed);
+	if (consumed.load() != index) {
+		uint64_t start = nowUsec();
+		sleepUntil(mutex, changed, socketWaiting, [this, index] {
+			return consumed.load() == index;
+		});
+		socketStallUsec += nowUsec() - start;
+	}
+	stats->socketStallUsec = socketStallUsec;
+	stats->diskStallUsec = diskStallUsec.exchange(0);
+	stats->writeUsec = writeUsec.exchange(0);
+	stats->writes = writes.exchange(0);
+	if (failed.load()) {
+		errno = error.load();
+		return -1;
+	}
+	return 0;
+}
+
+void ReceivePipeline::run() {
+	size_t index = 0;
+	while (true) {
+		if (produced.load() == index) {
+			uint64_t start = nowUsec();
+			sleepUntil(mutex, changed, diskWaiting, [this, index] {
+				return stopping || produced.load() != index;
+			});
+			if (produced.load() == index) {
+				return;
+			}
+			// Waiting between files is not a stall
+			uint64_t now = nowUsec();
+			uint64_t from = std::max(start, fileStartUsec);
+			if (now > from) {
+				diskStallUsec.fetch_add(now - from, std::memory_order_relaxed);
+			}
+		}
+
+		// After a failure the rest is dropped so the reader never blocks
+		Slot& slot = slots[index % PIPELINE_SLOTS];
+		if (!failed.load(std::memory_order_relaxed)) {
+			uint64_t start = nowUsec();
+			if ((slot.seek && fseeko(file, slot.offset, SEEK_SET) != 0) ||
+			    fwrite(slot.data, 1, slot.length, file) != slot.length) {
+				error.store(errno);
+				failed.store(true);
+			} else if (tracker && slot.length) {
+				tracker->written(file, slot.length);
+			}
+			writeUsec.fetch_add(nowUsec() - start, std::memory_order_relaxed);
+			writes.fetch_add(1, std::memory_order_relaxed);
+		}
+		consumed.store(++index);
+		wake(mutex, changed, socketWaiting);
+	}
+}
+
+} // namespace Dex
@@ -0,0 +1,125 @@
+#include "Prefetch.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Dex {
+
+// Starts reading the beginning of the file into the page cache
+static void adviseWillNeed(int fd, off_t size) {
+	off_t length = size < PREFETCH_BYTES ? size : PREFETCH_BYTES;
+#ifdef __APPLE__
+	struct radvisory advice;
+	advice.ra_offset = 0;
+	advice.ra_count = static_cast<int>(length);
+	fcntl(fd, F_RDADVISE, &advice);
+#else
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+Prefetcher::Prefetcher(int dirFd, const std::vector<FileEntry>& files,
+    Metrics& metrics) : dirFd(dirFd), files(files), metrics(metrics) {
+	if (files.size() > 1) {
+		thread = std::thread(&Prefetcher::run, this);
+	}
+}
+
+Prefetcher::~Prefetcher() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	if (thread.joinable()) {
+		thread.join();
+	}
+	for (const auto& entry : ready) {
+		close(entry.second.fd);
+	}
+}
+
+int Prefetcher::open(size_t index, struct stat* st) {
+	const FileEntry& entry = files[index];
+	metrics.addSyscalls(Syscall::OPEN, 1);
+	int fd = openat(dirFd, entry.name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (entry.hasStat) {
+		*st = entry.st;
+		return fd;
+	}
+	metrics.addSyscalls(Syscall::STAT, 1);
+	if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int Prefetcher::take(size_t index, struct stat* st) {
+	std::unique_lock<std::mutex> lock(mutex);
+	// Wait for a file that is already being opened rather than opening it
+	// a second time
+	while (opening && next == index) {
+		changed.wait(lock);
+	}
+	taken = index + 1;
+	if (next <= index) {
+		next = index + 1;
+	}
+	int fd = -1;
+	for (auto it = ready.begin(); it != ready.end() && it->first <= index;) {
+		if (it->first == index) {
+			fd = it->second.fd;
+			*st = it->second.st;
+		} else {
+			close(it->second.fd);
+		}
+		it = ready.erase(it);
+	}
+	changed.notify_all();
+	lock.unlock();
+	return fd >= 0 ? fd : open(index, st);
+}
+
+void Prefetcher::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		changed.wait(lock, [this] {
+			return stopping || (next < files.size() &&
+			                    next < taken + PREFETCH_FILES);
+		});
+		if (stopping) {
+			return;
+		}
+
+		size_t index = next;
+		opening = true;
+		lock.unlock();
+		struct stat st;
+		int fd = open(index, &st);
+		if (fd >= 0) {
+			adviseWillNeed(fd, st.st_size);
+		} else {
+			// sendFile opens it again and reports the error
+			LOGD("Prefetch of %s failed", files[index].name.c_str());
+		}
+		lock.lock();
+		opening = false;
+		next = std::max(next, index + 1);
+		if (fd >= 0 && index >= taken) {
+			ready[index] = Opened{fd, st};
+		} else if (fd >= 0) {
+			close(fd); // Taken while it was being opened
+		}
+		changed.notify_all();
+	}
+}
+
+} // namespace Dex
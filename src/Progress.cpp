@@ -0,0 +1,63 @@
+#include "Progress.h"
+#include <chrono>
+
+namespace Dex {
+
+static uint64_t nowUsec() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ProgressReporter::ProgressReporter(ProgressCallback callback, void* ctx,
+    unsigned intervalMs, uint64_t sessionId, Command cmd) : callback(callback),
+    ctx(ctx), intervalUsec(static_cast<uint64_t>(intervalMs) * 1000),
+    startUsec(nowUsec()), lastUsec(startUsec), lastBytes(0), progress{} {
+	progress.sessionId = sessionId;
+	progress.command = cmd;
+}
+
+void ProgressReporter::fileDone(bool ok) {
+	if (ok) {
+		progress.files++;
+	} else {
+		progress.failedFiles++;
+	}
+	if (callback) {
+		report(false);
+	}
+}
+
+void ProgressReporter::finish() {
+	progress.currentFile = nullptr;
+	progress.done = true;
+	if (callback) {
+		report(true);
+	}
+}
+
+TransferResult ProgressReporter::result(TransferStatus status) const {
+	TransferResult r{};
+	r.status = status;
+	r.files = progress.files;
+	r.failedFiles = progress.failedFiles;
+	r.bytes = progress.bytes;
+	r.elapsedUsec = nowUsec() - startUsec;
+	return r;
+}
+
+void ProgressReporter::report(bool force) {
+	uint64_t now = nowUsec();
+	if (!force && now - lastUsec < intervalUsec) {
+		return;
+	}
+	// The final report gives the average rate of the whole transfer
+	uint64_t interval = progress.done ? now - startUsec : now - lastUsec;
+	uint64_t bytes = progress.done ? progress.bytes : progress.bytes - lastBytes;
+	progress.bytesPerSec = interval ? bytes * 1e6 / interval : 0;
+	progress.elapsedUsec = now - startUsec;
+	lastUsec = now;
+	lastBytes = progress.bytes;
+	callback(progress, ctx);
+}
+
+} // namespace Dex
@@ -0,0 +1,236 @@
+#include "Sha256.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA256_X86
+#endif
+
+namespace Dex {
+
+#define HASH_READ_SIZE (256 * 1024)
+
+static const uint32_t roundConstants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256() {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(state, initial, sizeof(state));
+}
+
+static void compressPortable(uint32_t state[8], const uint8_t* block,
+    size_t blocks) {
+	for (; blocks > 0; block += 64, blocks--) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			w[i] = static_cast<uint32_t>(block[i * 4]) << 24 |
+			       static_cast<uint32_t>(block[i * 4 + 1]) << 16 |
+			       static_cast<uint32_t>(block[i * 4 + 2]) << 8 |
+			       static_cast<uint32_t>(block[i * 4 + 3]);
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^
+			              (w[i - 15] >> 3);
+			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^
+			              (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+			uint32_t ch = (e & f) ^ (~e & g);
+			uint32_t t1 = h + s1 + ch + roundConstants[i] + w[i];
+			uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+			uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			uint32_t t2 = s0 + maj;
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#ifdef SHA256_X86
+// The SHA extensions do two rounds per instruction on state kept as ABEF
+// and CDGH
+__attribute__((target("sha,sse4.1")))
+static void compressShaNi(uint32_t state[8], const uint8_t* block,
+    size_t blocks) {
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                        0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; blocks > 0; block += 64, blocks--) {
+		__m128i abef = state0;
+		__m128i cdgh = state1;
+		__m128i w[16];
+		for (int i = 0; i < 16; i++) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(block + i * 16)), byteSwap);
+			} else {
+				tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[i - 4], w[i - 3]),
+				                    _mm_alignr_epi8(w[i - 1], w[i - 2], 4));
+				w[i] = _mm_sha256msg2_epu32(tmp, w[i - 1]);
+			}
+			__m128i message = _mm_add_epi32(w[i], _mm_loadu_si128(
+				reinterpret_cast<const __m128i*>(&roundConstants[i * 4])));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			state0 = _mm_sha256rnds2_epu32(state0, state1,
+			                               _mm_shuffle_epi32(message, 0x0E));
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]),
+	                 _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]),
+	                 _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+typedef void (*CompressFunction)(uint32_t state[8], const uint8_t* block,
+                                 size_t blocks);
+
+static CompressFunction selectCompress() {
+#ifdef SHA256_X86
+	if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+		return compressShaNi;
+	}
+#endif
+	return compressPortable;
+}
+
+void Sha256::compress(const uint8_t* block, size_t blocks) {
+	static const CompressFunction function = selectCompress();
+	function(state, block, blocks);
+}
+
+void Sha256::update(const void* data, size_t length) {
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	total += length;
+	if (used) {
+		size_t n = std::min(length, sizeof(buffer) - used);
+		memcpy(buffer + used, p, n);
+		used += n;
+		p += n;
+		length -= n;
+		if (used < sizeof(buffer)) {
+			return;
+		}
+		compress(buffer, 1);
+		used = 0;
+	}
+	size_t blocks = length / sizeof(buffer);
+	if (blocks) {
+		compress(p, blocks);
+		p += blocks * sizeof(buffer);
+		length -= blocks * sizeof(buffer);
+	}
+	memcpy(buffer, p, length);
+	used = length;
+}
+
+void Sha256::updateZeros(uint64_t length) {
+	static const uint8_t zeros[4096] = {0};
+	while (length > 0) {
+		size_t n = std::min<uint64_t>(sizeof(zeros), length);
+		update(zeros, n);
+		length -= n;
+	}
+}
+
+void Sha256::final(uint8_t digest[SHA256_SIZE]) {
+	uint64_t bits = total * 8;
+	static const uint8_t padding[64] = {0x80};
+	update(padding, used < 56 ? 56 - used : 120 - used);
+	uint8_t length[8];
+	for (int i = 0; i < 8; i++) {
+		length[i] = static_cast<uint8_t>(bits >> (56 - i * 8));
+	}
+	update(length, sizeof(length));
+	for (int i = 0; i < 8; i++) {
+		digest[i * 4] = static_cast<uint8_t>(state[i] >> 24);
+		digest[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+		digest[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+		digest[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+	}
+}
+
+int hashFile(int fd, uint8_t digest[SHA256_SIZE]) {
+	std::unique_ptr<char[]> buffer(new char[HASH_READ_SIZE]);
+	Sha256 hasher;
+	off_t offset = 0;
+	while (true) {
+		ssize_t n = pread(fd, buffer.get(), HASH_READ_SIZE, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		hasher.update(buffer.get(), n);
+		offset += n;
+	}
+	hasher.final(digest);
+	return 0;
+}
+
+std::string hexDigest(const uint8_t digest[SHA256_SIZE]) {
+	static const char hex[] = "0123456789abcdef";
+	std::string out(SHA256_SIZE * 2, '0');
+	for (int i = 0; i < SHA256_SIZE; i++) {
+		out[i * 2] = hex[digest[i] >> 4];
+		out[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	return out;
+}
+
+} // namespace Dex
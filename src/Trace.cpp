@@ -0,0 +1,241 @@
+#include "Trace.h"
+#include "Logger.h"
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+namespace Dex {
+namespace Trace {
+
+struct Event {
+	const char* name;
+	uint64_t ts;
+	uint64_t dur;
+	const char* argNames[TRACE_MAX_ARGS];
+	uint64_t args[TRACE_MAX_ARGS];
+	char detail[TRACE_DETAIL_SIZE];
+};
+
+struct Ring {
+	uint64_t sessionId = 0;
+	const char* role = nullptr;
+	uint64_t head = 0; // Total events recorded in this session
+	Event events[TRACE_RING_SIZE];
+};
+
+static std::atomic<bool> traceEnabled(false);
+static std::string traceDirectory;
+
+// Only non-null while a session is being traced on this thread. The ring is
+// allocated on first use and reused by later sessions of the same thread.
+static thread_local Ring* activeRing = nullptr;
+static thread_local Ring* threadRing = nullptr;
+
+struct RingDeleter {
+	~RingDeleter() { delete threadRing; }
+};
+static thread_local RingDeleter ringDeleter;
+
+void enable(const char* directory) {
+	traceDirectory = directory;
+	traceEnabled.store(true, std::memory_order_release);
+}
+
+bool enabled() {
+	return traceEnabled.load(std::memory_order_acquire);
+}
+
+bool active() {
+	return activeRing != nullptr;
+}
+
+uint64_t newSessionId() {
+	std::random_device rd;
+	uint64_t id = (static_cast<uint64_t>(rd()) << 32) ^ rd() ^ nowUsec();
+	return id ? id : 1;
+}
+
+uint64_t nowUsec() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void beginSession(uint64_t sessionId, const char* role) {
+	if (!enabled()) {
+		return;
+	}
+	if (!threadRing) {
+		threadRing = new Ring();
+		(void)ringDeleter;
+	}
+	threadRing->sessionId = sessionId;
+	threadRing->role = role;
+	threadRing->head = 0;
+	activeRing = threadRing;
+}
+
+static void recordEvent(const char* name, uint64_t startUsec,
+    uint64_t durUsec, const char* detail, const char* const* argNames,
+    const uint64_t* args) {
+	Ring* ring = activeRing;
+	if (!ring) {
+		return;
+	}
+	Event& e = ring->events[ring->head % TRACE_RING_SIZE];
+	e.name = name;
+	e.ts = startUsec;
+	e.dur = durUsec;
+	for (int i = 0; i < TRACE_MAX_ARGS; i++) {
+		e.argNames[i] = argNames[i];
+		e.args[i] = args[i];
+	}
+	if (detail) {
+		strncpy(e.detail, detail, TRACE_DETAIL_SIZE - 1);
+		e.detail[TRACE_DETAIL_SIZE - 1] = '\0';
+	} else {
+		e.detail[0] = '\0';
+	}
+	ring->head++;
+}
+
+void record(const char* name, uint64_t startUsec, uint64_t durUsec,
+    const char* detail, const char* argName, uint64_t arg) {
+	const char* argNames[TRACE_MAX_ARGS] = {argName};
+	const uint64_t args[TRACE_MAX_ARGS] = {arg};
+	recordEvent(name, startUsec, durUsec, detail, argNames, args);
+}
+
+uint64_t lap(const char* name, uint64_t startUsec, uint64_t* totalUsec,
+    const char* detail, uint64_t bytes) {
+	uint64_t now = nowUsec();
+	uint64_t dur = now - startUsec;
+	*totalUsec += dur;
+	if (dur >= TRACE_SLOW_USEC) {
+		record(name, startUsec, dur, detail, "bytes", bytes);
+	}
+	return now;
+}
+
+static void writeJsonString(FILE* out, const char* str) {
+	fputc('"', out);
+	for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			fputc('\\', out);
+			fputc(*p, out);
+		} else if (*p < 0x20) {
+			fprintf(out, "\\u%04x", *p);
+		} else {
+			fputc(*p, out);
+		}
+	}
+	fputc('"', out);
+}
+
+void endSession() {
+	Ring* ring = activeRing;
+	if (!ring) {
+		return;
+	}
+	activeRing = nullptr;
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/dexft-%016llx-%s.json",
+	         traceDirectory.c_str(),
+	         static_cast<unsigned long long>(ring->sessionId), ring->role);
+	FILE* out = fopen(path, "w");
+	if (!out) {
+		LOGE("Error opening trace file %s: %s", path, strerror(errno));
+		return;
+	}
+
+	uint64_t count = ring->head < TRACE_RING_SIZE ? ring->head :
+	                 TRACE_RING_SIZE;
+	uint64_t first = ring->head - count;
+	long pid = static_cast<long>(getpid());
+	long tid = static_cast<long>(std::hash<std::thread::id>()(
+	           std::this_thread::get_id()) & 0x7fffffff);
+
+	fprintf(out, "{\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,"
+	        "\"args\":{\"name\":\"dexft %s\"}}", pid, ring->role);
+	for (uint64_t i = first; i < ring->head; i++) {
+		const Event& e = ring->events[i % TRACE_RING_SIZE];
+		fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"dexft\",\"ph\":\"X\","
+		        "\"ts\":%llu,\"dur\":%llu,\"pid\":%ld,\"tid\":%ld,\"args\":{"
+		        "\"session\":\"%016llx\"", e.name,
+		        static_cast<unsigned long long>(e.ts),
+		        static_cast<unsigned long long>(e.dur), pid, tid,
+		        static_cast<unsigned long long>(ring->sessionId));
+		if (e.detail[0]) {
+			fprintf(out, ",\"detail\":");
+			writeJsonString(out, e.detail);
+		}
+		for (int a = 0; a < TRACE_MAX_ARGS; a++) {
+			if (e.argNames[a]) {
+				fprintf(out, ",\"%s\":%llu", e.argNames[a],
+				        static_cast<unsigned long long>(e.args[a]));
+			}
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{"
+	        "\"session\":\"%016llx\",\"role\":\"%s\",\"dropped\":%llu}}\n",
+	        static_cast<unsigned long long>(ring->sessionId), ring->role,
+	        static_cast<unsigned long long>(ring->head - count));
+	fclose(out);
+	LOGI("Trace written to %s", path);
+}
+
+Session::Session(uint64_t sessionId, const char* role) : startUsec(0) {
+	beginSession(sessionId, role);
+	if (activeRing) {
+		startUsec = nowUsec();
+	}
+}
+
+Session::~Session() {
+	if (activeRing) {
+		record("session", startUsec, nowUsec() - startUsec);
+		endSession();
+	}
+}
+
+Span::Span(const char* name, const char* detail) : name(name), detail{},
+    startUsec(0), argNames{}, args{} {
+	if (activeRing) {
+		setDetail(detail);
+		startUsec = nowUsec();
+	}
+}
+
+Span::~Span() {
+	end();
+}
+
+void Span::end() {
+	if (activeRing && startUsec) {
+		recordEvent(name, startUsec, nowUsec() - startUsec, detail, argNames,
+		            args);
+	}
+	startUsec = 0;
+}
+
+void Span::setDetail(const char* detail) {
+	if (activeRing && detail) {
+		strncpy(this->detail, detail, TRACE_DETAIL_SIZE - 1);
+	}
+}
+
+void Span::setArg(int i, const char* argName, uint64_t value) {
+	argNames[i] = argName;
+	args[i] = value;
+}
+
+} // namespace Trace
+} // namespace Dex
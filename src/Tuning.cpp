@@ -0,0 +1,159 @@
+#include "Tuning.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace Dex {
+
+static uint64_t nowUsec() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void setNoDelay(int socket) {
+	int on = 1;
+	if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+		LOGE("Error setting TCP_NODELAY: %s", strerror(errno));
+	}
+}
+
+// Smoothed round-trip time in microseconds, 0 if the platform does not
+// report it. A receiver mostly sends ACKs, so it prefers its own estimate
+// from the incoming data.
+static uint64_t roundTripUsec(int socket, bool sending) {
+#if defined(__linux__)
+	struct tcp_info info;
+	socklen_t length = sizeof(info);
+	if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+		if (!sending && info.tcpi_rcv_rtt) {
+			return info.tcpi_rcv_rtt;
+		}
+		return info.tcpi_rtt;
+	}
+#elif defined(__APPLE__)
+	(void)sending;
+	struct tcp_connection_info info;
+	socklen_t length = sizeof(info);
+	if (getsockopt(socket, IPPROTO_TCP, TCP_CONNECTION_INFO, &info,
+		&length) == 0) {
+		return info.tcpi_srtt * 1000ULL;
+	}
+#else
+	(void)socket;
+	(void)sending;
+#endif
+	return 0;
+}
+
+#ifdef __linux__
+static uint64_t readLimit(const char* path) {
+	unsigned long long value = UINT64_MAX;
+	FILE* file = fopen(path, "r");
+	if (file) {
+		if (fscanf(file, "%llu", &value) != 1) {
+			value = UINT64_MAX;
+		}
+		fclose(file);
+	}
+	return value;
+}
+#endif
+
+// Largest buffer an unprivileged process may set
+static uint64_t bufferLimit(int option) {
+#ifdef __linux__
+	static const uint64_t sendLimit =
+		readLimit("/proc/sys/net/core/wmem_max");
+	static const uint64_t receiveLimit =
+		readLimit("/proc/sys/net/core/rmem_max");
+	return option == SO_SNDBUF ? sendLimit : receiveLimit;
+#else
+	(void)option;
+	return UINT64_MAX;
+#endif
+}
+
+// Linux reports twice the size that was set, the rest is its bookkeeping
+static uint64_t usableBytes(int reported) {
+#ifdef __linux__
+	return reported / 2;
+#else
+	return reported;
+#endif
+}
+
+AutoTuner::AutoTuner(int socket, bool sending) : socket(socket),
+    sending(sending), data(TUNE_MIN_CHUNK) {
+	socklen_t length = sizeof(socketBuffer);
+	getsockopt(socket, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF,
+	           &socketBuffer, &length);
+}
+
+void AutoTuner::begin() {
+	windowStartUsec = nowUsec();
+	windowBytes = 0;
+}
+
+void AutoTuner::moved(size_t bytes) {
+	windowBytes += bytes;
+	uint64_t now = nowUsec();
+	uint64_t elapsed = now - windowStartUsec;
+	if (probed ? elapsed >= TUNE_INTERVAL_MS * 1000ULL :
+	    windowBytes >= TUNE_PROBE_BYTES && elapsed >= TUNE_PROBE_MS * 1000ULL) {
+		adjust(elapsed);
+		probed = true;
+		windowStartUsec = now;
+		windowBytes = 0;
+	}
+}
+
+void AutoTuner::adjust(uint64_t elapsedUsec) {
+	uint64_t rate = windowBytes * 1000000 / elapsedUsec; // Bytes per second
+	uint64_t rtt = roundTripUsec(socket, sending);
+
+	size_t target = rate * TUNE_CHUNK_USEC / 1000000;
+	size_t newChunk = TUNE_MIN_CHUNK;
+	while (newChunk < TUNE_MAX_CHUNK && newChunk * 2 <= target) {
+		newChunk *= 2;
+	}
+
+	// The kernel may have grown the buffer by itself since the last look.
+	// Setting it stops that, so it is only set when the kernel allows more.
+	int option = sending ? SO_SNDBUF : SO_RCVBUF;
+	uint64_t want = std::min<uint64_t>({rate * rtt / 1000000 * 2,
+	                                    TUNE_MAX_SOCKET_BUFFER,
+	                                    bufferLimit(option)});
+	socklen_t length = sizeof(socketBuffer);
+	getsockopt(socket, SOL_SOCKET, option, &socketBuffer, &length);
+	int before = socketBuffer;
+	if (want > usableBytes(socketBuffer)) {
+		int size = static_cast<int>(want);
+		if (setsockopt(socket, SOL_SOCKET, option, &size, sizeof(size)) != 0 ||
+		    getsockopt(socket, SOL_SOCKET, option, &socketBuffer,
+		               &length) != 0) {
+			LOGE("Error setting socket buffer: %s", strerror(errno));
+		}
+	}
+	bool raised = socketBuffer > before; // The kernel caps it
+
+	if (newChunk == chunk && !raised) {
+		return;
+	}
+	if (newChunk > data.size()) {
+		data.resize(newChunk);
+	}
+	chunk = newChunk;
+	LOGI("Tuned %s for %.1f MB/s, rtt %.2f ms: chunk %zu KiB, %s buffer "
+	     "%d KiB, %d chunks in flight", sending ? "sending" : "receiving",
+	     rate / 1e6, rtt / 1e3, chunk / 1024, sending ? "send" : "receive",
+	     socketBuffer / 1024,
+	     std::max(1, socketBuffer / static_cast<int>(chunk)));
+}
+
+} // namespace Dex
@@ -0,0 +1,748 @@
+#include "UdpTransport.h"
+#include "Logger.h"
+#include "Trace.h"
+#include "utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+namespace Dex {
+
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)
+#define UDP_INITIAL_RATE (4.0 * 1024 * 1024) // Bytes per second
+#define UDP_MIN_RATE (64.0 * 1024)
+#define UDP_BURST 32 // Packets sent back to back at most
+#define UDP_STARTUP_GAIN 2.885 // Doubles the delivery rate every round trip
+#define UDP_MASK (UDP_WINDOW - 1)
+
+enum class UdpType : uint8_t {
+	DATA,
+	PARITY,
+	ACK
+};
+
+// Followed by the payload; parity payloads are always UDP_PAYLOAD_SIZE bytes
+typedef struct UdpDataPkt {
+	UdpType type;
+	uint16_t length; // DATA: payload bytes; PARITY: XOR of the group's lengths
+	uint32_t fileId;
+	uint64_t seq; // DATA: packet number; PARITY: group number
+	uint64_t offset; // DATA: file offset; PARITY: XOR of the group's offsets
+	uint64_t sentUsec; // Sender clock, echoed by ACKs
+} udpDataPkt;
+
+// Followed by sackBytes of bitmap; bit i is set when packet cumulative + i
+// has arrived
+typedef struct UdpAckPkt {
+	UdpType type;
+	uint16_t sackBytes;
+	uint32_t fileId;
+	uint64_t cumulative; // All packets below this have arrived
+	uint64_t received; // Distinct packets received, rebuilt ones included
+	uint64_t echoUsec; // Latest sentUsec seen
+	uint64_t ackDelayUsec; // Since the packet carrying echoUsec arrived
+} udpAckPkt;
+
+// Sent over TCP by the receiver when the file is complete, or by either
+// side to abort it
+typedef struct UdpDonePkt {
+	uint32_t fileId;
+	bool ok;
+} udpDonePkt;
+
+enum class PacketState : uint8_t {
+	NONE,
+	INFLIGHT,
+	LOST, // Waiting to be resent
+	ACKED
+};
+
+int parseImpairment(const char* str, UdpImpairment* impairment) {
+	char* end;
+	double loss = strtod(str, &end);
+	if (end == str || *end != '%' || loss < 0 || loss > 100) {
+		return -1;
+	}
+	end++;
+	unsigned long delayMs = 0;
+	if (*end == ',') {
+		const char* delay = end + 1;
+		delayMs = strtoul(delay, &end, 10);
+		if (end == delay || strcmp(end, "ms") != 0) {
+			return -1;
+		}
+	} else if (*end != '\0') {
+		return -1;
+	}
+	impairment->loss = loss / 100;
+	impairment->delayMs = static_cast<unsigned>(delayMs);
+	return 0;
+}
+
+UdpChannel::UdpChannel(bool fec, const UdpImpairment& impairment) :
+    udpSocket(-1), controlSocket(-1), fec(fec), impairment(impairment),
+    random(std::random_device{}()), fileId(0), stats{} {
+	pacing.rate = UDP_INITIAL_RATE;
+}
+
+UdpChannel::~UdpChannel() {
+	if (udpSocket != -1) {
+		close(udpSocket);
+	}
+}
+
+uint64_t UdpChannel::packetCount(const std::vector<ExtentPkt>& extents) {
+	uint64_t packets = 0;
+	for (const auto& extent : extents) {
+		packets += (extent.length + UDP_PAYLOAD_SIZE - 1) / UDP_PAYLOAD_SIZE;
+	}
+	return packets;
+}
+
+int UdpChannel::open(int controlSocket) {
+	struct sockaddr_in addr{};
+	socklen_t addrLen = sizeof(addr);
+	this->controlSocket = controlSocket;
+	if (getsockname(controlSocket, (struct sockaddr*)&addr, &addrLen) != 0) {
+		LOGE("UDP address lookup failed: %s", strerror(errno));
+		return -1;
+	}
+	addr.sin_port = 0;
+
+	if ((udpSocket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		LOGE("UDP socket creation failed: %s", strerror(errno));
+		return -1;
+	}
+	// The kernel caps these at net.core.[rw]mem_max
+	int size = UDP_SOCKET_BUFFER;
+	setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(udpSocket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if (bind(udpSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+	    getsockname(udpSocket, (struct sockaddr*)&addr, &addrLen) != 0) {
+		LOGE("UDP bind failed: %s", strerror(errno));
+		return -1;
+	}
+	return ntohs(addr.sin_port);
+}
+
+int UdpChannel::connect(int port) {
+	struct sockaddr_in peer{};
+	socklen_t peerLen = sizeof(peer);
+	if (getpeername(controlSocket, (struct sockaddr*)&peer, &peerLen) != 0) {
+		LOGE("UDP peer lookup failed: %s", strerror(errno));
+		return -1;
+	}
+	peer.sin_port = htons(port);
+	if (::connect(udpSocket, (struct sockaddr*)&peer, sizeof(peer)) != 0) {
+		LOGE("UDP connect failed: %s", strerror(errno));
+		return -1;
+	}
+	LOGD("UDP transport to port %d", port);
+	return 0;
+}
+
+void UdpChannel::transmit(const void* data, size_t length) {
+	stats.wireBytes += length;
+	if (impairment.loss > 0 &&
+	    std::uniform_real_distribution<double>(0, 1)(random) < impairment.loss) {
+		return;
+	}
+	if (impairment.delayMs) {
+		const char* bytes = static_cast<const char*>(data);
+		delayed.push_back({Trace::nowUsec() + impairment.delayMs * 1000ULL,
+		                   std::vector<char>(bytes, bytes + length)});
+		return;
+	}
+	// Errors, such as a full buffer, are handled like loss
+	send(udpSocket, data, length, MSG_NOSIGNAL);
+}
+
+void UdpChannel::flushDelayed(uint64_t now) {
+	while (!delayed.empty() && delayed.front().dueUsec <= now) {
+		send(udpSocket, delayed.front().data.data(),
+		     delayed.front().data.size(), MSG_NOSIGNAL);
+		delayed.pop_front();
+	}
+}
+
+uint64_t UdpChannel::nextDelayedUsec() const {
+	return delayed.empty() ? UINT64_MAX : delayed.front().dueUsec;
+}
+
+// Waits until a datagram or control message arrives or untilUsec passes
+int UdpChannel::wait(uint64_t untilUsec, bool* controlReady) {
+	struct pollfd fds[2] = {{udpSocket, POLLIN, 0}, {controlSocket, POLLIN, 0}};
+	uint64_t now = Trace::nowUsec();
+	uint64_t timeout = untilUsec > now ? untilUsec - now : 0;
+#ifdef __linux__
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000000;
+	ts.tv_nsec = (timeout % 1000000) * 1000;
+	int ret = ppoll(fds, 2, &ts, nullptr);
+#else
+	int ret = poll(fds, 2, static_cast<int>((timeout + 999) / 1000));
+#endif
+	if (ret < 0 && errno != EINTR) {
+		LOGE("UDP poll failed: %s", strerror(errno));
+		return -1;
+	}
+	*controlReady = ret > 0 && fds[1].revents != 0;
+	return 0;
+}
+
+int UdpChannel::sendDone(bool ok) {
+	UdpDonePkt donePkt{};
+	donePkt.fileId = fileId;
+	donePkt.ok = ok;
+	if (send(controlSocket, &donePkt, sizeof(donePkt), MSG_NOSIGNAL) !=
+	    sizeof(donePkt)) {
+		LOGE("Send UDP done failed: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int UdpChannel::receiveDone(bool* ok) {
+	UdpDonePkt donePkt{};
+	if (recv(controlSocket, &donePkt, sizeof(donePkt), MSG_WAITALL) !=
+	    sizeof(donePkt)) {
+		LOGE("Connection lost during UDP transfer");
+		return -1;
+	}
+	if (donePkt.fileId != fileId) {
+		LOGE("UDP done for file %u, expected %u", donePkt.fileId, fileId);
+		return -1;
+	}
+	*ok = donePkt.ok;
+	return 0;
+}
+
+int UdpChannel::sendFile(int fd, const std::vector<ExtentPkt>& extents,
+    ProgressReporter& progress) {
+	static const double probeGains[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+	fileId++;
+	stats = UdpStats{};
+	uint64_t packets = packetCount(extents);
+
+	// First packet number of every extent, to map packets to file offsets
+	std::vector<uint64_t> firstSeq;
+	uint64_t seqs = 0;
+	for (const auto& extent : extents) {
+		firstSeq.push_back(seqs);
+		seqs += (extent.length + UDP_PAYLOAD_SIZE - 1) / UDP_PAYLOAD_SIZE;
+	}
+
+	std::vector<PacketState> state(UDP_WINDOW, PacketState::NONE);
+	std::vector<uint64_t> sentAt(UDP_WINDOW, 0);
+	std::deque<uint64_t> lost; // Waiting to be resent, oldest first
+	std::deque<uint64_t> resent; // Resent and in flight, by send time
+	char packet[sizeof(UdpDataPkt) + UDP_PAYLOAD_SIZE];
+	char ackBuffer[sizeof(UdpAckPkt) + UDP_WINDOW / 8];
+	char parity[sizeof(UdpDataPkt) + UDP_PAYLOAD_SIZE];
+	UdpDataPkt parityPkt{};
+	bool parityPending = false;
+
+	uint64_t base = 0; // Lowest packet not yet ACKed
+	uint64_t nextSeq = 0; // Next packet sent for the first time
+	uint64_t scanSeq = 0; // Loss detection has passed the packets below
+	uint64_t inflight = 0;
+	uint64_t delivered = 0;
+	uint64_t highestEcho = 0;
+
+	// Rate control follows the measured delivery rate: start by doubling it
+	// every round trip until it stops growing, then pace at its recent
+	// maximum and probe 25% above it once every eight round trips. Random
+	// loss does not slow the sender down, which is what keeps it fast on
+	// lossy links where TCP backs off. What was learned carries over to the
+	// next file.
+	double& rate = pacing.rate;
+	double* bwSamples = pacing.bwSamples;
+	double& maxBw = pacing.maxBw;
+	unsigned& bwIndex = pacing.bwIndex;
+	unsigned& cycle = pacing.cycle;
+	uint64_t& minRtt = pacing.minRtt;
+	uint64_t& srtt = pacing.srtt;
+	uint64_t& rttVar = pacing.rttVar;
+	bool startup = !pacing.probed;
+	double startupBw = 0;
+	unsigned plateau = 0;
+	uint64_t now = Trace::nowUsec();
+	uint64_t sampleStart = now;
+	uint64_t sampleDelivered = 0;
+	uint64_t nextSendUsec = now;
+	uint64_t lastAckUsec = now;
+
+	// Reads and sends one data packet; returns its size or -1
+	auto sendData = [&](uint64_t seq) -> ssize_t {
+		size_t i = std::upper_bound(firstSeq.begin(), firstSeq.end(), seq) -
+		           firstSeq.begin() - 1;
+		UdpDataPkt dataPkt{};
+		dataPkt.type = UdpType::DATA;
+		dataPkt.fileId = fileId;
+		dataPkt.seq = seq;
+		dataPkt.offset = extents[i].offset +
+		                 (seq - firstSeq[i]) * UDP_PAYLOAD_SIZE;
+		dataPkt.length = static_cast<uint16_t>(std::min<uint64_t>(
+			UDP_PAYLOAD_SIZE, extents[i].offset + extents[i].length -
+			dataPkt.offset));
+		dataPkt.sentUsec = now;
+		char* payload = packet + sizeof(dataPkt);
+		if (pread(fd, payload, dataPkt.length, dataPkt.offset) !=
+		    dataPkt.length) {
+			LOGE("Error reading file: %s", strerror(errno));
+			return -1;
+		}
+		memcpy(packet, &dataPkt, sizeof(dataPkt));
+		transmit(packet, sizeof(dataPkt) + dataPkt.length);
+		sentAt[seq & UDP_MASK] = now;
+
+		// Parity covers the first transmission of every packet in a group
+		if (fec && seq == nextSeq) {
+			if (seq % UDP_FEC_GROUP == 0) {
+				memset(parity, 0, sizeof(parity));
+				parityPkt = UdpDataPkt{};
+				parityPkt.type = UdpType::PARITY;
+				parityPkt.fileId = fileId;
+				parityPkt.seq = seq / UDP_FEC_GROUP;
+			}
+			char* parityPayload = parity + sizeof(parityPkt);
+			for (uint16_t b = 0; b < dataPkt.length; b++) {
+				parityPayload[b] ^= payload[b];
+			}
+			parityPkt.offset ^= dataPkt.offset;
+			parityPkt.length ^= dataPkt.length;
+			parityPending = seq % UDP_FEC_GROUP == UDP_FEC_GROUP - 1 ||
+			                seq == packets - 1;
+		}
+		return sizeof(dataPkt) + dataPkt.length;
+	};
+
+	bool ok = false;
+	bool done = false;
+	bool failed = false;
+	while (!done && !failed) {
+		now = Trace::nowUsec();
+		flushDelayed(now);
+
+		// Process ACKs
+		ssize_t n;
+		while ((n = recv(udpSocket, ackBuffer, sizeof(ackBuffer),
+		                 MSG_DONTWAIT)) >= static_cast<ssize_t>(sizeof(UdpAckPkt))) {
+			UdpAckPkt ackPkt;
+			memcpy(&ackPkt, ackBuffer, sizeof(ackPkt));
+			if (ackPkt.type != UdpType::ACK || ackPkt.fileId != fileId ||
+			    sizeof(ackPkt) + ackPkt.sackBytes > static_cast<size_t>(n)) {
+				continue;
+			}
+			lastAckUsec = now;
+			if (ackPkt.echoUsec && now > ackPkt.echoUsec + ackPkt.ackDelayUsec) {
+				uint64_t rtt = now - ackPkt.echoUsec - ackPkt.ackDelayUsec;
+				minRtt = std::min(minRtt, rtt);
+				if (srtt == 0) {
+					srtt = rtt;
+					rttVar = rtt / 2;
+				} else {
+					uint64_t diff = rtt > srtt ? rtt - srtt : srtt - rtt;
+					rttVar = (3 * rttVar + diff) / 4;
+					srtt = (7 * srtt + rtt) / 8;
+				}
+			}
+			highestEcho = std::max(highestEcho, ackPkt.echoUsec);
+			delivered = std::max(delivered, ackPkt.received);
+
+			auto markAcked = [&](uint64_t seq) {
+				if (seq < base || seq >= nextSeq) {
+					return;
+				}
+				PacketState& s = state[seq & UDP_MASK];
+				if (s == PacketState::INFLIGHT) {
+					inflight--;
+				}
+				s = PacketState::ACKED;
+			};
+			for (uint64_t seq = base;
+			     seq < std::min(ackPkt.cumulative, nextSeq); seq++) {
+				markAcked(seq);
+			}
+			const uint8_t* sack = reinterpret_cast<const uint8_t*>(ackBuffer +
+				sizeof(ackPkt));
+			for (unsigned byte = 0; byte < ackPkt.sackBytes; byte++) {
+				for (unsigned bit = 0; sack[byte] && bit < 8; bit++) {
+					if (sack[byte] & (1 << bit)) {
+						markAcked(ackPkt.cumulative + byte * 8 + bit);
+					}
+				}
+			}
+			while (base < nextSeq && state[base & UDP_MASK] ==
+			       PacketState::ACKED) {
+				state[base & UDP_MASK] = PacketState::NONE;
+				base++;
+			}
+			scanSeq = std::max(scanSeq, base);
+		}
+
+		// Take a delivery rate sample once per round trip
+		uint64_t interval = std::max<uint64_t>(
+			minRtt == UINT64_MAX ? 0 : minRtt, UDP_ACK_INTERVAL_US);
+		if (now - sampleStart >= interval) {
+			double bw = (delivered - sampleDelivered) * UDP_PAYLOAD_SIZE *
+			            1e6 / (now - sampleStart);
+			sampleStart = now;
+			sampleDelivered = delivered;
+			bwSamples[bwIndex++ % UDP_BW_SAMPLES] = bw;
+			maxBw = *std::max_element(bwSamples, bwSamples + UDP_BW_SAMPLES);
+			if (startup) {
+				if (maxBw >= startupBw * 1.25) {
+					startupBw = maxBw;
+					plateau = 0;
+				} else if (++plateau >= 3) {
+					startup = false;
+					pacing.probed = true;
+					LOGD("UDP startup done at %.0f KB/s", maxBw / 1024);
+				}
+				rate = std::max(rate, maxBw * UDP_STARTUP_GAIN);
+			} else {
+				rate = std::max(maxBw * probeGains[cycle++ % 8], UDP_MIN_RATE);
+			}
+		}
+
+		// A packet is lost when one sent sufficiently later has arrived, or
+		// when it is not ACKed within the retransmission timeout
+		uint64_t rto = srtt ? srtt + 4 * rttVar + UDP_ACK_INTERVAL_US :
+		               200000;
+		uint64_t reorder = srtt ? std::max<uint64_t>(minRtt / 4, 200) : 0;
+		while (scanSeq < nextSeq) {
+			PacketState& s = state[scanSeq & UDP_MASK];
+			if (s == PacketState::INFLIGHT) {
+				uint64_t sent = sentAt[scanSeq & UDP_MASK];
+				if (sent + reorder >= highestEcho && sent + rto >= now) {
+					break;
+				}
+				s = PacketState::LOST;
+				inflight--;
+				lost.push_back(scanSeq);
+			}
+			scanSeq++;
+		}
+		while (!resent.empty()) {
+			uint64_t seq = resent.front();
+			if (seq < base || state[seq & UDP_MASK] != PacketState::INFLIGHT) {
+				resent.pop_front();
+			} else if (sentAt[seq & UDP_MASK] + rto < now) {
+				state[seq & UDP_MASK] = PacketState::LOST;
+				inflight--;
+				lost.push_back(seq);
+				resent.pop_front();
+			} else {
+				break;
+			}
+		}
+
+		// Send what the pacing rate allows: parity, then resends, then new.
+		// ACKs are delayed by up to UDP_ACK_INTERVAL_US, so that is part of
+		// the round trip the window has to cover.
+		uint64_t cwnd = minRtt == UINT64_MAX ? UDP_WINDOW / 4 :
+			std::max<uint64_t>(2 * maxBw * (minRtt + UDP_ACK_INTERVAL_US) /
+			                   1e6 / UDP_PAYLOAD_SIZE, 64);
+		nextSendUsec = std::max(nextSendUsec, now - std::min<uint64_t>(now,
+		                        500));
+		bool canSend = true;
+		for (unsigned burst = 0; burst < UDP_BURST && nextSendUsec <= now;
+		     burst++) {
+			ssize_t sent = 0;
+			if (parityPending) {
+				parityPkt.sentUsec = now;
+				memcpy(parity, &parityPkt, sizeof(parityPkt));
+				transmit(parity, sizeof(parity));
+				parityPending = false;
+				stats.parity++;
+				sent = sizeof(parity);
+			} else if (!lost.empty()) {
+				uint64_t seq = lost.front();
+				lost.pop_front();
+				if (seq < base || state[seq & UDP_MASK] != PacketState::LOST) {
+					continue;
+				}
+				if ((sent = sendData(seq)) < 0) {
+					failed = true;
+					break;
+				}
+				state[seq & UDP_MASK] = PacketState::INFLIGHT;
+				inflight++;
+				resent.push_back(seq);
+				stats.retransmits++;
+			} else if (nextSeq < packets && nextSeq - base < UDP_WINDOW &&
+			           inflight < cwnd) {
+				if ((sent = sendData(nextSeq)) < 0) {
+					failed = true;
+					break;
+				}
+				state[nextSeq & UDP_MASK] = PacketState::INFLIGHT;
+				inflight++;
+				progress.addBytes(sent - sizeof(UdpDataPkt));
+				stats.packets++;
+				nextSeq++;
+			} else {
+				canSend = false;
+				break;
+			}
+			nextSendUsec += static_cast<uint64_t>(sent * 1e6 / rate);
+		}
+		if (failed) {
+			sendDone(false);
+			break;
+		}
+
+		if (now - lastAckUsec > UDP_TIMEOUT_MS * 1000ULL) {
+			LOGE("UDP receiver not responding");
+			failed = true;
+			break;
+		}
+
+		// Sleep until the next packet is due, an ACK or the receiver's done
+		uint64_t until = canSend ? nextSendUsec : now + UDP_ACK_INTERVAL_US;
+		bool controlReady = false;
+		if (wait(std::min(until, nextDelayedUsec()), &controlReady) != 0) {
+			failed = true;
+		} else if (controlReady) {
+			failed = receiveDone(&ok) != 0;
+			done = true;
+		}
+	}
+
+	stats.rate = rate;
+	LOGD("UDP sent %llu packets, %llu resent, %llu parity, rtt %llu us, "
+	     "rate %.0f KB/s", static_cast<unsigned long long>(stats.packets),
+	     static_cast<unsigned long long>(stats.retransmits),
+	     static_cast<unsigned long long>(stats.parity),
+	     static_cast<unsigned long long>(srtt), rate / 1024);
+	return !failed && ok ? 0 : -1;
+}
+
+int UdpChannel::receiveFile(FILE* file, uint64_t size, uint64_t packets,
+    ProgressReporter& progress, DurabilityTracker& durability) {
+	// XOR of the packets of one FEC group received so far
+	struct Group {
+		uint64_t id = UINT64_MAX;
+		unsigned count = 0;
+		bool parity = false;
+		uint64_t offset = 0;
+		uint16_t length = 0;
+		std::vector<char> payload;
+	};
+
+	fileId++;
+	stats = UdpStats{};
+	int fd = fileno(file);
+	std::vector<uint8_t> received(UDP_WINDOW / 8, 0); // Ring, by packet
+	std::vector<Group> groups(fec ? 2 * UDP_WINDOW / UDP_FEC_GROUP : 0);
+	char packet[sizeof(UdpDataPkt) + UDP_PAYLOAD_SIZE];
+	char ackBuffer[sizeof(UdpAckPkt) + UDP_WINDOW / 8];
+	uint64_t cumulative = 0; // All packets below have arrived
+	uint64_t highest = 0; // Above the highest packet that arrived
+	uint64_t count = 0;
+	uint64_t echoUsec = 0;
+	uint64_t echoArrival = 0;
+	unsigned unacked = 0;
+	uint64_t firstUnackedUsec = 0;
+	uint64_t now = Trace::nowUsec();
+	uint64_t lastDataUsec = now;
+	bool failed = false;
+
+	auto isReceived = [&](uint64_t seq) {
+		return seq < cumulative ||
+		       (received[(seq & UDP_MASK) / 8] & (1 << (seq % 8)));
+	};
+
+	auto sendAck = [&]() {
+		UdpAckPkt ackPkt{};
+		ackPkt.type = UdpType::ACK;
+		ackPkt.fileId = fileId;
+		ackPkt.cumulative = cumulative;
+		ackPkt.received = count;
+		ackPkt.echoUsec = echoUsec;
+		ackPkt.ackDelayUsec = now - echoArrival;
+		uint64_t span = std::min<uint64_t>(highest - cumulative, UDP_WINDOW);
+		ackPkt.sackBytes = static_cast<uint16_t>((span + 7) / 8);
+		uint8_t* sack = reinterpret_cast<uint8_t*>(ackBuffer + sizeof(ackPkt));
+		memset(sack, 0, ackPkt.sackBytes);
+		for (uint64_t i = 1; i < span; i++) {
+			if (isReceived(cumulative + i)) {
+				sack[i / 8] |= 1 << (i % 8);
+			}
+		}
+		memcpy(ackBuffer, &ackPkt, sizeof(ackPkt));
+		transmit(ackBuffer, sizeof(ackPkt) + ackPkt.sackBytes);
+		unacked = 0;
+	};
+
+	auto inFile = [&](uint64_t offset, uint16_t length) {
+		return offset <= size && length <= size - offset;
+	};
+
+	// Writes a packet where it belongs in the file
+	auto accept = [&](uint64_t seq, uint64_t offset, uint16_t length,
+	                  const char* payload) -> int {
+		if (pwrite(fd, payload, length, offset) != length) {
+			LOGE("Error writing file: %s", strerror(errno));
+			return -1;
+		}
+		received[(seq & UDP_MASK) / 8] |= 1 << (seq % 8);
+		count++;
+		stats.packets++;
+		progress.addBytes(length);
+		durability.written(file, length);
+		highest = std::max(highest, seq + 1);
+		while (cumulative < highest &&
+		       (received[(cumulative & UDP_MASK) / 8] & (1 << (cumulative % 8)))) {
+			received[(cumulative & UDP_MASK) / 8] &= ~(1 << (cumulative % 8));
+			cumulative++;
+		}
+		return 0;
+	};
+
+	auto group = [&](uint64_t id) -> Group& {
+		Group& g = groups[id % groups.size()];
+		if (g.id != id) {
+			g.id = id;
+			g.count = 0;
+			g.parity = false;
+			g.offset = 0;
+			g.length = 0;
+			g.payload.assign(UDP_PAYLOAD_SIZE, 0);
+		}
+		return g;
+	};
+
+	// A group missing one packet with its parity present yields that packet
+	auto recover = [&](Group& g) -> int {
+		uint64_t first = g.id * UDP_FEC_GROUP;
+		uint64_t members = std::min<uint64_t>(UDP_FEC_GROUP, packets - first);
+		if (!g.parity || g.count + 1 != members ||
+		    g.length > UDP_PAYLOAD_SIZE || !inFile(g.offset, g.length)) {
+			return 0;
+		}
+		for (uint64_t seq = first; seq < first + members; seq++) {
+			if (!isReceived(seq)) {
+				g.count++;
+				stats.recovered++;
+				return accept(seq, g.offset, g.length, g.payload.data());
+			}
+		}
+		return 0;
+	};
+
+	while (count < packets && !failed) {
+		now = Trace::nowUsec();
+		flushDelayed(now);
+
+		ssize_t n;
+		while (!failed && (n = recv(udpSocket, packet, sizeof(packet),
+		       MSG_DONTWAIT)) >= static_cast<ssize_t>(sizeof(UdpDataPkt))) {
+			UdpDataPkt dataPkt;
+			memcpy(&dataPkt, packet, sizeof(dataPkt));
+			const char* payload = packet + sizeof(dataPkt);
+			if (dataPkt.fileId != fileId) {
+				continue; // Late packets of a previous file
+			}
+			lastDataUsec = now;
+			if (dataPkt.type == UdpType::DATA) {
+				if (dataPkt.length > UDP_PAYLOAD_SIZE ||
+				    sizeof(dataPkt) + dataPkt.length !=
+				    static_cast<size_t>(n) || dataPkt.seq >= packets ||
+				    !inFile(dataPkt.offset, dataPkt.length)) {
+					continue;
+				}
+				if (dataPkt.sentUsec > echoUsec) {
+					echoUsec = dataPkt.sentUsec;
+					echoArrival = now;
+				}
+				if (unacked++ == 0) {
+					firstUnackedUsec = now;
+				}
+				if (isReceived(dataPkt.seq) ||
+				    dataPkt.seq >= cumulative + UDP_WINDOW) {
+					continue; // A resend crossed our ACK
+				}
+				if (accept(dataPkt.seq, dataPkt.offset, dataPkt.length,
+				           payload) != 0) {
+					failed = true;
+					break;
+				}
+				if (fec) {
+					Group& g = group(dataPkt.seq / UDP_FEC_GROUP);
+					for (uint16_t b = 0; b < dataPkt.length; b++) {
+						g.payload[b] ^= payload[b];
+					}
+					g.offset ^= dataPkt.offset;
+					g.length ^= dataPkt.length;
+					g.count++;
+					failed = recover(g) != 0;
+				}
+			} else if (dataPkt.type == UdpType::PARITY && fec &&
+			           n == sizeof(packet)) {
+				uint64_t first = dataPkt.seq * UDP_FEC_GROUP;
+				if (first >= packets || first + UDP_FEC_GROUP <= cumulative) {
+					continue;
+				}
+				stats.parity++;
+				Group& g = group(dataPkt.seq);
+				for (unsigned b = 0; b < UDP_PAYLOAD_SIZE; b++) {
+					g.payload[b] ^= payload[b];
+				}
+				g.offset ^= dataPkt.offset;
+				g.length ^= dataPkt.length;
+				g.parity = true;
+				failed = recover(g) != 0;
+			}
+			if (unacked >= UDP_ACK_PACKETS) {
+				sendAck();
+			}
+		}
+		if (failed || count >= packets) {
+			break;
+		}
+		if (unacked && now - firstUnackedUsec >= UDP_ACK_INTERVAL_US) {
+			sendAck();
+		}
+		if (now - lastDataUsec > UDP_TIMEOUT_MS * 1000ULL) {
+			LOGE("UDP sender not responding");
+			failed = true;
+			break;
+		}
+
+		uint64_t until = unacked ? firstUnackedUsec + UDP_ACK_INTERVAL_US :
+		                 now + 100000;
+		bool controlReady = false;
+		if (wait(std::min(until, nextDelayedUsec()), &controlReady) != 0) {
+			failed = true;
+		} else if (controlReady) {
+			bool ok;
+			receiveDone(&ok); // The sender gave up
+			LOGE("UDP sender aborted the file");
+			return -1;
+		}
+	}
+
+	if (!failed) {
+		now = Trace::nowUsec();
+		sendAck();
+		flushDelayed(now);
+	}
+	LOGD("UDP received %llu packets, %llu parity, %llu recovered",
+	     static_cast<unsigned long long>(stats.packets),
+	     static_cast<unsigned long long>(stats.parity),
+	     static_cast<unsigned long long>(stats.recovered));
+	if (sendDone(!failed) != 0) {
+		return -1;
+	}
+	return failed ? -1 : 0;
+}
+
+} // namespace Dex
@@ -1,8 +1,14 @@
 #include "FileTransferServer.h"
 #include "FileTransferClient.h"
 #include "packet.h"
+#include "Trace.h"
+#include "Logger.h"
+#include "Agent.h"
+#include "utils.h"
 #include <iostream>
 #include <cstring>
+#include <utility>
+#include <vector>
 // Arg parse
 #include <getopt.h>
 
@@ -12,21 +18,66 @@ void printUsage() {
 	std::cout << "\nUsage:\n";
 	std::cout << binName.c_str() << " --server\n";
 	std::cout << binName.c_str() << " --client --ip <server_ip> --pull <filename>\n";
+	std::cout << binName.c_str() << " --agent\n";
 	std::cout << "\n";
 	std::cout << "Server options:\n";
 	std::cout << "  -s, --server\t Run server mode\n";
+	std::cout << "  -m, --metrics\t Serve Prometheus metrics on a local port or "
+	             "unix:<path>\n";
+	std::cout << "  --cache\t Memory for blocks of hot files, e.g. 256m "
+	             "(default 64m, 0 disables)\n";
+	std::cout << "  --store\t Keep one copy of each PUSHed content in a "
+	             "directory\n";
+	std::cout << "  --disk-order\t PULL reads files in the order they are "
+	             "on disk\n";
+	std::cout << "  --advertise\t Address[:port] multipath subflows connect "
+	             "to, repeatable (default: interface addresses)\n";
+	std::cout << "Common options:\n";
+	std::cout << "  -P, --port\t TCP port to listen on / connect to (default 9413)\n";
+	std::cout << "  -t, --trace\t Write per-session Chrome trace JSON to a "
+	             "directory\n";
+	std::cout << "  -D, --durability\t none (default), file (fsync each file) "
+	             "or batch (syncfs per batch)\n";
+	std::cout << "  --impair\t Drop and delay outgoing UDP datagrams, e.g. "
+	             "1%,20ms\n";
+	std::cout << "  -L, --log-level\t debug (debug builds), info, error or "
+	             "off (default info)\n";
+	std::cout << "  --local-socket\t Unix socket for clients on this host, "
+	             "or off (default $XDG_RUNTIME_DIR/dexft-<port>.sock)\n";
 	std::cout << "Client options:\n";
 	std::cout << "  -c, --client\t Run client mode\n";
 	std::cout << "  -i, --ip\t IP address of the server\n";
 	std::cout << "  -p, --pull\t File pattern to pull\n";
 	std::cout << "  -u, --push\t File pattern to push\n";
 	std::cout << "  -l, --list\t File pattern to list\n";
+	std::cout << "  \t\t -p, -u and -l can be repeated to run several commands "
+	             "over one connection\n";
+	std::cout << "  -U, --udp\t Send file data over UDP\n";
+	std::cout << "  --fec\t\t Send file data over UDP with parity packets\n";
+	std::cout << "  --multipath\t Stripe file data over every pair of local "
+	             "and server addresses\n";
+	std::cout << "  -f, --filter\t Narrow matches, e.g. \"+*.jpg -*thumb* "
+	             "size>=1m newer:1d\"\n";
+	std::cout << "  -r, --range\t PULL only these bytes of each file, e.g. "
+	             "\"0:64k,-10m\"\n";
+	std::cout << "  --stdout\t PULL writes file contents to stdout\n";
+	std::cout << "  --follow\t Keep pulling what is appended to a file, "
+	             "like tail -F\n";
+	std::cout << "  --dedupe\t PUSH skips files the server's --store has\n";
+	std::cout << "  --limit\t LIST at most this many entries\n";
+	std::cout << "  --cursor\t Continue a LIST from the cursor it printed\n";
+	std::cout << "  --no-agent\t Connect directly even if an agent is running\n";
+	std::cout << "Agent options:\n";
+	std::cout << "  -a, --agent\t Keep warm connections for later client calls\n";
+	std::cout << "  --agent-socket\t Agent Unix socket path (default "
+	          << Dex::Agent::defaultSocketPath() << ")\n";
 	exit(1);
 }
 
 enum class Mode {
 	SERVER,
 	CLIENT,
+	AGENT,
 	INVALID
 };
 
@@ -35,9 +86,13 @@ int main(int argc, char* argv[]) {
 	binName = argv[0];
 	int opt;
 	int option_index = 0;
-	Command cmd = Command::INVALID;
+	std::vector<std::pair<Command, std::string>> commands;
 	std::string serverIp;
-	std::string pattern;
+	std::string agentPath = Dex::Agent::defaultSocketPath();
+	bool useAgent = true;
+	unsigned listLimit = 0;
+	uint64_t listCursor = 0;
+	int port = 0;
 	Dex::FileTransferServer ftServer;
 	Dex::FileTransferClient ftClient;
 
@@ -50,10 +105,34 @@ int main(int argc, char* argv[]) {
 		{"pull", required_argument, 0, 'p'},
 		{"push", required_argument, 0, 'u'},
 		{"list", required_argument, 0, 'l'},
+		{"port", required_argument, 0, 'P'},
+		{"metrics", required_argument, 0, 'm'},
+		{"cache", required_argument, 0, 'K'},
+		{"store", required_argument, 0, 'S'},
+		{"disk-order", no_argument, 0, 'G'},
+		{"advertise", required_argument, 0, 'E'},
+		{"trace", required_argument, 0, 't'},
+		{"log-level", required_argument, 0, 'L'},
+		{"local-socket", required_argument, 0, 'X'},
+		{"durability", required_argument, 0, 'D'},
+		{"udp", no_argument, 0, 'U'},
+		{"fec", no_argument, 0, 'F'},
+		{"multipath", no_argument, 0, 'M'},
+		{"impair", required_argument, 0, 'I'},
+		{"agent", no_argument, 0, 'a'},
+		{"agent-socket", required_argument, 0, 'A'},
+		{"no-agent", no_argument, 0, 'N'},
+		{"filter", required_argument, 0, 'f'},
+		{"range", required_argument, 0, 'r'},
+		{"stdout", no_argument, 0, 'O'},
+		{"follow", no_argument, 0, 'W'},
+		{"dedupe", no_argument, 0, 'H'},
+		{"limit", required_argument, 0, 'n'},
+		{"cursor", required_argument, 0, 'C'},
 		{0, 0, 0, 0} // This marks the end of the array
 	};
 
-	while ((opt = getopt_long(argc, argv, "hvsci:p:u:l:", long_options,
+	while ((opt = getopt_long(argc, argv, "hvscaUi:p:u:l:f:r:P:m:t:L:D:", long_options,
 	       &option_index)) != -1) {
 		switch (opt) {
 			case 'h':
@@ -72,17 +151,138 @@ int main(int argc, char* argv[]) {
 			case 'i':
 				serverIp = optarg;
 				break;
+			case 'a':
+				mode = Mode::AGENT;
+				break;
 			case 'p':
-				pattern = optarg;
-				cmd = Command::PULL;
+				commands.emplace_back(Command::PULL, optarg);
 				break;
 			case 'u':
-				pattern = optarg;
-				cmd = Command::PUSH;
+				commands.emplace_back(Command::PUSH, optarg);
 				break;
 			case 'l':
-				pattern = optarg;
-				cmd = Command::LIST;
+				commands.emplace_back(Command::LIST, optarg);
+				break;
+			case 'f':
+				if (ftClient.setFilter(optarg) != 0) {
+					printUsage();
+				}
+				break;
+			case 'r':
+				if (ftClient.setRanges(optarg) != 0) {
+					std::cerr << "Invalid range: " << optarg << "\n";
+					printUsage();
+				}
+				break;
+			case 'W':
+				ftClient.setFollow(true);
+				break;
+			case 'H':
+				ftClient.setDedupe(true);
+				break;
+			case 'O':
+				ftClient.setStdout(true);
+				Dex::Log::setStderrOnly(true);
+				break;
+			case 'A':
+				agentPath = optarg;
+				break;
+			case 'N':
+				useAgent = false;
+				break;
+			case 'n':
+				listLimit = strtoul(optarg, nullptr, 10);
+				break;
+			case 'C':
+				listCursor = strtoull(optarg, nullptr, 10);
+				break;
+			case 't':
+				Dex::Trace::enable(optarg);
+				break;
+			case 'L': {
+				Dex::Log::Level level = Dex::Log::parseLevel(optarg);
+				if (level > Dex::Log::LEVEL_OFF) {
+					std::cerr << "Invalid log level: " << optarg << "\n";
+					printUsage();
+				}
+#ifndef DEBUG
+				if (level == Dex::Log::LEVEL_DEBUG) {
+					std::cerr << "Debug logging needs a debug build "
+					             "(make BUILD_TYPE=debug)\n";
+					exit(1);
+				}
+#endif
+				Dex::Log::setLevel(level);
+				break;
+			}
+			case 'X': {
+				const char* path = strcmp(optarg, "off") == 0 ? nullptr : optarg;
+				ftServer.setLocalSocket(path);
+				ftClient.setLocalSocket(path);
+				break;
+			}
+			case 'D': {
+				Dex::Durability durability;
+				if (Dex::parseDurability(optarg, &durability) != 0) {
+					std::cerr << "Invalid durability: " << optarg << "\n";
+					printUsage();
+				}
+				ftServer.setDurability(durability);
+				ftClient.setDurability(durability);
+				break;
+			}
+			case 'U':
+				ftClient.setUdp(true);
+				break;
+			case 'F':
+				ftClient.setUdp(true, true);
+				break;
+			case 'M':
+				ftClient.setMultipath(true);
+				break;
+			case 'I': {
+				Dex::UdpImpairment impairment;
+				if (Dex::parseImpairment(optarg, &impairment) != 0) {
+					std::cerr << "Invalid impairment: " << optarg << "\n";
+					printUsage();
+				}
+				ftServer.setUdpImpairment(impairment);
+				ftClient.setUdpImpairment(impairment);
+				break;
+			}
+			case 'm':
+				ftServer.setMetricsAddress(optarg);
+				break;
+			case 'K': {
+				uint64_t bytes;
+				if (parseSize(optarg, &bytes) != 0) {
+					std::cerr << "Invalid cache size: " << optarg << "\n";
+					printUsage();
+				}
+				ftServer.setCacheSize(bytes);
+				break;
+			}
+			case 'S':
+				if (ftServer.setStore(optarg) != 0) {
+					std::cerr << "Invalid store: " << optarg << "\n";
+					printUsage();
+				}
+				break;
+			case 'G':
+				ftServer.setDiskOrder(true);
+				break;
+			case 'E':
+				if (ftServer.advertiseAddress(optarg) != 0) {
+					std::cerr << "Invalid address: " << optarg << "\n";
+					printUsage();
+				}
+				break;
+			case 'P':
+				port = atoi(optarg);
+				if (port <= 0 || port > 65535) {
+					std::cerr << "Invalid port: " << optarg << "\n";
+					printUsage();
+				}
 				break;
 			case '?':
 				// getopt_long already prints an error message
@@ -95,10 +295,15 @@ int main(int argc, char* argv[]) {
 	}
 
 	if (mode == Mode::INVALID) {
-		std::cerr << "-s or -c is required!\n";
+		std::cerr << "-s, -c or -a is required!\n";
 		printUsage();
 	}
 
+	if (port) {
+		ftServer.setPort(port);
+		ftClient.setPort(port);
+	}
+
 	if (mode == Mode::SERVER) {
 		std::string localIp = ftServer.getLocalPrivateIP();
 		std::cout << "Server listening on " << localIp.c_str() << std::endl;
@@ -109,28 +314,30 @@ int main(int argc, char* argv[]) {
 			printUsage();
 		}
 
-		if (pattern.empty()) {
+		if (commands.empty()) {
 			printf("-p, -u, -l is required");
 			printUsage();
 		}
 
-		switch (cmd) {
-		case Command::PULL:
-			ftClient.runClient(serverIp.c_str(), Command::PULL,
-			                   pattern.c_str());
-			break;
-		case Command::PUSH:
-			ftClient.runClient(serverIp.c_str(), Command::PUSH,
-			                   pattern.c_str());
-			break;
-		case Command::LIST:
-			ftClient.runClient(serverIp.c_str(), Command::LIST,
-			                   pattern.c_str());
-			break;
-		default:
-			printf("Invalid command=%d\n", static_cast<int>(cmd));
-			break;
+		ftClient.setListPage(listCursor, listLimit);
+		if (useAgent) {
+			ftClient.setAgentSocket(agentPath.c_str());
+		}
+		// Several commands share one connection
+		ftClient.setKeepAlive(commands.size() > 1);
+		int failed = 0;
+		for (const auto& command : commands) {
+			Dex::TransferResult result = ftClient.runClient(serverIp.c_str(),
+			                             command.first, command.second.c_str());
+			if (result.status != Dex::TransferStatus::OK) {
+				failed++;
+			}
 		}
+		ftClient.disconnect();
+		return failed ? 1 : 0;
+	} else if (mode == Mode::AGENT) {
+		Dex::Agent agent;
+		return agent.run(agentPath.c_str()) == 0 ? 0 : 1;
 	} else {
 		printUsage();
 	}
@@ -1,10 +1,119 @@
 #include "utils.h"
 #include "Logger.h"
+#include <algorithm>
 #include <cstring>
 #include <dirent.h>
 #include <sys/types.h>
 #include <fnmatch.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <unistd.h>
+#include <atomic>
+#include <sys/statvfs.h>
+#include <cstdlib>
+#include <memory>
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+int parseSize(const char* str, uint64_t* size) {
+	char* end;
+	if (*str < '0' || *str > '9') {
+		return -1;
+	}
+	unsigned long long value = strtoull(str, &end, 10);
+	int shift = 0;
+	switch (*end) {
+	case 'k': case 'K': shift = 10; end++; break;
+	case 'm': case 'M': shift = 20; end++; break;
+	case 'g': case 'G': shift = 30; end++; break;
+	case 't': case 'T': shift = 40; end++; break;
+	default: break;
+	}
+	if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+		return -1;
+	}
+	*size = static_cast<uint64_t>(value) << shift;
+	return 0;
+}
+
+int parseRanges(const char* spec, std::vector<RangePkt>& ranges) {
+	ranges.clear();
+	std::string str = spec;
+	size_t start = 0;
+	while (start <= str.size()) {
+		size_t end = str.find(',', start);
+		if (end == std::string::npos) {
+			end = str.size();
+		}
+		std::string range = str.substr(start, end - start);
+		bool fromEnd = !range.empty() && range[0] == '-';
+		size_t colon = range.find(':');
+		std::string offsetStr = range.substr(fromEnd ? 1 : 0,
+			colon == std::string::npos ? std::string::npos :
+			colon - (fromEnd ? 1 : 0));
+		RangePkt pkt{0, 0};
+		uint64_t offset;
+		if (ranges.size() == MAX_RANGES ||
+			parseSize(offsetStr.c_str(), &offset) != 0 ||
+			offset > static_cast<uint64_t>(INT64_MAX) ||
+			(fromEnd && offset == 0)) {
+			return -1;
+		}
+		pkt.offset = fromEnd ? -static_cast<int64_t>(offset) :
+		             static_cast<int64_t>(offset);
+		if (colon != std::string::npos && colon + 1 < range.size() &&
+			(parseSize(range.c_str() + colon + 1, &pkt.length) != 0 ||
+			pkt.length == 0)) {
+			return -1;
+		}
+		ranges.push_back(pkt);
+		start = end + 1;
+	}
+	return 0;
+}
+
+void resolveRanges(const RangePkt* ranges, unsigned count, uint64_t size,
+	std::vector<ExtentPkt>& extents) {
+	extents.clear();
+	for (unsigned i = 0; i < count; i++) {
+		uint64_t start;
+		if (ranges[i].offset < 0) {
+			// Negated in two steps so INT64_MIN cannot overflow
+			uint64_t back = static_cast<uint64_t>(-(ranges[i].offset + 1)) + 1;
+			start = back < size ? size - back : 0;
+		} else {
+			start = std::min<uint64_t>(ranges[i].offset, size);
+		}
+		uint64_t length = size - start;
+		if (ranges[i].length && ranges[i].length < length) {
+			length = ranges[i].length;
+		}
+		if (length) {
+			extents.push_back({start, length});
+		}
+	}
+	std::sort(extents.begin(), extents.end(),
+	          [](const ExtentPkt& a, const ExtentPkt& b) {
+		return a.offset < b.offset;
+	});
+	size_t merged = 0;
+	for (size_t i = 0; i < extents.size(); i++) {
+		uint64_t end = extents[i].offset + extents[i].length;
+		if (merged && extents[i].offset <= extents[merged - 1].offset +
+			extents[merged - 1].length) {
+			ExtentPkt& last = extents[merged - 1];
+			last.length = std::max(last.offset + last.length, end) -
+			              last.offset;
+		} else {
+			extents[merged++] = extents[i];
+		}
+	}
+	extents.resize(merged);
+}
 
 bool isFilePattern(const char *filename) {
 	return strchr(filename, '*') != nullptr;
@@ -37,41 +146,187 @@ void splitPathAndPattern(const std::string &filestr,
 	}
 }
 
-std::vector<std::string> getMatchingFiles(const std::string &filestr) {
+std::vector<std::string> getMatchingFiles(const std::string &filestr,
+    const Dex::Filter* filter) {
+	std::string directory, pattern;
+	splitPathAndPattern(filestr, directory, pattern);
+	std::vector<FileEntry> entries;
+	std::vector<std::string> matching_files;
+	int dirFd = scanMatchingFiles(filestr, filter, entries);
+	if (dirFd < 0) {
+		return matching_files;
+	}
+	close(dirFd);
+	matching_files.reserve(entries.size());
+	for (const auto& entry : entries) {
+		matching_files.push_back(directory + "/" + entry.name);
+	}
+	return matching_files;
+}
+
+int scanMatchingFiles(const std::string& filestr, const Dex::Filter* filter,
+    std::vector<FileEntry>& entries) {
 	std::string directory, pattern;
 	splitPathAndPattern(filestr, directory, pattern);
 	LOGD("xxxxxx directory=%s", directory.c_str());
 	LOGD("xxxxxx pattern=%s", pattern.c_str());
+	entries.clear();
 
-	std::vector<std::string> matching_files;
-	DIR* dir;
+	int dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int readFd = dirFd >= 0 ? fcntl(dirFd, F_DUPFD_CLOEXEC, 0) : -1;
+	DIR* dir = readFd >= 0 ? fdopendir(readFd) : nullptr;
+	if (!dir) {
+		LOGE("Could not open directory");
+		if (readFd >= 0) {
+			close(readFd);
+		}
+		if (dirFd >= 0) {
+			close(dirFd);
+		}
+		return -1;
+	}
+
+	bool needsStat = filter && filter->needsStat();
 	struct dirent* ent;
+	while ((ent = readdir(dir)) != nullptr) {
+		LOGD("xxxxxx filename=%s", ent->d_name);
 
-	if ((dir = opendir(directory.c_str())) != nullptr) {
-		while ((ent = readdir(dir)) != nullptr) {
-			std::string filename = ent->d_name;
-			LOGD("xxxxxx filename=%s", filename.c_str());
+		// Name checks first so rejected entries are never stat'ed
+		if (ent->d_type == DT_DIR ||
+		    fnmatch(pattern.c_str(), ent->d_name, 0) != 0 ||
+		    (filter && !filter->matchName(ent->d_name))) {
+			continue;
+		}
+		FileEntry entry;
+		entry.name = ent->d_name;
+		entry.ino = ent->d_ino;
+		// Anything else could be a FIFO, a socket or a link to a directory
+		entry.hasStat = needsStat || ent->d_type != DT_REG;
+		if (entry.hasStat && (fstatat(dirFd, ent->d_name, &entry.st, 0) != 0 ||
+		    !S_ISREG(entry.st.st_mode) ||
+		    (needsStat && !filter->matchStat(entry.st)))) {
+			continue;
+		}
+		entries.push_back(std::move(entry));
+	}
+	closedir(dir);
+	return dirFd;
+}
 
-			if (fnmatch(pattern.c_str(), filename.c_str(), 0) == 0) {
-				matching_files.push_back(directory + "/" + filename);
+int getSparseExtents(int fd, const struct stat& st,
+    std::vector<ExtentPkt>& extents) {
+	extents.clear();
+#ifdef SEEK_DATA
+	// Fewer allocated blocks than bytes means the file has holes
+	if (st.st_size == 0 ||
+		static_cast<uint64_t>(st.st_blocks) * 512 >=
+		static_cast<uint64_t>(st.st_size)) {
+		return -1;
+	}
+
+	off_t offset = 0;
+	while (offset < st.st_size) {
+		off_t data = lseek(fd, offset, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO) {
+				break; // Only a hole remains
 			}
+			LOGD("SEEK_DATA failed: %s", strerror(errno));
+			return -1;
 		}
-		closedir(dir);
-	} else {
-		LOGE("Could not open directory");
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0) {
+			LOGD("SEEK_HOLE failed: %s", strerror(errno));
+			return -1;
+		}
+		if (data >= st.st_size) {
+			break;
+		}
+		hole = std::min(hole, st.st_size);
+		extents.push_back({static_cast<uint64_t>(data),
+		                   static_cast<uint64_t>(hole - data)});
+		offset = hole;
 	}
+	lseek(fd, 0, SEEK_SET);
 
-	return matching_files;
+	// A single extent covering the file has no holes after all
+	if (extents.size() == 1 && extents[0].length ==
+		static_cast<uint64_t>(st.st_size)) {
+		return -1;
+	}
+	return 0;
+#else
+	(void)fd;
+	(void)st;
+	return -1;
+#endif
 }
 
-bool fileExists(const char *path) {
-	FILE *file = fopen(path, "rb");
-	if (file) {
-		fclose(file);
-		return true;
-	} else {
-		return false;
+int getDiskExtents(int fd, size_t maxExtents, std::vector<DiskExtent>& extents) {
+	extents.clear();
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+	size_t bytes = sizeof(struct fiemap) +
+	               maxExtents * sizeof(struct fiemap_extent);
+	std::unique_ptr<char[]> buffer(new char[bytes]());
+	struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer.get());
+	map->fm_start = 0;
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = static_cast<uint32_t>(maxExtents);
+	if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+		LOGD("FIEMAP failed: %s", strerror(errno));
+		return -1;
+	}
+	bool last = map->fm_mapped_extents == 0;
+	for (uint32_t i = 0; i < map->fm_mapped_extents; i++) {
+		const struct fiemap_extent& fe = map->fm_extents[i];
+		// Delayed allocation has no place on the disk until written back
+		bool unplaced = fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN |
+		                               FIEMAP_EXTENT_DELALLOC);
+		extents.push_back({fe.fe_logical, unplaced ? 0 : fe.fe_physical,
+		                   fe.fe_length});
+		last = fe.fe_flags & FIEMAP_EXTENT_LAST;
 	}
+	return last ? 0 : 1;
+#else
+	(void)fd;
+	(void)maxExtents;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+void sortByDiskLocation(int dirFd, std::vector<FileEntry>& entries) {
+	// Inode order first: it is the fallback, and it keeps the opens below
+	// from seeking around the inode tables
+	std::stable_sort(entries.begin(), entries.end(),
+	    [](const FileEntry& a, const FileEntry& b) { return a.ino < b.ino; });
+
+	std::vector<std::pair<uint64_t, size_t>> keys;
+	keys.reserve(entries.size());
+	std::vector<DiskExtent> extents;
+	for (size_t i = 0; i < entries.size(); i++) {
+		int fd = openat(dirFd, entries[i].name.c_str(),
+		                O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+		if (fd < 0) {
+			keys.push_back({0, i}); // Fails again when it is sent
+			continue;
+		}
+		int ret = getDiskExtents(fd, 1, extents);
+		close(fd);
+		if (ret < 0) {
+			return;
+		}
+		keys.push_back({extents.empty() ? 0 : extents[0].physical, i});
+	}
+	std::stable_sort(keys.begin(), keys.end(),
+	    [](const std::pair<uint64_t, size_t>& a,
+	       const std::pair<uint64_t, size_t>& b) { return a.first < b.first; });
+	std::vector<FileEntry> sorted;
+	sorted.reserve(entries.size());
+	for (const auto& key : keys) {
+		sorted.push_back(std::move(entries[key.second]));
+	}
+	entries.swap(sorted);
 }
 
 int createDirectory(const char *dir) {
@@ -86,3 +341,124 @@ int createDirectory(const char *dir) {
 
 	return 0;
 }
+
+int checkFreeSpace(const char* dir, uint64_t bytes) {
+	struct statvfs vfs;
+	if (statvfs(dir, &vfs) != 0) {
+		LOGE("Failed to get free space of %s: %s", dir, strerror(errno));
+		return -1;
+	}
+	uint64_t available = static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize;
+	if (available < bytes) {
+		LOGE("Not enough space in %s: %llu bytes needed, %llu available", dir,
+		     static_cast<unsigned long long>(bytes),
+		     static_cast<unsigned long long>(available));
+		return -1;
+	}
+	return 0;
+}
+
+FILE* createPartialFile(const std::string& path, uint64_t size, bool sparse,
+    std::string& tempPath) {
+	static std::atomic<unsigned> counter(0);
+	size_t slash = path.find_last_of('/');
+	size_t nameStart = slash == std::string::npos ? 0 : slash + 1;
+
+	// ".name.pid.n.part" is hidden and unique among concurrent sessions
+	int fd = -1;
+	for (int attempt = 0; fd < 0 && attempt < 8; attempt++) {
+		tempPath = path.substr(0, nameStart) + "." + path.substr(nameStart) +
+		           "." + std::to_string(getpid()) + "." +
+		           std::to_string(counter++) + ".part";
+		fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		          0666);
+		if (fd < 0 && errno != EEXIST) {
+			break;
+		}
+	}
+	if (fd < 0) {
+		LOGE("Error creating %s: %s", tempPath.c_str(), strerror(errno));
+		return nullptr;
+	}
+
+#ifdef __linux__
+	// Filesystems without fallocate simply allocate as the data arrives.
+	// The size is kept so that publishing can tell a file that is short.
+	if (!sparse && size > 0 &&
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) != 0 &&
+		errno != EOPNOTSUPP && errno != ENOSYS) {
+		LOGE("Error preallocating %s: %s", tempPath.c_str(), strerror(errno));
+		close(fd);
+		unlink(tempPath.c_str());
+		return nullptr;
+	}
+#else
+	(void)size;
+	(void)sparse;
+#endif
+
+	FILE* file = fdopen(fd, "wb");
+	if (!file) {
+		close(fd);
+		unlink(tempPath.c_str());
+	}
+	return file;
+}
+
+int publishPartialFile(FILE* file, const std::string& tempPath,
+    const std::string& path, uint64_t size, time_t time) {
+	struct stat st;
+	if (fflush(file) != 0 || ferror(file) || fstat(fileno(file), &st) != 0) {
+		LOGE("Error writing %s: %s", tempPath.c_str(), strerror(errno));
+		discardPartialFile(file, tempPath);
+		return -1;
+	}
+	if (static_cast<uint64_t>(st.st_size) != size) {
+		LOGE("Size mismatch for %s: %lld bytes, expected %llu", path.c_str(),
+		     static_cast<long long>(st.st_size),
+		     static_cast<unsigned long long>(size));
+		discardPartialFile(file, tempPath);
+		return -1;
+	}
+
+	// Copy original file timestamp
+	struct timespec times[2];
+	times[0].tv_sec = time;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
+	if (futimens(fileno(file), times) != 0) {
+		LOGE("Error copying file timestamp: %s", strerror(errno));
+		discardPartialFile(file, tempPath);
+		return -1;
+	}
+
+	if (fclose(file) != 0) {
+		LOGE("Error closing %s: %s", tempPath.c_str(), strerror(errno));
+		unlink(tempPath.c_str());
+		return -1;
+	}
+	if (rename(tempPath.c_str(), path.c_str()) != 0) {
+		LOGE("Error renaming %s to %s: %s", tempPath.c_str(), path.c_str(),
+		     strerror(errno));
+		unlink(tempPath.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+void discardPartialFile(FILE* file, const std::string& tempPath) {
+	fclose(file);
+	unlink(tempPath.c_str());
+}
+
+FILE* openRangeFile(const std::string& path) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+	FILE* file = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+	if (!file) {
+		LOGE("Error opening %s: %s", path.c_str(), strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	return file;
+}